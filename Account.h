@@ -0,0 +1,409 @@
+/**
+ * @file Account.h
+ * @brief Account model and interning tables
+ *
+ * Defines the Account update record, the compact AccountData field array, the string interning tables
+ * that map account ids, account types and data field names to integer handles, and the IndexedAccount
+ * record the indexer stores.
+ */
+
+#ifndef ACCOUNT_H
+#define ACCOUNT_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+
+using namespace std;
+
+// Compact integer handles for interned account ids and account types
+typedef uint32_t IdHandle;
+typedef uint32_t TypeHandle;
+
+// Returned by lookups for strings that have never been interned
+const uint32_t kInvalidHandle = numeric_limits<uint32_t>::max();
+
+/**
+ * The strings of an interning table, by handle. Every interner keeps its strings here, so code that
+ * only resolves handles back to strings, like callback sinks and query results, works with any of them.
+ * The strings live in a deque, which never moves its elements.
+ */
+class InternedStrings {
+    protected:
+        deque<string> strings;
+
+        template <typename String>
+        uint32_t append(String &&value) {
+            strings.push_back(std::forward<String>(value));
+            return static_cast<uint32_t>(strings.size() - 1);
+        }
+
+    public:
+        InternedStrings() = default;
+        InternedStrings(const InternedStrings &) = delete;
+        InternedStrings &operator=(const InternedStrings &) = delete;
+
+        const string &str(uint32_t handle) const { return strings[handle]; }
+        size_t size() const { return strings.size(); }
+};
+
+/**
+ * Interning table that maps each distinct string to a dense integer handle, starting from 0.
+ * Every string is stored exactly once, and the lookup table is keyed by pointers to the stored strings.
+ */
+class StringInterner : public InternedStrings {
+    private:
+        struct StringPtrHash {
+            size_t operator()(const string *value) const { return hash<string>{}(*value); }
+        };
+        struct StringPtrEqual {
+            bool operator()(const string *a, const string *b) const { return *a == *b; }
+        };
+
+        unordered_map<const string *, uint32_t, StringPtrHash, StringPtrEqual> handles;
+
+        template <typename String>
+        uint32_t insert(String &&value) {
+            auto it = handles.find(&value);
+            if (it != handles.end()) return it->second;
+
+            uint32_t handle = append(std::forward<String>(value));
+            handles.emplace(&strings.back(), handle);
+            return handle;
+        }
+
+    public:
+        // The lookup table points into the string storage, so an interner cannot be copied
+        StringInterner() = default;
+
+        /**
+         * Get the handle of the given string, interning it on first sight.
+         * @param value The string to be interned.
+         * @return The handle of the string.
+         */
+        uint32_t intern(const string &value) {
+            return insert(value);
+        }
+
+        /**
+         * Get the handle of the given string, interning it on first sight by moving it into the table.
+         * @param value The string to be interned; left unspecified if it was interned.
+         * @return The handle of the string.
+         */
+        uint32_t intern(string &&value) {
+            return insert(std::move(value));
+        }
+
+        /**
+         * Get the handle of the given string without interning it.
+         * @param value The string to look up.
+         * @return The handle of the string, or kInvalidHandle if it has never been interned.
+         */
+        uint32_t find(const string &value) const {
+            auto it = handles.find(&value);
+            return it != handles.end() ? it->second : kInvalidHandle;
+        }
+};
+
+// Compact integer handle for an interned Account::data field name
+typedef uint32_t FieldHandle;
+
+/**
+ * Process-wide interning table for the names of Account::data fields. The field sets in our feeds are
+ * small and highly repetitive, so each name is stored once for all accounts. Access is serialized with
+ * a mutex so that updates can be parsed on any thread.
+ */
+class FieldNames {
+    public:
+        static FieldHandle intern(const string &name) {
+            lock_guard<mutex> guard(lock());
+            return table().intern(name);
+        }
+
+        static FieldHandle find(const string &name) {
+            lock_guard<mutex> guard(lock());
+            return table().find(name);
+        }
+
+        // Interned strings never move, so the reference stays valid after the lock is released
+        static const string &name(FieldHandle field) {
+            lock_guard<mutex> guard(lock());
+            return table().str(field);
+        }
+
+    private:
+        static StringInterner &table() {
+            static StringInterner names;
+            return names;
+        }
+
+        static mutex &lock() {
+            static mutex namesLock;
+            return namesLock;
+        }
+};
+
+/**
+ * Compact representation of Account::data: a flat array of (field handle, value) pairs sorted by
+ * field handle. Up to kInlineFields pairs are stored inline in the object itself, so the common small
+ * field sets need no heap allocation at all; larger sets spill to a single heap array.
+ */
+class AccountData {
+    public:
+        struct Field {
+            FieldHandle key;
+            int value;
+        };
+
+        static const uint32_t kInlineFields = 4;
+
+        AccountData() : fieldCount(0), capacity(kInlineFields), fields(inlineFields) {}
+
+        AccountData(const AccountData &other) : fieldCount(0), capacity(kInlineFields), fields(inlineFields) {
+            reserve(other.fieldCount);
+            std::copy(other.begin(), other.end(), fields);
+            fieldCount = other.fieldCount;
+        }
+
+        AccountData(AccountData &&other) : fieldCount(0), capacity(kInlineFields), fields(inlineFields) {
+            swap(other);
+        }
+
+        AccountData &operator=(AccountData other) {
+            swap(other);
+            return *this;
+        }
+
+        ~AccountData() {
+            if (fields != inlineFields) delete[] fields;
+        }
+
+        /**
+         * Build the compact representation from a map of field names to values.
+         * @param map The fields by name.
+         * @return The compact representation.
+         */
+        static AccountData fromMap(const unordered_map<string, int> &map) {
+            AccountData data;
+            data.reserve(static_cast<uint32_t>(map.size()));
+            for (const auto &field : map) {
+                data.set(FieldNames::intern(field.first), field.second);
+            }
+            return data;
+        }
+
+        /**
+         * Expand the fields into a map of field names to values.
+         * @return The fields by name.
+         */
+        unordered_map<string, int> toMap() const {
+            unordered_map<string, int> map;
+            for (const Field &field : *this) {
+                map[FieldNames::name(field.key)] = field.value;
+            }
+            return map;
+        }
+
+        /**
+         * Set the value of a field, inserting it at its sorted position if it is not present yet.
+         * @param key The handle of the field name.
+         * @param value The value of the field.
+         */
+        void set(FieldHandle key, int value) {
+            Field *position = lowerBound(key);
+            if (position != end() && position->key == key) {
+                position->value = value;
+                return;
+            }
+            size_t offset = position - fields;
+            reserve(fieldCount + 1);
+            std::copy_backward(fields + offset, fields + fieldCount, fields + fieldCount + 1);
+            fields[offset] = Field{key, value};
+            ++fieldCount;
+        }
+
+        void set(const string &name, int value) {
+            set(FieldNames::intern(name), value);
+        }
+
+        /**
+         * Find the value of a field.
+         * @param key The handle of the field name.
+         * @return A pointer to the value, or nullptr if the field is not present.
+         */
+        const int *find(FieldHandle key) const {
+            const Field *position = const_cast<AccountData *>(this)->lowerBound(key);
+            return position != end() && position->key == key ? &position->value : nullptr;
+        }
+
+        const int *find(const string &name) const {
+            FieldHandle key = FieldNames::find(name);
+            return key != kInvalidHandle ? find(key) : nullptr;
+        }
+
+        /**
+         * Get the value of a field.
+         * @param name The field name.
+         * @return The value of the field. Throws out_of_range if the field is not present.
+         */
+        int at(const string &name) const {
+            const int *value = find(name);
+            if (!value) throw out_of_range("No data field named " + name);
+            return *value;
+        }
+
+        size_t count(const string &name) const { return find(name) ? 1 : 0; }
+        size_t size() const { return fieldCount; }
+        // Drop every field but keep the storage, for decoding into the same AccountData again
+        void clear() { fieldCount = 0; }
+        bool empty() const { return fieldCount == 0; }
+        bool isInline() const { return fields == inlineFields; }
+        // The bytes of the heap array the fields spilled to, if any
+        size_t heapBytes() const { return isInline() ? 0 : capacity * sizeof(Field); }
+        const Field *begin() const { return fields; }
+        const Field *end() const { return fields + fieldCount; }
+
+        bool operator==(const AccountData &other) const {
+            if (fieldCount != other.fieldCount) return false;
+            for (uint32_t i = 0; i < fieldCount; ++i) {
+                if (fields[i].key != other.fields[i].key || fields[i].value != other.fields[i].value) return false;
+            }
+            return true;
+        }
+        bool operator!=(const AccountData &other) const { return !(*this == other); }
+
+        void reserve(uint32_t required) {
+            if (required <= capacity) return;
+            uint32_t grown = std::max(required, capacity * 2);
+            Field *spilled = new Field[grown];
+            std::copy(begin(), end(), spilled);
+            if (fields != inlineFields) delete[] fields;
+            fields = spilled;
+            capacity = grown;
+        }
+
+        void swap(AccountData &other) {
+            // Inline storage has to be copied across; heap storage just changes hands
+            Field ours[kInlineFields];
+            bool oursInline = isInline();
+            bool theirsInline = other.isInline();
+            if (oursInline) std::copy(inlineFields, inlineFields + fieldCount, ours);
+            Field *oursHeap = fields;
+
+            if (theirsInline) {
+                std::copy(other.inlineFields, other.inlineFields + other.fieldCount, inlineFields);
+                fields = inlineFields;
+            }
+            else {
+                fields = other.fields;
+            }
+            if (oursInline) {
+                std::copy(ours, ours + fieldCount, other.inlineFields);
+                other.fields = other.inlineFields;
+            }
+            else {
+                other.fields = oursHeap;
+            }
+            std::swap(fieldCount, other.fieldCount);
+            std::swap(capacity, other.capacity);
+        }
+
+    private:
+        uint32_t fieldCount;
+        uint32_t capacity;
+        Field *fields;
+        Field inlineFields[kInlineFields];
+
+        Field *lowerBound(FieldHandle key) {
+            return std::lower_bound(fields, fields + fieldCount, key, [](const Field &field, FieldHandle k) {
+                return field.key < k;
+            });
+        }
+};
+
+struct Account {
+    string id;
+    string accountType;
+    AccountData data;
+    int tokens;
+    int version;
+    int callbackTimeMs;
+
+    Account() : tokens(0), version(0), callbackTimeMs(0) {}
+    // Taken by value, so that callers can move their strings and data in instead of copying them
+    Account(string id, string accountType, int tokens, int callbackTimeMs, AccountData data, int version)
+        : id(std::move(id)), accountType(std::move(accountType)), data(std::move(data)), tokens(tokens), version(version),
+          callbackTimeMs(callbackTimeMs) {}
+
+    // Comparison operator to compare two Account objects
+    bool operator<(const Account &other) const {
+        return tokens < other.tokens;
+    }
+};
+
+// The interning tables shared by the indexer and the callback manager. The id interner is a policy
+// of the indexer (see AccountPolicies.h); any of them keeps its strings in InternedStrings.
+template <typename IdInterner>
+struct BasicAccountSymbols {
+    IdInterner ids;
+    StringInterner types;
+};
+
+typedef BasicAccountSymbols<StringInterner> AccountSymbols;
+
+// An account as it is stored by the indexer, with its id and type replaced by interned handles
+struct IndexedAccount {
+    IdHandle id;
+    TypeHandle accountType;
+    int tokens;
+    int version;
+    int callbackTimeMs;
+    AccountData data;
+    // Row of the account in the indexer's column store, assigned when it is indexed
+    uint32_t columnRow;
+
+    IndexedAccount() : id(0), accountType(0), tokens(0), version(0), callbackTimeMs(0), columnRow(0) {}
+
+    IndexedAccount(IdHandle id, TypeHandle accountType, int tokens, int version, int callbackTimeMs, AccountData data)
+        : id(id), accountType(accountType), tokens(tokens), version(version), callbackTimeMs(callbackTimeMs),
+          data(std::move(data)), columnRow(0) {}
+};
+
+struct AccountKey {
+    IdHandle id;
+    int version;
+
+    bool operator==(const AccountKey &other) const {
+        return id == other.id && version == other.version;
+    }
+};
+
+struct AccountKeyHash {
+    size_t operator()(const AccountKey &key) const {
+        // Both halves are 32 bits wide, so packing them into one 64-bit value loses nothing. std::hash
+        // of an integer is the identity, which would leave the low bits, all a power-of-two table
+        // looks at, to the version alone; the finalizer of MurmurHash3 mixes every bit into all of them.
+        uint64_t h = (static_cast<uint64_t>(key.id) << 32) | static_cast<uint32_t>(key.version);
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return static_cast<size_t>(h);
+    }
+};
+
+// Comparison functor for sorting accounts by tokens in descending order
+struct AccountTokenComparator {
+    bool operator()(const Account &a1, const Account &a2) const {
+        return a1.tokens > a2.tokens;
+    }
+};
+
+#endif // ACCOUNT_H
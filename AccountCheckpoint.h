@@ -0,0 +1,399 @@
+/**
+ * @file AccountCheckpoint.h
+ * @brief Binary checkpoints of an AccountManager's state, for restarting without replaying the update history
+ *
+ * A checkpoint holds the latest version of every indexed account, the highest token value accounts of
+ * every type and the pending callbacks, laid out like a columnar update file, as in SectionedFile.h: a
+ * header with a schema table, then 8 byte aligned sections. Ids, account types and data field names are stored once each,
+ * as dictionaries that rows refer to by index; types are stored in handle order, so a restored
+ * indexer hands out the same type handles.
+ *
+ * The state is captured on the ingest thread as an AccountSnapshot, whose unchanged segments are shared
+ * with the previous snapshot and hold the locations of the accounts evicted to the cold tier, whose
+ * records never change once written, plus a copy of the pending callbacks. Encoding and writing then
+ * only read that immutable capture, so they can run on a background thread while ingest carries on.
+ * Callback deadlines are stored as wall clock times, and re-filed against the restored scheduler.
+ */
+
+#ifndef ACCOUNT_CHECKPOINT_H
+#define ACCOUNT_CHECKPOINT_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Account.h"
+#include "AccountSnapshot.h"
+#include "ColumnarAccountFormat.h"
+#include "MappedFile.h"
+#include "ColdAccountStore.h"
+#include "SectionedFile.h"
+
+namespace checkpoint {
+
+const char kMagic[8] = {'A', 'C', 'C', 'T', 'C', 'K', 'P', '1'};
+const uint32_t kFormatVersion = 1;
+
+// The sections of a checkpoint, in the order they are written
+enum Section : uint32_t {
+    kIdOffsets, kIdBytes,
+    kTypeOffsets, kTypeBytes,
+    kFieldNameOffsets, kFieldNameBytes,
+    kAccounts, kDataFields,
+    kTopKOffsets, kTopKEntries,
+    kCallbacks,
+    kSectionCount
+};
+
+struct Header {
+    char magic[8];
+    uint32_t endianMark;
+    uint32_t formatVersion;
+    // The sequence of the snapshot the checkpoint was written from, i.e. the updates ingested by then
+    uint64_t sequence;
+    // Wall clock time the state was captured, in nanoseconds since the epoch
+    int64_t capturedAtNs;
+    uint64_t topK;
+    uint32_t idCount;
+    uint32_t typeCount;
+    uint32_t fieldNameCount;
+    uint32_t sectionCount;
+    sectioned::SectionInfo sections[kSectionCount];
+};
+
+// The latest version of an account; its data fields are dataCount entries from dataOffset
+struct AccountRow {
+    uint32_t id;
+    uint32_t accountType;
+    int32_t tokens;
+    int32_t version;
+    int32_t callbackTimeMs;
+    uint32_t dataCount;
+    uint64_t dataOffset;
+};
+
+// One of the highest token value accounts of a type
+struct TopKRow {
+    uint32_t id;
+    int32_t version;
+    int32_t tokens;
+};
+
+// A pending callback, with its deadline in nanoseconds since the epoch
+struct CallbackRow {
+    uint32_t id;
+    int32_t version;
+    int64_t deadlineNs;
+};
+
+inline const char *sectionName(uint32_t section) {
+    static const char *names[kSectionCount] = {
+        "id.offsets", "id.bytes", "accountType.offsets", "accountType.bytes",
+        "dataField.offsets", "dataField.bytes", "accounts", "data.fields",
+        "topK.offsets", "topK.entries", "callbacks"
+    };
+    return names[section];
+}
+
+inline uint32_t elementSize(uint32_t section) {
+    static const uint32_t sizes[kSectionCount] = {
+        4, 1, 4, 1, 4, 1, sizeof(AccountRow), sizeof(columnar::DataField), 4, sizeof(TopKRow), sizeof(CallbackRow)
+    };
+    return sizes[section];
+}
+
+inline int64_t toNanoseconds(chrono::system_clock::time_point time) {
+    return chrono::duration_cast<chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+inline chrono::system_clock::time_point fromNanoseconds(int64_t ns) {
+    return chrono::system_clock::time_point(chrono::duration_cast<chrono::system_clock::duration>(chrono::nanoseconds(ns)));
+}
+
+} // namespace checkpoint
+
+// A pending callback as captured for a checkpoint. The id points into the indexer's interning table.
+struct CheckpointCallback {
+    const string *id;
+    int version;
+    chrono::system_clock::time_point deadline;
+};
+
+// The state a checkpoint is written from. It only refers to immutable data, so it can be written on
+// any thread, but must not outlive the indexer it was captured from.
+struct CheckpointState {
+    shared_ptr<const AccountSnapshot> snapshot;
+    vector<CheckpointCallback> callbacks;
+    size_t topK;
+    chrono::system_clock::time_point capturedAt;
+};
+
+class AccountCheckpointWriter {
+    private:
+        // Sync the directory holding a file, so that a file renamed into it survives a crash
+        static bool syncDirectoryOf(const string &filename) {
+            size_t slash = filename.find_last_of('/');
+            string directory = slash == string::npos ? "." : slash == 0 ? "/" : filename.substr(0, slash);
+            int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd < 0) return false;
+            bool synced = fsync(fd) == 0;
+            return ::close(fd) == 0 && synced;
+        }
+
+        static bool writeAll(int fd, const void *data, size_t length) {
+            const char *p = static_cast<const char *>(data);
+            while (length > 0) {
+                ssize_t written = ::write(fd, p, length);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                p += written;
+                length -= static_cast<size_t>(written);
+            }
+            return true;
+        }
+
+    public:
+        /**
+         * Encode the state and write it to the given file. The checkpoint is written to a temporary
+         * file, flushed to disk and renamed over the target, so a crash leaves either the old or the
+         * new checkpoint in place.
+         * @param state The captured state.
+         * @param filename The checkpoint file to create or replace.
+         * @return False if the file could not be written.
+         */
+        static bool write(const CheckpointState &state, const string &filename) {
+            using namespace checkpoint;
+            const AccountSnapshot &snapshot = *state.snapshot;
+            // Interned strings never move, so their addresses identify them
+            sectioned::Dictionary<const string *> ids;
+            sectioned::Dictionary<const string *> types;
+            sectioned::Dictionary<FieldHandle> fieldNames;
+            vector<AccountRow> accounts;
+            vector<columnar::DataField> dataFields;
+            vector<uint32_t> topKOffsets(1, 0);
+            vector<TopKRow> topKEntries;
+            vector<CallbackRow> callbacks;
+
+            accounts.reserve(snapshot.size());
+            string record;
+            Account cold;
+            for (TypeHandle type = 0; type < snapshot.getAccountTypeCount(); ++type) {
+                const AccountSnapshotSegment &segment = snapshot.getSegment(type);
+                // Types are stored in handle order, so a restored indexer hands out the same type handles
+                uint32_t typeIndex = types.add(segment.accountType, *segment.accountType);
+                for (const SnapshotAccount &account : segment.accounts) {
+                    AccountRow row{ids.add(account.id, *account.id), typeIndex, account.tokens, account.version,
+                                   account.callbackTimeMs, static_cast<uint32_t>(account.data.size()), dataFields.size()};
+                    for (const AccountData::Field &field : account.data) {
+                        dataFields.push_back(columnar::DataField{fieldNames.add(field.key, FieldNames::name(field.key)), field.value});
+                    }
+                    accounts.push_back(row);
+                }
+                for (const SnapshotColdAccount &location : segment.coldAccounts) {
+                    bool read = segment.coldFile && segment.coldFile->read(location.record, record);
+                    const char *p = record.data();
+                    if (!read || !wire::getAccount(p, p + record.size(), cold)) {
+                        cerr << "Failed to write the checkpoint: " << filename << ": the cold accounts could not be read" << endl;
+                        return false;
+                    }
+                    AccountRow row{ids.add(location.id, *location.id), typeIndex, cold.tokens, cold.version, cold.callbackTimeMs,
+                                   static_cast<uint32_t>(cold.data.size()), dataFields.size()};
+                    for (const AccountData::Field &field : cold.data) {
+                        dataFields.push_back(columnar::DataField{fieldNames.add(field.key, FieldNames::name(field.key)), field.value});
+                    }
+                    accounts.push_back(row);
+                }
+                for (const SnapshotTopKEntry &entry : segment.highestTokenAccounts) {
+                    topKEntries.push_back(TopKRow{ids.add(entry.id, *entry.id), entry.version, entry.tokens});
+                }
+                topKOffsets.push_back(static_cast<uint32_t>(topKEntries.size()));
+            }
+            callbacks.reserve(state.callbacks.size());
+            for (const CheckpointCallback &callback : state.callbacks) {
+                callbacks.push_back(CallbackRow{ids.add(callback.id, *callback.id), callback.version, toNanoseconds(callback.deadline)});
+            }
+
+            const void *data[kSectionCount] = {
+                ids.endOffsets.data(), ids.bytes.data(), types.endOffsets.data(), types.bytes.data(),
+                fieldNames.endOffsets.data(), fieldNames.bytes.data(), accounts.data(), dataFields.data(),
+                topKOffsets.data(), topKEntries.data(), callbacks.data()
+            };
+            const uint64_t counts[kSectionCount] = {
+                ids.endOffsets.size(), ids.bytes.size(), types.endOffsets.size(), types.bytes.size(),
+                fieldNames.endOffsets.size(), fieldNames.bytes.size(), accounts.size(), dataFields.size(),
+                topKOffsets.size(), topKEntries.size(), callbacks.size()
+            };
+
+            Header header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, kMagic, sizeof(kMagic));
+            header.endianMark = sectioned::kEndianMark;
+            header.formatVersion = kFormatVersion;
+            header.sequence = snapshot.getSequence();
+            header.capturedAtNs = toNanoseconds(state.capturedAt);
+            header.topK = state.topK;
+            header.idCount = ids.size();
+            header.typeCount = types.size();
+            header.fieldNameCount = fieldNames.size();
+            header.sectionCount = kSectionCount;
+            sectioned::layOut(header.sections, kSectionCount, sizeof(header), sectionName, elementSize, counts);
+
+            string temporary = filename + ".tmp";
+            int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                cerr << "Failed to open the file: " << temporary << endl;
+                return false;
+            }
+            bool written = sectioned::writeSections([fd](const void *bytes, size_t length) {
+                return writeAll(fd, bytes, length);
+            }, &header, sizeof(header), header.sections, kSectionCount, data) && fsync(fd) == 0;
+            written = ::close(fd) == 0 && written;
+            if (!written || rename(temporary.c_str(), filename.c_str()) != 0) {
+                cerr << "Failed to write the checkpoint: " << filename << endl;
+                unlink(temporary.c_str());
+                return false;
+            }
+            // The rename is only durable once the directory entry is
+            if (!syncDirectoryOf(filename)) {
+                cerr << "Failed to sync the directory of the checkpoint: " << filename << endl;
+                return false;
+            }
+            return true;
+        }
+};
+
+/**
+ * Read-only memory mapping of a checkpoint. Opening validates the header and every section, so the
+ * accessors can be used without further checks.
+ */
+class AccountCheckpointFile {
+    private:
+        MappedFile mapping;
+        const checkpoint::Header *header;
+        sectioned::Sections sections;
+
+        bool fail(const string &filename, const string &reason) {
+            cerr << "Invalid checkpoint " << filename << ": " << reason << endl;
+            close();
+            return false;
+        }
+
+        template <typename T>
+        const T *section(uint32_t section) const {
+            return sections.section<T>(section);
+        }
+
+        uint64_t elements(uint32_t section) const {
+            return sections.elements(section);
+        }
+
+        bool validate(const string &filename) {
+            using namespace checkpoint;
+            size_t mappedLength = mapping.size();
+            if (mappedLength < sizeof(Header)) return fail(filename, "too short");
+            header = reinterpret_cast<const Header *>(mapping.data());
+            if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) return fail(filename, "bad magic");
+            if (header->endianMark != sectioned::kEndianMark) return fail(filename, "written with the other byte order");
+            if (header->formatVersion != kFormatVersion) return fail(filename, "unsupported format version");
+            if (header->sectionCount != kSectionCount) return fail(filename, "unexpected schema");
+
+            sections = sectioned::Sections(mapping.data(), header->sections);
+            uint32_t badSection;
+            if (!sections.tableValid(kSectionCount, mappedLength, sectionName, elementSize, badSection)) {
+                return fail(filename, string("bad section ") + sectionName(badSection));
+            }
+
+            if (!sections.dictionaryValid(kIdOffsets, kIdBytes, header->idCount) ||
+                !sections.dictionaryValid(kTypeOffsets, kTypeBytes, header->typeCount) ||
+                !sections.dictionaryValid(kFieldNameOffsets, kFieldNameBytes, header->fieldNameCount)) {
+                return fail(filename, "bad dictionary");
+            }
+            if (!sections.offsetsValid(kTopKOffsets, uint64_t(header->typeCount) + 1, elements(kTopKEntries), true)) {
+                return fail(filename, "bad top K offsets");
+            }
+
+            const AccountRow *accounts = section<AccountRow>(kAccounts);
+            uint64_t dataFieldCount = elements(kDataFields);
+            for (uint64_t i = 0; i < elements(kAccounts); ++i) {
+                const AccountRow &row = accounts[i];
+                if (row.id >= header->idCount || row.accountType >= header->typeCount ||
+                    row.dataOffset > dataFieldCount || row.dataCount > dataFieldCount - row.dataOffset) {
+                    return fail(filename, "bad account row");
+                }
+            }
+            const columnar::DataField *fields = section<columnar::DataField>(kDataFields);
+            for (uint64_t i = 0; i < dataFieldCount; ++i) {
+                if (fields[i].name >= header->fieldNameCount) return fail(filename, "data field name out of range");
+            }
+            const TopKRow *topK = section<TopKRow>(kTopKEntries);
+            for (uint64_t i = 0; i < elements(kTopKEntries); ++i) {
+                if (topK[i].id >= header->idCount) return fail(filename, "top K id out of range");
+            }
+            const CallbackRow *callbacks = section<CallbackRow>(kCallbacks);
+            for (uint64_t i = 0; i < elements(kCallbacks); ++i) {
+                if (callbacks[i].id >= header->idCount) return fail(filename, "callback id out of range");
+            }
+            return true;
+        }
+
+        string dictionaryEntry(uint32_t offsets, uint32_t bytes, uint32_t index) const {
+            size_t length;
+            const char *entry = sections.dictionaryEntry(offsets, bytes, index, length);
+            return string(entry, length);
+        }
+
+    public:
+        AccountCheckpointFile() : header(nullptr) {}
+
+        /**
+         * Map and validate a checkpoint.
+         * @param filename The checkpoint file.
+         * @return False if the file could not be mapped or is not a valid checkpoint.
+         */
+        bool open(const string &filename) {
+            close();
+            return mapping.open(filename) && validate(filename);
+        }
+
+        void close() {
+            mapping.close();
+            header = nullptr;
+        }
+
+        uint64_t getSequence() const { return header->sequence; }
+        chrono::system_clock::time_point getCapturedAt() const { return checkpoint::fromNanoseconds(header->capturedAtNs); }
+        size_t getTopK() const { return static_cast<size_t>(header->topK); }
+        uint32_t idCount() const { return header->idCount; }
+        uint32_t typeCount() const { return header->typeCount; }
+        uint32_t fieldNameCount() const { return header->fieldNameCount; }
+
+        string id(uint32_t index) const {
+            return dictionaryEntry(checkpoint::kIdOffsets, checkpoint::kIdBytes, index);
+        }
+        string accountType(uint32_t index) const {
+            return dictionaryEntry(checkpoint::kTypeOffsets, checkpoint::kTypeBytes, index);
+        }
+        string fieldName(uint32_t index) const {
+            return dictionaryEntry(checkpoint::kFieldNameOffsets, checkpoint::kFieldNameBytes, index);
+        }
+
+        size_t accountCount() const { return static_cast<size_t>(elements(checkpoint::kAccounts)); }
+        const checkpoint::AccountRow *accounts() const { return section<checkpoint::AccountRow>(checkpoint::kAccounts); }
+        const columnar::DataField *dataFields() const { return section<columnar::DataField>(checkpoint::kDataFields); }
+        // The top K entries of type t are topKEntries()[topKOffsets()[t]] up to topKOffsets()[t + 1]
+        const uint32_t *topKOffsets() const { return section<uint32_t>(checkpoint::kTopKOffsets); }
+        const checkpoint::TopKRow *topKEntries() const { return section<checkpoint::TopKRow>(checkpoint::kTopKEntries); }
+        size_t callbackCount() const { return static_cast<size_t>(elements(checkpoint::kCallbacks)); }
+        const checkpoint::CallbackRow *callbacks() const { return section<checkpoint::CallbackRow>(checkpoint::kCallbacks); }
+};
+
+#endif // ACCOUNT_CHECKPOINT_H
@@ -0,0 +1,375 @@
+/**
+ * @file AccountCluster.h
+ * @brief Partitioning accounts across nodes: consistent hashing, batched routing, scatter/gather queries
+ *
+ * Each node (see AccountNode.h) holds the accounts whose ids hash to it on a consistent hash ring, so
+ * all versions of an account meet on one node, and adding a node to N moves only about 1/(N+1) of the
+ * ids to it, all taken from the others. The PartitionRouter sends every update to its id's node, in
+ * batches per node; the QueryCoordinator sends every query to all nodes and merges their answers.
+ *
+ * Merging is bounded: a search with a limit asks each node for only that many accounts, and the top K
+ * of a type asks each node for its top K, and the sorted answers are merged until the limit, so no
+ * node ships more of its result than can make the merged one. Queries see the updates the router has
+ * flushed.
+ */
+
+#ifndef ACCOUNT_CLUSTER_H
+#define ACCOUNT_CLUSTER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <cstdint>
+#include "Account.h"
+#include "AccountNode.h"
+
+/**
+ * Maps account ids to nodes by consistent hashing. Each node is placed at virtualNodes points on a
+ * 64-bit ring, hashed from its name, and an id belongs to the first node point at or after its own
+ * hash. The hashes are computed here rather than with std::hash, so that every process, whatever its
+ * standard library, puts an id on the same node.
+ */
+class ConsistentHashRing {
+    private:
+        size_t virtualNodes;
+        // (point, node) pairs, sorted by point
+        vector<pair<uint64_t, uint32_t>> points;
+        vector<string> names;
+
+    public:
+        explicit ConsistentHashRing(size_t virtualNodes = 128) : virtualNodes(max<size_t>(1, virtualNodes)) {}
+
+        // FNV-1a, then the MurmurHash3 finalizer, as FNV alone mixes the last bytes into few high bits
+        static uint64_t hash(const string &key) {
+            uint64_t h = 0xCBF29CE484222325ull;
+            for (unsigned char c : key) {
+                h ^= c;
+                h *= 0x100000001B3ull;
+            }
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDull;
+            h ^= h >> 33;
+            h *= 0xC4CEB9FE1A85EC53ull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        /**
+         * Place a node on the ring.
+         * @param name The node's name, e.g. its host:port; rings built from the same names agree, in any order.
+         * @return The index of the node, in the order of addNode calls.
+         */
+        uint32_t addNode(const string &name) {
+            uint32_t index = static_cast<uint32_t>(names.size());
+            names.push_back(name);
+            for (size_t replica = 0; replica < virtualNodes; ++replica) {
+                points.push_back(make_pair(hash(name + "#" + to_string(replica)), index));
+            }
+            sort(points.begin(), points.end());
+            return index;
+        }
+
+        /**
+         * Find the node an account id belongs to. The ring must have a node.
+         * @param id The account id.
+         * @return The index of the node.
+         */
+        uint32_t nodeOf(const string &id) const {
+            auto point = lower_bound(points.begin(), points.end(), make_pair(hash(id), uint32_t(0)));
+            return point != points.end() ? point->second : points.front().second;
+        }
+
+        size_t size() const { return names.size(); }
+        const string &getName(uint32_t node) const { return names[node]; }
+};
+
+/**
+ * Sends account updates to the nodes that own their ids. Updates are encoded straight into a pending
+ * Ingest frame per node, which is sent once it holds batchSize updates. Up to kMaxInFlightBatches
+ * batches per node are sent before waiting for the node to confirm the oldest, so encoding overlaps
+ * with ingest on the nodes. Not thread-safe.
+ */
+class PartitionRouter {
+    private:
+        enum { kMaxInFlightBatches = 4 };
+
+        struct Node {
+            AccountNodeClient client;
+            string frame;
+            size_t frameStart;
+            size_t buffered;
+            size_t inFlight;
+            uint64_t routed;
+        };
+
+        ConsistentHashRing ring;
+        vector<unique_ptr<Node>> nodes;
+        size_t batchSize;
+
+        void beginBatch(Node &target) {
+            target.frame.clear();
+            target.frameStart = node::beginFrame(target.frame, node::kIngest);
+            target.buffered = 0;
+        }
+
+        bool awaitBatch(Node &target) {
+            uint32_t count;
+            if (!target.client.receiveIngested(count)) return false;
+            --target.inFlight;
+            return true;
+        }
+
+        bool sendBatch(Node &target) {
+            if (target.buffered == 0) return true;
+            if (target.inFlight >= kMaxInFlightBatches && !awaitBatch(target)) return false;
+            node::finishFrame(target.frame, target.frameStart);
+            if (!target.client.sendIngest(target.frame)) return false;
+            ++target.inFlight;
+            beginBatch(target);
+            return true;
+        }
+
+    public:
+        /**
+         * @param batchSize The number of updates sent to a node at once.
+         * @param virtualNodes The number of points of each node on the hash ring.
+         */
+        explicit PartitionRouter(size_t batchSize = 512, size_t virtualNodes = 128)
+            : ring(virtualNodes), batchSize(max<size_t>(1, batchSize)) {}
+
+        PartitionRouter(const PartitionRouter &) = delete;
+        PartitionRouter &operator=(const PartitionRouter &) = delete;
+
+        // Updates still buffered are sent, and waited for
+        ~PartitionRouter() {
+            flush();
+        }
+
+        /**
+         * Connect to a node and give it its share of the hash ring. Nodes must be added before
+         * updates are routed, in any order, and identified by the same host and port by every router.
+         * @param host The host name or address of the node.
+         * @param port The TCP port of the node.
+         * @return False if the node cannot be reached.
+         */
+        bool addNode(const string &host, uint16_t port) {
+            unique_ptr<Node> added(new Node());
+            if (!added->client.connect(host, port)) return false;
+            added->inFlight = 0;
+            added->routed = 0;
+            beginBatch(*added);
+            ring.addNode(host + ":" + to_string(port));
+            nodes.push_back(std::move(added));
+            return true;
+        }
+
+        /**
+         * Route an update to the node of its id, sending that node's batch if it is full.
+         * @param account The account update.
+         * @return False if there are no nodes, or the node's connection failed.
+         */
+        bool route(const Account &account) {
+            if (nodes.empty()) return false;
+            Node &target = *nodes[ring.nodeOf(account.id)];
+            wire::putAccount(target.frame, account);
+            ++target.routed;
+            return ++target.buffered < batchSize || sendBatch(target);
+        }
+
+        /**
+         * Send every partly filled batch and wait until every node has ingested all it was sent.
+         * @return False if a node's connection failed; its updates since the last flush may be lost.
+         */
+        bool flush() {
+            bool flushed = true;
+            for (unique_ptr<Node> &target : nodes) {
+                if (!sendBatch(*target)) flushed = false;
+            }
+            for (unique_ptr<Node> &target : nodes) {
+                while (target->inFlight > 0) {
+                    if (!awaitBatch(*target)) {
+                        flushed = false;
+                        break;
+                    }
+                }
+            }
+            return flushed;
+        }
+
+        /**
+         * Get the node an account id is routed to.
+         * @param id The account id.
+         * @return The index of the node, in the order they were added.
+         */
+        size_t nodeOf(const string &id) const { return ring.nodeOf(id); }
+
+        size_t getNodeCount() const { return nodes.size(); }
+        // The number of updates routed to the given node so far
+        uint64_t getRoutedCount(size_t node) const { return nodes[node]->routed; }
+};
+
+/**
+ * Answers searchAndFilterAccounts and the highest token value accounts over all nodes. A query is sent
+ * to every node before any answer is read, and the sorted answers are merged on a heap of the nodes'
+ * next accounts, stopping at the limit. Not thread-safe.
+ */
+class QueryCoordinator {
+    private:
+        vector<unique_ptr<AccountNodeClient>> nodes;
+        size_t topK;
+
+        /**
+         * Merge the answers of the nodes, each sorted in merge order, into the first limit items.
+         */
+        template <typename Item, typename Precedes>
+        static vector<Item> merge(vector<vector<Item>> &answers, size_t limit, Precedes precedes) {
+            typedef pair<size_t, size_t> Cursor;
+            // The heap's top is the node whose next item comes first
+            auto later = [&answers, &precedes](const Cursor &a, const Cursor &b) {
+                return precedes(answers[b.first][b.second], answers[a.first][a.second]);
+            };
+            priority_queue<Cursor, vector<Cursor>, decltype(later)> next(later);
+            for (size_t i = 0; i < answers.size(); ++i) {
+                if (!answers[i].empty()) next.push(Cursor(i, 0));
+            }
+            vector<Item> merged;
+            while (!next.empty() && merged.size() < limit) {
+                Cursor cursor = next.top();
+                next.pop();
+                merged.push_back(std::move(answers[cursor.first][cursor.second]));
+                if (++cursor.second < answers[cursor.first].size()) next.push(cursor);
+            }
+            return merged;
+        }
+
+    public:
+        /**
+         * @param topK The number of highest token value accounts to return per type; the nodes must keep
+         * at least as many.
+         */
+        explicit QueryCoordinator(size_t topK = 3) : topK(topK) {}
+
+        /**
+         * Connect to a node.
+         * @param host The host name or address of the node.
+         * @param port The TCP port of the node.
+         * @return False if the node cannot be reached.
+         */
+        bool addNode(const string &host, uint16_t port) {
+            unique_ptr<AccountNodeClient> client(new AccountNodeClient());
+            if (!client->connect(host, port)) return false;
+            nodes.push_back(std::move(client));
+            return true;
+        }
+
+        /**
+         * Search and filter accounts across all nodes.
+         * @param results Set to the matching accounts, ordered by tokens in descending order, then by id.
+         * @param accountType The account type to filter by, or an empty string for all types.
+         * @param minTokens The minimum token value to filter by.
+         * @param maxTokens The maximum token value to filter by.
+         * @param limit The maximum number of accounts to return; each node sends at most this many.
+         * @return False if a node failed to answer.
+         */
+        bool searchAndFilterAccounts(
+            vector<Account> &results,
+            const string &accountType = "",
+            int minTokens = numeric_limits<int>::min(),
+            int maxTokens = numeric_limits<int>::max(),
+            size_t limit = numeric_limits<size_t>::max()
+        ) {
+            uint32_t nodeLimit = limit >= node::kNoLimit ? node::kNoLimit : static_cast<uint32_t>(limit);
+            bool answered = true;
+            for (unique_ptr<AccountNodeClient> &client : nodes) {
+                answered = client->sendSearch(accountType, minTokens, maxTokens, nodeLimit) && answered;
+            }
+            vector<vector<Account>> answers(nodes.size());
+            // A node that failed partway leaves what it sent, and maybe a half-decoded account, so drop it
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                if (nodes[i]->receiveAccounts(answers[i])) continue;
+                answers[i].clear();
+                answered = false;
+            }
+            results = merge(answers, limit, [](const Account &a, const Account &b) { return node::precedes(a, b); });
+            return answered;
+        }
+
+        /**
+         * Get the highest token value accounts of the given type, merged from the top K of every node.
+         * @param entries Set to up to K accounts, highest tokens first.
+         * @param accountType The account type.
+         * @return False if a node failed to answer.
+         */
+        bool getHighestTokenAccounts(vector<ShardedTopKEntry> &entries, const string &accountType) {
+            bool answered = true;
+            for (unique_ptr<AccountNodeClient> &client : nodes) {
+                answered = client->sendHighestTokens(accountType) && answered;
+            }
+            vector<vector<ShardedTopKEntry>> answers(nodes.size());
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                if (nodes[i]->receiveHighestTokens(answers[i])) continue;
+                answers[i].clear();
+                answered = false;
+            }
+            entries = merge(answers, topK, [](const ShardedTopKEntry &a, const ShardedTopKEntry &b) { return node::precedes(a, b); });
+            return answered;
+        }
+
+        /**
+         * Get the account types seen by any node, in node order and then in order of first appearance.
+         * @param accountTypes Set to the account types.
+         * @return False if a node failed to answer.
+         */
+        bool getAccountTypes(vector<string> &accountTypes) {
+            bool answered = true;
+            for (unique_ptr<AccountNodeClient> &client : nodes) {
+                answered = client->sendAccountTypes() && answered;
+            }
+            accountTypes.clear();
+            vector<string> nodeTypes;
+            for (unique_ptr<AccountNodeClient> &client : nodes) {
+                if (!client->receiveAccountTypes(nodeTypes)) {
+                    answered = false;
+                    continue;
+                }
+                for (const string &accountType : nodeTypes) {
+                    if (find(accountTypes.begin(), accountTypes.end(), accountType) == accountTypes.end()) {
+                        accountTypes.push_back(accountType);
+                    }
+                }
+            }
+            return answered;
+        }
+
+        /**
+         * Print the highest token value accounts for each account type, merged across nodes.
+         * @return False if a node failed to answer.
+         */
+        bool printHighestTokenValueAccounts() {
+            vector<string> accountTypes;
+            if (!getAccountTypes(accountTypes)) return false;
+            for (const string &accountType : accountTypes) {
+                vector<ShardedTopKEntry> tokenAccounts;
+                if (!getHighestTokenAccounts(tokenAccounts, accountType)) return false;
+
+                cout << "Highest token value accounts for account type " << accountType << ":" << endl;
+
+                // Lowest first, as in AccountManager
+                for (auto entry = tokenAccounts.rbegin(); entry != tokenAccounts.rend(); ++entry) {
+                    cout << "Account " << entry->id << " v" << entry->version << ": Tokens - " << entry->tokens << endl;
+                }
+                cout << endl;
+            }
+            return true;
+        }
+
+        size_t getNodeCount() const { return nodes.size(); }
+};
+
+#endif // ACCOUNT_CLUSTER_H
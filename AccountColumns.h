@@ -0,0 +1,240 @@
+/**
+ * @file AccountColumns.h
+ * @brief Columnar side store of the indexed accounts, with a vectorized filter scan
+ *
+ * Keeps the fields that queries filter and order on as contiguous columns, one row per indexed account
+ * version: tokens, type handle, id handle, a live bitmap and a pointer back to the account. Scanning the
+ * columns for a type and token range streams through 8 bytes per account, evaluating the predicates 8 rows per AVX2
+ * instruction on x86-64 CPUs that have it, 4 per NEON instruction on AArch64, and one at a time
+ * otherwise, where walking the token index chases a tree node per account.
+ *
+ * Rows are padded to whole 64-row words of the bitmap. Removed rows are marked dead and reused by
+ * later inserts, so the columns stay as long as the most accounts indexed at once. A second bitmap
+ * holds a reference bit per row, set on insert, which the indexer's CLOCK eviction clears as it
+ * sweeps the rows.
+ */
+
+#ifndef ACCOUNT_COLUMNS_H
+#define ACCOUNT_COLUMNS_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include "Account.h"
+// Build with -DACCOUNT_COLUMNS_SCALAR to scan with the scalar kernel only
+#if defined(ACCOUNT_COLUMNS_SCALAR)
+#elif defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define ACCOUNT_COLUMNS_AVX2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ACCOUNT_COLUMNS_NEON 1
+#endif
+
+class AccountColumns {
+    private:
+        enum { kWordRows = 64 };
+
+        vector<int32_t> tokens;
+        vector<uint32_t> typeIds;
+        vector<IdHandle> ids;
+        vector<uint64_t> live;
+        vector<uint64_t> referenced;
+        vector<const IndexedAccount *> accounts;
+        vector<uint32_t> freeRows;
+        size_t liveRows;
+
+        // Bit i of the result is set if row i of the word is of the type, or of any type for
+        // kInvalidHandle, and has tokens in [minTokens, maxTokens]. Dead rows are masked out by the caller.
+        static uint64_t matchWordScalar(const int32_t *tokens, const uint32_t *typeIds, TypeHandle type,
+                                        int minTokens, int maxTokens) {
+            uint64_t mask = 0;
+            for (int i = 0; i < kWordRows; ++i) {
+                bool match = tokens[i] >= minTokens && tokens[i] <= maxTokens && (type == kInvalidHandle || typeIds[i] == type);
+                mask |= static_cast<uint64_t>(match) << i;
+            }
+            return mask;
+        }
+
+#if defined(ACCOUNT_COLUMNS_AVX2)
+        __attribute__((target("avx2")))
+        static uint64_t matchWordAvx2(const int32_t *tokens, const uint32_t *typeIds, TypeHandle type,
+                                      int minTokens, int maxTokens) {
+            const __m256i low = _mm256_set1_epi32(minTokens);
+            const __m256i high = _mm256_set1_epi32(maxTokens);
+            const __m256i wanted = _mm256_set1_epi32(static_cast<int>(type));
+            const bool anyType = type == kInvalidHandle;
+            uint64_t mask = 0;
+            for (int i = 0; i < kWordRows; i += 8) {
+                __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tokens + i));
+                // Outside the range if below minTokens or above maxTokens
+                __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(low, values), _mm256_cmpgt_epi32(values, high));
+                __m256i match = _mm256_andnot_si256(outside, _mm256_set1_epi32(-1));
+                if (!anyType) {
+                    __m256i types = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(typeIds + i));
+                    match = _mm256_and_si256(match, _mm256_cmpeq_epi32(types, wanted));
+                }
+                mask |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_castsi256_ps(match))) << i;
+            }
+            return mask;
+        }
+
+        static bool hasAvx2() {
+            static const bool supported = __builtin_cpu_supports("avx2");
+            return supported;
+        }
+#endif
+
+#if defined(ACCOUNT_COLUMNS_NEON)
+        static uint64_t matchWordNeon(const int32_t *tokens, const uint32_t *typeIds, TypeHandle type,
+                                      int minTokens, int maxTokens) {
+            const int32x4_t low = vdupq_n_s32(minTokens);
+            const int32x4_t high = vdupq_n_s32(maxTokens);
+            const uint32x4_t wanted = vdupq_n_u32(type);
+            const uint32_t laneBitValues[4] = {1, 2, 4, 8};
+            const uint32x4_t laneBits = vld1q_u32(laneBitValues);
+            const bool anyType = type == kInvalidHandle;
+            uint64_t mask = 0;
+            for (int i = 0; i < kWordRows; i += 4) {
+                int32x4_t values = vld1q_s32(tokens + i);
+                uint32x4_t match = vandq_u32(vcgeq_s32(values, low), vcleq_s32(values, high));
+                if (!anyType) match = vandq_u32(match, vceqq_u32(vld1q_u32(typeIds + i), wanted));
+                mask |= static_cast<uint64_t>(vaddvq_u32(vandq_u32(match, laneBits))) << i;
+            }
+            return mask;
+        }
+#endif
+
+        uint64_t matchWord(size_t word, TypeHandle type, int minTokens, int maxTokens) const {
+            const int32_t *wordTokens = &tokens[word * kWordRows];
+            const uint32_t *wordTypes = &typeIds[word * kWordRows];
+#if defined(ACCOUNT_COLUMNS_AVX2)
+            if (hasAvx2()) return matchWordAvx2(wordTokens, wordTypes, type, minTokens, maxTokens);
+#elif defined(ACCOUNT_COLUMNS_NEON)
+            return matchWordNeon(wordTokens, wordTypes, type, minTokens, maxTokens);
+#endif
+            return matchWordScalar(wordTokens, wordTypes, type, minTokens, maxTokens);
+        }
+
+    public:
+        AccountColumns() : liveRows(0) {}
+
+        /**
+         * Add a row for the given account, reusing a removed one if there is one.
+         * @param account The indexed account, which must stay where it is until its row is removed.
+         * @return The row of the account.
+         */
+        uint32_t insert(const IndexedAccount &account) {
+            uint32_t row;
+            if (!freeRows.empty()) {
+                row = freeRows.back();
+                freeRows.pop_back();
+            }
+            else {
+                row = static_cast<uint32_t>(accounts.size());
+                if (row % kWordRows == 0) {
+                    // A whole word of dead rows, so that the kernel always reads full words
+                    tokens.resize(row + kWordRows, 0);
+                    typeIds.resize(row + kWordRows, kInvalidHandle);
+                    ids.resize(row + kWordRows, 0);
+                    live.push_back(0);
+                    referenced.push_back(0);
+                }
+                accounts.push_back(nullptr);
+            }
+            tokens[row] = account.tokens;
+            typeIds[row] = account.accountType;
+            ids[row] = account.id;
+            accounts[row] = &account;
+            live[row / kWordRows] |= uint64_t(1) << (row % kWordRows);
+            referenced[row / kWordRows] |= uint64_t(1) << (row % kWordRows);
+            ++liveRows;
+            return row;
+        }
+
+        /**
+         * Remove the given row, leaving it for the next insert.
+         * @param row A row returned by insert and not removed since.
+         */
+        void remove(uint32_t row) {
+            live[row / kWordRows] &= ~(uint64_t(1) << (row % kWordRows));
+            accounts[row] = nullptr;
+            freeRows.push_back(row);
+            --liveRows;
+        }
+
+        /**
+         * Scan the columns for the accounts of a type with tokens in [minTokens, maxTokens].
+         * @param type The handle of the account type, or kInvalidHandle for all types.
+         * @param minTokens The minimum token value, inclusive.
+         * @param maxTokens The maximum token value, inclusive.
+         * @param out The vector to append the matching accounts to, in row order.
+         */
+        void scan(TypeHandle type, int minTokens, int maxTokens, vector<const IndexedAccount *> &out) const {
+            if (minTokens > maxTokens) return;
+            for (size_t word = 0; word < live.size(); ++word) {
+                if (live[word] == 0) continue;
+                for (uint64_t mask = live[word] & matchWord(word, type, minTokens, maxTokens); mask; mask &= mask - 1) {
+                    out.push_back(accounts[word * kWordRows + __builtin_ctzll(mask)]);
+                }
+            }
+        }
+
+        /**
+         * Scan the columns as scan does, and return the matches in the order of the token index: tokens
+         * in descending order, then by id handle, then newest version first. The matches are sorted on
+         * 64-bit keys built from the columns, so the accounts are only read to order versions of an id
+         * with equal tokens.
+         * @param type The handle of the account type, or kInvalidHandle for all types.
+         * @param minTokens The minimum token value, inclusive.
+         * @param maxTokens The maximum token value, inclusive.
+         * @param out The vector to append the matching accounts to.
+         */
+        void scanOrdered(TypeHandle type, int minTokens, int maxTokens, vector<const IndexedAccount *> &out) const {
+            if (minTokens > maxTokens) return;
+            // Flipping the sign bit orders the tokens as unsigned; complementing them puts the highest first
+            vector<pair<uint64_t, uint32_t>> keys;
+            for (size_t word = 0; word < live.size(); ++word) {
+                if (live[word] == 0) continue;
+                for (uint64_t mask = live[word] & matchWord(word, type, minTokens, maxTokens); mask; mask &= mask - 1) {
+                    size_t row = word * kWordRows + __builtin_ctzll(mask);
+                    uint64_t descendingTokens = ~(static_cast<uint32_t>(tokens[row]) ^ 0x80000000u) & 0xFFFFFFFFu;
+                    keys.push_back(make_pair(descendingTokens << 32 | ids[row], static_cast<uint32_t>(row)));
+                }
+            }
+            sort(keys.begin(), keys.end(),
+                 [](const pair<uint64_t, uint32_t> &a, const pair<uint64_t, uint32_t> &b) { return a.first < b.first; });
+            size_t first = out.size();
+            for (const pair<uint64_t, uint32_t> &key : keys) out.push_back(accounts[key.second]);
+            for (size_t i = 1; i < keys.size(); ++i) {
+                if (keys[i].first != keys[i - 1].first) continue;
+                size_t end = i + 1;
+                while (end < keys.size() && keys[end].first == keys[i].first) ++end;
+                sort(out.begin() + first + i - 1, out.begin() + first + end,
+                     [](const IndexedAccount *a, const IndexedAccount *b) { return a->version > b->version; });
+                i = end - 1;
+            }
+        }
+
+        /**
+         * Clear the reference bit of a row, as the CLOCK hand passes it.
+         * @param row A row below capacity().
+         * @return Whether the bit was set, i.e. whether the row was inserted since the hand last passed.
+         */
+        bool clearReferenced(uint32_t row) {
+            uint64_t bit = uint64_t(1) << (row % kWordRows);
+            bool wasSet = (referenced[row / kWordRows] & bit) != 0;
+            referenced[row / kWordRows] &= ~bit;
+            return wasSet;
+        }
+
+        // The account of a row, or nullptr if the row is dead
+        const IndexedAccount *account(uint32_t row) const { return accounts[row]; }
+
+        // The number of live rows, and of rows including the removed ones awaiting reuse
+        size_t size() const { return liveRows; }
+        size_t capacity() const { return accounts.size(); }
+};
+
+#endif // ACCOUNT_COLUMNS_H
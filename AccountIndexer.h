@@ -0,0 +1,1083 @@
+/**
+ * @file AccountIndexer.h
+ * @brief Account index with primary, secondary and top-K indexes
+ *
+ * Stores the indexed account versions, the id -> latest version index, the token-ordered secondary
+ * indexes used by queries, a columnar copy of the tokens and types for scans, and the per-type top-K
+ * containers, plus the lazy query views over them. With a memory budget, cold versions are evicted to
+ * a disk-backed tier and faulted back in on demand.
+ */
+
+#ifndef ACCOUNT_INDEXER_H
+#define ACCOUNT_INDEXER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <set>
+#include <limits>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+#include "Account.h"
+#include "TopKAccounts.h"
+#include "NodePool.h"
+#include "AccountPolicies.h"
+#include "AccountColumns.h"
+#include "FlatHashMap.h"
+#include "ColdAccountStore.h"
+#include "Metrics.h"
+
+// Entry of a token-ordered secondary index. It points at the account's slot in indexedAccounts,
+// which stays valid until the account is removed from the index.
+struct TokenIndexEntry {
+    int tokens;
+    const IndexedAccount *account;
+};
+
+// Orders the secondary index by tokens in descending order, then by id handle (i.e. the order in which
+// ids were first seen) and newest version first, so that range queries come back in a deterministic
+// order. An entry without an account is a search probe that sorts ahead of every account with the
+// same tokens.
+struct TokenIndexOrder {
+    bool operator()(const TokenIndexEntry &a, const TokenIndexEntry &b) const {
+        if (a.tokens != b.tokens) return a.tokens > b.tokens;
+        if (!a.account || !b.account) return !a.account && b.account;
+        if (a.account->id != b.account->id) return a.account->id < b.account->id;
+        return a.account->version > b.account->version;
+    }
+};
+
+// The nodes of the indexes come from the indexer's NodeArena
+typedef set<TokenIndexEntry, TokenIndexOrder, PoolAllocator<TokenIndexEntry>> TokenIndex;
+
+// Entry of the per-type token index of the versions evicted to the cold tier, ordered as TokenIndexOrder
+// orders the hot ones
+struct ColdTokenEntry {
+    int tokens;
+    IdHandle id;
+    int version;
+};
+
+struct ColdTokenOrder {
+    bool operator()(const ColdTokenEntry &a, const ColdTokenEntry &b) const {
+        if (a.tokens != b.tokens) return a.tokens > b.tokens;
+        if (a.id != b.id) return a.id < b.id;
+        return a.version > b.version;
+    }
+};
+
+typedef set<ColdTokenEntry, ColdTokenOrder, PoolAllocator<ColdTokenEntry>> ColdTokenIndex;
+
+// A version evicted to the cold tier: what ranking and queries need without reading its record
+struct ColdAccount {
+    TypeHandle accountType;
+    int tokens;
+    ColdRecord record;
+};
+
+// Iterator range over a token-ordered secondary index
+struct TokenRange {
+    TokenIndex::const_iterator first;
+    TokenIndex::const_iterator last;
+
+    TokenIndex::const_iterator begin() const { return first; }
+    TokenIndex::const_iterator end() const { return last; }
+    bool empty() const { return first == last; }
+};
+
+/**
+ * Lightweight read-only handle to an account stored in the index. It resolves the interned id and
+ * type on access, so handing it around copies three pointers.
+ */
+class AccountRef {
+    private:
+        const IndexedAccount *account;
+        const InternedStrings *ids;
+        const InternedStrings *types;
+
+    public:
+        AccountRef(const IndexedAccount *account, const InternedStrings *ids, const InternedStrings *types)
+            : account(account), ids(ids), types(types) {}
+
+        const string &id() const { return ids->str(account->id); }
+        const string &accountType() const { return types->str(account->accountType); }
+        int tokens() const { return account->tokens; }
+        int version() const { return account->version; }
+        int callbackTimeMs() const { return account->callbackTimeMs; }
+        const AccountData &data() const { return account->data; }
+        const IndexedAccount &get() const { return *account; }
+
+        /**
+         * Materialize a full copy of the account.
+         * @return The account with its id and type resolved.
+         */
+        Account toAccount() const {
+            return Account(id(), accountType(), account->tokens, account->callbackTimeMs, account->data, account->version);
+        }
+};
+
+// Position in query results to resume a paginated query from: the last account of the previous page
+struct AccountCursor {
+    int tokens;
+    IdHandle id;
+    int version;
+
+    AccountCursor() : tokens(numeric_limits<int>::max()), id(0), version(0) {}
+    explicit AccountCursor(const AccountRef &last) : tokens(last.tokens()), id(last.get().id), version(last.version()) {}
+};
+
+/**
+ * Lazy, read-only view over the accounts matching a query. Iterating it yields AccountRef handles to
+ * the accounts stored in the index, so nothing is copied unless the caller materializes it. A view is
+ * invalidated by the next update to the index.
+ */
+class AccountView {
+    public:
+        class iterator {
+            private:
+                TokenIndex::const_iterator position;
+                size_t remaining;
+                const InternedStrings *ids;
+                const InternedStrings *types;
+
+                // Lets it->id() work although dereferencing yields a handle by value
+                struct ArrowProxy {
+                    AccountRef ref;
+                    const AccountRef *operator->() const { return &ref; }
+                };
+
+            public:
+                typedef std::input_iterator_tag iterator_category;
+                typedef AccountRef value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef ArrowProxy pointer;
+                typedef AccountRef reference;
+
+                iterator(TokenIndex::const_iterator position, size_t remaining, const InternedStrings *ids,
+                         const InternedStrings *types)
+                    : position(position), remaining(remaining), ids(ids), types(types) {}
+
+                AccountRef operator*() const { return AccountRef(position->account, ids, types); }
+                ArrowProxy operator->() const { return ArrowProxy{**this}; }
+                iterator &operator++() {
+                    ++position;
+                    --remaining;
+                    return *this;
+                }
+                iterator operator++(int) {
+                    iterator previous = *this;
+                    ++*this;
+                    return previous;
+                }
+                // Iterators that have used up the limit compare equal to the end of the view
+                bool operator==(const iterator &other) const {
+                    return position == other.position || (remaining == 0 && other.remaining == 0);
+                }
+                bool operator!=(const iterator &other) const { return !(*this == other); }
+        };
+
+        /**
+         * Construct a view over a range of an indexer's token index.
+         * @param range The matching entries.
+         * @param limit The maximum number of accounts in the view.
+         * @param symbols The interning tables of the indexer, of any id policy.
+         */
+        template <typename Symbols>
+        AccountView(TokenRange range, size_t limit, const Symbols *symbols)
+            : range(range), limit(limit), ids(&symbols->ids), types(&symbols->types) {}
+
+        iterator begin() const { return iterator(range.first, limit, ids, types); }
+        iterator end() const { return iterator(range.last, 0, ids, types); }
+        bool empty() const { return begin() == end(); }
+
+        /**
+         * Count the accounts in the view without materializing them. This walks the view, O(k).
+         * @return The number of accounts in the view.
+         */
+        size_t size() const {
+            size_t count = 0;
+            for (iterator it = begin(); it != end(); ++it) ++count;
+            return count;
+        }
+
+    private:
+        TokenRange range;
+        size_t limit;
+        const InternedStrings *ids;
+        const InternedStrings *types;
+};
+
+/**
+ * AccountIndexer class is used to manage indexing of account updates. The id interner, the storage of
+ * the indexed versions and K are chosen by the policy (see AccountPolicies.h); AccountIndexer is the
+ * default instantiation.
+ */
+template <typename Policy>
+class BasicAccountIndexer {
+    public:
+        typedef BasicAccountSymbols<typename Policy::IdInterner> Symbols;
+        typedef typename Policy::template AccountMap<AccountKey, IndexedAccount, AccountKeyHash,
+                                                     PoolAllocator<pair<const AccountKey, IndexedAccount>>> IndexedAccountMap;
+        typedef FlatHashMap<AccountKey, ColdAccount, AccountKeyHash, equal_to<AccountKey>,
+                            PoolAllocator<pair<const AccountKey, ColdAccount>>> ColdAccountMap;
+
+    private:
+        enum : size_t {
+            // Estimated bytes of a token index node, including the tree's node header, and of a flat
+            // table's slot and control byte per entry at its average load, for the memory estimate
+            kTreeNodeBytes = 48, kTableSlotBytes = 16,
+            // Eviction goes 1/kEvictionSlack below the budget, so that it does not run on every update
+            kEvictionSlack = 16,
+            kColdAccountBytes = sizeof(pair<const AccountKey, ColdAccount>) + kTableSlotBytes + kTreeNodeBytes
+        };
+        enum : int { kNoColdVersion = numeric_limits<int>::min() };
+
+        size_t topK;
+        Symbols symbols;
+        // Slabs for the nodes of indexedAccounts and the token indexes, reused as versions are superseded.
+        // Declared before the containers, so that it outlives them.
+        NodeArena nodeArena;
+        IndexedAccountMap indexedAccounts;
+        // Primary index from id handle to the slot of its latest indexed version in indexedAccounts, or nullptr.
+        // The policy's map never moves its values, so the pointers stay valid until the entry is erased.
+        vector<IndexedAccount *> latestAccounts;
+        // Per account type, indexed by type handle. A deque keeps references to them stable as types are added.
+        deque<TopKAccounts> highestTokenAccounts;
+        deque<TokenIndex> accountsByType;
+        // Secondary index ordered by tokens across all types
+        TokenIndex allAccounts;
+        // The tokens and type of every indexed account as columns, for queries that scan
+        AccountColumns columns;
+        // Per account type, bumped on every change to the type's accounts, so snapshots can tell which
+        // types changed since they were taken
+        vector<uint64_t> typeRevisions;
+        // Set between deferHighestTokenAccounts and rankDeferredHighestTokenAccounts, during which the
+        // types whose accounts changed are only recorded, to be ranked afresh once
+        bool rankingDeferred;
+        vector<TypeHandle> unrankedTypes;
+
+        // The cold tier, open once enableColdTier is called: the record file, the evicted versions by
+        // key and per type in token order, and for every id whose latest version was evicted, that
+        // version, or kNoColdVersion
+        ColdAccountStore coldStore;
+        ColdAccountMap coldAccounts;
+        deque<ColdTokenIndex> coldAccountsByType;
+        vector<int> coldLatestVersions;
+        size_t memoryBudget;
+        // The memory estimate above which eviction is due: the budget, or if the last pass could not get
+        // under it for the pinned versions, 1/kEvictionSlack of it above where that pass ended
+        size_t evictAbove;
+        // The estimated bytes of the versions in memory, and the row the CLOCK hand of eviction is at
+        size_t hotBytes;
+        size_t clockHand;
+
+        // The estimated memory of an indexed version: its node, its slot in indexedAccounts, its nodes
+        // in the two token indexes, its columns and its spilled data fields
+        static size_t hotAccountBytes(const IndexedAccount &account) {
+            return sizeof(pair<const AccountKey, IndexedAccount>) + kTableSlotBytes + 2 * kTreeNodeBytes +
+                   sizeof(int32_t) + sizeof(uint32_t) + sizeof(IdHandle) + sizeof(const IndexedAccount *) +
+                   account.data.heapBytes();
+        }
+
+        // Take an account out of the id index, the token indexes and the columns, leaving its slot in
+        // indexedAccounts and the top-K containers to the caller
+        void unlinkIndexedAccount(const IndexedAccount &account) {
+            if (latestAccounts[account.id] == &account) {
+                latestAccounts[account.id] = nullptr;
+            }
+
+            TokenIndexEntry entry{account.tokens, &account};
+            allAccounts.erase(entry);
+            columns.remove(account.columnRow);
+            accountsByType[account.accountType].erase(entry);
+            ++typeRevisions[account.accountType];
+            hotBytes -= hotAccountBytes(account);
+        }
+
+        void removeIndexedAccount(typename IndexedAccountMap::iterator it) {
+            const IndexedAccount &account = it->second;
+            IdHandle id = account.id;
+            int version = account.version;
+            TypeHandle type = account.accountType;
+            unlinkIndexedAccount(account);
+            // Erased first, since backfilling may fault accounts in from the cold tier
+            indexedAccounts.erase(it);
+
+            if (rankingDeferred) {
+                unrankedTypes.push_back(type);
+            }
+            else {
+                TopKAccounts &topKForType = highestTokenAccounts[type];
+                const TopKEntry *topKEntry = topKForType.find(id);
+                if (topKEntry && topKEntry->version == version) {
+                    topKForType.remove(id);
+                    faultInHighestTokenCandidates(type);
+                    backfillHighestTokenAccounts(topKForType, accountsByType[type]);
+                }
+            }
+        }
+
+        bool isHighestTokenAccount(const IndexedAccount &account) const {
+            const TopKEntry *entry = highestTokenAccounts[account.accountType].find(account.id);
+            return entry && entry->version == account.version;
+        }
+
+        /**
+         * Move an account to the cold tier.
+         * @return False if its record could not be written; the account is then left in memory.
+         */
+        bool evictAccount(const IndexedAccount &account) {
+            ColdRecord record;
+            if (!coldStore.append(symbols.ids.str(account.id), symbols.types.str(account.accountType), account, record)) {
+                return false;
+            }
+            AccountKey key{account.id, account.version};
+            coldAccounts.emplace(key, ColdAccount{account.accountType, account.tokens, record});
+            coldAccountsByType[account.accountType].insert(ColdTokenEntry{account.tokens, account.id, account.version});
+            if (latestAccounts[account.id] == &account) {
+                if (account.id >= coldLatestVersions.size()) {
+                    coldLatestVersions.resize(latestAccounts.size(), kNoColdVersion);
+                }
+                coldLatestVersions[account.id] = account.version;
+            }
+            auto it = indexedAccounts.find(key);
+            unlinkIndexedAccount(it->second);
+            indexedAccounts.erase(it);
+            return true;
+        }
+
+        // Take a version out of the cold tier's indexes, dropping its record
+        void dropColdAccount(typename ColdAccountMap::iterator it) {
+            const AccountKey key = it->first;
+            const ColdAccount &cold = it->second;
+            coldAccountsByType[cold.accountType].erase(ColdTokenEntry{cold.tokens, key.id, key.version});
+            ++typeRevisions[cold.accountType];
+            if (key.id < coldLatestVersions.size() && coldLatestVersions[key.id] == key.version) {
+                coldLatestVersions[key.id] = kNoColdVersion;
+            }
+            coldStore.release(cold.record);
+            coldAccounts.erase(it);
+        }
+
+        /**
+         * Bring a version back from the cold tier into memory.
+         * @return The indexed account, or nullptr if the version is not cold or its record could not be read.
+         */
+        const IndexedAccount *faultInAccount(const AccountKey &key) {
+            auto it = coldAccounts.find(key);
+            if (it == coldAccounts.end()) return nullptr;
+            Account account;
+            if (!coldStore.read(it->second.record, account)) return nullptr;
+            IndexedAccount restored{key.id, it->second.accountType, account.tokens, account.version, account.callbackTimeMs,
+                                    std::move(account.data)};
+            dropColdAccount(it);
+            METRICS_COUNT(Counter::AccountsFaultedIn, 1);
+            return &restoreAccount(std::move(restored));
+        }
+
+        /**
+         * Fault in the cold accounts of a type that could be among its K highest token value accounts:
+         * those that fewer than K distinct ids of the type's accounts in memory rank ahead of. So the
+         * top-K containers stay exact, although they are only ranked from the accounts in memory.
+         * Ties rank by id string, which the indexes are not ordered by, so once a candidate is ruled
+         * out the others with as many tokens are still looked at, and only those with fewer are not.
+         */
+        void faultInHighestTokenCandidates(TypeHandle type) {
+            const ColdTokenIndex &cold = coldAccountsByType[type];
+            vector<IdHandle> ahead;
+            bool ruledOut = false;
+            int ruledOutTokens = 0;
+            for (auto it = cold.begin(); it != cold.end(); ) {
+                const ColdTokenEntry candidate = *it;
+                if (ruledOut && candidate.tokens != ruledOutTokens) return;
+                ahead.clear();
+                for (const TokenIndexEntry &entry : accountsByType[type]) {
+                    if (entry.tokens < candidate.tokens || ahead.size() >= topK) break;
+                    const IndexedAccount &account = *entry.account;
+                    bool ranksAhead = entry.tokens != candidate.tokens ? true
+                        : account.id != candidate.id ? symbols.ids.str(account.id) < symbols.ids.str(candidate.id)
+                        : account.version > candidate.version;
+                    if (ranksAhead && find(ahead.begin(), ahead.end(), account.id) == ahead.end()) ahead.push_back(account.id);
+                }
+                if (ahead.size() >= topK) {
+                    ruledOut = true;
+                    ruledOutTokens = candidate.tokens;
+                    ++it;
+                    continue;
+                }
+                // Faulting in drops only the candidate's own cold entry, so the next one stays valid
+                auto next = std::next(it);
+                if (!faultInAccount(AccountKey{candidate.id, candidate.version})) return;
+                it = next;
+            }
+        }
+
+        // Append the cold entries of an index with tokens in [minTokens, maxTokens] that come after the
+        // cursor, if there is one, up to the limit
+        static void collectColdRange(const ColdTokenIndex &index, int minTokens, int maxTokens, const AccountCursor *after,
+                                     size_t limit, vector<ColdTokenEntry> &out) {
+            if (minTokens > maxTokens) return;
+            ColdTokenOrder order;
+            ColdTokenEntry first{maxTokens, 0, numeric_limits<int>::max()};
+            auto it = index.lower_bound(first);
+            if (after) {
+                ColdTokenEntry cursor{after->tokens, after->id, after->version};
+                if (!order(cursor, first)) it = index.upper_bound(cursor);
+            }
+            for (size_t taken = 0; it != index.end() && it->tokens >= minTokens && taken < limit; ++it, ++taken) {
+                out.push_back(*it);
+            }
+        }
+
+        // Collect the cold entries matching a query, in query order, up to the limit
+        void collectColdAccounts(const string &accountType, int minTokens, int maxTokens, const AccountCursor *after,
+                                 size_t limit, vector<ColdTokenEntry> &out) const {
+            if (coldAccounts.empty()) return;
+            if (!accountType.empty()) {
+                TypeHandle type = symbols.types.find(accountType);
+                if (type != kInvalidHandle) collectColdRange(coldAccountsByType[type], minTokens, maxTokens, after, limit, out);
+                return;
+            }
+            size_t first = out.size();
+            for (const ColdTokenIndex &index : coldAccountsByType) {
+                collectColdRange(index, minTokens, maxTokens, after, limit, out);
+            }
+            sort(out.begin() + first, out.end(), ColdTokenOrder());
+            if (out.size() - first > limit) out.resize(first + limit);
+        }
+
+        /**
+         * Fill a top-K container from the type's token index with the best accounts that are not in it yet.
+         * The index orders ties by id handle rather than id string, so once the container is full the
+         * entries with as many tokens as its weakest are still offered to it. This is O(K log K) plus
+         * the entries tied with the K-th.
+         */
+        void backfillHighestTokenAccounts(TopKAccounts &tokenAccounts, const TokenIndex &index) {
+            if (tokenAccounts.getCapacity() == 0) return;
+            for (const TokenIndexEntry &entry : index) {
+                if (tokenAccounts.size() >= tokenAccounts.getCapacity() && entry.tokens < tokenAccounts.weakest().tokens) return;
+                if (!tokenAccounts.find(entry.account->id)) {
+                    tokenAccounts.insert(*entry.account);
+                }
+            }
+        }
+
+        /**
+         * Rank the accounts of a type afresh from its token index, so this is O(K log K) plus the ties
+         * with the K-th, however many of the type's accounts changed.
+         */
+        void rankHighestTokenAccounts(TypeHandle type) {
+            faultInHighestTokenCandidates(type);
+            TopKAccounts &tokenAccounts = highestTokenAccounts[type];
+            tokenAccounts.clear();
+            backfillHighestTokenAccounts(tokenAccounts, accountsByType[type]);
+        }
+
+        // Make room in the primary index for a newly interned id
+        IdHandle trackAccountId(IdHandle handle) {
+            if (handle >= latestAccounts.size()) {
+                latestAccounts.resize(handle + 1, nullptr);
+            }
+            return handle;
+        }
+
+        const TokenIndex *findTokenIndex(const string &accountType) const {
+            if (accountType.empty()) return &allAccounts;
+            TypeHandle type = symbols.types.find(accountType);
+            return type != kInvalidHandle ? &accountsByType[type] : nullptr;
+        }
+
+        static TokenRange rangeOf(const TokenIndex &index, int minTokens, int maxTokens) {
+            if (minTokens > maxTokens) return TokenRange{index.end(), index.end()};
+            auto first = index.lower_bound(TokenIndexEntry{maxTokens, nullptr});
+            auto last = minTokens == numeric_limits<int>::min()
+                ? index.end()
+                : index.lower_bound(TokenIndexEntry{minTokens - 1, nullptr});
+            return TokenRange{first, last};
+        }
+
+    public:
+        /**
+         * Construct an AccountIndexer.
+         * @param topK The number of highest token value accounts to keep per account type, unless the
+         * policy fixes it.
+         */
+        explicit BasicAccountIndexer(size_t topK = 3)
+            : topK(Policy::kTopK != 0 ? static_cast<size_t>(Policy::kTopK) : topK), indexedAccounts(0, AccountKeyHash(), equal_to<AccountKey>(), PoolAllocator<IndexedAccount>(nodeArena)),
+              allAccounts(TokenIndexOrder(), PoolAllocator<TokenIndexEntry>(nodeArena)), rankingDeferred(false),
+              coldAccounts(0, AccountKeyHash(), equal_to<AccountKey>(), PoolAllocator<ColdAccount>(nodeArena)),
+              memoryBudget(0), evictAbove(0), hotBytes(0), clockHand(0) {}
+
+        // The secondary indexes point into indexedAccounts, so the indexer cannot be copied
+        BasicAccountIndexer(const BasicAccountIndexer &) = delete;
+        BasicAccountIndexer &operator=(const BasicAccountIndexer &) = delete;
+
+        /**
+         * Get the handle of the given account id, interning it on first sight.
+         * @param id The account id.
+         * @return The handle of the id.
+         */
+        IdHandle internAccountId(const string &id) {
+            return trackAccountId(symbols.ids.intern(id));
+        }
+
+        /**
+         * Get the handle of the given account id, interning it on first sight by moving it into the table.
+         * @param id The account id; left unspecified if it was interned.
+         * @return The handle of the id.
+         */
+        IdHandle internAccountId(string &&id) {
+            return trackAccountId(symbols.ids.intern(std::move(id)));
+        }
+
+        /**
+         * Get the handle of the given account type, interning it and creating its indexes on first sight.
+         * @param accountType The account type.
+         * @return The handle of the account type.
+         */
+        TypeHandle internAccountType(const string &accountType) {
+            TypeHandle handle = symbols.types.intern(accountType);
+            while (handle >= accountsByType.size()) {
+                accountsByType.emplace_back(TokenIndexOrder(), PoolAllocator<TokenIndexEntry>(nodeArena));
+                highestTokenAccounts.emplace_back(topK, &symbols.ids);
+                coldAccountsByType.emplace_back(ColdTokenOrder(), PoolAllocator<ColdTokenEntry>(nodeArena));
+                typeRevisions.push_back(0);
+            }
+            return handle;
+        }
+
+        /**
+         * Get the handle of the given account id without interning it.
+         * @param id The account id.
+         * @return The handle of the id, or kInvalidHandle if the id has never been seen.
+         */
+        IdHandle findAccountId(const string &id) const {
+            return symbols.ids.find(id);
+        }
+
+        const string &getAccountId(IdHandle id) const { return symbols.ids.str(id); }
+        const string &getAccountType(TypeHandle accountType) const { return symbols.types.str(accountType); }
+        const Symbols &getSymbols() const { return symbols; }
+
+        /**
+         * Index the given account.
+         * @param account The account to be indexed, with its id and type already interned in this indexer.
+         * @return The indexed account.
+         */
+        const IndexedAccount &indexAccount(IndexedAccount account) {
+            const IndexedAccount &slot = restoreAccount(std::move(account));
+            cout << "Account " << symbols.ids.str(slot.id) << " v" << slot.version << " has been indexed." << endl;
+            return slot;
+        }
+
+        /**
+         * Index the given account without reporting it, as when restoring a checkpoint.
+         * @param account The account to be indexed, with its id and type already interned in this indexer.
+         * @return The indexed account.
+         */
+        const IndexedAccount &restoreAccount(IndexedAccount account) {
+            AccountKey key{account.id, account.version};
+            auto existing = indexedAccounts.find(key);
+            if (existing != indexedAccounts.end()) {
+                removeIndexedAccount(existing);
+            }
+            if (!coldAccounts.empty()) {
+                auto cold = coldAccounts.find(key);
+                if (cold != coldAccounts.end()) dropColdAccount(cold);
+            }
+
+            IndexedAccount &slot = indexedAccounts.emplace(key, std::move(account)).first->second;
+            IndexedAccount *&latest = latestAccounts[slot.id];
+            if (slot.id < coldLatestVersions.size() && coldLatestVersions[slot.id] != kNoColdVersion) {
+                // The latest version is in the cold tier, and stays the latest unless this one is newer
+                if (slot.version > coldLatestVersions[slot.id]) {
+                    coldLatestVersions[slot.id] = kNoColdVersion;
+                    latest = &slot;
+                }
+            }
+            else if (!latest || latest->version <= slot.version) {
+                latest = &slot;
+            }
+            slot.columnRow = columns.insert(slot);
+            hotBytes += hotAccountBytes(slot);
+            TokenIndexEntry entry{slot.tokens, &slot};
+            allAccounts.insert(entry);
+            accountsByType[slot.accountType].insert(entry);
+            ++typeRevisions[slot.accountType];
+            if (rankingDeferred) {
+                unrankedTypes.push_back(slot.accountType);
+            }
+            return slot;
+        }
+
+        /**
+         * Index the given account.
+         * @param id The interned handle of the account's id.
+         * @param account The account to be indexed.
+         * @return The indexed copy of the account.
+         */
+        const IndexedAccount &indexAccount(IdHandle id, const Account &account) {
+            return indexAccount(IndexedAccount{id, internAccountType(account.accountType), account.tokens, account.version,
+                                               account.callbackTimeMs, account.data});
+        }
+
+        /**
+         * Index the given account.
+         * @param account The account to be indexed.
+         * @return The indexed copy of the account.
+         */
+        const IndexedAccount &indexAccount(const Account &account) {
+            return indexAccount(internAccountId(account.id), account);
+        }
+
+        /**
+         * Remove the given account from the index.
+         * @param id The id of the account to be removed.
+         * @param version The version of the account to be removed.
+         */
+        void removeAccount(const string &id, int version) {
+            IdHandle handle = symbols.ids.find(id);
+            if (handle != kInvalidHandle) {
+                removeAccount(AccountKey{handle, version});
+            }
+        }
+
+        /**
+         * Remove the account with the given key from the index, including its secondary index entries,
+         * or from the cold tier. If it was among the top K of its type, the next best account of that
+         * type takes its place.
+         * @param key The id handle and version of the account to be removed.
+         */
+        void removeAccount(const AccountKey &key) {
+            auto it = indexedAccounts.find(key);
+            if (it != indexedAccounts.end()) {
+                removeIndexedAccount(it);
+                return;
+            }
+            auto cold = coldAccounts.find(key);
+            if (cold != coldAccounts.end()) {
+                dropColdAccount(cold);
+            }
+        }
+
+        /**
+         * Bound the memory of the indexed versions. Once their estimated size passes the budget,
+         * evictColdAccounts moves the versions indexed least recently to a disk-backed tier in the given
+         * file, and faultInLatestAccount and faultInAccountsByTokens bring them back. The lookups and
+         * ranges of the index only see the versions in memory; the K highest token value accounts of
+         * every type are never evicted, and are ranked as if every version were in memory. Calling it
+         * again only changes the budget.
+         * @param filename The tier's scratch file, created empty and removed with the indexer.
+         * @param budgetBytes The memory budget, in bytes.
+         * @return False if the file could not be created.
+         */
+        bool enableColdTier(const string &filename, size_t budgetBytes) {
+            if (!coldStore.isOpen() && !coldStore.open(filename)) return false;
+            memoryBudget = budgetBytes;
+            evictAbove = budgetBytes;
+            return true;
+        }
+
+        /**
+         * Check whether the cold tier is enabled and the versions in memory exceed the budget. After a
+         * pass of evictColdAccounts that could not get 1/16 below the budget, as when too many versions
+         * are pinned, the next pass is only due once the estimate has grown by another 1/16 of the
+         * budget, so that the budget may be exceeded by that much rather than swept on every update.
+         * @return True if evictColdAccounts is due.
+         */
+        bool isOverMemoryBudget() const {
+            return coldStore.isOpen() && getMemoryUsage() > evictAbove;
+        }
+
+        /**
+         * Estimate the memory the indexed versions take: those in memory, and the index entries of the
+         * cold ones. The interned ids and types are not included.
+         * @return The estimate, in bytes.
+         */
+        size_t getMemoryUsage() const {
+            return hotBytes + coldAccounts.size() * kColdAccountBytes;
+        }
+
+        size_t getMemoryBudget() const { return memoryBudget; }
+
+        /**
+         * Get the number of versions in the cold tier.
+         * @return The number of cold versions.
+         */
+        size_t getColdAccountCount() const {
+            return coldAccounts.size();
+        }
+
+        /**
+         * Evict versions to the cold tier until the memory estimate is 1/16 below the budget, choosing
+         * them with the CLOCK algorithm over the rows of the column store: the hand clears the reference
+         * bit that indexing or faulting in a version sets, and evicts the versions whose bit is already
+         * clear. The highest token value accounts, and the versions the predicate pins, are skipped.
+         * Must not be called while the highest token value accounts are deferred.
+         * @param pinned Whether a version must stay in memory.
+         * @return The number of versions evicted.
+         */
+        template <typename Pinned>
+        size_t evictColdAccounts(Pinned pinned) {
+            if (!isOverMemoryBudget() || rankingDeferred) return 0;
+            size_t target = memoryBudget - memoryBudget / kEvictionSlack;
+            size_t rows = columns.capacity();
+            size_t evicted = 0;
+            // Two turns of the hand pass every row once with its bit cleared
+            for (size_t visited = 0; visited < 2 * rows && getMemoryUsage() > target; ++visited) {
+                uint32_t row = static_cast<uint32_t>(clockHand);
+                clockHand = (clockHand + 1) % rows;
+                const IndexedAccount *account = columns.account(row);
+                if (!account || columns.clearReferenced(row)) continue;
+                if (isHighestTokenAccount(*account) || pinned(*account)) continue;
+                if (!evictAccount(*account)) break;
+                ++evicted;
+            }
+            size_t usage = getMemoryUsage();
+            evictAbove = usage <= target ? memoryBudget : usage + memoryBudget / kEvictionSlack;
+            METRICS_COUNT(Counter::AccountsEvicted, evicted);
+            if (coldStore.needsCompaction()) {
+                vector<ColdRecord *> records;
+                records.reserve(coldAccounts.size());
+                for (auto &cold : coldAccounts) records.push_back(&cold.second.record);
+                coldStore.compact(records);
+            }
+            return evicted;
+        }
+
+        /**
+         * Find the latest version of the account with the given id, faulting it in from the cold tier if
+         * it was evicted.
+         * @param id The handle of the account id.
+         * @return A pointer to the indexed account, or nullptr if no version of it is indexed.
+         */
+        const IndexedAccount *faultInLatestAccount(IdHandle id) {
+            if (id >= latestAccounts.size()) return nullptr;
+            if (latestAccounts[id] || id >= coldLatestVersions.size() || coldLatestVersions[id] == kNoColdVersion) {
+                return latestAccounts[id];
+            }
+            return faultInAccount(AccountKey{id, coldLatestVersions[id]});
+        }
+
+        /**
+         * Fault in from the cold tier the versions findAccountsByTokens would return among the first
+         * limit accounts of its range, after the cursor if given, so that the range is complete up to
+         * the limit. At most limit versions are read.
+         * @param accountType The account type to look in, or an empty string for all types.
+         * @param minTokens The minimum token value, inclusive.
+         * @param maxTokens The maximum token value, inclusive.
+         * @param limit The number of accounts from the start of the range that must be in memory.
+         * @param after The last account returned by the previous page, or nullptr.
+         */
+        void faultInAccountsByTokens(const string &accountType, int minTokens, int maxTokens,
+                                     size_t limit = numeric_limits<size_t>::max(), const AccountCursor *after = nullptr) {
+            if (coldAccounts.empty()) return;
+            vector<ColdTokenEntry> wanted;
+            collectColdAccounts(accountType, minTokens, maxTokens, after, limit, wanted);
+            for (const ColdTokenEntry &entry : wanted) {
+                faultInAccount(AccountKey{entry.id, entry.version});
+            }
+        }
+
+        /**
+         * Find the versions in the cold tier with tokens in [minTokens, maxTokens], without faulting them in.
+         * @param accountType The account type to look in, or an empty string for all types.
+         * @param minTokens The minimum token value, inclusive.
+         * @param maxTokens The maximum token value, inclusive.
+         * @param out The vector to append the matching entries to, in the order of findAccountsByTokens.
+         * @param limit The maximum number of entries to append.
+         */
+        void findColdAccountsByTokens(const string &accountType, int minTokens, int maxTokens, vector<ColdTokenEntry> &out,
+                                      size_t limit = numeric_limits<size_t>::max()) const {
+            collectColdAccounts(accountType, minTokens, maxTokens, nullptr, limit, out);
+        }
+
+        /**
+         * Find the cold tier's entry for the latest version of an account, without reading its record.
+         * @param id The handle of the account id.
+         * @param version Set to the version of the entry, if there is one.
+         * @return The entry, or nullptr if the latest version of the account is not in the cold tier.
+         */
+        const ColdAccount *findColdLatestAccount(IdHandle id, int &version) const {
+            if (id >= coldLatestVersions.size() || coldLatestVersions[id] == kNoColdVersion) return nullptr;
+            version = coldLatestVersions[id];
+            auto it = coldAccounts.find(AccountKey{id, version});
+            return it != coldAccounts.end() ? &it->second : nullptr;
+        }
+
+        /**
+         * Read a version from the cold tier without faulting it in.
+         * @param id The handle of the account id.
+         * @param version The version of the account.
+         * @param account The account to decode into.
+         * @return False if the version is not in the cold tier or could not be read.
+         */
+        bool readColdAccount(IdHandle id, int version, Account &account) {
+            auto it = coldAccounts.find(AccountKey{id, version});
+            return it != coldAccounts.end() && coldStore.read(it->second.record, account);
+        }
+
+        /**
+         * Find the cold tier's entry for a version, without reading its record.
+         * @param key The id handle and version.
+         * @return The entry, or nullptr if the version is not in the cold tier.
+         */
+        const ColdAccount *findColdAccount(const AccountKey &key) const {
+            if (coldAccounts.empty()) return nullptr;
+            auto it = coldAccounts.find(key);
+            return it != coldAccounts.end() ? &it->second : nullptr;
+        }
+
+        // The cold versions of a type, ordered like its token index
+        const ColdTokenIndex &getColdTokenIndex(TypeHandle accountType) const { return coldAccountsByType[accountType]; }
+
+        /**
+         * Write out the cold tier's buffered records and share its file, for a snapshot or a checkpoint
+         * to read the records of the cold versions on another thread while the indexer carries on.
+         * @return The file, or null if there is no cold tier or its records could not be written out.
+         */
+        shared_ptr<const ColdAccountFile> shareColdFile() {
+            return coldStore.isOpen() ? coldStore.shareFile() : nullptr;
+        }
+
+        /**
+         * Find the latest indexed version of the account with the given id, if it is in memory.
+         * @param id The handle of the account id.
+         * @return A pointer to the indexed account, or nullptr if no version of it is in memory.
+         */
+        const IndexedAccount *findLatestAccount(IdHandle id) const {
+            return id < latestAccounts.size() ? latestAccounts[id] : nullptr;
+        }
+
+        /**
+         * Find the latest indexed version of the account with the given id.
+         * @param id The account id.
+         * @return A pointer to the indexed account, or nullptr if no version of it is indexed.
+         */
+        const IndexedAccount *findLatestAccount(const string &id) const {
+            return findLatestAccount(symbols.ids.find(id));
+        }
+
+        /**
+         * Find the given version of an account.
+         * @param id The account id.
+         * @param version The version of the account.
+         * @return A pointer to the indexed account, or nullptr if that version is not indexed.
+         */
+        const IndexedAccount *findAccount(const string &id, int version) const {
+            IdHandle handle = symbols.ids.find(id);
+            if (handle == kInvalidHandle) return nullptr;
+            auto it = indexedAccounts.find(AccountKey{handle, version});
+            return it != indexedAccounts.end() ? &it->second : nullptr;
+        }
+
+        /**
+         * Check whether the given version of an account is indexed.
+         * @param id The account id.
+         * @param version The version of the account.
+         * @return True if that version is indexed.
+         */
+        bool contains(const string &id, int version) const {
+            return findAccount(id, version) != nullptr;
+        }
+
+        /**
+         * Get the number of indexed account versions, in memory or in the cold tier.
+         * @return The number of indexed account versions.
+         */
+        size_t size() const {
+            return indexedAccounts.size() + coldAccounts.size();
+        }
+
+        /**
+         * Find the indexed accounts with tokens in [minTokens, maxTokens] in O(log n).
+         * The range is ordered by tokens in descending order, then by id.
+         * @param accountType The account type to look in, or an empty string for all types.
+         * @param minTokens The minimum token value, inclusive.
+         * @param maxTokens The maximum token value, inclusive.
+         * @return The range of matching secondary index entries. It is invalidated by the next index update.
+         */
+        TokenRange findAccountsByTokens(const string &accountType, int minTokens, int maxTokens) const {
+            const TokenIndex *index = findTokenIndex(accountType);
+            if (!index) {
+                return TokenRange{allAccounts.end(), allAccounts.end()};
+            }
+            return rangeOf(*index, minTokens, maxTokens);
+        }
+
+        /**
+         * Find the indexed accounts with tokens in [minTokens, maxTokens] that come after the cursor in query order.
+         * @param accountType The account type to look in, or an empty string for all types.
+         * @param minTokens The minimum token value, inclusive.
+         * @param maxTokens The maximum token value, inclusive.
+         * @param after The last account returned by the previous page.
+         * @return The range of matching secondary index entries. It is invalidated by the next index update.
+         */
+        TokenRange findAccountsByTokens(const string &accountType, int minTokens, int maxTokens, const AccountCursor &after) const {
+            TokenRange range = findAccountsByTokens(accountType, minTokens, maxTokens);
+            if (range.empty()) return range;
+
+            // The cursor's account may have been removed since, so locate it by its sort key
+            IndexedAccount probeAccount{};
+            probeAccount.id = after.id;
+            probeAccount.version = after.version;
+            TokenIndexEntry probe{after.tokens, &probeAccount};
+            TokenIndexOrder order;
+            if (order(probe, *range.first)) return range;
+
+            const TokenIndex &index = *findTokenIndex(accountType);
+            if (range.last != index.end() && !order(probe, *range.last)) {
+                return TokenRange{range.last, range.last};
+            }
+            return TokenRange{index.upper_bound(probe), range.last};
+        }
+
+        /**
+         * Scan the column store for the indexed accounts with tokens in [minTokens, maxTokens]. This reads
+         * every row, but 8 bytes per row and several rows per instruction, so it beats walking the token
+         * index once a query matches a large share of the accounts, and serves queries that filter the
+         * matches further on what the indexes do not cover.
+         * @param accountType The account type to look in, or an empty string for all types.
+         * @param minTokens The minimum token value, inclusive.
+         * @param maxTokens The maximum token value, inclusive.
+         * @param out The vector to append the matching accounts to.
+         * @param ordered Whether to append them in the order of findAccountsByTokens, rather than in no
+         * particular order, which saves sorting them.
+         */
+        void scanAccountsByTokens(const string &accountType, int minTokens, int maxTokens,
+                                  vector<const IndexedAccount *> &out, bool ordered = false) const {
+            TypeHandle type = kInvalidHandle;
+            if (!accountType.empty()) {
+                type = symbols.types.find(accountType);
+                if (type == kInvalidHandle) return;
+            }
+            if (ordered) columns.scanOrdered(type, minTokens, maxTokens, out);
+            else columns.scan(type, minTokens, maxTokens, out);
+        }
+
+        /**
+         * Estimate how many accounts findAccountsByTokens would return, in O(log n), assuming the tokens
+         * of the index are spread evenly between its lowest and highest.
+         * @param accountType The account type to look in, or an empty string for all types.
+         * @param minTokens The minimum token value, inclusive.
+         * @param maxTokens The maximum token value, inclusive.
+         * @return The estimated number of matching accounts.
+         */
+        size_t estimateAccountsByTokens(const string &accountType, int minTokens, int maxTokens) const {
+            const TokenIndex *index = findTokenIndex(accountType);
+            if (!index || index->empty()) return 0;
+            double highest = index->begin()->tokens, lowest = index->rbegin()->tokens;
+            double low = max<double>(minTokens, lowest), high = min<double>(maxTokens, highest);
+            if (low > high) return 0;
+            if (highest == lowest) return index->size();
+            return static_cast<size_t>(index->size() * min(1.0, (high - low + 1) / (highest - lowest + 1)));
+        }
+
+        /**
+         * Get the number of rows of the column store a scan reads.
+         * @return The rows, including removed ones awaiting reuse.
+         */
+        size_t getColumnRows() const {
+            return columns.capacity();
+        }
+
+        /**
+         * Offer the account to the top-K container of its account type.
+         * @param account The indexed account to be ranked.
+         */
+        void updateHighestTokenAccounts(const IndexedAccount &account) {
+            highestTokenAccounts[account.accountType].insert(account);
+        }
+
+        /**
+         * Stop maintaining the highest token value accounts on every change, as when ingesting a batch
+         * of updates. Until rankDeferredHighestTokenAccounts is called, the top-K containers of the types
+         * that change are stale and updateHighestTokenAccounts must not be called.
+         */
+        void deferHighestTokenAccounts() {
+            rankingDeferred = true;
+        }
+
+        /**
+         * Rank the highest token value accounts of every type that changed since deferHighestTokenAccounts,
+         * once per type, and go back to maintaining them on every change.
+         */
+        void rankDeferredHighestTokenAccounts() {
+            rankingDeferred = false;
+            sort(unrankedTypes.begin(), unrankedTypes.end());
+            unrankedTypes.erase(unique(unrankedTypes.begin(), unrankedTypes.end()), unrankedTypes.end());
+            for (TypeHandle type : unrankedTypes) {
+                rankHighestTokenAccounts(type);
+            }
+            unrankedTypes.clear();
+        }
+
+        /**
+         * Get the highest token value accounts of the given account type.
+         * @param accountType The handle of the account type.
+         * @return The top-K container of the account type.
+         */
+        const TopKAccounts &getHighestTokenAccounts(TypeHandle accountType) const {
+            return highestTokenAccounts[accountType];
+        }
+
+        /**
+         * Find the highest token value accounts of the given account type.
+         * @param accountType The account type.
+         * @return The top-K container of the account type, or nullptr if the type has never been indexed.
+         */
+        const TopKAccounts *findHighestTokenAccounts(const string &accountType) const {
+            TypeHandle type = symbols.types.find(accountType);
+            return type != kInvalidHandle ? &highestTokenAccounts[type] : nullptr;
+        }
+
+        /**
+         * Get the token-ordered index of the given account type.
+         * @param accountType The handle of the account type.
+         * @return The secondary index of the account type.
+         */
+        const TokenIndex &getTokenIndex(TypeHandle accountType) const {
+            return accountsByType[accountType];
+        }
+
+        /**
+         * Get the revision of the given account type, which changes whenever an account of the type is
+         * indexed or removed.
+         * @param accountType The handle of the account type.
+         * @return The revision of the account type.
+         */
+        uint64_t getTypeRevision(TypeHandle accountType) const {
+            return typeRevisions[accountType];
+        }
+
+        /**
+         * Get the number of account types seen so far. Type handles range from 0 to this count.
+         * @return The number of account types.
+         */
+        size_t getAccountTypeCount() const {
+            return symbols.types.size();
+        }
+
+        /**
+         * Get the counters of the slabs the index nodes are allocated from.
+         * @return The counters of the indexer's node arena.
+         */
+        NodeArenaStats getNodeArenaStats() const {
+            return nodeArena.getStats();
+        }
+
+        /**
+         * Get the number of highest token value accounts kept per account type.
+         * @return The configured K.
+         */
+        size_t getTopK() const {
+            return topK;
+        }
+};
+
+typedef BasicAccountIndexer<DefaultAccountPolicy> AccountIndexer;
+
+#endif // ACCOUNT_INDEXER_H
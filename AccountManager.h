@@ -0,0 +1,1102 @@
+/**
+ * @file AccountManager.h
+ * @brief Ingestion and queries over the account index
+ *
+ * Ingests the account updates read by the AccountUpdateReader into the AccountIndexer and
+ * CallbackManager, answers search and filter queries, and reports the changes to standing queries
+ * to their subscribers, optionally within a memory budget. The manager is a template on the policy
+ * of its indexer and callback manager (see AccountPolicies.h); AccountManager is the default.
+ */
+
+#ifndef ACCOUNT_MANAGER_H
+#define ACCOUNT_MANAGER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <limits>
+#include <random>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <future>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include "Account.h"
+#include "AccountIndexer.h"
+#include "CallbackManager.h"
+#include "AccountUpdateReader.h"
+#include "SpscRing.h"
+#include "AccountSnapshot.h"
+#include "ColumnarAccountFormat.h"
+#include "AccountCheckpoint.h"
+#include "AccountSubscriptions.h"
+#include "WriteAheadLog.h"
+#include "Metrics.h"
+
+// Throughput counters of one stage of the pipelined ingest
+struct PipelineStageStats {
+    // Updates the stage has handled
+    uint64_t items;
+    // Times the stage had to wait for the other one, and the time it spent waiting
+    uint64_t stalls;
+    chrono::nanoseconds stalledTime;
+    // Time the stage spent on its own work
+    chrono::nanoseconds busyTime;
+
+    PipelineStageStats() : items(0), stalls(0), stalledTime(0), busyTime(0) {}
+
+    /**
+     * Get the rate the stage could sustain if it never had to wait.
+     * @return Updates per second of busy time.
+     */
+    double throughput() const {
+        return busyTime.count() > 0 ? items * 1e9 / busyTime.count() : 0.0;
+    }
+};
+
+// Counters of the last pipelined ingest. The stage with the lower throughput is the bottleneck;
+// the other one stalls on the ring.
+struct IngestPipelineStats {
+    PipelineStageStats parse;
+    PipelineStageStats ingest;
+};
+
+template <typename Policy>
+class BasicAccountManager {
+    private:
+        enum { kPipelineRingCapacity = 1024, kIngestBatchSize = 512, kScanSelectivity = 32 };
+        enum : uint32_t { kNotInBatch = 0xFFFFFFFFu };
+        typedef chrono::steady_clock PipelineClock;
+
+        IngestPipelineStats pipelineStats;
+
+        // The snapshot readers get, replaced with atomic_store so that readers never see it half written
+        shared_ptr<const AccountSnapshot> snapshot;
+        // Publish a snapshot after this many updates; 0 leaves publishing to the caller
+        size_t snapshotInterval;
+        size_t updatesSinceSnapshot;
+        uint64_t ingestedUpdates;
+        // Draws the random part of callback delays; seeded once, as a random_device read per update is costly
+        mt19937 delayEngine;
+
+        // Scratch space of ingestAccountUpdates, kept across batches: the interned id of every update,
+        // the positions of the updates that survive collapsing, the batch position of each id's latest
+        // version (indexed by id handle, kNotInBatch between batches), and the callbacks to schedule
+        vector<IdHandle> batchIds;
+        vector<uint32_t> batchSurvivors;
+        vector<uint32_t> batchPositionOf;
+        vector<ScheduledCallback> batchCallbacks;
+        // Scratch space of the queries: the matching accounts in memory, and the matching versions in the cold tier
+        vector<const IndexedAccount *> scannedAccounts;
+        vector<ColdTokenEntry> coldMatches;
+
+        // The checkpoint being written in the background, if any
+        future<bool> pendingCheckpoint;
+        // Every update is logged here before it is ingested, if enabled
+        unique_ptr<WriteAheadLog> writeAheadLog;
+
+        // Held while an update is ingested, so that the callback dispatcher never resolves a callback
+        // against a half modified index. Declared before the callback manager, which may still be
+        // draining when it is destroyed.
+        mutex indexerMutex;
+
+    public:
+        // The callback manager resolves accounts from the indexer, so the indexer is declared first
+        BasicAccountIndexer<Policy> accountIndexer;
+        BasicCallbackManager<Policy> callbackManager;
+
+    private:
+        AccountSubscriptions subscriptions;
+
+    public:
+
+        BasicAccountManager() : snapshotInterval(0), updatesSinceSnapshot(0), ingestedUpdates(0), delayEngine(random_device()()),
+              callbackManager(accountIndexer), subscriptions(accountIndexer) {}
+
+        /**
+         * Construct an AccountManager that keeps the given number of highest token value accounts per account type.
+         * @param topK The number of highest token value accounts to keep per account type, unless the policy fixes it.
+         * @param schedulerType The data structure to keep the pending callbacks in, unless the policy fixes it.
+         */
+        explicit BasicAccountManager(size_t topK, SchedulerType schedulerType = SchedulerType::BinaryHeap)
+            : snapshotInterval(0), updatesSinceSnapshot(0), ingestedUpdates(0), delayEngine(random_device()()),
+              accountIndexer(topK),
+              callbackManager(accountIndexer, schedulerType), subscriptions(accountIndexer) {}
+
+        /**
+         * Construct an AccountManager and process the account updates from the given file.
+         * @param filename The name of the file containing the account updates.
+         * @param mode Whether to parse the file up front or stream it update by update.
+         */
+        BasicAccountManager(const string &filename, IngestMode mode = IngestMode::Batch)
+            : snapshotInterval(0), updatesSinceSnapshot(0), ingestedUpdates(0), delayEngine(random_device()()),
+              callbackManager(accountIndexer), subscriptions(accountIndexer) {
+            processAccountUpdates(filename, mode);
+        }
+
+        // A checkpoint still being written refers to the indexer, so it is finished first, and the
+        // dispatcher is stopped before the mutex it locks goes; pending callbacks are dropped
+        ~BasicAccountManager() {
+            waitForCheckpoint();
+            callbackManager.stopDispatcher(false);
+        }
+
+        /**
+         * Fire callbacks from a dispatcher thread when they are due, rather than polling for due
+         * callbacks after each ingested update. With the dispatcher running, callbacks still pending
+         * when the input is exhausted fire at their deadlines instead of being left behind.
+         */
+        void startCallbackDispatcher() {
+            callbackManager.startDispatcher(indexerMutex);
+        }
+
+        /**
+         * Stop the callback dispatcher thread and go back to polling.
+         * @param drain If true, wait until every pending callback has fired.
+         */
+        void stopCallbackDispatcher(bool drain = true) {
+            callbackManager.stopDispatcher(drain);
+        }
+
+        /**
+         * Process the account updates from the given file. A file parsed up front is ingested in batches of
+         * kIngestBatchSize; a streamed one update by update, so that every update is indexed as soon as it
+         * is read, however slowly the input arrives.
+         * @param filename The name of the file containing the account updates.
+         * @param mode Whether to parse the file up front or stream it update by update.
+         */
+        void processAccountUpdates(const string &filename, IngestMode mode = IngestMode::Batch) {
+            if (mode == IngestMode::Pipelined) {
+                pipelineAccountUpdates(filename);
+                return;
+            }
+            vector<Account> batch;
+            if (mode == IngestMode::Batch) batch.reserve(kIngestBatchSize);
+            // The updates after one the write-ahead log failed on are dropped, as they could not be logged
+            bool logged = true;
+            bool read = AccountUpdateReader::readFile(filename, mode, [this, mode, &batch, &logged](Account &&account) {
+                if (!logged) return;
+                if (mode == IngestMode::Streaming) {
+                    logged = ingestAccount(std::move(account));
+                    return;
+                }
+                batch.push_back(std::move(account));
+                if (batch.size() == kIngestBatchSize) {
+                    logged = ingestAccountUpdates(std::move(batch));
+                    batch.clear();
+                }
+            });
+            logged = logged && ingestAccountUpdates(std::move(batch));
+            if (snapshotInterval > 0) {
+                publishSnapshot();
+            }
+            if (!logged) {
+                cerr << "Stopped ingesting " << filename << ": the write-ahead log failed" << endl;
+            }
+            else if (read) {
+                printHighestTokenValueAccounts();
+            }
+        }
+
+        /**
+         * Process the account updates from a columnar file, as written by ColumnarAccountWriter.
+         * The file is memory-mapped and ingested in place: every dictionary entry is interned once, and
+         * each row is then indexed from its columns without building an intermediate Account.
+         * @param filename The name of the columnar file.
+         * @return False if the file could not be mapped or is not a valid columnar file, or if the write-ahead
+         * log failed, in which case the rows from the first one it did not take are not applied.
+         */
+        bool replayColumnarFile(const string &filename) {
+            ColumnarAccountFile file;
+            if (!file.open(filename)) return false;
+
+            vector<IdHandle> ids(file.idCount());
+            vector<FieldHandle> fieldNames(file.fieldNameCount());
+            {
+                lock_guard<mutex> guard(indexerMutex);
+                for (uint32_t i = 0; i < file.idCount(); ++i) {
+                    ids[i] = accountIndexer.internAccountId(file.id(i));
+                }
+            }
+            for (uint32_t i = 0; i < file.fieldNameCount(); ++i) {
+                fieldNames[i] = FieldNames::intern(file.fieldName(i));
+            }
+            // Types are interned on first use, so that a type whose updates are all stale is not created
+            vector<TypeHandle> types(file.typeCount(), kInvalidHandle);
+
+            const uint32_t *idColumn = file.idColumn();
+            const uint32_t *typeColumn = file.typeColumn();
+            const int32_t *tokens = file.tokensColumn();
+            const int32_t *versions = file.versionColumn();
+            const int32_t *callbackTimes = file.callbackTimeMsColumn();
+            const uint64_t *dataOffsets = file.dataOffsets();
+            const columnar::DataField *dataFields = file.dataFields();
+            for (size_t row = 0; row < file.rowCount(); ++row) {
+                IdHandle id = ids[idColumn[row]];
+                AccountData data;
+                data.reserve(static_cast<uint32_t>(dataOffsets[row + 1] - dataOffsets[row]));
+                for (uint64_t f = dataOffsets[row]; f < dataOffsets[row + 1]; ++f) {
+                    data.set(fieldNames[dataFields[f].name], dataFields[f].value);
+                }
+                if (writeAheadLog && !writeAheadLog->append(ingestedUpdates + 1, accountIndexer.getAccountId(id),
+                                                            file.accountType(typeColumn[row]), tokens[row], callbackTimes[row],
+                                                            data, versions[row])) {
+                    cerr << "Stopped replaying " << filename << ": the write-ahead log failed" << endl;
+                    return false;
+                }
+                {
+                    lock_guard<mutex> guard(indexerMutex);
+                    if (supersedeLatestVersion(id, versions[row])) {
+                        TypeHandle &type = types[typeColumn[row]];
+                        if (type == kInvalidHandle) {
+                            type = accountIndexer.internAccountType(file.accountType(typeColumn[row]));
+                        }
+                        indexAndSchedule(IndexedAccount{id, type, tokens[row], versions[row], callbackTimes[row], std::move(data)});
+                    }
+                }
+                finishUpdate();
+            }
+            if (snapshotInterval > 0) {
+                publishSnapshot();
+            }
+            printHighestTokenValueAccounts();
+            return true;
+        }
+
+        /**
+         * Write a checkpoint of the index, the highest token value accounts and the pending callbacks to
+         * the given file, and wait for it to be on disk. Must be called on the ingest thread.
+         * @param filename The checkpoint file to create or replace.
+         * @return False if the checkpoint could not be written.
+         */
+        bool checkpoint(const string &filename) {
+            startCheckpoint(filename);
+            return waitForCheckpoint();
+        }
+
+        /**
+         * Capture the state for a checkpoint and write it on a background thread, so that ingest can
+         * carry on meanwhile. Capturing publishes a snapshot, which copies only the account types that
+         * changed since the previous one, plus the pending callbacks. A checkpoint still being written
+         * is waited for first. Must be called on the ingest thread.
+         * @param filename The checkpoint file to create or replace.
+         */
+        void startCheckpoint(const string &filename) {
+            waitForCheckpoint();
+            // The dispatcher may fire callbacks meanwhile; the indexer is not modified off this thread
+            CheckpointState state;
+            publishSnapshot();
+            state.snapshot = atomic_load(&snapshot);
+            state.topK = accountIndexer.getTopK();
+            state.capturedAt = chrono::system_clock::now();
+            for (const ScheduledCallback &callback : callbackManager.pendingCallbacks()) {
+                state.callbacks.push_back(CheckpointCallback{&accountIndexer.getAccountId(callback.id), callback.version,
+                                                             callback.deadline});
+            }
+            pendingCheckpoint = async(launch::async, [filename](const CheckpointState &captured) {
+                return AccountCheckpointWriter::write(captured, filename);
+            }, std::move(state));
+        }
+
+        /**
+         * Wait for the checkpoint started by startCheckpoint to be written.
+         * @return False if it could not be written; true if it was, or if none was started.
+         */
+        bool waitForCheckpoint() {
+            return pendingCheckpoint.valid() ? pendingCheckpoint.get() : true;
+        }
+
+        /**
+         * Restore the state written by checkpoint into this manager, which must not have ingested anything.
+         * The checkpoint is memory-mapped; its accounts are indexed without replaying their history, the
+         * highest token value accounts are restored as they were, and the pending callbacks are
+         * scheduled at their original wall clock deadlines, so ones that passed while the process was
+         * down fire on the next poll.
+         * @param filename The checkpoint file.
+         * @return False if the manager is not empty, or the file could not be mapped or is not a valid checkpoint.
+         */
+        bool restoreCheckpoint(const string &filename) {
+            if (accountIndexer.getSymbols().ids.size() > 0 || accountIndexer.getAccountTypeCount() > 0) {
+                cerr << "Cannot restore the checkpoint " << filename << " into a manager that has ingested updates" << endl;
+                return false;
+            }
+            AccountCheckpointFile file;
+            if (!file.open(filename)) return false;
+
+            unique_lock<mutex> guard(indexerMutex);
+            vector<IdHandle> ids(file.idCount());
+            for (uint32_t i = 0; i < file.idCount(); ++i) {
+                ids[i] = accountIndexer.internAccountId(file.id(i));
+            }
+            vector<TypeHandle> types(file.typeCount());
+            for (uint32_t i = 0; i < file.typeCount(); ++i) {
+                types[i] = accountIndexer.internAccountType(file.accountType(i));
+            }
+            vector<FieldHandle> fieldNames(file.fieldNameCount());
+            for (uint32_t i = 0; i < file.fieldNameCount(); ++i) {
+                fieldNames[i] = FieldNames::intern(file.fieldName(i));
+            }
+
+            const checkpoint::AccountRow *accounts = file.accounts();
+            const columnar::DataField *dataFields = file.dataFields();
+            for (size_t i = 0; i < file.accountCount(); ++i) {
+                const checkpoint::AccountRow &row = accounts[i];
+                AccountData data;
+                data.reserve(row.dataCount);
+                for (uint64_t f = row.dataOffset; f < row.dataOffset + row.dataCount; ++f) {
+                    data.set(fieldNames[dataFields[f].name], dataFields[f].value);
+                }
+                const IndexedAccount &indexed = accountIndexer.restoreAccount(
+                    IndexedAccount{ids[row.id], types[row.accountType], row.tokens, row.version, row.callbackTimeMs, std::move(data)});
+                // With a different K, the highest token value accounts are ranked afresh
+                if (file.getTopK() != accountIndexer.getTopK()) {
+                    accountIndexer.updateHighestTokenAccounts(indexed);
+                }
+                subscriptions.indexed(indexed);
+            }
+            if (file.getTopK() == accountIndexer.getTopK()) {
+                const uint32_t *topKOffsets = file.topKOffsets();
+                const checkpoint::TopKRow *topKEntries = file.topKEntries();
+                for (uint32_t t = 0; t < file.typeCount(); ++t) {
+                    for (uint32_t e = topKOffsets[t]; e < topKOffsets[t + 1]; ++e) {
+                        const IndexedAccount *account = accountIndexer.findLatestAccount(ids[topKEntries[e].id]);
+                        if (account && account->version == topKEntries[e].version) {
+                            accountIndexer.updateHighestTokenAccounts(*account);
+                        }
+                    }
+                }
+            }
+
+            const checkpoint::CallbackRow *callbacks = file.callbacks();
+            for (size_t i = 0; i < file.callbackCount(); ++i) {
+                const IndexedAccount *account = accountIndexer.findLatestAccount(ids[callbacks[i].id]);
+                if (account && account->version == callbacks[i].version) {
+                    callbackManager.scheduleCallback(*account, checkpoint::fromNanoseconds(callbacks[i].deadlineNs));
+                }
+            }
+
+            subscriptions.rankedHighestTokens(accountIndexer);
+            if (accountIndexer.isOverMemoryBudget()) {
+                evictColdAccounts();
+            }
+
+            ingestedUpdates = file.getSequence();
+            if (snapshotInterval > 0) {
+                publishSnapshot();
+            }
+            guard.unlock();
+            subscriptions.deliver();
+            return true;
+        }
+
+        /**
+         * Log every update from now on to the given write-ahead log before ingesting it, with group commit.
+         * Sequence numbers continue after the last record already in the log, if that is higher than the
+         * updates ingested so far.
+         * @param filename The log file, created if it does not exist.
+         * @param policy When the log's flusher thread writes and syncs batches of records.
+         * @return False if the log could not be opened.
+         */
+        bool enableWriteAheadLog(const string &filename, GroupCommitPolicy policy = GroupCommitPolicy()) {
+            unique_ptr<WriteAheadLog> log(new WriteAheadLog(policy));
+            if (!log->open(filename)) return false;
+            if (log->getLastLsn() > ingestedUpdates) {
+                ingestedUpdates = log->getLastLsn();
+            }
+            writeAheadLog = std::move(log);
+            return true;
+        }
+
+        /**
+         * Flush the write-ahead log and close it; later updates are not logged.
+         */
+        void disableWriteAheadLog() {
+            writeAheadLog.reset();
+        }
+
+        /**
+         * Wait until every update logged so far is on disk.
+         * @return False if no log is enabled or it has failed to write.
+         */
+        bool syncWriteAheadLog() {
+            return writeAheadLog && writeAheadLog->sync();
+        }
+
+        /**
+         * Get the batch size and fsync latency counters of the write-ahead log.
+         * @return The counters, all zero if no log is enabled.
+         */
+        WriteAheadLogStats getWriteAheadLogStats() const {
+            return writeAheadLog ? writeAheadLog->getStats() : WriteAheadLogStats();
+        }
+
+        /**
+         * Recover the state of a manager that crashed or was shut down: restore the checkpoint if there
+         * is one, replay the write-ahead log records written after it, and go on logging to the same
+         * log. This manager must not have ingested anything.
+         * @param checkpointFile The latest checkpoint; a missing file means starting from empty.
+         * @param logFile The write-ahead log; a missing file is an empty log.
+         * @param policy When the log's flusher thread writes and syncs batches of records.
+         * @return False if the checkpoint or the log could not be read.
+         */
+        bool recover(const string &checkpointFile, const string &logFile, GroupCommitPolicy policy = GroupCommitPolicy()) {
+            if (writeAheadLog || accountIndexer.getSymbols().ids.size() > 0) {
+                cerr << "Cannot recover into a manager that has ingested updates" << endl;
+                return false;
+            }
+            if (access(checkpointFile.c_str(), F_OK) == 0 && !restoreCheckpoint(checkpointFile)) return false;
+            WriteAheadLogReplay replayed;
+            bool read = WriteAheadLog::replay(logFile, ingestedUpdates, [this](uint64_t lsn, Account &&account) {
+                // Keep the sequence numbers of the replayed updates, so later checkpoints line up with the log
+                ingestedUpdates = lsn - 1;
+                ingestAccount(std::move(account));
+            }, replayed);
+            if (!read) return false;
+            if (replayed.tornTail) {
+                cerr << "Discarding the torn tail of the write-ahead log " << logFile << " after sequence number "
+                     << replayed.lastLsn << endl;
+            }
+            if (snapshotInterval > 0) {
+                publishSnapshot();
+            }
+            return enableWriteAheadLog(logFile, policy);
+        }
+
+        /**
+         * Get the stage counters of the last pipelined processAccountUpdates.
+         * @return The counters of the parse and ingest stages.
+         */
+        const IngestPipelineStats &getPipelineStats() const {
+            return pipelineStats;
+        }
+
+        /**
+         * Get the process-wide counters and latency histograms, with this manager's gauges: the
+         * indexed account versions, the pending callbacks and the updates ingested so far. Must be called
+         * on the ingest thread; MetricsSnapshot::take alone can be called from any thread. Export the
+         * result with toPrometheus or toJson.
+         * @return The metrics snapshot.
+         */
+        MetricsSnapshot getMetrics() const {
+            MetricsSnapshot metrics = MetricsSnapshot::take();
+            metrics.gauges.push_back(MetricsGauge{"indexed_accounts", static_cast<double>(accountIndexer.size())});
+            metrics.gauges.push_back(MetricsGauge{"pending_callbacks", static_cast<double>(callbackManager.size())});
+            metrics.gauges.push_back(MetricsGauge{"ingested_updates", static_cast<double>(ingestedUpdates)});
+            metrics.gauges.push_back(MetricsGauge{"cold_accounts", static_cast<double>(accountIndexer.getColdAccountCount())});
+            metrics.gauges.push_back(MetricsGauge{"index_memory_bytes", static_cast<double>(accountIndexer.getMemoryUsage())});
+            return metrics;
+        }
+
+        /**
+         * Bound the memory of the index, for a predictable RSS on a node of fixed size. Whenever ingest
+         * leaves the estimated size of the indexed accounts above the budget, the accounts indexed least
+         * recently are evicted to a disk-backed tier in the given file, down to 1/16 below the budget.
+         * The highest token value accounts and the accounts with a pending callback stay in memory.
+         * Views and subscriptions fault evicted accounts back in as they need them, updates supersede
+         * them in the tier without reading them, and snapshots and checkpoints include them, reading their
+         * records from the tier. Calling it again only changes the budget.
+         * @param budgetBytes The memory budget of the indexed accounts, in bytes.
+         * @param coldFile The tier's scratch file, created empty and removed with the manager.
+         * @return False if the file could not be created.
+         */
+        bool enableMemoryBudget(size_t budgetBytes, const string &coldFile) {
+            lock_guard<mutex> guard(indexerMutex);
+            if (!accountIndexer.enableColdTier(coldFile, budgetBytes)) return false;
+            evictColdAccounts();
+            return true;
+        }
+
+        /**
+         * Ingest a single account update, then fire the callbacks that are due unless the dispatcher
+         * thread fires them.
+         * @param account The account update.
+         * @return False if the update could not be logged to the write-ahead log, in which case it is not applied.
+         */
+        bool ingestAccount(const Account &account) {
+            if (!ingestAccountUpdate(account)) return false;
+            finishUpdate();
+            return true;
+        }
+
+        /**
+         * Ingest a single account update whose id and data are moved into the index rather than copied.
+         * @param account The account update; left unspecified.
+         * @return False if the update could not be logged to the write-ahead log, in which case it is not applied.
+         */
+        bool ingestAccount(Account &&account) {
+            if (!ingestAccountUpdate(std::move(account))) return false;
+            finishUpdate();
+            return true;
+        }
+
+        /**
+         * Ingest a batch of account updates with the same outcome as ingesting them one by one, except for
+         * the versions superseded within the batch: the batch is first collapsed to the latest version of
+         * every id, so those are neither logged nor indexed nor given a callback. The highest token value
+         * accounts are then ranked once per account type that changed, the callbacks are scheduled
+         * together, and due callbacks are fired once, after the whole batch.
+         * @param updates The account updates, in feed order; left unspecified, with their ids and data
+         * moved into the index.
+         * @return False if the write-ahead log failed, in which case only the updates it took before are
+         * applied, and the rest of the batch is dropped.
+         */
+        bool ingestAccountUpdates(vector<Account> &&updates) {
+            if (updates.empty()) return true;
+            METRICS_TIME(Histogram::IngestBatchLatency);
+            collapseBatch(updates);
+            METRICS_COUNT(Counter::UpdatesCollapsed, updates.size() - batchSurvivors.size());
+            // An update keeps the sequence number it would have had if the batch were ingested one by one
+            size_t ingested = updates.size();
+            if (writeAheadLog) {
+                for (size_t survivor = 0; survivor < batchSurvivors.size(); ++survivor) {
+                    uint32_t position = batchSurvivors[survivor];
+                    const Account &account = updates[position];
+                    if (!writeAheadLog->append(ingestedUpdates + 1 + position, accountIndexer.getAccountId(batchIds[position]),
+                                               account.accountType, account.tokens, account.callbackTimeMs, account.data,
+                                               account.version)) {
+                        batchSurvivors.resize(survivor);
+                        ingested = position;
+                        break;
+                    }
+                }
+            }
+            {
+                lock_guard<mutex> guard(indexerMutex);
+                chrono::system_clock::time_point now = chrono::system_clock::now();
+                batchCallbacks.clear();
+                accountIndexer.deferHighestTokenAccounts();
+                for (uint32_t position : batchSurvivors) {
+                    Account &account = updates[position];
+                    IdHandle id = batchIds[position];
+                    if (!supersedeLatestVersion(id, account.version)) continue;
+                    const IndexedAccount &indexed = accountIndexer.indexAccount(
+                        IndexedAccount{id, accountIndexer.internAccountType(account.accountType), account.tokens,
+                                       account.version, account.callbackTimeMs, std::move(account.data)});
+                    subscriptions.indexed(indexed);
+                    chrono::milliseconds delay(indexed.callbackTimeMs + getRandomDelay());
+                    batchCallbacks.push_back(ScheduledCallback{now + delay, id, indexed.version});
+                }
+                accountIndexer.rankDeferredHighestTokenAccounts();
+                subscriptions.rankedHighestTokens(accountIndexer);
+                callbackManager.rescheduleCallbacks(batchCallbacks);
+            }
+            if (ingested > 0) finishUpdates(ingested);
+            return ingested == updates.size();
+        }
+
+        /**
+         * Ingest a copy of a batch of account updates, as the overload taking the batch by rvalue does.
+         * @param updates The account updates, in feed order.
+         * @return False if the write-ahead log failed.
+         */
+        bool ingestAccountUpdates(const vector<Account> &updates) {
+            return ingestAccountUpdates(vector<Account>(updates));
+        }
+
+        /**
+         * Publish a snapshot of the index every so many ingested updates, and at the end of every
+         * processAccountUpdates, for readers on other threads.
+         * @param interval The number of updates between snapshots, or 0 to publish only on publishSnapshot.
+         */
+        void enableSnapshots(size_t interval) {
+            snapshotInterval = interval;
+            updatesSinceSnapshot = 0;
+        }
+
+        /**
+         * Publish a snapshot of the index as it is now. Only the account types that changed since the
+         * previous snapshot are copied. Must be called on the ingest thread.
+         */
+        void publishSnapshot() {
+            shared_ptr<const AccountSnapshot> next = AccountSnapshot::take(accountIndexer, accountIndexer.shareColdFile(),
+                                                                           atomic_load(&snapshot), ingestedUpdates);
+            atomic_store(&snapshot, next);
+            updatesSinceSnapshot = 0;
+        }
+
+        /**
+         * Get the latest published snapshot. Safe to call from any thread while ingest runs; the
+         * snapshot stays valid and unchanged for as long as it is held, but not beyond the manager.
+         * @return The latest snapshot, empty if none has been published.
+         */
+        shared_ptr<const AccountSnapshot> getSnapshot() const {
+            shared_ptr<const AccountSnapshot> current = atomic_load(&snapshot);
+            return current ? current : make_shared<const AccountSnapshot>();
+        }
+
+        /**
+         * Search and filter accounts based on the specified criteria.
+         * @param accountType The account type to filter by (optional).
+         * @param minTokens The minimum token value to filter by (optional).
+         * @param maxTokens The maximum token value to filter by (optional).
+         * @return A vector of filtered accounts, ordered by tokens in descending order, then by id. Accounts
+         * in the cold tier are read from it, without faulting them in.
+         */
+        vector<Account> searchAndFilterAccounts(
+            const string &accountType = "", 
+            int minTokens = numeric_limits<int>::min(), 
+            int maxTokens=numeric_limits<int>::max()
+        ) {
+            METRICS_TIME(Histogram::QueryLatency);
+            METRICS_COUNT(Counter::Queries, 1);
+            scannedAccounts.clear();
+            // Walking the token index costs a tree node per match, a scan of the column store a few
+            // cycles per indexed account plus sorting the matches; the scan wins once a query matches
+            // more than about 1 in kScanSelectivity accounts
+            if (accountIndexer.estimateAccountsByTokens(accountType, minTokens, maxTokens) * kScanSelectivity >
+                accountIndexer.getColumnRows()) {
+                METRICS_COUNT(Counter::QueryScans, 1);
+                accountIndexer.scanAccountsByTokens(accountType, minTokens, maxTokens, scannedAccounts, true);
+            }
+            else {
+                for (const TokenIndexEntry &entry : accountIndexer.findAccountsByTokens(accountType, minTokens, maxTokens)) {
+                    scannedAccounts.push_back(entry.account);
+                }
+            }
+            return collectAccounts(accountType, minTokens, maxTokens, nullptr);
+        }
+
+        /**
+         * Search and filter accounts on a predicate over their data fields, besides their type and
+         * tokens. The data fields are not indexed, so this scans the column store for the type and
+         * token range, and evaluates the predicate on every account that passes those.
+         * @param accountType The account type to filter by, or an empty string for all types.
+         * @param minTokens The minimum token value to filter by.
+         * @param maxTokens The maximum token value to filter by.
+         * @param predicate Whether to return an account, given its data fields.
+         * @return A vector of filtered accounts, ordered by tokens in descending order, then by id. Accounts
+         * in the cold tier are read from it, without faulting them in.
+         */
+        vector<Account> searchAndFilterAccounts(
+            const string &accountType,
+            int minTokens,
+            int maxTokens,
+            const function<bool(const AccountData &)> &predicate
+        ) {
+            METRICS_TIME(Histogram::QueryLatency);
+            METRICS_COUNT(Counter::Queries, 1);
+            METRICS_COUNT(Counter::QueryScans, 1);
+            vector<Account> filteredAccounts;
+            scannedAccounts.clear();
+            accountIndexer.scanAccountsByTokens(accountType, minTokens, maxTokens, scannedAccounts);
+            scannedAccounts.erase(remove_if(scannedAccounts.begin(), scannedAccounts.end(),
+                                            [&predicate](const IndexedAccount *account) { return !predicate(account->data); }),
+                                  scannedAccounts.end());
+            TokenIndexOrder order;
+            sort(scannedAccounts.begin(), scannedAccounts.end(), [&order](const IndexedAccount *a, const IndexedAccount *b) {
+                return order(TokenIndexEntry{a->tokens, a}, TokenIndexEntry{b->tokens, b});
+            });
+            return collectAccounts(accountType, minTokens, maxTokens, &predicate);
+        }
+
+        /**
+         * Query accounts without copying them. The view yields handles into the index, ordered by tokens in
+         * descending order, then by id, and is invalidated by the next ingested update. Accounts in the cold
+         * tier that the view reaches, up to offset plus limit, are faulted in first.
+         * Skipping with offset walks the skipped accounts; use queryAccountsAfter to page deep into large results.
+         * @param accountType The account type to filter by (optional).
+         * @param minTokens The minimum token value to filter by (optional).
+         * @param maxTokens The maximum token value to filter by (optional).
+         * @param offset The number of matching accounts to skip.
+         * @param limit The maximum number of accounts in the view.
+         * @return A lazy view over the matching accounts.
+         */
+        AccountView queryAccounts(
+            const string &accountType = "",
+            int minTokens = numeric_limits<int>::min(),
+            int maxTokens = numeric_limits<int>::max(),
+            size_t offset = 0,
+            size_t limit = numeric_limits<size_t>::max()
+        ) {
+            if (accountIndexer.getColdAccountCount() > 0) {
+                lock_guard<mutex> guard(indexerMutex);
+                size_t reached = limit > numeric_limits<size_t>::max() - offset ? numeric_limits<size_t>::max() : offset + limit;
+                accountIndexer.faultInAccountsByTokens(accountType, minTokens, maxTokens, reached);
+            }
+            TokenRange range = accountIndexer.findAccountsByTokens(accountType, minTokens, maxTokens);
+            while (offset > 0 && range.first != range.last) {
+                ++range.first;
+                --offset;
+            }
+            return AccountView(range, limit, &accountIndexer.getSymbols());
+        }
+
+        /**
+         * Query the page of accounts following the cursor, without copying them. Accounts in the cold tier
+         * on the page are faulted in first.
+         * @param cursor Cursor built from the last account of the previous page.
+         * @param accountType The account type to filter by.
+         * @param minTokens The minimum token value to filter by.
+         * @param maxTokens The maximum token value to filter by.
+         * @param limit The maximum number of accounts in the view.
+         * @return A lazy view over the next matching accounts.
+         */
+        AccountView queryAccountsAfter(
+            const AccountCursor &cursor,
+            const string &accountType,
+            int minTokens,
+            int maxTokens,
+            size_t limit
+        ) {
+            if (accountIndexer.getColdAccountCount() > 0) {
+                lock_guard<mutex> guard(indexerMutex);
+                accountIndexer.faultInAccountsByTokens(accountType, minTokens, maxTokens, limit, &cursor);
+            }
+            return AccountView(accountIndexer.findAccountsByTokens(accountType, minTokens, maxTokens, cursor), limit,
+                               &accountIndexer.getSymbols());
+        }
+
+        /**
+         * Subscribe to the accounts that searchAndFilterAccounts would return for the given criteria.
+         * The handler is first called with an Enter for every account in the result now, and then after
+         * every ingested update or batch that changed the result, with the accounts that entered it, left
+         * it or were replaced by a newer version within it. Handlers are called on the ingest thread once
+         * the update is indexed, and must not ingest updates themselves. Must be called on the ingest thread.
+         * @param accountType The account type to filter by, or an empty string for all types.
+         * @param minTokens The minimum token value to filter by.
+         * @param maxTokens The maximum token value to filter by.
+         * @param handler Receives the changes to the result.
+         * @return The id of the subscription, for unsubscribe.
+         */
+        SubscriptionId subscribe(const string &accountType, int minTokens, int maxTokens, AccountChangeHandler handler) {
+            if (accountIndexer.getColdAccountCount() > 0) {
+                lock_guard<mutex> guard(indexerMutex);
+                accountIndexer.faultInAccountsByTokens(accountType, minTokens, maxTokens);
+            }
+            SubscriptionId id = subscriptions.subscribe(accountIndexer, accountType, minTokens, maxTokens, std::move(handler));
+            subscriptions.deliver();
+            return id;
+        }
+
+        /**
+         * Subscribe to the highest token value accounts of a type, as printed after processing a file.
+         * The handler is called as for subscribe, with the accounts that entered or left the top K, or
+         * were replaced by a newer version within it; a change of rank within the top K alone is not
+         * reported. Must be called on the ingest thread.
+         * @param accountType The account type, which need not have been seen yet.
+         * @param handler Receives the changes to the top K.
+         * @return The id of the subscription, for unsubscribe.
+         */
+        SubscriptionId subscribeHighestTokenAccounts(const string &accountType, AccountChangeHandler handler) {
+            SubscriptionId id = subscriptions.subscribeHighestTokens(accountIndexer, accountType, std::move(handler));
+            subscriptions.deliver();
+            return id;
+        }
+
+        /**
+         * Cancel a subscription; changes not delivered yet are dropped. May be called from a handler.
+         * @param id The id returned by subscribe or subscribeHighestTokenAccounts.
+         * @return False if there is no such subscription.
+         */
+        bool unsubscribe(SubscriptionId id) {
+            return subscriptions.unsubscribe(id);
+        }
+
+    private:
+        // Book-keeping after every ingested update: publish a snapshot when one is due, and poll for callbacks
+        void finishUpdate() {
+            finishUpdates(1);
+        }
+
+        void finishUpdates(size_t count) {
+            ingestedUpdates += count;
+            METRICS_COUNT(Counter::UpdatesIngested, count);
+            subscriptions.deliver();
+            if (accountIndexer.isOverMemoryBudget()) {
+                lock_guard<mutex> guard(indexerMutex);
+                evictColdAccounts();
+            }
+            if (snapshotInterval > 0 && (updatesSinceSnapshot += count) >= snapshotInterval) {
+                publishSnapshot();
+            }
+            pollCallbacks();
+        }
+
+        /**
+         * Intern the ids of a batch into batchIds, moving them out of the updates, and fill batchSurvivors
+         * with the positions of the latest version of every id, in feed order. Of equal versions the first
+         * survives, as ingestAccount ignores an update no newer than the indexed one.
+         * @param updates The batch of account updates.
+         */
+        void collapseBatch(vector<Account> &updates) {
+            batchIds.resize(updates.size());
+            {
+                lock_guard<mutex> guard(indexerMutex);
+                for (size_t position = 0; position < updates.size(); ++position) {
+                    batchIds[position] = accountIndexer.internAccountId(std::move(updates[position].id));
+                }
+            }
+            if (batchPositionOf.size() < accountIndexer.getSymbols().ids.size()) {
+                batchPositionOf.resize(accountIndexer.getSymbols().ids.size(), kNotInBatch);
+            }
+            // Collect the distinct ids first, then swap each for the position of its latest version
+            batchSurvivors.clear();
+            for (uint32_t position = 0; position < updates.size(); ++position) {
+                uint32_t &latest = batchPositionOf[batchIds[position]];
+                if (latest == kNotInBatch) {
+                    latest = position;
+                    batchSurvivors.push_back(batchIds[position]);
+                }
+                else if (updates[position].version > updates[latest].version) {
+                    latest = position;
+                }
+            }
+            for (uint32_t &survivor : batchSurvivors) {
+                uint32_t &latest = batchPositionOf[survivor];
+                survivor = latest;
+                latest = kNotInBatch;
+            }
+            sort(batchSurvivors.begin(), batchSurvivors.end());
+        }
+
+        // Spin briefly, then yield, until the predicate holds
+        template <typename Predicate>
+        static void waitUntil(Predicate ready) {
+            for (unsigned spins = 0; !ready(); ++spins) {
+                if (spins >= 64) this_thread::yield();
+            }
+        }
+
+        /**
+         * Stream the account updates from the given file through a two stage pipeline: a parser thread
+         * reads and parses the updates and moves them into a lock-free ring, and the calling thread
+         * takes them out and ingests them, so that parsing the next update overlaps with ingesting the
+         * current one. Updates are ingested in file order.
+         * @param filename The name of the file containing the account updates.
+         */
+        void pipelineAccountUpdates(const string &filename) {
+            SpscRing<Account> ring(kPipelineRingCapacity);
+            IngestPipelineStats stats;
+            bool read = false;
+
+            thread parser([&filename, &ring, &stats, &read]() {
+                PipelineStageStats &parse = stats.parse;
+                PipelineClock::time_point start = PipelineClock::now();
+                read = AccountUpdateReader::readFile(filename, IngestMode::Streaming, [&ring, &parse](Account &&account) {
+                    if (!ring.tryPush(account)) {
+                        PipelineClock::time_point stalledAt = PipelineClock::now();
+                        ++parse.stalls;
+                        waitUntil([&ring, &account] { return ring.tryPush(account); });
+                        parse.stalledTime += PipelineClock::now() - stalledAt;
+                    }
+                    ++parse.items;
+                });
+                ring.close();
+                parse.busyTime = PipelineClock::now() - start - parse.stalledTime;
+            });
+
+            PipelineStageStats &ingest = stats.ingest;
+            PipelineClock::time_point start = PipelineClock::now();
+            Account account;
+            // Once the write-ahead log fails the ring is still drained, so that the parser finishes
+            bool logged = true;
+            while (true) {
+                if (!ring.tryPop(account)) {
+                    PipelineClock::time_point stalledAt = PipelineClock::now();
+                    bool drained = false;
+                    ++ingest.stalls;
+                    waitUntil([&ring, &account, &drained] {
+                        if (ring.tryPop(account)) return true;
+                        // A push before the close is visible once the close is
+                        if (ring.isClosed()) drained = !ring.tryPop(account);
+                        return ring.isClosed();
+                    });
+                    ingest.stalledTime += PipelineClock::now() - stalledAt;
+                    if (drained) break;
+                }
+                logged = logged && ingestAccount(std::move(account));
+                ++ingest.items;
+            }
+            ingest.busyTime = PipelineClock::now() - start - ingest.stalledTime;
+            parser.join();
+
+            pipelineStats = stats;
+            if (snapshotInterval > 0) {
+                publishSnapshot();
+            }
+            if (!logged) {
+                cerr << "Stopped ingesting " << filename << ": the write-ahead log failed" << endl;
+            }
+            else if (read) {
+                printHighestTokenValueAccounts();
+            }
+        }
+
+        /**
+         * Evict accounts to the cold tier until the index is back under its memory budget, keeping the
+         * accounts with a pending callback in memory, where the callback looks them up when it fires.
+         * Called with indexerMutex held.
+         */
+        void evictColdAccounts() {
+            accountIndexer.evictColdAccounts([this](const IndexedAccount &account) {
+                return callbackManager.hasPendingCallback(account.id, account.version);
+            });
+        }
+
+        /**
+         * Copy the accounts in scannedAccounts, which are in query order, into a query result, merged in
+         * query order with the matching versions in the cold tier. Those are read from the tier rather
+         * than faulted in, so that a wide query does not pull the tier back into memory.
+         * @param accountType The account type to filter by, or an empty string for all types.
+         * @param minTokens The minimum token value to filter by.
+         * @param maxTokens The maximum token value to filter by.
+         * @param predicate The predicate the accounts in scannedAccounts passed, to apply to the cold
+         * versions, or nullptr.
+         * @return The query result.
+         */
+        vector<Account> collectAccounts(const string &accountType, int minTokens, int maxTokens,
+                                        const function<bool(const AccountData &)> *predicate) {
+            coldMatches.clear();
+            accountIndexer.findColdAccountsByTokens(accountType, minTokens, maxTokens, coldMatches);
+            vector<Account> accounts;
+            accounts.reserve(scannedAccounts.size() + coldMatches.size());
+            size_t cold = 0;
+            Account coldAccount;
+            for (size_t hot = 0; hot <= scannedAccounts.size(); ++hot) {
+                // The cold versions that rank ahead of the next account in memory come first
+                while (cold < coldMatches.size()) {
+                    const ColdTokenEntry &entry = coldMatches[cold];
+                    if (hot < scannedAccounts.size()) {
+                        const IndexedAccount &next = *scannedAccounts[hot];
+                        bool ahead = entry.tokens != next.tokens ? entry.tokens > next.tokens
+                            : entry.id != next.id ? entry.id < next.id : entry.version > next.version;
+                        if (!ahead) break;
+                    }
+                    ++cold;
+                    if (accountIndexer.readColdAccount(entry.id, entry.version, coldAccount) &&
+                        (!predicate || (*predicate)(coldAccount.data))) {
+                        accounts.push_back(std::move(coldAccount));
+                    }
+                }
+                if (hot < scannedAccounts.size()) {
+                    accounts.push_back(AccountRef(scannedAccounts[hot], &accountIndexer.getSymbols().ids,
+                                                  &accountIndexer.getSymbols().types).toAccount());
+                }
+            }
+            return accounts;
+        }
+
+        // Fire the callbacks due by now, unless the dispatcher thread fires them
+        void pollCallbacks() {
+            if (!callbackManager.isDispatching()) {
+                callbackManager.fireCallbacks(chrono::system_clock::now());
+            }
+        }
+
+        /**
+         * Ingest the account update by indexing it, updating the highest token accounts, and scheduling a callback if necessary.
+         * Updates with a version no newer than the indexed one are ignored; a newer version retires the previous
+         * one from the index and cancels its pending callback.
+         * @param account The account to be ingested; an rvalue has its id and data moved into the index.
+         * @return False if the update could not be logged to the write-ahead log, and is not applied.
+         */
+        template <typename AccountUpdate>
+        bool ingestAccountUpdate(AccountUpdate &&account) {
+            METRICS_TIME(Histogram::IngestLatency);
+            // Logged ahead of indexing, under the sequence number finishUpdate is about to give it
+            if (writeAheadLog && !writeAheadLog->append(ingestedUpdates + 1, account)) return false;
+            lock_guard<mutex> guard(indexerMutex);
+            // A new id is moved into the interner; a known one, or a stale update, is never copied at all
+            IdHandle id = accountIndexer.internAccountId(std::forward<AccountUpdate>(account).id);
+            if (!supersedeLatestVersion(id, account.version)) return true;
+            indexAndSchedule(IndexedAccount{id, accountIndexer.internAccountType(account.accountType), account.tokens,
+                                            account.version, account.callbackTimeMs,
+                                            std::forward<AccountUpdate>(account).data});
+            return true;
+        }
+
+        /**
+         * Retire the indexed version of an account that an update is about to replace. Called with
+         * indexerMutex held.
+         * @param id The handle of the account id.
+         * @param version The version of the update.
+         * @return False if the update is stale, i.e. no newer than the indexed version.
+         */
+        bool supersedeLatestVersion(IdHandle id, int version) {
+            // A single lookup in the id index tells whether this update is stale or supersedes an
+            // indexed version, whether or not that version is among the top K of its type
+            const IndexedAccount *previous = accountIndexer.findLatestAccount(id);
+            int coldVersion;
+            const ColdAccount *cold = previous ? nullptr : accountIndexer.findColdLatestAccount(id, coldVersion);
+            if (previous) {
+                if (version <= previous->version) {
+                    METRICS_COUNT(Counter::UpdatesRejected, 1);
+                    return false;
+                }
+                METRICS_COUNT(Counter::UpdatesSuperseding, 1);
+                subscriptions.removing(*previous);
+                accountIndexer.removeAccount(AccountKey{id, previous->version});
+            }
+            else if (cold) {
+                // An evicted version is superseded in the cold tier, and only read if a subscription holds it
+                if (version <= coldVersion) {
+                    METRICS_COUNT(Counter::UpdatesRejected, 1);
+                    return false;
+                }
+                METRICS_COUNT(Counter::UpdatesSuperseding, 1);
+                Account removed;
+                if (subscriptions.holds(cold->accountType, cold->tokens) && accountIndexer.readColdAccount(id, coldVersion, removed)) {
+                    subscriptions.removing(cold->accountType, removed);
+                }
+                accountIndexer.removeAccount(AccountKey{id, coldVersion});
+            }
+            else {
+                METRICS_COUNT(Counter::UpdatesNew, 1);
+            }
+            return true;
+        }
+
+        /**
+         * Index an update that supersedes any indexed version, rank it and schedule its callback.
+         * Called with indexerMutex held.
+         * @param account The update, with its id and type interned.
+         */
+        void indexAndSchedule(IndexedAccount &&account) {
+            const IndexedAccount &indexed = accountIndexer.indexAccount(std::move(account));
+            accountIndexer.updateHighestTokenAccounts(indexed);
+            subscriptions.indexed(indexed);
+            subscriptions.rankedHighestTokens(accountIndexer);
+
+            chrono::milliseconds delay(indexed.callbackTimeMs + getRandomDelay());
+            chrono::system_clock::time_point callbackTime = chrono::system_clock::now() + delay;
+            // The previous version's pending callback, if any, is replaced in place
+            callbackManager.rescheduleCallback(indexed, callbackTime);
+        }
+
+        /**
+         * Get a random delay in milliseconds.
+         * @return The random delay.
+         */
+        int getRandomDelay() {
+            std::uniform_int_distribution<> dis(0, 1000);
+            int delay = dis(delayEngine);
+
+            return delay;
+        }
+
+        /**
+         * Print the highest token value accounts for each account type.
+         */
+        void printHighestTokenValueAccounts() {
+            for (TypeHandle type = 0; type < accountIndexer.getAccountTypeCount(); ++type) {
+                const string &accountType = accountIndexer.getAccountType(type);
+                vector<TopKEntry> tokenAccounts = accountIndexer.getHighestTokenAccounts(type).sortedEntries();
+
+                cout << "Highest token value accounts for account type " << accountType << ":" << endl;
+
+                // Lowest first, as the accounts used to come off the min-heap
+                for (auto entry = tokenAccounts.rbegin(); entry != tokenAccounts.rend(); ++entry) {
+                    cout << "Account " << accountIndexer.getAccountId(entry->id) << " v" << entry->version << ": Tokens - " << entry->tokens << endl;
+                }
+                cout << endl;
+            }
+        }
+};
+
+typedef BasicAccountManager<DefaultAccountPolicy> AccountManager;
+
+#endif // ACCOUNT_MANAGER_H
@@ -0,0 +1,597 @@
+/**
+ * @file AccountNode.h
+ * @brief Serving an AccountManager over TCP, and the client side of the protocol
+ *
+ * A node is an AccountManager that owns a partition of the account ids, served by an AccountNodeServer
+ * to the PartitionRouter that feeds it updates and the QueryCoordinator that queries it (see
+ * AccountCluster.h). The protocol is a handshake, then framed requests, each answered with one frame:
+ *
+ *     frame:      payload length (uint32), message type (uint8), payload
+ *     Ingest:     accounts as AccountWire.h encodes them, up to the end of the frame -> Ingested: count (uint32)
+ *     Search:     account type, minTokens, maxTokens (int32), limit (uint32) -> Accounts: count, accounts
+ *     TopK:       account type -> TopKEntries: count, then id, version and tokens per entry
+ *     Types:      nothing -> TypeNames: count, account types
+ *
+ * Strings are a uint32 length and the bytes, and integers are in host byte order: the handshake
+ * exchanges a magic and an endianness mark, so nodes and clients of different byte orders refuse each
+ * other instead of misreading every number. A malformed request closes its connection.
+ *
+ * Search and TopK results are ordered by tokens in descending order, then by id, the order the
+ * coordinator merges in, and Search returns at most limit accounts: a node never ships more than the
+ * coordinator can use of its result.
+ */
+
+#ifndef ACCOUNT_NODE_H
+#define ACCOUNT_NODE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include "Account.h"
+#include "AccountWire.h"
+#include "AccountManager.h"
+#include "ShardedAccountManager.h"
+
+namespace node {
+
+const char kMagic[8] = {'A', 'C', 'C', 'T', 'N', 'O', 'D', '1'};
+const uint32_t kEndianMark = 0x01020304u;
+const uint32_t kNoLimit = numeric_limits<uint32_t>::max();
+
+enum : uint32_t { kFrameHeaderSize = 5, kMaxFrameSize = 64 << 20 };
+
+enum MessageType : uint8_t {
+    kIngest = 1, kIngested,
+    kSearch, kAccounts,
+    kTopK, kTopKEntries,
+    kTypes, kTypeNames
+};
+
+// Highest tokens first, then by id and newest version first: the order results are merged in
+inline bool precedes(const Account &a, const Account &b) {
+    if (a.tokens != b.tokens) return a.tokens > b.tokens;
+    if (a.id != b.id) return a.id < b.id;
+    return a.version > b.version;
+}
+
+inline bool precedes(const ShardedTopKEntry &a, const ShardedTopKEntry &b) {
+    if (a.tokens != b.tokens) return a.tokens > b.tokens;
+    return a.id < b.id;
+}
+
+inline bool writeAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        // A peer that went away fails the write rather than raising SIGPIPE
+        ssize_t written = ::send(fd, data, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+inline bool readAll(int fd, char *data, size_t length) {
+    while (length > 0) {
+        ssize_t received = ::recv(fd, data, length, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        data += received;
+        length -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+// Start a frame of the given type at the end of out; the payload is appended after it
+inline size_t beginFrame(string &out, MessageType type) {
+    size_t start = out.size();
+    out.append(sizeof(uint32_t), '\0');
+    out.push_back(static_cast<char>(type));
+    return start;
+}
+
+// Fill in the payload length of the frame begun at start
+inline void finishFrame(string &out, size_t start) {
+    uint32_t length = static_cast<uint32_t>(out.size() - start - kFrameHeaderSize);
+    memcpy(&out[start], &length, sizeof(length));
+}
+
+/**
+ * Read one frame.
+ * @param fd The connection.
+ * @param type Set to the message type.
+ * @param payload Set to the payload.
+ * @return False if the connection closed or the frame is larger than kMaxFrameSize.
+ */
+inline bool readFrame(int fd, MessageType &type, string &payload) {
+    char header[kFrameHeaderSize];
+    if (!readAll(fd, header, sizeof(header))) return false;
+    uint32_t length;
+    memcpy(&length, header, sizeof(length));
+    if (length > kMaxFrameSize) return false;
+    type = static_cast<MessageType>(header[4]);
+    payload.resize(length);
+    return length == 0 || readAll(fd, &payload[0], length);
+}
+
+inline bool exchangeHandshake(int fd) {
+    char hello[sizeof(kMagic) + sizeof(kEndianMark)];
+    memcpy(hello, kMagic, sizeof(kMagic));
+    memcpy(hello + sizeof(kMagic), &kEndianMark, sizeof(kEndianMark));
+    char peer[sizeof(hello)];
+    return writeAll(fd, hello, sizeof(hello)) && readAll(fd, peer, sizeof(peer)) && memcmp(hello, peer, sizeof(hello)) == 0;
+}
+
+} // namespace node
+
+/**
+ * Serves an AccountManager to the nodes' clients: a thread accepts connections, and each connection
+ * gets a thread of its own. Requests from all connections are handled one at a time, so the manager
+ * sees a single ingest thread, as it requires. Connections are expected to be few and long-lived,
+ * one per router or coordinator; their threads are joined by stop.
+ */
+class AccountNodeServer {
+    private:
+        AccountManager &manager;
+        // Serializes the requests of all connections against the manager
+        mutex managerMutex;
+        int listenFd;
+        uint16_t port;
+        thread acceptor;
+        atomic<bool> stopping;
+        // The fds of open connections, -1 once closed, guarded by connectionsMutex
+        mutex connectionsMutex;
+        vector<int> connectionFds;
+        vector<thread> connectionThreads;
+
+        void acceptConnections() {
+            while (!stopping) {
+                int fd = ::accept(listenFd, nullptr, nullptr);
+                if (fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    return;
+                }
+                int noDelay = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+                lock_guard<mutex> guard(connectionsMutex);
+                if (stopping) {
+                    ::close(fd);
+                    return;
+                }
+                connectionFds.push_back(fd);
+                connectionThreads.push_back(thread(&AccountNodeServer::serve, this, connectionFds.size() - 1, fd));
+            }
+        }
+
+        void serve(size_t connection, int fd) {
+            if (node::exchangeHandshake(fd)) {
+                node::MessageType type;
+                string request, response;
+                while (node::readFrame(fd, type, request)) {
+                    response.clear();
+                    if (!handle(type, request, response) || !node::writeAll(fd, response.data(), response.size())) break;
+                }
+            }
+            lock_guard<mutex> guard(connectionsMutex);
+            ::close(fd);
+            connectionFds[connection] = -1;
+        }
+
+        /**
+         * Answer one request.
+         * @param type The message type of the request.
+         * @param request The payload of the request.
+         * @param response The frame to append the response to.
+         * @return False if the request is malformed.
+         */
+        bool handle(node::MessageType type, const string &request, string &response) {
+            const char *p = request.data();
+            const char *end = p + request.size();
+            switch (type) {
+                case node::kIngest: {
+                    vector<Account> batch;
+                    while (p != end) {
+                        batch.emplace_back();
+                        if (!wire::getAccount(p, end, batch.back())) return false;
+                    }
+                    uint32_t count = static_cast<uint32_t>(batch.size());
+                    {
+                        // A batch the write-ahead log failed on is not acknowledged, and the connection is dropped
+                        lock_guard<mutex> guard(managerMutex);
+                        if (!manager.ingestAccountUpdates(std::move(batch))) return false;
+                    }
+                    size_t frame = node::beginFrame(response, node::kIngested);
+                    wire::put<uint32_t>(response, count);
+                    node::finishFrame(response, frame);
+                    return true;
+                }
+                case node::kSearch: {
+                    string accountType;
+                    int32_t minTokens, maxTokens;
+                    uint32_t limit;
+                    if (!wire::getString(p, end, accountType) || !wire::get(p, end, minTokens) ||
+                        !wire::get(p, end, maxTokens) || !wire::get(p, end, limit) || p != end) {
+                        return false;
+                    }
+                    vector<Account> accounts;
+                    {
+                        lock_guard<mutex> guard(managerMutex);
+                        accounts = search(accountType, minTokens, maxTokens, limit);
+                    }
+                    size_t frame = node::beginFrame(response, node::kAccounts);
+                    wire::put<uint32_t>(response, static_cast<uint32_t>(accounts.size()));
+                    for (const Account &account : accounts) wire::putAccount(response, account);
+                    node::finishFrame(response, frame);
+                    return true;
+                }
+                case node::kTopK: {
+                    string accountType;
+                    if (!wire::getString(p, end, accountType) || p != end) return false;
+                    vector<ShardedTopKEntry> entries;
+                    {
+                        lock_guard<mutex> guard(managerMutex);
+                        const TopKAccounts *tokenAccounts = manager.accountIndexer.findHighestTokenAccounts(accountType);
+                        if (tokenAccounts) {
+                            for (const TopKEntry &entry : tokenAccounts->sortedEntries()) {
+                                entries.push_back(ShardedTopKEntry{manager.accountIndexer.getAccountId(entry.id), entry.version,
+                                                                   entry.tokens});
+                            }
+                        }
+                    }
+                    sort(entries.begin(), entries.end(),
+                         [](const ShardedTopKEntry &a, const ShardedTopKEntry &b) { return node::precedes(a, b); });
+                    size_t frame = node::beginFrame(response, node::kTopKEntries);
+                    wire::put<uint32_t>(response, static_cast<uint32_t>(entries.size()));
+                    for (const ShardedTopKEntry &entry : entries) {
+                        wire::putString(response, entry.id);
+                        wire::put<int32_t>(response, entry.version);
+                        wire::put<int32_t>(response, entry.tokens);
+                    }
+                    node::finishFrame(response, frame);
+                    return true;
+                }
+                case node::kTypes: {
+                    if (p != end) return false;
+                    size_t frame = node::beginFrame(response, node::kTypeNames);
+                    lock_guard<mutex> guard(managerMutex);
+                    const AccountIndexer &indexer = manager.accountIndexer;
+                    wire::put<uint32_t>(response, static_cast<uint32_t>(indexer.getAccountTypeCount()));
+                    for (TypeHandle accountType = 0; accountType < indexer.getAccountTypeCount(); ++accountType) {
+                        wire::putString(response, indexer.getAccountType(accountType));
+                    }
+                    node::finishFrame(response, frame);
+                    return true;
+                }
+                default:
+                    return false;
+            }
+        }
+
+        /**
+         * The first limit accounts of the query in the merge order. The token indexes order equal tokens
+         * by id handle, which differs from node to node, so every account tied with the last one taken
+         * is collected before the result is sorted and cut. Accounts in the cold tier are read from it,
+         * without faulting them in, and only those that make the cut.
+         */
+        vector<Account> search(const string &accountType, int minTokens, int maxTokens, uint32_t limit) {
+            vector<Account> accounts;
+            if (limit == node::kNoLimit) {
+                accounts = manager.searchAndFilterAccounts(accountType, minTokens, maxTokens);
+                sort(accounts.begin(), accounts.end(), [](const Account &a, const Account &b) { return node::precedes(a, b); });
+                return accounts;
+            }
+            if (limit == 0) return accounts;
+
+            AccountIndexer &indexer = manager.accountIndexer;
+            vector<Account> hot;
+            for (const TokenIndexEntry &entry : indexer.findAccountsByTokens(accountType, minTokens, maxTokens)) {
+                if (hot.size() >= limit && entry.tokens != hot.back().tokens) break;
+                hot.push_back(AccountRef(entry.account, &indexer.getSymbols().ids, &indexer.getSymbols().types).toAccount());
+            }
+            sort(hot.begin(), hot.end(), [](const Account &a, const Account &b) { return node::precedes(a, b); });
+
+            vector<ColdTokenEntry> cold;
+            indexer.findColdAccountsByTokens(accountType, minTokens, maxTokens, cold, limit);
+            if (cold.size() == limit) {
+                int lastTokens = cold.back().tokens;
+                cold.erase(remove_if(cold.begin(), cold.end(), [lastTokens](const ColdTokenEntry &entry) {
+                    return entry.tokens == lastTokens;
+                }), cold.end());
+                indexer.findColdAccountsByTokens(accountType, lastTokens, lastTokens, cold);
+            }
+            auto coldPrecedes = [&indexer](const ColdTokenEntry &entry, int tokens, const string &id, int version) {
+                if (entry.tokens != tokens) return entry.tokens > tokens;
+                const string &entryId = indexer.getAccountId(entry.id);
+                if (entryId != id) return entryId < id;
+                return entry.version > version;
+            };
+            sort(cold.begin(), cold.end(), [&](const ColdTokenEntry &a, const ColdTokenEntry &b) {
+                return coldPrecedes(a, b.tokens, indexer.getAccountId(b.id), b.version);
+            });
+
+            // Both are in the merge order, so the result is a merge of their fronts
+            size_t nextHot = 0, nextCold = 0;
+            Account coldAccount;
+            while (accounts.size() < limit && (nextHot < hot.size() || nextCold < cold.size())) {
+                if (nextCold == cold.size() || (nextHot < hot.size() &&
+                    !coldPrecedes(cold[nextCold], hot[nextHot].tokens, hot[nextHot].id, hot[nextHot].version))) {
+                    accounts.push_back(std::move(hot[nextHot++]));
+                    continue;
+                }
+                const ColdTokenEntry &entry = cold[nextCold++];
+                if (indexer.readColdAccount(entry.id, entry.version, coldAccount)) accounts.push_back(std::move(coldAccount));
+            }
+            return accounts;
+        }
+
+    public:
+        explicit AccountNodeServer(AccountManager &manager) : manager(manager), listenFd(-1), port(0), stopping(false) {}
+
+        AccountNodeServer(const AccountNodeServer &) = delete;
+        AccountNodeServer &operator=(const AccountNodeServer &) = delete;
+
+        ~AccountNodeServer() {
+            stop();
+        }
+
+        /**
+         * Listen on the given address and port, and start accepting connections.
+         * @param port The TCP port, or 0 for one chosen by the system; see getPort.
+         * @param address The IPv4 address to listen on.
+         * @return False if the socket could not be bound.
+         */
+        bool start(uint16_t port = 0, const string &address = "127.0.0.1") {
+            sockaddr_in local;
+            memset(&local, 0, sizeof(local));
+            local.sin_family = AF_INET;
+            local.sin_port = htons(port);
+            if (inet_pton(AF_INET, address.c_str(), &local.sin_addr) != 1) {
+                cerr << "Invalid node address " << address << endl;
+                return false;
+            }
+            listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+            int reuse = 1;
+            socklen_t length = sizeof(local);
+            if (listenFd < 0 || setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 || ::bind(listenFd, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0 ||
+                ::listen(listenFd, 64) != 0 || getsockname(listenFd, reinterpret_cast<sockaddr *>(&local), &length) != 0) {
+                cerr << "Cannot listen on " << address << ":" << port << ": " << strerror(errno) << endl;
+                if (listenFd >= 0) ::close(listenFd);
+                listenFd = -1;
+                return false;
+            }
+            this->port = ntohs(local.sin_port);
+            stopping = false;
+            acceptor = thread(&AccountNodeServer::acceptConnections, this);
+            return true;
+        }
+
+        /**
+         * Stop accepting connections, close the open ones, and wait for their requests in progress.
+         */
+        void stop() {
+            if (listenFd < 0) return;
+            stopping = true;
+            ::shutdown(listenFd, SHUT_RDWR);
+            acceptor.join();
+            ::close(listenFd);
+            listenFd = -1;
+            vector<thread> threads;
+            {
+                lock_guard<mutex> guard(connectionsMutex);
+                for (int fd : connectionFds) {
+                    if (fd >= 0) ::shutdown(fd, SHUT_RDWR);
+                }
+                threads.swap(connectionThreads);
+            }
+            for (thread &connection : threads) connection.join();
+            connectionFds.clear();
+        }
+
+        uint16_t getPort() const { return port; }
+};
+
+/**
+ * A connection to a node. Every request is a send and a receive, which can be issued separately:
+ * a coordinator sends a query to every node before it reads any answer, so a query costs the slowest
+ * node's time rather than the sum of all of them. Responses come back in request order.
+ * Not thread-safe; every method but connect returns false once the connection has failed.
+ */
+class AccountNodeClient {
+    private:
+        int fd;
+        string frame;
+        string payload;
+
+        bool send() {
+            if (fd < 0) return false;
+            if (!node::writeAll(fd, frame.data(), frame.size())) return fail();
+            return true;
+        }
+
+        bool receive(node::MessageType expected) {
+            node::MessageType type;
+            if (fd < 0) return false;
+            if (!node::readFrame(fd, type, payload) || type != expected) return fail();
+            return true;
+        }
+
+        bool fail() {
+            close();
+            return false;
+        }
+
+    public:
+        AccountNodeClient() : fd(-1) {}
+
+        AccountNodeClient(const AccountNodeClient &) = delete;
+        AccountNodeClient &operator=(const AccountNodeClient &) = delete;
+
+        ~AccountNodeClient() {
+            close();
+        }
+
+        /**
+         * Connect to a node and check that it speaks the protocol.
+         * @param host The host name or address of the node.
+         * @param port The TCP port of the node.
+         * @return False if the node cannot be reached or refused the handshake.
+         */
+        bool connect(const string &host, uint16_t port) {
+            close();
+            addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo *addresses = nullptr;
+            if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addresses) != 0) {
+                cerr << "Cannot resolve node " << host << endl;
+                return false;
+            }
+            for (addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+                fd = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+                if (fd >= 0 && ::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+                    ::close(fd);
+                    fd = -1;
+                }
+            }
+            freeaddrinfo(addresses);
+            if (fd < 0) {
+                cerr << "Cannot connect to node " << host << ":" << port << endl;
+                return false;
+            }
+            int noDelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            if (!node::exchangeHandshake(fd)) {
+                cerr << "Node " << host << ":" << port << " refused the handshake" << endl;
+                return fail();
+            }
+            return true;
+        }
+
+        void close() {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+
+        bool isConnected() const { return fd >= 0; }
+
+        /**
+         * Send a batch of updates, already encoded as an Ingest frame.
+         * @param ingestFrame The frame, begun with node::beginFrame and finished with node::finishFrame.
+         */
+        bool sendIngest(const string &ingestFrame) {
+            if (fd < 0) return false;
+            if (!node::writeAll(fd, ingestFrame.data(), ingestFrame.size())) return fail();
+            return true;
+        }
+
+        /**
+         * Wait for a node to have ingested a batch.
+         * @param count Set to the number of updates in the batch.
+         */
+        bool receiveIngested(uint32_t &count) {
+            const char *p;
+            if (!receive(node::kIngested)) return false;
+            p = payload.data();
+            return wire::get(p, p + payload.size(), count) || fail();
+        }
+
+        bool sendSearch(const string &accountType, int minTokens, int maxTokens, uint32_t limit) {
+            frame.clear();
+            size_t start = node::beginFrame(frame, node::kSearch);
+            wire::putString(frame, accountType);
+            wire::put<int32_t>(frame, minTokens);
+            wire::put<int32_t>(frame, maxTokens);
+            wire::put<uint32_t>(frame, limit);
+            node::finishFrame(frame, start);
+            return send();
+        }
+
+        /**
+         * Receive the answer to a search.
+         * @param accounts Set to the matching accounts, ordered by tokens in descending order, then by id.
+         */
+        bool receiveAccounts(vector<Account> &accounts) {
+            if (!receive(node::kAccounts)) return false;
+            const char *p = payload.data();
+            const char *end = p + payload.size();
+            uint32_t count;
+            if (!wire::get(p, end, count) || !wire::fits(p, end, count, wire::kMinAccountBytes)) return fail();
+            accounts.clear();
+            accounts.reserve(count);
+            for (uint32_t i = 0; i < count; ++i) {
+                accounts.emplace_back();
+                if (!wire::getAccount(p, end, accounts.back())) return fail();
+            }
+            return true;
+        }
+
+        bool sendHighestTokens(const string &accountType) {
+            frame.clear();
+            size_t start = node::beginFrame(frame, node::kTopK);
+            wire::putString(frame, accountType);
+            node::finishFrame(frame, start);
+            return send();
+        }
+
+        /**
+         * Receive the node's highest token value accounts of a type.
+         * @param entries Set to up to K entries, highest tokens first.
+         */
+        bool receiveHighestTokens(vector<ShardedTopKEntry> &entries) {
+            if (!receive(node::kTopKEntries)) return false;
+            const char *p = payload.data();
+            const char *end = p + payload.size();
+            uint32_t count;
+            if (!wire::get(p, end, count) || !wire::fits(p, end, count, wire::kMinStringBytes + 2 * sizeof(int32_t))) {
+                return fail();
+            }
+            entries.assign(count, ShardedTopKEntry());
+            for (ShardedTopKEntry &entry : entries) {
+                int32_t version, tokens;
+                if (!wire::getString(p, end, entry.id) || !wire::get(p, end, version) || !wire::get(p, end, tokens)) {
+                    return fail();
+                }
+                entry.version = version;
+                entry.tokens = tokens;
+            }
+            return true;
+        }
+
+        bool sendAccountTypes() {
+            frame.clear();
+            node::finishFrame(frame, node::beginFrame(frame, node::kTypes));
+            return send();
+        }
+
+        bool receiveAccountTypes(vector<string> &accountTypes) {
+            if (!receive(node::kTypeNames)) return false;
+            const char *p = payload.data();
+            const char *end = p + payload.size();
+            uint32_t count;
+            if (!wire::get(p, end, count) || !wire::fits(p, end, count, wire::kMinStringBytes)) return fail();
+            accountTypes.assign(count, string());
+            for (string &accountType : accountTypes) {
+                if (!wire::getString(p, end, accountType)) return fail();
+            }
+            return true;
+        }
+};
+
+#endif // ACCOUNT_NODE_H
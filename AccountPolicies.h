@@ -0,0 +1,238 @@
+/**
+ * @file AccountPolicies.h
+ * @brief Compile-time policies of the indexer, the callback manager and the account manager
+ *
+ * BasicAccountIndexer, BasicCallbackManager and BasicAccountManager are templates on a policy, which
+ * picks, per deployment:
+ *
+ * - IdInterner: how account ids are mapped to handles. It has intern(const string &),
+ *   intern(string &&), find(const string &) and derives from InternedStrings.
+ * - AccountMap: the storage of the indexed account versions, an alias template with the interface of
+ *   unordered_map<Key, Value, Hash, equal_to<Key>, Allocator> that never moves its values, since the
+ *   secondary indexes point at them: FlatHashMap, or unordered_map itself.
+ * - Scheduler: the CallbackScheduler the pending callbacks are kept in. The abstract CallbackScheduler
+ *   means the choice is made at run time, by SchedulerType; a concrete, final scheduler is held by
+ *   value and called without virtual dispatch.
+ * - kTopK: the number of highest token value accounts kept per type, or 0 to choose it at run time.
+ *
+ * DefaultAccountPolicy is the behavior of AccountIndexer, CallbackManager and AccountManager, which are
+ * its instantiations.
+ */
+
+#ifndef ACCOUNT_POLICIES_H
+#define ACCOUNT_POLICIES_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include "Account.h"
+#include "CallbackScheduler.h"
+#include "FlatHashMap.h"
+
+// Key codec of FixedKeyInterner for ids of at most N bytes of any text, stored with their length
+template <size_t N>
+struct TextKey {
+    static_assert(N > 0 && N < 256, "TextKey ids are between 1 and 255 bytes long");
+
+    enum { kKeyBytes = N + 1 };
+
+    static bool encode(const string &id, unsigned char *key) {
+        if (id.size() > N) return false;
+        key[0] = static_cast<unsigned char>(id.size());
+        memcpy(key + 1, id.data(), id.size());
+        return true;
+    }
+};
+
+/**
+ * Key codec of FixedKeyInterner for base58 encoded 32-byte public keys, as Solana account ids are: an
+ * id is interned by the 32 bytes it decodes to. Only the canonical encoding of a key is accepted, in
+ * which leading '1's stand for exactly the key's leading zero bytes, so no two ids share a key.
+ */
+struct Base58PubkeyKey {
+    enum { kKeyBytes = 32 };
+
+    static const char *alphabet() {
+        return "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+    }
+
+    static bool encode(const string &id, unsigned char *key) {
+        static const struct Digits {
+            signed char of[256];
+            Digits() {
+                memset(of, -1, sizeof(of));
+                for (int i = 0; i < 58; ++i) of[static_cast<unsigned char>(alphabet()[i])] = static_cast<signed char>(i);
+            }
+        } digits;
+        // The longest encoding of 32 bytes is 44 digits
+        if (id.empty() || id.size() > 44) return false;
+        size_t leadingOnes = 0;
+        while (leadingOnes < id.size() && id[leadingOnes] == '1') ++leadingOnes;
+        // The number is accumulated in 32-bit limbs, most significant first, five digits at a time:
+        // 58^5 still fits in 32 bits, so each chunk is one multiply-add pass over the limbs
+        uint32_t limbs[kKeyBytes / 4] = {0};
+        for (size_t first = 0; first < id.size(); first += 5) {
+            uint32_t chunk = 0, scale = 1;
+            for (size_t i = first; i < min(id.size(), first + 5); ++i) {
+                int digit = digits.of[static_cast<unsigned char>(id[i])];
+                if (digit < 0) return false;
+                chunk = chunk * 58 + static_cast<uint32_t>(digit);
+                scale *= 58;
+            }
+            uint64_t carry = chunk;
+            for (int i = kKeyBytes / 4 - 1; i >= 0; --i) {
+                carry += static_cast<uint64_t>(limbs[i]) * scale;
+                limbs[i] = static_cast<uint32_t>(carry);
+                carry >>= 32;
+            }
+            if (carry) return false;
+        }
+        for (int i = 0; i < kKeyBytes; ++i) {
+            key[i] = static_cast<unsigned char>(limbs[i / 4] >> (24 - 8 * (i % 4)));
+        }
+        size_t leadingZeros = 0;
+        while (leadingZeros < kKeyBytes && key[leadingZeros] == 0) ++leadingZeros;
+        return leadingOnes == leadingZeros;
+    }
+
+    /**
+     * Encode a 32-byte public key in base58.
+     * @param key The 32 bytes of the key.
+     * @return The canonical base58 text of the key, which encode maps back to it.
+     */
+    static string toString(const unsigned char *key) {
+        unsigned char number[kKeyBytes];
+        memcpy(number, key, kKeyBytes);
+        string digits;
+        size_t first = 0;
+        while (first < kKeyBytes && number[first] == 0) ++first;
+        // Long division by 58, most significant byte first, until the number is zero
+        for (size_t start = first; start < kKeyBytes;) {
+            int remainder = 0;
+            for (size_t i = start; i < kKeyBytes; ++i) {
+                int value = remainder * 256 + number[i];
+                number[i] = static_cast<unsigned char>(value / 58);
+                remainder = value % 58;
+            }
+            digits += alphabet()[remainder];
+            while (start < kKeyBytes && number[start] == 0) ++start;
+        }
+        digits.append(first, '1');
+        return string(digits.rbegin(), digits.rend());
+    }
+};
+
+/**
+ * Interning table for ids with a fixed-width key, such as 32-byte public keys. The Codec maps an id
+ * to its Codec::kKeyBytes byte key, or refuses it. Every key is kept in one contiguous array, and found
+ * through an open-addressing table of handles with linear probing, so a lookup hashes and compares the
+ * key in place instead of chasing a node and a string pointer. Interning an id the codec refuses
+ * throws invalid_argument.
+ */
+template <typename Codec>
+class FixedKeyInterner : public InternedStrings {
+    private:
+        enum { kKeyBytes = Codec::kKeyBytes };
+        enum : uint32_t { kEmpty = 0xFFFFFFFFu };
+
+        struct Key {
+            unsigned char bytes[kKeyBytes];
+        };
+
+        vector<Key> keys;
+        // Handles by hash slot, kEmpty where free; at most half full
+        vector<uint32_t> slots;
+
+        static size_t hashOf(const Key &key) {
+            // Eight bytes at a time, each word folded in with a multiply and a shift
+            uint64_t h = 0x9E3779B97F4A7C15ull;
+            for (size_t i = 0; i < kKeyBytes; i += 8) {
+                uint64_t word = 0;
+                memcpy(&word, key.bytes + i, min<size_t>(8, kKeyBytes - i));
+                h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+                h ^= h >> 32;
+            }
+            return static_cast<size_t>(h);
+        }
+
+        // The slot holding the key, or the free slot it would go in
+        size_t probe(const Key &key) const {
+            size_t mask = slots.size() - 1;
+            for (size_t slot = hashOf(key) & mask;; slot = (slot + 1) & mask) {
+                if (slots[slot] == kEmpty || memcmp(keys[slots[slot]].bytes, key.bytes, kKeyBytes) == 0) return slot;
+            }
+        }
+
+        void grow() {
+            vector<uint32_t> previous(slots.size() * 2, kEmpty);
+            previous.swap(slots);
+            for (uint32_t handle : previous) {
+                if (handle != kEmpty) slots[probe(keys[handle])] = handle;
+            }
+        }
+
+        template <typename String>
+        uint32_t insert(String &&value) {
+            Key key = Key();
+            if (!Codec::encode(value, key.bytes)) {
+                throw invalid_argument("Account id does not have a fixed-width key: " + value);
+            }
+            size_t slot = probe(key);
+            if (slots[slot] != kEmpty) return slots[slot];
+
+            uint32_t handle = append(std::forward<String>(value));
+            keys.push_back(key);
+            slots[slot] = handle;
+            if (keys.size() * 2 > slots.size()) grow();
+            return handle;
+        }
+
+    public:
+        FixedKeyInterner() : slots(16, kEmpty) {}
+
+        uint32_t intern(const string &value) {
+            return insert(value);
+        }
+
+        uint32_t intern(string &&value) {
+            return insert(std::move(value));
+        }
+
+        uint32_t find(const string &value) const {
+            Key key = Key();
+            if (!Codec::encode(value, key.bytes)) return kInvalidHandle;
+            return slots[probe(key)];
+        }
+};
+
+// The behavior of AccountIndexer, CallbackManager and AccountManager
+struct DefaultAccountPolicy {
+    typedef StringInterner IdInterner;
+
+    template <typename Key, typename Value, typename Hash, typename Allocator>
+    using AccountMap = FlatHashMap<Key, Value, Hash, equal_to<Key>, Allocator>;
+
+    typedef CallbackScheduler Scheduler;
+
+    enum { kTopK = 0 };
+};
+
+/**
+ * A deployment on public key account ids: ids are base58 encoded 32-byte keys, interned by the bytes
+ * they decode to; callbacks go to a timing wheel, called directly; and the top 3 of each type are kept.
+ */
+struct PubkeyAccountPolicy {
+    typedef FixedKeyInterner<Base58PubkeyKey> IdInterner;
+
+    template <typename Key, typename Value, typename Hash, typename Allocator>
+    using AccountMap = FlatHashMap<Key, Value, Hash, equal_to<Key>, Allocator>;
+
+    typedef TimingWheelCallbackScheduler Scheduler;
+
+    enum { kTopK = 3 };
+};
+
+#endif // ACCOUNT_POLICIES_H
@@ -0,0 +1,274 @@
+/**
+ * @file AccountSnapshot.h
+ * @brief Immutable, shareable snapshots of the account index for concurrent readers
+ *
+ * A snapshot holds a copy of the latest version of every account, split into one immutable segment
+ * per account type, plus the type's highest token value accounts. The ingest thread publishes a new
+ * snapshot by rebuilding only the segments of the types that changed and sharing the others with the
+ * previous snapshot; readers on any thread take the current snapshot and query it without locks,
+ * while ingest carries on. A snapshot lives as long as a reader holds it, read-copy-update style.
+ *
+ * The accounts evicted to the indexer's cold tier are held as their index entries and the locations
+ * of their records, which never change once written; a query reads the records it returns from the
+ * tier's file, so a snapshot does not pull the tier back into memory.
+ */
+
+#ifndef ACCOUNT_SNAPSHOT_H
+#define ACCOUNT_SNAPSHOT_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include "Account.h"
+#include "AccountWire.h"
+#include "ColdAccountStore.h"
+#include "AccountIndexer.h"
+
+// Copy of an account version in a snapshot. The id points into the indexer's interning table, whose
+// strings never move or change once interned.
+struct SnapshotAccount {
+    const string *id;
+    IdHandle idHandle;
+    int tokens;
+    int callbackTimeMs;
+    int version;
+    AccountData data;
+};
+
+// An account version in the cold tier as of a snapshot: what ordering and filtering need, and where
+// its record is, to be read when a query returns it
+struct SnapshotColdAccount {
+    const string *id;
+    IdHandle idHandle;
+    int tokens;
+    int version;
+    ColdRecord record;
+};
+
+// One of the highest token value accounts of a type, as of the snapshot
+struct SnapshotTopKEntry {
+    const string *id;
+    int version;
+    int tokens;
+};
+
+// The accounts of one type, ordered like the type's token index: tokens descending, then id handle
+struct AccountSnapshotSegment {
+    const string *accountType;
+    uint64_t revision;
+    vector<SnapshotAccount> accounts;
+    // The cold accounts, in the same order, and the tier's file as of the segment, which keeps the
+    // file open past a compaction that replaces it
+    vector<SnapshotColdAccount> coldAccounts;
+    shared_ptr<const ColdAccountFile> coldFile;
+    vector<SnapshotTopKEntry> highestTokenAccounts;
+};
+
+/**
+ * Read-only snapshot of the index. It refers to the indexer's interned strings, so it must not
+ * outlive the indexer it was taken from.
+ */
+class AccountSnapshot {
+    private:
+        vector<shared_ptr<const AccountSnapshotSegment>> segments;
+        uint64_t sequence;
+
+        // An account a query matched, in memory or in the cold tier, and the segment it is in
+        struct Match {
+            int tokens;
+            IdHandle id;
+            const AccountSnapshotSegment *segment;
+            const SnapshotAccount *account;
+            const SnapshotColdAccount *cold;
+        };
+
+        static bool precedes(const Match &a, const Match &b) {
+            if (a.tokens != b.tokens) return a.tokens > b.tokens;
+            return a.id < b.id;
+        }
+
+        // The entries of a token-ordered vector with tokens in [minTokens, maxTokens]
+        template <typename Entry>
+        static pair<typename vector<Entry>::const_iterator, typename vector<Entry>::const_iterator>
+        tokenRange(const vector<Entry> &entries, int minTokens, int maxTokens) {
+            auto first = partition_point(entries.begin(), entries.end(),
+                                         [maxTokens](const Entry &entry) { return entry.tokens > maxTokens; });
+            auto last = partition_point(first, entries.end(),
+                                        [minTokens](const Entry &entry) { return entry.tokens >= minTokens; });
+            return make_pair(first, last);
+        }
+
+        // Append the matches of a segment with tokens in [minTokens, maxTokens], in the segment's order
+        static void appendRange(const AccountSnapshotSegment &segment, int minTokens, int maxTokens, vector<Match> &out) {
+            if (minTokens > maxTokens) return;
+            size_t first = out.size();
+            auto hot = tokenRange(segment.accounts, minTokens, maxTokens);
+            for (auto it = hot.first; it != hot.second; ++it) {
+                out.push_back(Match{it->tokens, it->idHandle, &segment, &*it, nullptr});
+            }
+            size_t middle = out.size();
+            auto cold = tokenRange(segment.coldAccounts, minTokens, maxTokens);
+            for (auto it = cold.first; it != cold.second; ++it) {
+                out.push_back(Match{it->tokens, it->idHandle, &segment, nullptr, &*it});
+            }
+            inplace_merge(out.begin() + first, out.begin() + middle, out.end(), precedes);
+        }
+
+        static bool readColdAccount(const AccountSnapshotSegment &segment, const SnapshotColdAccount &cold, Account &account) {
+            string record;
+            if (segment.coldFile && segment.coldFile->read(cold.record, record)) {
+                const char *p = record.data();
+                if (wire::getAccount(p, p + record.size(), account)) return true;
+            }
+            cerr << "Failed to read the cold account " << *cold.id << " of a snapshot" << endl;
+            return false;
+        }
+
+        template <typename Indexer>
+        static shared_ptr<const AccountSnapshotSegment> buildSegment(const Indexer &indexer, TypeHandle type,
+                                                                     const shared_ptr<const ColdAccountFile> &coldFile) {
+            shared_ptr<AccountSnapshotSegment> segment = make_shared<AccountSnapshotSegment>();
+            segment->accountType = &indexer.getAccountType(type);
+            segment->revision = indexer.getTypeRevision(type);
+            const TokenIndex &index = indexer.getTokenIndex(type);
+            segment->accounts.reserve(index.size());
+            for (const TokenIndexEntry &entry : index) {
+                const IndexedAccount &account = *entry.account;
+                // Only the latest version of an account, should an older one still be indexed
+                if (indexer.findLatestAccount(account.id) != &account) continue;
+                segment->accounts.push_back(SnapshotAccount{&indexer.getAccountId(account.id), account.id, account.tokens,
+                                                            account.callbackTimeMs, account.version, account.data});
+            }
+            const ColdTokenIndex &coldIndex = indexer.getColdTokenIndex(type);
+            if (!coldIndex.empty()) {
+                segment->coldAccounts.reserve(coldIndex.size());
+                segment->coldFile = coldFile;
+            }
+            for (const ColdTokenEntry &entry : coldIndex) {
+                int latestVersion;
+                if (!indexer.findColdLatestAccount(entry.id, latestVersion) || latestVersion != entry.version) continue;
+                const ColdAccount *cold = indexer.findColdAccount(AccountKey{entry.id, entry.version});
+                segment->coldAccounts.push_back(SnapshotColdAccount{&indexer.getAccountId(entry.id), entry.id, entry.tokens,
+                                                                    entry.version, cold->record});
+            }
+            for (const TopKEntry &entry : indexer.getHighestTokenAccounts(type).sortedEntries()) {
+                segment->highestTokenAccounts.push_back(SnapshotTopKEntry{&indexer.getAccountId(entry.id), entry.version, entry.tokens});
+            }
+            return segment;
+        }
+
+        const AccountSnapshotSegment *findSegment(const string &accountType) const {
+            for (const shared_ptr<const AccountSnapshotSegment> &segment : segments) {
+                if (*segment->accountType == accountType) return segment.get();
+            }
+            return nullptr;
+        }
+
+    public:
+        AccountSnapshot() : sequence(0) {}
+
+        /**
+         * Take a snapshot of the indexer, reusing the segments of the previous snapshot whose types have
+         * not changed since. Must run on the thread that modifies the indexer.
+         * @param indexer The indexer to take the snapshot of, of any policy.
+         * @param coldFile The file of the indexer's cold tier, with every record written out, or null if
+         * it has none or could not be written.
+         * @param previous The previous snapshot of the same indexer, or null.
+         * @param sequence A caller-chosen number identifying the snapshot, such as the updates ingested so far.
+         * @return The new snapshot.
+         */
+        template <typename Indexer>
+        static shared_ptr<const AccountSnapshot> take(const Indexer &indexer,
+                                                      const shared_ptr<const ColdAccountFile> &coldFile,
+                                                      const shared_ptr<const AccountSnapshot> &previous,
+                                                      uint64_t sequence) {
+            shared_ptr<AccountSnapshot> snapshot = make_shared<AccountSnapshot>();
+            snapshot->sequence = sequence;
+            snapshot->segments.reserve(indexer.getAccountTypeCount());
+            for (TypeHandle type = 0; type < indexer.getAccountTypeCount(); ++type) {
+                if (previous && type < previous->segments.size() &&
+                    previous->segments[type]->revision == indexer.getTypeRevision(type)) {
+                    snapshot->segments.push_back(previous->segments[type]);
+                }
+                else {
+                    snapshot->segments.push_back(buildSegment(indexer, type, coldFile));
+                }
+            }
+            return snapshot;
+        }
+
+        /**
+         * Search and filter the accounts in the snapshot.
+         * @param accountType The account type to filter by (optional).
+         * @param minTokens The minimum token value to filter by (optional).
+         * @param maxTokens The maximum token value to filter by (optional).
+         * @return A vector of filtered accounts, ordered by tokens in descending order, then by id. Accounts
+         * in the cold tier are read from it.
+         */
+        vector<Account> searchAndFilterAccounts(
+            const string &accountType = "",
+            int minTokens = numeric_limits<int>::min(),
+            int maxTokens = numeric_limits<int>::max()
+        ) const {
+            vector<Match> matches;
+            if (!accountType.empty()) {
+                const AccountSnapshotSegment *segment = findSegment(accountType);
+                if (segment) appendRange(*segment, minTokens, maxTokens, matches);
+            }
+            else {
+                // Merge the types back into the order of the index over all types
+                for (const shared_ptr<const AccountSnapshotSegment> &segment : segments) {
+                    appendRange(*segment, minTokens, maxTokens, matches);
+                }
+                sort(matches.begin(), matches.end(), precedes);
+            }
+
+            vector<Account> filteredAccounts;
+            filteredAccounts.reserve(matches.size());
+            Account cold;
+            for (const Match &match : matches) {
+                if (match.account) {
+                    const SnapshotAccount &account = *match.account;
+                    filteredAccounts.push_back(Account(*account.id, *match.segment->accountType, account.tokens,
+                                                       account.callbackTimeMs, account.data, account.version));
+                }
+                else if (readColdAccount(*match.segment, *match.cold, cold)) {
+                    filteredAccounts.push_back(std::move(cold));
+                }
+            }
+            return filteredAccounts;
+        }
+
+        /**
+         * Get the highest token value accounts of the given type as of the snapshot.
+         * @param accountType The account type.
+         * @return Up to K accounts, highest tokens first; empty if the type had not been seen.
+         */
+        vector<SnapshotTopKEntry> getHighestTokenAccounts(const string &accountType) const {
+            const AccountSnapshotSegment *segment = findSegment(accountType);
+            return segment ? segment->highestTokenAccounts : vector<SnapshotTopKEntry>();
+        }
+
+        /**
+         * Get the number of accounts in the snapshot.
+         * @return The number of accounts, one version each, in memory or in the cold tier.
+         */
+        size_t size() const {
+            size_t total = 0;
+            for (const shared_ptr<const AccountSnapshotSegment> &segment : segments) {
+                total += segment->accounts.size() + segment->coldAccounts.size();
+            }
+            return total;
+        }
+
+        size_t getAccountTypeCount() const { return segments.size(); }
+        const AccountSnapshotSegment &getSegment(TypeHandle type) const { return *segments[type]; }
+        uint64_t getSequence() const { return sequence; }
+};
+
+#endif // ACCOUNT_SNAPSHOT_H
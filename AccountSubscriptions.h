@@ -0,0 +1,380 @@
+/**
+ * @file AccountSubscriptions.h
+ * @brief Standing queries over the account index, answered with incremental changes
+ *
+ * A subscription registers a query once, either the accounts of a type (or of all types) with tokens
+ * in a range, or the highest token value accounts of a type, and is then told how its result changes
+ * as updates are ingested: an account enters the result, leaves it, or is updated within it. The
+ * changes are worked out from each update and the version it supersedes, so the cost of a subscription
+ * follows the rate of the updates its query can see, not the size of its result.
+ *
+ * Range subscriptions are kept per account type, so an update is only checked against the
+ * subscriptions of its type, its previous version's type and all types. Top-K subscriptions compare
+ * the K accounts they last reported with the type's top-K container, once per ingested update or
+ * batch that changed the type.
+ */
+
+#ifndef ACCOUNT_SUBSCRIPTIONS_H
+#define ACCOUNT_SUBSCRIPTIONS_H
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include "Account.h"
+#include "AccountIndexer.h"
+#include "Metrics.h"
+
+typedef uint32_t SubscriptionId;
+
+enum class AccountChangeKind {
+    Enter,   // The account is now in the result
+    Leave,   // The account is no longer in the result
+    Update   // A newer version of the account replaced the one in the result
+};
+
+struct AccountChange {
+    AccountChangeKind kind;
+    // The account as it is now for Enter and Update, and as it was last reported for Leave
+    Account account;
+};
+
+// Receives the changes to a subscription's result since its previous call, in the order they happened
+typedef function<void(const vector<AccountChange> &)> AccountChangeHandler;
+
+/**
+ * The subscriptions of an AccountManager. The manager reports every version it removes and indexes,
+ * and the changes are delivered once it has released the index, on its ingest thread.
+ */
+class AccountSubscriptions {
+    private:
+        struct Subscription {
+            SubscriptionId id;
+            bool highestTokens;
+            // The account type as given, empty for all types, and its handle once it has been interned
+            string accountType;
+            TypeHandle type;
+            int minTokens;
+            int maxTokens;
+            AccountChangeHandler handler;
+            vector<AccountChange> pending;
+            // Of a top-K subscription, the accounts last reported, by tokens in descending order
+            vector<Account> members;
+            bool active;
+
+            bool matches(int tokens) const {
+                return tokens >= minTokens && tokens <= maxTokens;
+            }
+
+            bool matches(const IndexedAccount &account) const {
+                return matches(account.tokens);
+            }
+        };
+
+        const InternedStrings &ids;
+        const InternedStrings &types;
+        SubscriptionId nextId;
+        // Held until their pending changes are delivered, so unsubscribing from a handler is safe
+        unordered_map<SubscriptionId, shared_ptr<Subscription>> subscriptions;
+        // Range subscriptions of all types and by type handle, and top-K subscriptions by type handle
+        vector<Subscription *> rangeAllTypes;
+        vector<vector<Subscription *>> rangeByType;
+        vector<vector<Subscription *>> highestTokensByType;
+        // Subscriptions to types that have not been interned yet, resolved as types appear
+        vector<Subscription *> unresolved;
+        size_t resolvedTypeCount;
+        // The range subscriptions the version being superseded was in, with that version, until its
+        // successor is indexed
+        vector<pair<Subscription *, Account>> leaving;
+        // The types whose top-K containers may have changed, and the subscriptions with changes to deliver
+        vector<TypeHandle> touchedTypes;
+        vector<shared_ptr<Subscription>> ready;
+
+        Account toAccount(const IndexedAccount &account) const {
+            return AccountRef(&account, &ids, &types).toAccount();
+        }
+
+        void push(Subscription &subscription, AccountChangeKind kind, Account &&account) {
+            if (subscription.pending.empty()) ready.push_back(subscriptions[subscription.id]);
+            subscription.pending.push_back(AccountChange{kind, std::move(account)});
+            METRICS_COUNT(Counter::SubscriptionChanges, 1);
+        }
+
+        static void unlink(vector<Subscription *> &list, Subscription *subscription) {
+            list.erase(std::remove(list.begin(), list.end(), subscription), list.end());
+        }
+
+        void link(Subscription *subscription) {
+            if (!subscription->highestTokens && subscription->accountType.empty()) {
+                rangeAllTypes.push_back(subscription);
+                return;
+            }
+            vector<vector<Subscription *>> &byType = subscription->highestTokens ? highestTokensByType : rangeByType;
+            if (byType.size() <= subscription->type) byType.resize(subscription->type + 1);
+            byType[subscription->type].push_back(subscription);
+        }
+
+        // Resolve the subscriptions waiting for types interned since the last call
+        void resolveTypes() {
+            if (types.size() == resolvedTypeCount) return;
+            resolvedTypeCount = types.size();
+            for (size_t i = 0; i < unresolved.size();) {
+                Subscription *subscription = unresolved[i];
+                for (TypeHandle type = 0; type < types.size(); ++type) {
+                    if (types.str(type) == subscription->accountType) subscription->type = type;
+                }
+                if (subscription->type != kInvalidHandle) {
+                    link(subscription);
+                    unresolved[i] = unresolved.back();
+                    unresolved.pop_back();
+                }
+                else {
+                    ++i;
+                }
+            }
+        }
+
+        template <typename Visit>
+        void forEachRangeSubscription(TypeHandle type, Visit visit) const {
+            for (Subscription *subscription : rangeAllTypes) visit(*subscription);
+            if (type < rangeByType.size()) {
+                for (Subscription *subscription : rangeByType[type]) visit(*subscription);
+            }
+        }
+
+        void touchType(TypeHandle type) {
+            if (type < highestTokensByType.size() && !highestTokensByType[type].empty()) touchedTypes.push_back(type);
+        }
+
+    public:
+        // Takes an indexer of any policy
+        template <typename Indexer>
+        explicit AccountSubscriptions(const Indexer &indexer)
+            : ids(indexer.getSymbols().ids), types(indexer.getSymbols().types), nextId(0), resolvedTypeCount(0) {}
+
+        AccountSubscriptions(const AccountSubscriptions &) = delete;
+        AccountSubscriptions &operator=(const AccountSubscriptions &) = delete;
+
+        /**
+         * Subscribe to the accounts of a type with tokens in [minTokens, maxTokens]. Every account in
+         * the result now is reported as entering it on the next delivery.
+         * @param indexer The indexer the manager reports to this registry.
+         * @param accountType The account type, or an empty string for all types.
+         * @param minTokens The minimum token value, inclusive.
+         * @param maxTokens The maximum token value, inclusive.
+         * @param handler Receives the changes to the result.
+         * @return The id of the subscription.
+         */
+        template <typename Indexer>
+        SubscriptionId subscribe(const Indexer &indexer, const string &accountType, int minTokens, int maxTokens,
+                                 AccountChangeHandler handler) {
+            Subscription &subscription = add(accountType, false, minTokens, maxTokens, std::move(handler));
+            TokenRange range = indexer.findAccountsByTokens(accountType, minTokens, maxTokens);
+            for (auto it = range.first; it != range.last; ++it) {
+                push(subscription, AccountChangeKind::Enter, toAccount(*it->account));
+            }
+            return subscription.id;
+        }
+
+        /**
+         * Subscribe to the highest token value accounts of a type. The accounts among them now are
+         * reported as entering on the next delivery. A change of rank alone is not reported.
+         * @param indexer The indexer the manager reports to this registry.
+         * @param accountType The account type.
+         * @param handler Receives the changes to the top K.
+         * @return The id of the subscription.
+         */
+        template <typename Indexer>
+        SubscriptionId subscribeHighestTokens(const Indexer &indexer, const string &accountType, AccountChangeHandler handler) {
+            Subscription &subscription = add(accountType, true, numeric_limits<int>::min(), numeric_limits<int>::max(),
+                                             std::move(handler));
+            if (subscription.type != kInvalidHandle) {
+                refreshHighestTokens(indexer, subscription);
+            }
+            return subscription.id;
+        }
+
+        /**
+         * Cancel a subscription. Changes not delivered yet are dropped. May be called from a handler.
+         * @param id The id of the subscription.
+         * @return False if there is no such subscription.
+         */
+        bool unsubscribe(SubscriptionId id) {
+            auto it = subscriptions.find(id);
+            if (it == subscriptions.end()) return false;
+            Subscription *subscription = it->second.get();
+            subscription->active = false;
+            unlink(rangeAllTypes, subscription);
+            unlink(unresolved, subscription);
+            if (subscription->type != kInvalidHandle) {
+                vector<vector<Subscription *>> &byType = subscription->highestTokens ? highestTokensByType : rangeByType;
+                if (subscription->type < byType.size()) unlink(byType[subscription->type], subscription);
+            }
+            subscriptions.erase(it);
+            return true;
+        }
+
+        /**
+         * Record that an indexed version is about to be removed, as superseded by the update indexed
+         * next. Called with the index locked.
+         * @param account The version being removed.
+         */
+        void removing(const IndexedAccount &account) {
+            if (subscriptions.empty()) return;
+            forEachRangeSubscription(account.accountType, [this, &account](Subscription &subscription) {
+                if (subscription.matches(account)) leaving.push_back(make_pair(&subscription, toAccount(account)));
+            });
+            touchType(account.accountType);
+        }
+
+        /**
+         * Check whether a range subscription holds versions of the given type and tokens, so that one in
+         * the cold tier only has to be read when removing it changes a subscription.
+         * @param accountType The type of the version.
+         * @param tokens The tokens of the version.
+         * @return True if a range subscription holds it.
+         */
+        bool holds(TypeHandle accountType, int tokens) const {
+            bool held = false;
+            forEachRangeSubscription(accountType, [&held, tokens](const Subscription &subscription) {
+                held = held || subscription.matches(tokens);
+            });
+            return held;
+        }
+
+        /**
+         * Record that a version in the cold tier is about to be removed, as removing does for an indexed
+         * one. A cold version is never among the top K of its type. Called with the index locked.
+         * @param accountType The type of the version.
+         * @param account The version, read from the cold tier.
+         */
+        void removing(TypeHandle accountType, const Account &account) {
+            if (subscriptions.empty()) return;
+            forEachRangeSubscription(accountType, [this, &account](Subscription &subscription) {
+                if (subscription.matches(account.tokens)) leaving.push_back(make_pair(&subscription, account));
+            });
+        }
+
+        /**
+         * Work out the changes to the range subscriptions from a newly indexed version and the version it
+         * superseded, if removing reported one. Called with the index locked.
+         * @param account The version indexed.
+         */
+        void indexed(const IndexedAccount &account) {
+            if (subscriptions.empty()) return;
+            resolveTypes();
+            forEachRangeSubscription(account.accountType, [this, &account](Subscription &subscription) {
+                if (!subscription.matches(account)) return;
+                for (size_t i = 0; i < leaving.size(); ++i) {
+                    if (leaving[i].first == &subscription) {
+                        leaving.erase(leaving.begin() + i);
+                        push(subscription, AccountChangeKind::Update, toAccount(account));
+                        return;
+                    }
+                }
+                push(subscription, AccountChangeKind::Enter, toAccount(account));
+            });
+            for (pair<Subscription *, Account> &left : leaving) {
+                push(*left.first, AccountChangeKind::Leave, std::move(left.second));
+            }
+            leaving.clear();
+            touchType(account.accountType);
+        }
+
+        /**
+         * Work out the changes to the top-K subscriptions of the types changed since the last call, once
+         * their top-K containers are up to date. Called with the index locked.
+         * @param indexer The indexer the manager reports to this registry.
+         */
+        template <typename Indexer>
+        void rankedHighestTokens(const Indexer &indexer) {
+            if (touchedTypes.empty()) return;
+            sort(touchedTypes.begin(), touchedTypes.end());
+            touchedTypes.erase(unique(touchedTypes.begin(), touchedTypes.end()), touchedTypes.end());
+            for (TypeHandle type : touchedTypes) {
+                for (Subscription *subscription : highestTokensByType[type]) refreshHighestTokens(indexer, *subscription);
+            }
+            touchedTypes.clear();
+        }
+
+        /**
+         * Hand every subscription its pending changes. Called on the ingest thread with the index unlocked,
+         * so handlers may query the manager. A handler must not ingest updates.
+         */
+        void deliver() {
+            if (ready.empty()) return;
+            vector<shared_ptr<Subscription>> delivering;
+            delivering.swap(ready);
+            vector<AccountChange> changes;
+            for (const shared_ptr<Subscription> &subscription : delivering) {
+                changes.clear();
+                changes.swap(subscription->pending);
+                if (subscription->active) subscription->handler(changes);
+            }
+        }
+
+        size_t size() const { return subscriptions.size(); }
+        bool empty() const { return subscriptions.empty(); }
+
+    private:
+        Subscription &add(const string &accountType, bool highestTokens, int minTokens, int maxTokens,
+                          AccountChangeHandler handler) {
+            shared_ptr<Subscription> subscription = make_shared<Subscription>();
+            subscription->id = nextId++;
+            subscription->highestTokens = highestTokens;
+            subscription->accountType = accountType;
+            subscription->type = kInvalidHandle;
+            subscription->minTokens = minTokens;
+            subscription->maxTokens = maxTokens;
+            subscription->handler = std::move(handler);
+            subscription->active = true;
+            subscriptions[subscription->id] = subscription;
+
+            if (highestTokens || !accountType.empty()) {
+                for (TypeHandle type = 0; type < types.size(); ++type) {
+                    if (types.str(type) == accountType) subscription->type = type;
+                }
+                if (subscription->type == kInvalidHandle) {
+                    unresolved.push_back(subscription.get());
+                    return *subscription;
+                }
+            }
+            link(subscription.get());
+            return *subscription;
+        }
+
+        // Report how the type's top K differ from the accounts the subscription last reported
+        template <typename Indexer>
+        void refreshHighestTokens(const Indexer &indexer, Subscription &subscription) {
+            vector<TopKEntry> entries = indexer.getHighestTokenAccounts(subscription.type).sortedEntries();
+            vector<Account> members;
+            members.reserve(entries.size());
+            vector<bool> kept(subscription.members.size(), false);
+            for (const TopKEntry &entry : entries) {
+                const string &id = ids.str(entry.id);
+                size_t previous = 0;
+                while (previous < subscription.members.size() && subscription.members[previous].id != id) ++previous;
+                if (previous < subscription.members.size() && subscription.members[previous].version == entry.version) {
+                    kept[previous] = true;
+                    members.push_back(std::move(subscription.members[previous]));
+                    continue;
+                }
+                const IndexedAccount *account = indexer.findLatestAccount(entry.id);
+                if (previous < subscription.members.size()) kept[previous] = true;
+                push(subscription, previous < subscription.members.size() ? AccountChangeKind::Update : AccountChangeKind::Enter,
+                     toAccount(*account));
+                members.push_back(toAccount(*account));
+            }
+            for (size_t i = 0; i < subscription.members.size(); ++i) {
+                if (!kept[i]) push(subscription, AccountChangeKind::Leave, std::move(subscription.members[i]));
+            }
+            subscription.members.swap(members);
+        }
+};
+
+#endif // ACCOUNT_SUBSCRIPTIONS_H
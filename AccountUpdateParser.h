@@ -0,0 +1,312 @@
+/**
+ * @file AccountUpdateParser.h
+ * @brief Schema-aware parser for account update JSON
+ *
+ * Decodes account update objects straight into Account, without building a JSON DOM: a single pass
+ * over the text recognizes the six keys of the fixed schema by length and bytes, decodes integers
+ * and plain ASCII strings in place, and interns data field names as it goes. Anything outside that
+ * happy path (a missing or unknown key, a number that is not an int, a string with non-ASCII bytes or
+ * \u escapes, malformed JSON) makes it give up and return false, so the caller can fall back to the
+ * generic nlohmann path, which decides exactly as before and reports the error.
+ */
+
+#ifndef ACCOUNT_UPDATE_PARSER_H
+#define ACCOUNT_UPDATE_PARSER_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include "Account.h"
+#include "Metrics.h"
+
+class AccountUpdateParser {
+    private:
+        // Bits of the keys an update must have
+        enum {
+            kId = 1 << 0,
+            kAccountType = 1 << 1,
+            kTokens = 1 << 2,
+            kCallbackTimeMs = 1 << 3,
+            kData = 1 << 4,
+            kVersion = 1 << 5,
+            kAllKeys = (1 << 6) - 1
+        };
+
+        static void skipWhitespace(const char *&p, const char *end) {
+            while (p != end && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r')) ++p;
+        }
+
+        static bool consume(const char *&p, const char *end, char expected) {
+            skipWhitespace(p, end);
+            if (p == end || *p != expected) return false;
+            ++p;
+            return true;
+        }
+
+        // A key is matched on its raw bytes, so one with escapes is left to the fallback
+        static bool parseKey(const char *&p, const char *end, const char *&key, size_t &length) {
+            if (!consume(p, end, '"')) return false;
+            const char *close = static_cast<const char *>(memchr(p, '"', end - p));
+            if (!close) return false;
+            for (const char *c = p; c != close; ++c) {
+                if (*c == '\\' || static_cast<unsigned char>(*c) < 0x20 || static_cast<unsigned char>(*c) >= 0x80) return false;
+            }
+            key = p;
+            length = close - p;
+            p = close + 1;
+            return consume(p, end, ':');
+        }
+
+        static bool parseString(const char *&p, const char *end, string &out) {
+            if (!consume(p, end, '"')) return false;
+            out.clear();
+            while (p != end) {
+                unsigned char c = static_cast<unsigned char>(*p++);
+                if (c == '"') return true;
+                if (c < 0x20 || c >= 0x80) return false;
+                if (c != '\\') {
+                    out += static_cast<char>(c);
+                    continue;
+                }
+                if (p == end) return false;
+                switch (*p++) {
+                    case '"': out += '"'; break;
+                    case '\\': out += '\\'; break;
+                    case '/': out += '/'; break;
+                    case 'b': out += '\b'; break;
+                    case 'f': out += '\f'; break;
+                    case 'n': out += '\n'; break;
+                    case 'r': out += '\r'; break;
+                    case 't': out += '\t'; break;
+                    default: return false;
+                }
+            }
+            return false;
+        }
+
+        // Only a plain JSON integer that fits in an int, or a boolean, which nlohmann converts to 1 or 0;
+        // fractions and exponents go to the fallback
+        static bool parseInt(const char *&p, const char *end, int &out) {
+            skipWhitespace(p, end);
+            if (end - p >= 4 && memcmp(p, "true", 4) == 0) {
+                p += 4;
+                out = 1;
+                return true;
+            }
+            if (end - p >= 5 && memcmp(p, "false", 5) == 0) {
+                p += 5;
+                out = 0;
+                return true;
+            }
+            bool negative = p != end && *p == '-';
+            if (negative) ++p;
+            if (p == end || *p < '0' || *p > '9') return false;
+            if (*p == '0' && p + 1 != end && p[1] >= '0' && p[1] <= '9') return false;
+            int64_t value = 0;
+            const char *first = p;
+            while (p != end && *p >= '0' && *p <= '9') {
+                if (p - first >= 10) return false;
+                value = value * 10 + (*p++ - '0');
+            }
+            if (p != end && (*p == '.' || *p == 'e' || *p == 'E')) return false;
+            if (negative) value = -value;
+            if (value < numeric_limits<int>::min() || value > numeric_limits<int>::max()) return false;
+            out = static_cast<int>(value);
+            return true;
+        }
+
+        static bool parseData(const char *&p, const char *end, AccountData &data, string &fieldName) {
+            if (!consume(p, end, '{')) return false;
+            data.clear();
+            skipWhitespace(p, end);
+            if (p != end && *p == '}') {
+                ++p;
+                return true;
+            }
+            while (true) {
+                const char *key;
+                size_t length;
+                int value;
+                if (!parseKey(p, end, key, length) || !parseInt(p, end, value)) return false;
+                fieldName.assign(key, length);
+                data.set(FieldNames::intern(fieldName), value);
+                skipWhitespace(p, end);
+                if (p == end) return false;
+                if (*p == '}') {
+                    ++p;
+                    return true;
+                }
+                if (*p++ != ',') return false;
+            }
+        }
+
+        static bool keyIs(const char *key, size_t length, const char *name, size_t nameLength) {
+            return length == nameLength && memcmp(key, name, length) == 0;
+        }
+
+        // The parsing of parseObject, which times and counts it
+        static bool decodeObject(const char *&p, const char *end, Account &account) {
+            string fieldName;
+            if (!consume(p, end, '{')) return false;
+            int seen = 0;
+            skipWhitespace(p, end);
+            if (p != end && *p == '}') return false;
+            while (true) {
+                const char *key;
+                size_t length;
+                if (!parseKey(p, end, key, length)) return false;
+                bool parsed;
+                int bit;
+                if (keyIs(key, length, "id", 2)) {
+                    parsed = parseString(p, end, account.id);
+                    bit = kId;
+                }
+                else if (keyIs(key, length, "accountType", 11)) {
+                    parsed = parseString(p, end, account.accountType);
+                    bit = kAccountType;
+                }
+                else if (keyIs(key, length, "tokens", 6)) {
+                    parsed = parseInt(p, end, account.tokens);
+                    bit = kTokens;
+                }
+                else if (keyIs(key, length, "callbackTimeMs", 14)) {
+                    parsed = parseInt(p, end, account.callbackTimeMs);
+                    bit = kCallbackTimeMs;
+                }
+                else if (keyIs(key, length, "data", 4)) {
+                    parsed = parseData(p, end, account.data, fieldName);
+                    bit = kData;
+                }
+                else if (keyIs(key, length, "version", 7)) {
+                    parsed = parseInt(p, end, account.version);
+                    bit = kVersion;
+                }
+                else {
+                    return false;
+                }
+                if (!parsed) return false;
+                seen |= bit;
+
+                skipWhitespace(p, end);
+                if (p == end) return false;
+                if (*p == '}') {
+                    ++p;
+                    return seen == kAllKeys;
+                }
+                if (*p++ != ',') return false;
+            }
+        }
+
+        /**
+         * The updates a text has parsed into so far, and how long each took, recorded only once the
+         * whole text has parsed: a text the fast path gives up on is parsed again by the fallback
+         * parser, which counts its updates itself.
+         */
+        class ParsedUpdates {
+#if ACCOUNT_INDEXING_METRICS
+            private:
+                // The first latency is held inline, so that parsing a single object does not allocate
+                uint64_t firstLatency;
+                vector<uint64_t> latencies;
+                size_t count;
+                chrono::steady_clock::time_point start;
+
+            public:
+                ParsedUpdates() : firstLatency(0), count(0) {}
+
+                void begin() { start = chrono::steady_clock::now(); }
+
+                void end() {
+                    chrono::nanoseconds elapsed = chrono::steady_clock::now() - start;
+                    if (count++ == 0) firstLatency = static_cast<uint64_t>(elapsed.count());
+                    else latencies.push_back(static_cast<uint64_t>(elapsed.count()));
+                }
+
+                void record() const {
+                    if (count == 0) return;
+                    METRICS_RECORD(Histogram::ParseLatency, firstLatency);
+                    for (uint64_t latency : latencies) METRICS_RECORD(Histogram::ParseLatency, latency);
+                    METRICS_COUNT(Counter::UpdatesParsed, count);
+                }
+#else
+            public:
+                void begin() {}
+                void end() {}
+                void record() const {}
+#endif
+        };
+
+    public:
+        /**
+         * Parse one account update object. It is not counted in the metrics; parse and parseArray count
+         * the updates of a text once all of it has parsed.
+         * @param p The start of the text; on success, moved past the object's closing brace.
+         * @param end The end of the text.
+         * @param account Receives the update. Its buffers are reused, so parsing into the same Account
+         * repeatedly does not allocate for ids and types that fit.
+         * @return False if the object is not a well-formed update of the fixed schema.
+         */
+        static bool parseObject(const char *&p, const char *end, Account &account) {
+            return decodeObject(p, end, account);
+        }
+
+        /**
+         * Parse a text holding exactly one account update object.
+         * @param text The text, such as one NDJSON line.
+         * @param account Receives the update.
+         * @return False if the text is anything else.
+         */
+        static bool parse(const string &text, Account &account) {
+            const char *p = text.data();
+            const char *end = p + text.size();
+            ParsedUpdates parsed;
+            parsed.begin();
+            if (!parseObject(p, end, account)) return false;
+            parsed.end();
+            skipWhitespace(p, end);
+            if (p != end) return false;
+            parsed.record();
+            return true;
+        }
+
+        /**
+         * Parse a text holding a JSON array of account update objects.
+         * @param text The text, such as a whole batch file.
+         * @param accounts Receives the updates in order; its contents are unspecified on failure.
+         * @return False unless every element is a well-formed update.
+         */
+        static bool parseArray(const string &text, vector<Account> &accounts) {
+            const char *p = text.data();
+            const char *end = p + text.size();
+            ParsedUpdates parsed;
+            if (!consume(p, end, '[')) return false;
+            skipWhitespace(p, end);
+            if (p != end && *p == ']') {
+                ++p;
+            }
+            else {
+                while (true) {
+                    accounts.emplace_back();
+                    parsed.begin();
+                    if (!parseObject(p, end, accounts.back())) return false;
+                    parsed.end();
+                    skipWhitespace(p, end);
+                    if (p == end) return false;
+                    if (*p == ']') {
+                        ++p;
+                        break;
+                    }
+                    if (*p++ != ',') return false;
+                }
+            }
+            skipWhitespace(p, end);
+            if (p != end) return false;
+            parsed.record();
+            return true;
+        }
+};
+
+#endif // ACCOUNT_UPDATE_PARSER_H
@@ -0,0 +1,220 @@
+/**
+ * @file AccountUpdateReader.h
+ * @brief Reading and parsing of account update files
+ *
+ * Reads account update files, either parsed up front as one JSON array or streamed update by update,
+ * and hands every parsed Account to a handler. Batch files and NDJSON lines go through the
+ * schema-aware AccountUpdateParser first, and through nlohmann only if it gives up. The reader knows nothing about indexing, so the same
+ * files can feed a single AccountManager or be routed across several.
+ */
+
+#ifndef ACCOUNT_UPDATE_READER_H
+#define ACCOUNT_UPDATE_READER_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include "nlohmann/json.hpp"
+#include "Account.h"
+#include "AccountUpdateParser.h"
+#include "Metrics.h"
+
+using json = nlohmann::json;
+
+// Selects how an account update file is read
+enum class IngestMode {
+    Batch,      // Parse the whole file as one JSON array before ingesting
+    Streaming,  // Ingest each update as soon as it is parsed (NDJSON or a top-level JSON array)
+    Pipelined   // Stream as above, parsing on a thread of its own that runs ahead of ingest
+};
+
+class AccountUpdateReader {
+    public:
+        /**
+         * Read the account updates from the given file and pass each one to the handler, as an rvalue.
+         * @param filename The name of the file containing the account updates.
+         * @param mode Whether to parse the file up front or stream it update by update; the reader
+         * streams a Pipelined file on the calling thread.
+         * @param onUpdate Called with every parsed account update, in file order.
+         * @return False if the file could not be opened, or could not be parsed in batch mode.
+         */
+        template <typename Handler>
+        static bool readFile(const string &filename, IngestMode mode, Handler onUpdate) {
+            ifstream file(filename);
+            if (!file.is_open()) {
+                cerr << "Failed to open the file: " << filename << endl;
+                return false;
+            }
+
+            if (mode != IngestMode::Batch) {
+                streamAccountUpdates(file, onUpdate);
+                return true;
+            }
+
+            string fileContents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+            file.close();
+
+            vector<Account> accountUpdates;
+            if (AccountUpdateParser::parseArray(fileContents, accountUpdates)) {
+                for (Account &account : accountUpdates) {
+                    onUpdate(std::move(account));
+                }
+                return true;
+            }
+            accountUpdates.clear();
+            METRICS_COUNT(Counter::ParserFallbacks, 1);
+
+            json jsonAccounts;
+            try {
+                jsonAccounts = json::parse(fileContents);
+            }
+            catch (const json::parse_error &e) {
+                METRICS_COUNT(Counter::ParseErrors, 1);
+                std::cerr << "Error parsing JSON: " << e.what() << std::endl;
+                return false;
+            }
+
+            for (const auto &accountJson : jsonAccounts) {
+                accountUpdates.push_back(parseAccountUpdate(accountJson));
+            }
+
+            for (Account &account : accountUpdates) {
+                onUpdate(std::move(account));
+            }
+            return true;
+        }
+
+        /**
+         * Stream the account updates from the given input, handing each update on as soon as it is parsed.
+         * The input is either newline-delimited JSON (one update object per line) or a top-level JSON array;
+         * the format is detected from the first non-whitespace character. Only one update is held in memory
+         * at a time.
+         * @param input The stream containing the account updates.
+         * @param onUpdate Called with every parsed account update, in stream order.
+         */
+        template <typename Handler>
+        static void streamAccountUpdates(istream &input, Handler &onUpdate) {
+            input >> ws;
+            if (input.peek() == '[') {
+                streamJsonArray(input, onUpdate);
+            }
+            else {
+                streamNdjson(input, onUpdate);
+            }
+        }
+
+        /**
+         * Parse the account update from the given JSON object.
+         * @param accountJson The JSON object representing an account update.
+         * @return The parsed Account object.
+         */
+        static Account parseAccountUpdate(const json &accountJson) {
+            METRICS_TIME(Histogram::ParseLatency);
+            // Every member is decoded in place, so each string is copied out of the JSON value exactly once
+            Account account;
+            account.id = accountJson["id"].get<string>();
+            account.accountType = accountJson["accountType"].get<string>();
+            account.tokens = accountJson["tokens"];
+            account.callbackTimeMs = accountJson["callbackTimeMs"];
+            account.version = accountJson["version"];
+            // Decode the fields straight into the compact representation, without an intermediate map
+            const json::object_t &fields = accountJson["data"].get_ref<const json::object_t &>();
+            account.data.reserve(static_cast<uint32_t>(fields.size()));
+            for (const auto &field : fields) {
+                account.data.set(FieldNames::intern(field.first), field.second.get<int>());
+            }
+            METRICS_COUNT(Counter::UpdatesParsed, 1);
+            return account;
+        }
+
+    private:
+        /**
+         * Stream a top-level JSON array of account updates.
+         * Algorithm:
+         * 1. Let nlohmann's callback parser read the array incrementally from the stream
+         * 2. Every time an element of the top-level array (depth 1) is complete, i.e. on its object_end
+         * event, hand it on
+         * 3. Return false from the callback so that the parser discards the element instead of
+         * appending it to the array it is building
+         * @param input The stream positioned at the opening bracket of the array.
+         * @param onUpdate Called with every parsed account update.
+         */
+        template <typename Handler>
+        static void streamJsonArray(istream &input, Handler &onUpdate) {
+            json::parser_callback_t onValue = [&onUpdate](int depth, json::parse_event_t event, json &parsed) {
+                if (depth != 1 || (event != json::parse_event_t::object_end && event != json::parse_event_t::value)) {
+                    return true;
+                }
+                handleStreamedUpdate(parsed, onUpdate);
+                return false;
+            };
+
+            try {
+                // Every element is discarded by the callback, so this is just the empty array
+                json emptyArray = json::parse(input, onValue);
+                (void)emptyArray;
+            }
+            catch (const json::exception &e) {
+                METRICS_COUNT(Counter::ParseErrors, 1);
+                std::cerr << "Error parsing JSON: " << e.what() << std::endl;
+            }
+        }
+
+        /**
+         * Stream newline-delimited JSON account updates. Blank lines are skipped, and a malformed line
+         * is reported and skipped without stopping the rest of the stream.
+         * @param input The stream containing one account update object per line.
+         * @param onUpdate Called with every parsed account update.
+         */
+        template <typename Handler>
+        static void streamNdjson(istream &input, Handler &onUpdate) {
+            string line;
+            size_t lineNumber = 0;
+            Account account;
+            while (getline(input, line)) {
+                ++lineNumber;
+                if (line.find_first_not_of(" \t\r") == string::npos) continue;
+
+                if (AccountUpdateParser::parse(line, account)) {
+                    onUpdate(std::move(account));
+                    continue;
+                }
+
+                METRICS_COUNT(Counter::ParserFallbacks, 1);
+                json accountJson;
+                try {
+                    accountJson = json::parse(line);
+                }
+                catch (const json::parse_error &e) {
+                    METRICS_COUNT(Counter::ParseErrors, 1);
+                    std::cerr << "Error parsing JSON on line " << lineNumber << ": " << e.what() << std::endl;
+                    continue;
+                }
+                handleStreamedUpdate(accountJson, onUpdate);
+            }
+        }
+
+        /**
+         * Parse a single streamed account update and hand it on. An update that does not match the
+         * schema is reported and skipped.
+         * @param accountJson The JSON object representing an account update.
+         * @param onUpdate Called with the parsed account update.
+         */
+        template <typename Handler>
+        static void handleStreamedUpdate(const json &accountJson, Handler &onUpdate) {
+            Account account;
+            try {
+                account = parseAccountUpdate(accountJson);
+            }
+            catch (const json::exception &e) {
+                METRICS_COUNT(Counter::ParseErrors, 1);
+                std::cerr << "Skipping invalid account update: " << e.what() << std::endl;
+                return;
+            }
+            onUpdate(std::move(account));
+        }
+};
+
+#endif // ACCOUNT_UPDATE_READER_H
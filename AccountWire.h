@@ -0,0 +1,119 @@
+/**
+ * @file AccountWire.h
+ * @brief Binary encoding of account updates, shared by the write-ahead log and the node protocol
+ *
+ * An account is encoded as its tokens, callbackTimeMs and version, the lengths of its id, its type and
+ * its data field count as 32-bit integers, then the id and type bytes, and then every data field as its
+ * name length, its value and its name. Integers are in host byte order.
+ */
+
+#ifndef ACCOUNT_WIRE_H
+#define ACCOUNT_WIRE_H
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include "Account.h"
+
+namespace wire {
+
+// The fewest bytes a string and an account can be encoded in: their lengths and integers, nothing else
+enum : size_t { kMinStringBytes = sizeof(uint32_t), kMinAccountBytes = 6 * sizeof(uint32_t) };
+
+template <typename T>
+inline void put(string &out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+inline bool get(const char *&p, const char *end, T &value) {
+    if (static_cast<size_t>(end - p) < sizeof(value)) return false;
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+inline bool getString(const char *&p, const char *end, uint32_t length, string &value) {
+    if (static_cast<size_t>(end - p) < length) return false;
+    value.assign(p, length);
+    p += length;
+    return true;
+}
+
+inline void putString(string &out, const string &value) {
+    put<uint32_t>(out, static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+inline bool getString(const char *&p, const char *end, string &value) {
+    uint32_t length;
+    return get(p, end, length) && getString(p, end, length, value);
+}
+
+/**
+ * Check that a count read off the input can be true: that the rest of the input has room for that
+ * many items, so that it is safe to allocate room for them.
+ * @param p The start of the items.
+ * @param end The end of the input.
+ * @param count The number of items.
+ * @param minItemBytes The fewest bytes an item can be encoded in.
+ * @return False if the input is too short for that many items.
+ */
+inline bool fits(const char *p, const char *end, uint32_t count, size_t minItemBytes) {
+    return count <= static_cast<size_t>(end - p) / minItemBytes;
+}
+
+inline void putAccount(string &out, const string &id, const string &accountType, int tokens, int callbackTimeMs,
+                       const AccountData &data, int version) {
+    put<int32_t>(out, tokens);
+    put<int32_t>(out, callbackTimeMs);
+    put<int32_t>(out, version);
+    put<uint32_t>(out, static_cast<uint32_t>(id.size()));
+    put<uint32_t>(out, static_cast<uint32_t>(accountType.size()));
+    put<uint32_t>(out, static_cast<uint32_t>(data.size()));
+    out += id;
+    out += accountType;
+    for (const AccountData::Field &field : data) {
+        const string &name = FieldNames::name(field.key);
+        put<uint32_t>(out, static_cast<uint32_t>(name.size()));
+        put<int32_t>(out, field.value);
+        out += name;
+    }
+}
+
+inline void putAccount(string &out, const Account &account) {
+    putAccount(out, account.id, account.accountType, account.tokens, account.callbackTimeMs, account.data, account.version);
+}
+
+/**
+ * Decode an account written by putAccount.
+ * @param p The start of the encoded account, advanced past it.
+ * @param end The end of the input.
+ * @param account The account to decode into; its data storage is reused.
+ * @return False if the input ends before the account does.
+ */
+inline bool getAccount(const char *&p, const char *end, Account &account) {
+    int32_t tokens, callbackTimeMs, version;
+    uint32_t idLength, typeLength, fieldCount;
+    if (!get(p, end, tokens) || !get(p, end, callbackTimeMs) || !get(p, end, version) ||
+        !get(p, end, idLength) || !get(p, end, typeLength) || !get(p, end, fieldCount) ||
+        !getString(p, end, idLength, account.id) || !getString(p, end, typeLength, account.accountType)) {
+        return false;
+    }
+    account.tokens = tokens;
+    account.callbackTimeMs = callbackTimeMs;
+    account.version = version;
+    account.data.clear();
+    string name;
+    for (uint32_t i = 0; i < fieldCount; ++i) {
+        uint32_t nameLength;
+        int32_t value;
+        if (!get(p, end, nameLength) || !get(p, end, value) || !getString(p, end, nameLength, name)) return false;
+        account.data.set(FieldNames::intern(name), value);
+    }
+    return true;
+}
+
+} // namespace wire
+
+#endif // ACCOUNT_WIRE_H
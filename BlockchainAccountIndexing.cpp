@@ -9,436 +9,1632 @@
  * @author [Sami Ahmad Khan] [sami.ahmadkhan12@gmail.com]
  */
 
-#include <iostream>
+#include <cassert>
 #include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <limits>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
-#include <unordered_map>
-#include <queue>
 #include <random>
-#include <chrono>
-#include "nlohmann/json.hpp"
-
-using namespace std;
-using json = nlohmann::json;
-
-struct Account {
-    string id;
-    string accountType;
-    unordered_map<string, int> data;
-    int tokens;
-    int version;
-    int callbackTimeMs;
-
-    Account() : tokens(0), callbackTimeMs(0), version(0) {}
-    Account(const string &id, const string &accountType, int tokens, int callbackTimeMs,
-            const unordered_map<string, int> &data, int version)
-        : id(id), accountType(accountType), tokens(tokens), callbackTimeMs(callbackTimeMs),
-          data(data), version(version) {}
-
-    // Comparison operator to compare two Account objects
-    bool operator<(const Account &other) const {
-        return tokens < other.tokens;
-    }
-};
-
-struct AccountKey {
-    string id;
-    int version;
-
-    bool operator==(const AccountKey &other) const {
-        return id == other.id && version == other.version;
-    }
-};
-
-struct AccountKeyHash {
-    size_t operator()(const AccountKey &key) const {
-        size_t h1 = hash<string>{}(key.id);
-        size_t h2 = hash<int>{}(key.version);
-        // It combines the two hash values using bitwise operations. It performs an XOR operation between h1 (the hash value for id) and the left shift of h2 (the hash value for version) by 1. This is done to combine the hash values in a way that preserves the uniqueness of the keys.
-        return h1 ^ (h2 << 1);
-    }
-};
-
-// Custom Comparator to heapify based on time
-struct AccountTimeComparator {
-    bool operator()(const pair<chrono::system_clock::time_point, Account> &a, const pair<chrono::system_clock::time_point, Account> &b) const {
-        return a.first > b.first; // Compare based on the callback time
-    }
-};
-
-// Comparison functor for sorting accounts by tokens in descending order
-struct AccountTokenComparator {
-    bool operator()(const Account &a1, const Account &a2) const {
-        return a1.tokens > a2.tokens;
-    }
-};
-
-class CallbackManager {
-    private:
-        // Using a heap to store callbacks provides an efficient way 
-        // to manage and retrieve the callbacks based on their scheduled time
-        vector<pair<chrono::system_clock::time_point, Account>> callbacks;
-        unordered_map<string, int> indexMap;
-
-        void updateIndexMap(const Account &account, int index) {
-            indexMap[account.id] = index;
-        }
-
-        /**
-         * Remove the callback at the given index from the heap.
-         * @param index The index of the callback to be removed.
-         * Algorithm:
-         * 1. Check if the target callback index is not the last element in the vector
-         * 2. Then swap last element with target index, so that we can pop it easily from the vector
-         * 3. Update the indexMap with the new poition of the swapped callback.
-         * 4. Pop the swapped callback from the heap. pop_heap method allows to pop the max element according
-         * to heap property
-         * 5. Push the swapped callback back into the heap
-         */
-        void removeAtIndex(int index) {
-            if (index != callbacks.size() - 1) {
-                std::swap(callbacks[index], callbacks.back());
-                updateIndexMap(callbacks[index].second, index);
-                std::pop_heap(callbacks.begin(), callbacks.end(), AccountTimeComparator());
-                callbacks.pop_back();
-                std::push_heap(callbacks.begin(), callbacks.end(), AccountTimeComparator());
+#include <unordered_map>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include "AccountManager.h"
+#include "ShardedAccountManager.h"
+#include "AccountCluster.h"
+
+int main() {
+    // Test Case 1: Single Account Update
+    {
+        AccountManager accountManager("single_account_update.json");
+        assert(accountManager.accountIndexer.size() == 1);
+        assert(accountManager.accountIndexer.contains("GzbXUY1JQwRVUf3j3myg2NbDRwD5i4jD4HJpYhVNfiDm", 123));
+    }
+    // Test Case 2: Multiple Account Updates with Callbacks
+    {
+        AccountManager accountManager("multi_account_updates_with_callback.json");
+        assert(accountManager.accountIndexer.size() == 3);
+        assert(accountManager.accountIndexer.contains("account1", 2));
+        assert(accountManager.accountIndexer.contains("account2", 1));
+        assert(accountManager.accountIndexer.contains("account3", 1));
+    }
+    // Test Case 3: Account Update with Higher Tokens Replacing Existing Account (Callback cancellation)
+    {
+        AccountManager accountManager("account_replaced_by_higher_token.json");
+        assert(accountManager.accountIndexer.size() == 1);
+        assert(accountManager.accountIndexer.contains("account1", 2));
+    }
+    // Test Case 4: Three account updates with different IDs and account types. All three updates have different versions. The assertions check that all three accounts are indexed correctly.
+    {
+        AccountManager accountManager("multi_account_multi_version_indexing.json");
+        assert(accountManager.accountIndexer.size() == 2);
+        assert(accountManager.accountIndexer.contains("account1", 3));
+        assert(accountManager.accountIndexer.contains("account2", 1));
+    }
+    // Test Case 5: Accounts should get filtered based on the criteria
+    {
+        AccountManager accountManager("multi_accounts_to_be_filtered.json");
+        vector<Account> filteredAccounts = accountManager.searchAndFilterAccounts("user", 200, 400);
+        // Validate the filtered accounts
+        assert(filteredAccounts.size() == 2);
+        assert(filteredAccounts[0].id == "id4");
+        assert(filteredAccounts[0].accountType == "user");
+        assert(filteredAccounts[0].tokens == 400);
+        assert(filteredAccounts[1].id == "id3");
+        assert(filteredAccounts[1].accountType == "user");
+        assert(filteredAccounts[1].tokens == 300);
+    }
+    // Test Case 6: Streaming ingestion of newline-delimited JSON. Blank and malformed lines are skipped.
+    {
+        AccountManager accountManager("account_updates_stream.jsonl", IngestMode::Streaming);
+        assert(accountManager.accountIndexer.size() == 2);
+        assert(accountManager.accountIndexer.contains("account1", 3));
+        assert(accountManager.accountIndexer.contains("account2", 1));
+    }
+    // Test Case 7: Streaming ingestion of a top-level JSON array gives the same index as batch ingestion
+    {
+        AccountManager accountManager("multi_account_multi_version_indexing.json", IngestMode::Streaming);
+        assert(accountManager.accountIndexer.size() == 2);
+        assert(accountManager.accountIndexer.contains("account1", 3));
+        assert(accountManager.accountIndexer.contains("account2", 1));
+    }
+    // Test Case 8: The number of highest token value accounts kept per type is configurable, and an
+    // account already in the top K is updated in place by a newer version
+    {
+        AccountManager accountManager(2);
+        accountManager.processAccountUpdates("multi_accounts_to_be_filtered.json");
+        const AccountIndexer &indexer = accountManager.accountIndexer;
+        const TopKAccounts &userTopK = *indexer.findHighestTokenAccounts("user");
+        assert(userTopK.size() == 2);
+        assert(userTopK.getCapacity() == 2);
+        vector<TopKEntry> topUsers = userTopK.sortedEntries();
+        assert(indexer.getAccountId(topUsers[0].id) == "id4" && topUsers[0].tokens == 400);
+        assert(indexer.getAccountId(topUsers[1].id) == "id3" && topUsers[1].tokens == 300);
+        assert(userTopK.find(indexer.findAccountId("id1")) == nullptr);
+
+        accountManager.processAccountUpdates("multi_account_updates_with_callback.json");
+        const TopKAccounts &type1TopK = *indexer.findHighestTokenAccounts("type1");
+        IdHandle account1 = indexer.findAccountId("account1");
+        assert(type1TopK.size() == 2);
+        assert(type1TopK.find(account1)->version == 2);
+        assert(type1TopK.find(account1)->tokens == 150);
+        assert(indexer.getAccountId(type1TopK.sortedEntries()[0].id) == "account3");
+    }
+    // Test Case 9: Updates are checked against the latest indexed version of their id even after the account
+    // has dropped out of the top K. Stale versions are rejected and superseded versions are retired.
+    {
+        AccountManager accountManager("account_superseded_outside_top_k.json");
+        const AccountIndexer &indexer = accountManager.accountIndexer;
+        assert(indexer.size() == 4);
+        assert(!indexer.contains("account1", 1));
+        assert(indexer.contains("account1", 2));
+        assert(indexer.findLatestAccount("account1")->version == 2);
+        assert(indexer.findLatestAccount("account1")->tokens == 50);
+        assert(indexer.findLatestAccount("account3")->tokens == 300);
+        assert(indexer.findLatestAccount("account5") == nullptr);
+    }
+    // Test Case 10: Range queries are answered from the token-ordered secondary indexes, in descending token order
+    // across all types as well as within one type, and the top K of a type is backfilled when a member drops out
+    {
+        AccountManager accountManager("multi_accounts_to_be_filtered.json");
+        vector<Account> allTypes = accountManager.searchAndFilterAccounts("", 150, 1000);
+        assert(allTypes.size() == 3);
+        assert(allTypes[0].id == "id4" && allTypes[1].id == "id3" && allTypes[2].id == "id2");
+        assert(accountManager.searchAndFilterAccounts("user", 401).empty());
+        assert(accountManager.searchAndFilterAccounts("unknown").empty());
+        assert(accountManager.searchAndFilterAccounts("user", 300, 300).size() == 1);
+        assert(accountManager.searchAndFilterAccounts().size() == 4);
+
+        AccountIndexer &indexer = accountManager.accountIndexer;
+        indexer.removeAccount("id4", 4);
+        const TopKAccounts &userTopK = *indexer.findHighestTokenAccounts("user");
+        assert(userTopK.size() == 2);
+        accountManager.processAccountUpdates("lower_token_user_accounts.json");
+        assert(userTopK.size() == 3);
+        vector<TopKEntry> topUsers = userTopK.sortedEntries();
+        assert(indexer.getAccountId(topUsers[0].id) == "id3");
+        assert(indexer.getAccountId(topUsers[1].id) == "id5");
+        assert(indexer.getAccountId(topUsers[2].id) == "id6");
+        indexer.removeAccount("id3", 3);
+        topUsers = userTopK.sortedEntries();
+        assert(topUsers.size() == 3 && indexer.getAccountId(topUsers[2].id) == "id1");
+    }
+    // Test Case 11: Queries return lazy views into the index, with offset/limit and cursor pagination
+    {
+        AccountManager accountManager("multi_accounts_to_be_filtered.json");
+        AccountView firstPage = accountManager.queryAccounts("", numeric_limits<int>::min(), numeric_limits<int>::max(), 0, 2);
+        assert(firstPage.size() == 2);
+        AccountRef last = *(++firstPage.begin());
+        assert(&last.get() == accountManager.accountIndexer.findAccount("id3", 3));
+
+        AccountView secondPage = accountManager.queryAccountsAfter(AccountCursor(last), "", numeric_limits<int>::min(), numeric_limits<int>::max(), 2);
+        vector<string> ids;
+        for (const AccountRef &account : secondPage) ids.push_back(account.id());
+        assert(ids.size() == 2 && ids[0] == "id2" && ids[1] == "id1");
+        assert(accountManager.queryAccountsAfter(AccountCursor(*secondPage.begin()), "user", 0, 1000, 10).size() == 1);
+
+        AccountView offsetPage = accountManager.queryAccounts("user", 0, 1000, 1);
+        assert(offsetPage.size() == 2 && offsetPage.begin()->id() == "id3");
+        assert(accountManager.queryAccounts("user", 0, 1000, 5).empty());
+        assert(accountManager.queryAccounts("user", 0, 1000, 0, 0).empty());
+    }
+    // Test Case 12: Account ids and types are interned once, and the index works on their handles
+    {
+        AccountManager accountManager("multi_account_updates_with_callback.json");
+        const AccountIndexer &indexer = accountManager.accountIndexer;
+        assert(indexer.getSymbols().ids.size() == 3);
+        assert(indexer.getAccountTypeCount() == 2);
+        IdHandle account1 = indexer.findAccountId("account1");
+        assert(account1 != kInvalidHandle && indexer.getAccountId(account1) == "account1");
+        assert(indexer.findAccountId("account4") == kInvalidHandle);
+        const IndexedAccount *latest = indexer.findLatestAccount(account1);
+        assert(latest->version == 2 && indexer.getAccountType(latest->accountType) == "type1");
+    }
+    // Test Case 13: Account data is decoded into the compact sorted field array, inline for small field sets
+    {
+        AccountManager accountManager("single_account_update.json");
+        const IndexedAccount *account = accountManager.accountIndexer.findLatestAccount("GzbXUY1JQwRVUf3j3myg2NbDRwD5i4jD4HJpYhVNfiDm");
+        assert(account->data.size() == 2 && account->data.isInline());
+        assert(account->data.at("subtype_field1") == 1);
+        assert(account->data.at("subtype_field2") == 999);
+        assert(account->data.count("subtype_field3") == 0);
+
+        AccountData many;
+        for (int i = 9; i >= 0; --i) many.set("field" + to_string(i), i);
+        assert(many.size() == 10 && !many.isInline());
+        assert(many.at("field7") == 7);
+        AccountData copied = many;
+        AccountData moved = std::move(copied);
+        assert(moved == many && moved.toMap().size() == 10);
+        assert(AccountData::fromMap(account->data.toMap()) == account->data);
+    }
+    // Test Case 14: Pending callbacks hold only a deadline and an account handle, and are resolved against the
+    // indexer when they fire. A superseded version's callback is cancelled.
+    {
+        AccountManager accountManager("account_replaced_by_higher_token.json");
+        assert(sizeof(ScheduledCallback) <= 16);
+        assert(accountManager.callbackManager.size() == 1);
+        accountManager.callbackManager.fireCallbacks(chrono::system_clock::now() + chrono::hours(1));
+        assert(accountManager.callbackManager.size() == 0);
+    }
+    // Test Case 15: The timing wheel fires callbacks on the first tick at or after their deadline, across
+    // all wheel levels, and can back a CallbackManager in place of the binary heap
+    {
+        chrono::system_clock::time_point origin = chrono::system_clock::now();
+        TimingWheelCallbackScheduler wheel(origin);
+        wheel.schedule(ScheduledCallback{origin + chrono::milliseconds(5), 0, 1});
+        wheel.schedule(ScheduledCallback{origin + chrono::milliseconds(300), 1, 1});
+        wheel.schedule(ScheduledCallback{origin + chrono::seconds(20), 2, 1});
+        wheel.schedule(ScheduledCallback{origin + chrono::hours(2), 3, 1});
+        wheel.schedule(ScheduledCallback{origin + chrono::hours(30), 4, 1});
+        wheel.schedule(ScheduledCallback{origin + chrono::milliseconds(400), 5, 1});
+        assert(wheel.cancel(5) && !wheel.cancel(5));
+        assert(wheel.size() == 5);
+        assert(wheel.isPending(4, 1) && !wheel.isPending(4, 2) && !wheel.isPending(5, 1) && !wheel.isPending(99, 1));
+
+        vector<ScheduledCallback> due;
+        wheel.expire(origin + chrono::milliseconds(4), due);
+        assert(due.empty());
+        wheel.expire(origin + chrono::milliseconds(5), due);
+        assert(due.size() == 1 && due[0].id == 0);
+        wheel.expire(origin + chrono::seconds(20) - chrono::milliseconds(1), due);
+        assert(due.size() == 2 && due[1].id == 1);
+        wheel.expire(origin + chrono::seconds(20), due);
+        assert(due.size() == 3 && due[2].id == 2);
+        wheel.expire(origin + chrono::hours(2), due);
+        assert(due.size() == 4 && due[3].id == 3);
+        wheel.expire(origin + chrono::hours(31), due);
+        assert(due.size() == 5 && due[4].id == 4 && wheel.size() == 0);
+
+        AccountManager accountManager(3, SchedulerType::TimingWheel);
+        accountManager.processAccountUpdates("multi_account_updates_with_callback.json");
+        assert(accountManager.callbackManager.size() == 3);
+        accountManager.callbackManager.fireCallbacks(chrono::system_clock::now() + chrono::seconds(2));
+        assert(accountManager.callbackManager.size() == 0);
+    }
+    // Test Case 16: The 4-ary heap keeps every callback's position through sifts, so cancelling or
+    // rescheduling any pending callback affects exactly that one and deadline order is preserved
+    {
+        chrono::system_clock::time_point origin = chrono::system_clock::now();
+        HeapCallbackScheduler heap;
+        for (IdHandle id = 0; id < 50; ++id) {
+            heap.schedule(ScheduledCallback{origin + chrono::milliseconds((id * 37) % 50), id, 1});
+        }
+        for (IdHandle id = 0; id < 50; id += 3) {
+            assert(heap.cancel(id));
+        }
+        assert(!heap.cancel(0) && heap.size() == 33);
+        // Move a callback earlier and one later, in place
+        assert(heap.reschedule(ScheduledCallback{origin - chrono::milliseconds(1), 49, 2}));
+        assert(heap.reschedule(ScheduledCallback{origin + chrono::milliseconds(100), 1, 2}));
+        assert(!heap.reschedule(ScheduledCallback{origin + chrono::milliseconds(60), 0, 2}));
+        assert(heap.size() == 34);
+        assert(heap.isPending(49, 2) && !heap.isPending(49, 1) && !heap.isPending(3, 1) && heap.isPending(2, 1));
+
+        vector<ScheduledCallback> due;
+        heap.expire(origin + chrono::milliseconds(200), due);
+        assert(due.size() == 34 && heap.size() == 0);
+        assert(due.front().id == 49 && due.front().version == 2);
+        assert(due.back().id == 1 && due.back().version == 2);
+        for (size_t i = 1; i < due.size(); ++i) {
+            assert(due[i - 1].deadline <= due[i].deadline);
+            assert(due[i].id % 3 != 0 || due[i].id == 0);
+        }
+
+        AccountManager accountManager("account_replaced_by_higher_token.json");
+        assert(accountManager.callbackManager.size() == 1);
+    }
+    // Test Case 17: The dispatcher thread fires callbacks at their deadlines without polling, wakes early
+    // for an earlier schedule, and drains the pending callbacks when stopped
+    {
+        AccountManager accountManager(3);
+        accountManager.startCallbackDispatcher();
+        assert(accountManager.callbackManager.isDispatching());
+        accountManager.processAccountUpdates("multi_account_updates_with_callback.json");
+        accountManager.stopCallbackDispatcher();
+        assert(!accountManager.callbackManager.isDispatching());
+        assert(accountManager.callbackManager.size() == 0);
+
+        const IndexedAccount *account1 = accountManager.accountIndexer.findLatestAccount("account1");
+        const IndexedAccount *account2 = accountManager.accountIndexer.findLatestAccount("account2");
+        mutex firedMutex;
+        condition_variable firedSignal;
+        vector<IdHandle> firedIds;
+        accountManager.callbackManager.setSink(make_shared<FunctionCallbackSink>(
+            [&firedMutex, &firedSignal, &firedIds](const vector<FiredCallback> &batch) {
+                lock_guard<mutex> guard(firedMutex);
+                for (const FiredCallback &callback : batch) firedIds.push_back(callback.id);
+                firedSignal.notify_all();
+            }));
+        accountManager.startCallbackDispatcher();
+        accountManager.callbackManager.scheduleCallback(*account1, chrono::system_clock::now() + chrono::hours(1));
+        accountManager.callbackManager.scheduleCallback(*account2, chrono::system_clock::now() + chrono::milliseconds(10));
+        {
+            unique_lock<mutex> guard(firedMutex);
+            assert(firedSignal.wait_for(guard, chrono::seconds(30), [&firedIds]() { return !firedIds.empty(); }));
+            assert(firedIds.size() == 1 && firedIds[0] == account2->id);
+        }
+        assert(accountManager.callbackManager.size() == 1);
+        accountManager.stopCallbackDispatcher(false);
+        assert(accountManager.callbackManager.size() == 1);
+
+        // Destroying a manager with the dispatcher running does not wait for the hour-long callback
+        chrono::steady_clock::time_point destroying = chrono::steady_clock::now();
+        {
+            AccountManager dispatched(3);
+            dispatched.callbackManager.setSink(nullptr);
+            dispatched.startCallbackDispatcher();
+            dispatched.ingestAccount(Account("later", "stake", 1, 3600000, AccountData(), 1));
+        }
+        assert(chrono::steady_clock::now() - destroying < chrono::minutes(1));
+    }
+    // Test Case 18: Fired callbacks are delivered to the configured sink in batches, and a queued sink
+    // applies its backpressure policy instead of stalling the firing thread
+    {
+        vector<FiredCallback> delivered;
+        size_t batches = 0;
+        AccountManager accountManager(3);
+        accountManager.callbackManager.setSink(make_shared<FunctionCallbackSink>(
+            [&delivered, &batches](const vector<FiredCallback> &batch) {
+                delivered.insert(delivered.end(), batch.begin(), batch.end());
+                ++batches;
+            }));
+        accountManager.processAccountUpdates("multi_account_updates_with_callback.json");
+        accountManager.callbackManager.fireCallbacks(chrono::system_clock::now() + chrono::hours(1));
+        assert(delivered.size() == 3 && batches == 1);
+        for (size_t i = 1; i < delivered.size(); ++i) {
+            assert(delivered[i - 1].deadline <= delivered[i].deadline);
+        }
+        const IndexedAccount *account1 = accountManager.accountIndexer.findLatestAccount("account1");
+        bool firedLatest = false;
+        for (const FiredCallback &callback : delivered) {
+            assert(*callback.accountId == accountManager.accountIndexer.getAccountId(callback.id));
+            if (callback.id == account1->id) firedLatest = callback.version == 2;
+        }
+        assert(firedLatest);
+
+        // The index is unlocked while a sink delivers, so a sink that stalls the dispatcher does not stall ingest
+        {
+            AccountManager dispatched(3);
+            mutex gate;
+            atomic<bool> entered(false);
+            string firedId;
+            unique_lock<mutex> held(gate);
+            dispatched.callbackManager.setSink(make_shared<FunctionCallbackSink>(
+                [&gate, &entered, &firedId](const vector<FiredCallback> &batch) {
+                    firedId = *batch[0].accountId;
+                    entered = true;
+                    lock_guard<mutex> guard(gate);
+                }));
+            dispatched.startCallbackDispatcher();
+            dispatched.ingestAccount(Account("stalled", "stake", 1, 0, AccountData(), 1));
+            while (!entered) this_thread::yield();
+            for (int i = 0; i < 100; ++i) {
+                dispatched.ingestAccount(Account("during" + to_string(i), "stake", i, 60000, AccountData(), 1));
             }
-            else {
-                callbacks.pop_back();
-            }
-        }
-
-    public:
-        /**
-         * Schedule a callback for the given account at the specified time.
-         * @param account The account associated with the callback.
-         * @param callbackTime The time at which the callback should be triggered.
-         */
-        void scheduleCallback(const Account &account, chrono::system_clock::time_point callbackTime) {
-            callbacks.emplace_back(callbackTime, account);
-            updateIndexMap(account, callbacks.size() - 1);
-            std::push_heap(callbacks.begin(), callbacks.end(), AccountTimeComparator());
-        }
-
-        /**
-         * Cancel the callback associated with the given account.
-         * @param account The account for which the callback should be canceled.
-         */
-        void cancelCallback(const Account& account) {
-            cout<<account.id<<endl;
-            auto it = indexMap.find(account.id);
-            if (it != indexMap.end()) {
-                int index = it->second;
-                indexMap.erase(it);
-                removeAtIndex(index);
-            }
-        }
-
-        /**
-         * Fire the callbacks that have reached or passed the current time.
-         * @param currentTime The current time.
-         */
-        void fireCallbacks(std::chrono::system_clock::time_point currentTime) {
-            while (!callbacks.empty() && callbacks.front().first <= currentTime) {
-                const Account &account = callbacks.front().second;
-                std::cout << "Callback fired for Account " << account.id << " v" << account.version << std::endl;
-                std::pop_heap(callbacks.begin(), callbacks.end());
-                callbacks.pop_back();
-                indexMap.erase(account.id);
-            }
-        }
-};
-
-// AccountIndexer class is used to manage indexing of account updates
-class AccountIndexer {
-    private:
-        unordered_map<string, priority_queue<
-            Account, 
-            vector<Account>, 
-            AccountTokenComparator>
-        > highestTokenAccounts;
-
-    public:
-        unordered_map<AccountKey, Account, AccountKeyHash> indexedAccounts;
-
-        /**
-         * Index the given account.
-         * @param account The account to be indexed.
-         */
-        void indexAccount(const Account &account) {
-            indexedAccounts[{account.id, account.version}] = account;
-            cout << "Account " << account.id << " v" << account.version << " has been indexed." << endl;
-        }
-
-        /**
-         * Remove the given account from the index.
-         * @param account The account to be removed.
-         */
-        void removeAccount(const Account &account) {
-            indexedAccounts.erase({account.id, account.version});
-        }
-
-        /**
-         * Get the map of highest token value accounts for each account type.
-         * @return The map of highest token value accounts.
-         */
-        unordered_map<string, priority_queue<Account, vector<Account>, AccountTokenComparator>> &getHighestTokenAccounts() {
-            return highestTokenAccounts;
-        }
-};
-
-class AccountManager {
-    public:
-        CallbackManager callbackManager;
-        AccountIndexer accountIndexer;
-
-        AccountManager() = default; // Add default constructor
-        /**
-         * Construct an AccountManager and process the account updates from the given file.
-         * @param filename The name of the file containing the account updates.
-         */
-        AccountManager(const string &filename) {
-            processAccountUpdates(filename);
-        }
-
-        /**
-         * Process the account updates from the given file.
-         * @param filename The name of the file containing the account updates.
-         */
-        void processAccountUpdates(const string &filename) {
-            ifstream file(filename);
-            if (!file.is_open()) {
-                cerr << "Failed to open the file: " << filename << endl;
-                return;
-            }
-
-            string fileContents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-            json jsonAccounts;
-            try {
-                jsonAccounts = json::parse(fileContents);
-            }
-            catch (const json::parse_error &e) {
-                std::cerr << "Error parsing JSON: " << e.what() << std::endl;
-                file.close();
-                return;
-            }
-
-            file.close();
-
-            vector<Account> accountUpdates;
-            for (const auto &accountJson : jsonAccounts) {
-                Account account = parseAccountUpdate(accountJson);
-                accountUpdates.push_back(account);
-            }
-
-            for (const auto &account : accountUpdates) {
-                ingestAccountUpdate(account);
-                callbackManager.fireCallbacks(chrono::system_clock::now());
-            }
-
-            printHighestTokenValueAccounts();
-        }
-
-        /**
-         * Search and filter accounts based on the specified criteria.
-         * @param accountType The account type to filter by (optional).
-         * @param minTokens The minimum token value to filter by (optional).
-         * @param maxTokens The maximum token value to filter by (optional).
-         * @return A vector of filtered accounts.
-         */
-        vector<Account> searchAndFilterAccounts(
-            const string &accountType = "", 
-            int minTokens = numeric_limits<int>::min(), 
-            int maxTokens=numeric_limits<int>::max()
-        ) {
-            vector<Account> filteredAccounts;
-            for(const auto& pair: accountIndexer.indexedAccounts) {
-                const Account& account = pair.second;
-                
-                // Apply filters
-                if(!accountType.empty() && account.accountType!=accountType) continue;
-                if(account.tokens < minTokens || account.tokens > maxTokens) continue;
- 
-                // Account meets filter criteria
-                filteredAccounts.push_back(account);
-            }
-            return filteredAccounts;
-        }
-
-    private: 
-        /**
-         * Parse the account update from the given JSON object.
-         * @param accountJson The JSON object representing an account update.
-         * @return The parsed Account object.
-         */
-        Account parseAccountUpdate(const json &accountJson) {
-            string id = accountJson["id"];
-            string accountType = accountJson["accountType"];
-            int tokens = accountJson["tokens"];
-            int callbackTimeMs = accountJson["callbackTimeMs"];
-            unordered_map<string, int> data = accountJson["data"];
-            int version = accountJson["version"];
-            return Account(id, accountType, tokens, callbackTimeMs, data, version);
-        }
-
-        /**
-         * Ingest the account update by indexing it, updating the highest token accounts, and scheduling a callback if necessary.
-         * @param account The account to be ingested.
-         */
-        void ingestAccountUpdate(const Account &account) {
-            AccountKey key = {account.id, account.version};
-            auto &highestTokens = accountIndexer.getHighestTokenAccounts();
-            auto it = highestTokens.find(account.accountType);
-            if (it != highestTokens.end()) {
-                priority_queue<Account, vector<Account>, AccountTokenComparator> &tokenAccounts = it->second;
-                bool accountFound = false;
-                auto jt = tokenAccounts;
-                // p.s. priority_queue doesn't natively support find_if() method, so I have implemented the 
-                // iteration to find the relevant account in the queue, remove it and heapify
-                while (!jt.empty()) {
-                    if (jt.top().id == account.id) {
-                        accountFound = true;
-                        break;
-                    }
-                    jt.pop();
+            assert(dispatched.accountIndexer.size() == 101 && firedId == "stalled");
+            held.unlock();
+            dispatched.stopCallbackDispatcher(false);
+        }
+
+        // A worker held up by the gate leaves room for two records; the rest are dropped or spilled
+        const BackpressurePolicy policies[] = {BackpressurePolicy::Drop, BackpressurePolicy::Spill};
+        for (BackpressurePolicy policy : policies) {
+            mutex gate;
+            atomic<bool> entered(false);
+            atomic<int> handled(0);
+            unique_lock<mutex> held(gate);
+            uint64_t dropped = 0, spilled = 0;
+            {
+                const string id = "queued";
+                QueuedCallbackSink sink([&gate, &entered, &handled](const FiredCallback &) {
+                    entered = true;
+                    lock_guard<mutex> guard(gate);
+                    ++handled;
+                }, 2, 1, policy);
+                vector<FiredCallback> batch(1, FiredCallback{0, &id, 1, chrono::system_clock::now()});
+                sink.deliver(batch);
+                while (!entered) this_thread::yield();
+                batch.assign(4, batch[0]);
+                sink.deliver(batch);
+                dropped = sink.getDroppedCount();
+                spilled = sink.getSpilledCount();
+                held.unlock();
+            }
+            if (policy == BackpressurePolicy::Drop) assert(dropped == 2 && spilled == 0 && handled == 3);
+            else assert(dropped == 0 && spilled == 2 && handled == 5);
+        }
+    }
+    // Test Case 19: Ingest sharded by account id gives the same accounts, versions and highest token
+    // value accounts as a single AccountManager, whatever the shard count
+    {
+        const char *files[] = {"account_superseded_outside_top_k.json", "multi_accounts_to_be_filtered.json",
+                               "multi_account_multi_version_indexing.json"};
+        for (const char *file : files) {
+            AccountManager single(3);
+            single.processAccountUpdates(file);
+            vector<Account> expected = single.searchAndFilterAccounts();
+            sort(expected.begin(), expected.end(), [](const Account &a, const Account &b) {
+                return a.tokens != b.tokens ? a.tokens > b.tokens : a.id < b.id;
+            });
+
+            const size_t shardCounts[] = {1, 3, 8};
+            for (size_t shardCount : shardCounts) {
+                ShardedAccountManager sharded(shardCount, 3, SchedulerType::BinaryHeap, 2);
+                sharded.processAccountUpdates(file);
+                assert(sharded.getShardCount() == shardCount);
+                assert(sharded.size() == single.accountIndexer.size());
+
+                vector<Account> accounts = sharded.searchAndFilterAccounts();
+                assert(accounts.size() == expected.size());
+                for (size_t i = 0; i < accounts.size(); ++i) {
+                    assert(accounts[i].id == expected[i].id && accounts[i].version == expected[i].version);
+                    assert(sharded.shardOf(accounts[i].id) < shardCount);
                 }
-                if (accountFound) {
-                    if (account.version <= jt.top().version)
-                        return;
-                    callbackManager.cancelCallback(jt.top());
-                    accountIndexer.removeAccount(jt.top());
-                    tokenAccounts = removeAccountFromPriorityQueue(tokenAccounts, account);
+
+                for (const string &accountType : sharded.getAccountTypes()) {
+                    vector<TopKEntry> singleTop = single.accountIndexer.getHighestTokenAccounts(
+                        single.accountIndexer.getSymbols().types.find(accountType)).sortedEntries();
+                    vector<ShardedTopKEntry> shardedTop = sharded.getHighestTokenAccounts(accountType);
+                    assert(shardedTop.size() == singleTop.size());
+                    for (size_t i = 0; i < shardedTop.size(); ++i) {
+                        assert(shardedTop[i].tokens == singleTop[i].tokens);
+                        assert(shardedTop[i].version == single.accountIndexer.findLatestAccount(shardedTop[i].id)->version);
+                    }
                 }
             }
+        }
+    }
+    // Test Case 20: Pipelined ingest parses on a thread of its own and ingests the same updates, in order,
+    // as a single threaded run, and counts the updates through each stage
+    {
+        const char *files[] = {"multi_account_multi_version_indexing.json", "account_updates_stream.jsonl",
+                               "account_superseded_outside_top_k.json"};
+        for (const char *file : files) {
+            AccountManager streamed(3);
+            streamed.processAccountUpdates(file, IngestMode::Streaming);
+            AccountManager pipelined(3);
+            pipelined.processAccountUpdates(file, IngestMode::Pipelined);
+
+            vector<Account> expected = streamed.searchAndFilterAccounts();
+            vector<Account> accounts = pipelined.searchAndFilterAccounts();
+            assert(accounts.size() == expected.size() && accounts.size() > 0);
+            for (size_t i = 0; i < accounts.size(); ++i) {
+                assert(accounts[i].id == expected[i].id && accounts[i].version == expected[i].version);
+            }
 
-            accountIndexer.indexAccount(account);
+            const IngestPipelineStats &stats = pipelined.getPipelineStats();
+            assert(stats.parse.items == stats.ingest.items && stats.ingest.items >= accounts.size());
+            assert(stats.parse.throughput() > 0 && stats.ingest.throughput() > 0);
+        }
 
-            priority_queue<Account, vector<Account>, AccountTokenComparator> &highestTokensForType = highestTokens[account.accountType];
-            highestTokensForType = insertAccountIntoPriorityQueue(highestTokensForType, account);
-            if (highestTokensForType.size() > 3) {
-                highestTokensForType.pop();
+        AccountManager missing(3);
+        missing.processAccountUpdates("no_such_file.json", IngestMode::Pipelined);
+        assert(missing.accountIndexer.size() == 0 && missing.getPipelineStats().parse.items == 0);
+    }
+    // Test Case 21: Readers on other threads query published snapshots while ingest runs, and always see
+    // one consistent version per account; unchanged account types are shared between snapshots
+    {
+        AccountManager accountManager(3);
+        assert(accountManager.getSnapshot()->size() == 0);
+        accountManager.enableSnapshots(1);
+
+        atomic<bool> ingesting(true);
+        atomic<bool> consistent(true);
+        thread reader([&accountManager, &ingesting, &consistent]() {
+            uint64_t lastSequence = 0;
+            while (ingesting) {
+                shared_ptr<const AccountSnapshot> snapshot = accountManager.getSnapshot();
+                vector<Account> accounts = snapshot->searchAndFilterAccounts();
+                vector<string> ids;
+                for (const Account &account : accounts) ids.push_back(account.id);
+                sort(ids.begin(), ids.end());
+                if (adjacent_find(ids.begin(), ids.end()) != ids.end()) consistent = false;
+                if (accounts.size() != snapshot->size() || snapshot->getSequence() < lastSequence) consistent = false;
+                lastSequence = snapshot->getSequence();
             }
+        });
+        accountManager.processAccountUpdates("multi_account_multi_version_indexing.json");
+        accountManager.processAccountUpdates("account_superseded_outside_top_k.json");
+        ingesting = false;
+        reader.join();
+        assert(consistent);
 
-            chrono::milliseconds delay(account.callbackTimeMs + getRandomDelay());
-            chrono::system_clock::time_point callbackTime = chrono::system_clock::now() + delay;
-            callbackManager.scheduleCallback(account, callbackTime);
+        shared_ptr<const AccountSnapshot> snapshot = accountManager.getSnapshot();
+        vector<Account> expected = accountManager.searchAndFilterAccounts();
+        vector<Account> accounts = snapshot->searchAndFilterAccounts();
+        assert(accounts.size() == expected.size());
+        for (size_t i = 0; i < accounts.size(); ++i) {
+            assert(accounts[i].id == expected[i].id && accounts[i].version == expected[i].version);
+            assert(accounts[i].accountType == expected[i].accountType && accounts[i].data == expected[i].data);
+        }
+        for (TypeHandle type = 0; type < accountManager.accountIndexer.getAccountTypeCount(); ++type) {
+            const string &accountType = accountManager.accountIndexer.getAccountType(type);
+            vector<TopKEntry> top = accountManager.accountIndexer.getHighestTokenAccounts(type).sortedEntries();
+            vector<SnapshotTopKEntry> snapshotTop = snapshot->getHighestTokenAccounts(accountType);
+            assert(top.size() == snapshotTop.size());
+            for (size_t i = 0; i < top.size(); ++i) {
+                assert(top[i].tokens == snapshotTop[i].tokens && top[i].version == snapshotTop[i].version);
+            }
+            assert(snapshot->searchAndFilterAccounts(accountType, 150, 400).size() ==
+                   accountManager.searchAndFilterAccounts(accountType, 150, 400).size());
         }
 
-        /**
-         * Get a random delay in milliseconds.
-         * @return The random delay.
-         */
-        int getRandomDelay() {
-            std::random_device rd;
-            std::mt19937 gen(rd());
-            std::uniform_int_distribution<> dis(0, 1000);
-            int delay = dis(gen);
+        // Ingesting an account of a new type adds its segment and shares the unchanged ones
+        accountManager.processAccountUpdates("single_account_update.json");
+        shared_ptr<const AccountSnapshot> next = accountManager.getSnapshot();
+        assert(next->getAccountTypeCount() == snapshot->getAccountTypeCount() + 1);
+        for (TypeHandle type = 0; type < snapshot->getAccountTypeCount(); ++type) {
+            assert(&snapshot->getSegment(type) == &next->getSegment(type));
+        }
+        assert(snapshot->size() + 1 == next->size());
+        assert(next->searchAndFilterAccounts("escrow").size() == 1);
+    }
+    // Test Case 22: The schema-aware parser decodes updates exactly like the nlohmann path, and gives up
+    // on anything outside the fixed schema so that the nlohmann path decides
+    {
+        const char *files[] = {"account_updates.json", "multi_account_multi_version_indexing.json",
+                               "account_superseded_outside_top_k.json", "single_account_update.json"};
+        for (const char *file : files) {
+            ifstream input(file);
+            string contents((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+            vector<Account> fast;
+            assert(AccountUpdateParser::parseArray(contents, fast));
+            json parsed = json::parse(contents);
+            assert(fast.size() == parsed.size());
+            for (size_t i = 0; i < fast.size(); ++i) {
+                Account slow = AccountUpdateReader::parseAccountUpdate(parsed[i]);
+                assert(fast[i].id == slow.id && fast[i].accountType == slow.accountType);
+                assert(fast[i].tokens == slow.tokens && fast[i].callbackTimeMs == slow.callbackTimeMs);
+                assert(fast[i].version == slow.version && fast[i].data == slow.data);
+            }
+        }
+
+        Account account;
+        assert(AccountUpdateParser::parse(" {\"version\": 2, \"id\": \"a\\\"b\", \"accountType\": \"t\", \"tokens\": -5, "
+                                          "\"callbackTimeMs\": 0, \"data\": {\"y\": 1, \"x\": 2}} ", account));
+        assert(account.id == "a\"b" && account.tokens == -5 && account.version == 2);
+        assert(account.data.size() == 2 && account.data.at("x") == 2 && account.data.at("y") == 1);
+        assert(AccountUpdateParser::parse("{\"id\": \"a\", \"accountType\": \"t\", \"tokens\": 1, "
+                                          "\"callbackTimeMs\": 0, \"data\": {}, \"version\": 1}", account));
+        assert(account.data.empty());
 
-            return delay;
+        const char *fallbacks[] = {
+            "{\"id\": \"a\", \"accountType\": \"t\", \"tokens\": 1, \"callbackTimeMs\": 0, \"data\": {}}",
+            "{\"id\": \"a\", \"accountType\": \"t\", \"tokens\": 1.5, \"callbackTimeMs\": 0, \"data\": {}, \"version\": 1}",
+            "{\"id\": \"a\", \"accountType\": \"t\", \"tokens\": 3000000000, \"callbackTimeMs\": 0, \"data\": {}, \"version\": 1}",
+            "{\"id\": \"\\u0041\", \"accountType\": \"t\", \"tokens\": 1, \"callbackTimeMs\": 0, \"data\": {}, \"version\": 1}",
+            "{\"id\": \"a\", \"accountType\": \"t\", \"tokens\": 1, \"callbackTimeMs\": 0, \"data\": {}, \"version\": 1, \"extra\": 0}",
+            "{\"id\": \"a\", \"accountType\": \"t\", \"tokens\": 01, \"callbackTimeMs\": 0, \"data\": {}, \"version\": 1}",
+            "{\"id\": \"a\", \"accountType\": \"t\", \"tokens\": 1, \"callbackTimeMs\": 0, \"data\": {}, \"version\": 1} x",
+            "{\"id\": \"a\", \"accountType\": \"t\", \"tokens\": 1, \"callbackTimeMs\": 0, \"data\": {}, \"version\": 1"
+        };
+        for (const char *text : fallbacks) {
+            assert(!AccountUpdateParser::parse(text, account));
         }
 
-        /**
-         * Print the highest token value accounts for each account type.
-         */
-        void printHighestTokenValueAccounts() {
-            for (const auto &pair : accountIndexer.getHighestTokenAccounts()) {
-                const string &accountType = pair.first;
-                const priority_queue<Account, vector<Account>, AccountTokenComparator> &tokenAccounts = pair.second;
+        // The NDJSON fixture has a malformed line, which still goes to nlohmann and is reported
+        AccountManager accountManager("account_updates_stream.jsonl", IngestMode::Streaming);
+        assert(accountManager.accountIndexer.size() > 0);
+    }
+    // Test Case 23: A columnar file converted from JSON replays to the same index as the JSON file, and a
+    // truncated or corrupt columnar file is rejected without ingesting anything
+    {
+        const char *files[] = {"account_updates.json", "multi_account_multi_version_indexing.json",
+                               "account_superseded_outside_top_k.json", "account_updates_stream.jsonl"};
+        for (const char *file : files) {
+            IngestMode mode = string(file).find(".jsonl") != string::npos ? IngestMode::Streaming : IngestMode::Batch;
+            string columnarFile = string("/tmp/") + file + ".acol";
+            assert(ColumnarAccountWriter::convert(file, columnarFile, mode) > 0);
+
+            AccountManager fromJson(3);
+            fromJson.processAccountUpdates(file, mode);
+            AccountManager fromColumnar(3);
+            assert(fromColumnar.replayColumnarFile(columnarFile));
 
-                cout << "Highest token value accounts for account type " << accountType << ":" << endl;
+            vector<Account> expected = fromJson.searchAndFilterAccounts();
+            vector<Account> replayed = fromColumnar.searchAndFilterAccounts();
+            assert(expected.size() == replayed.size() && !replayed.empty());
+            for (size_t i = 0; i < expected.size(); ++i) {
+                assert(expected[i].id == replayed[i].id && expected[i].accountType == replayed[i].accountType);
+                assert(expected[i].tokens == replayed[i].tokens && expected[i].version == replayed[i].version);
+                assert(expected[i].callbackTimeMs == replayed[i].callbackTimeMs && expected[i].data == replayed[i].data);
+            }
+            assert(fromJson.callbackManager.size() == fromColumnar.callbackManager.size());
+        }
 
-                priority_queue<Account, vector<Account>, AccountTokenComparator> temp = tokenAccounts;
-                while (!temp.empty()) {
-                    const Account &account = temp.top();
-                    cout << "Account " << account.id << " v" << account.version << ": Tokens - " << account.tokens << endl;
-                    temp.pop();
+        ifstream input("/tmp/account_updates.json.acol", ios::binary);
+        string contents((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+        string truncated = contents.substr(0, contents.size() - 16);
+        string badMagic = contents;
+        badMagic[0] = 'X';
+        // The id column follows the dictionaries; point its first row at a nonexistent id
+        string badIndex = contents;
+        const columnar::Header *header = reinterpret_cast<const columnar::Header *>(contents.data());
+        uint32_t outOfRange = header->idCount;
+        badIndex.replace(header->sections[columnar::kIdColumn].offset, sizeof(outOfRange),
+                         reinterpret_cast<const char *>(&outOfRange), sizeof(outOfRange));
+        const string *corrupt[] = {&truncated, &badMagic, &badIndex};
+        for (const string *bytes : corrupt) {
+            ofstream output("/tmp/corrupt.acol", ios::binary | ios::trunc);
+            output.write(bytes->data(), bytes->size());
+            output.close();
+            AccountManager accountManager(3);
+            assert(!accountManager.replayColumnarFile("/tmp/corrupt.acol"));
+            assert(accountManager.accountIndexer.size() == 0);
+        }
+        AccountManager accountManager(3);
+        assert(!accountManager.replayColumnarFile("no_such_file.acol"));
+    }
+    // Test Case 24: A checkpoint restores the index, the highest token value accounts and the pending
+    // callbacks at their wall clock deadlines, and can be written in the background while ingest continues
+    {
+        auto sameState = [](AccountManager &expected, AccountManager &restored) {
+            vector<Account> a = expected.searchAndFilterAccounts();
+            vector<Account> b = restored.searchAndFilterAccounts();
+            assert(a.size() == b.size());
+            for (size_t i = 0; i < a.size(); ++i) {
+                assert(a[i].id == b[i].id && a[i].accountType == b[i].accountType && a[i].tokens == b[i].tokens);
+                assert(a[i].version == b[i].version && a[i].callbackTimeMs == b[i].callbackTimeMs && a[i].data == b[i].data);
+            }
+            assert(expected.accountIndexer.getAccountTypeCount() == restored.accountIndexer.getAccountTypeCount());
+            for (TypeHandle type = 0; type < expected.accountIndexer.getAccountTypeCount(); ++type) {
+                const string &accountType = expected.accountIndexer.getAccountType(type);
+                assert(restored.accountIndexer.getAccountType(type) == accountType);
+                vector<TopKEntry> x = expected.accountIndexer.getHighestTokenAccounts(type).sortedEntries();
+                vector<TopKEntry> y = restored.accountIndexer.findHighestTokenAccounts(accountType)->sortedEntries();
+                assert(x.size() == y.size());
+                for (size_t i = 0; i < x.size(); ++i) {
+                    assert(expected.accountIndexer.getAccountId(x[i].id) == restored.accountIndexer.getAccountId(y[i].id));
+                    assert(x[i].version == y[i].version && x[i].tokens == y[i].tokens);
                 }
-                cout << endl;
             }
+            map<string, pair<int, chrono::system_clock::time_point>> pending;
+            for (const ScheduledCallback &callback : expected.callbackManager.pendingCallbacks()) {
+                pending[expected.accountIndexer.getAccountId(callback.id)] = make_pair(callback.version, callback.deadline);
+            }
+            vector<ScheduledCallback> restoredCallbacks = restored.callbackManager.pendingCallbacks();
+            assert(restoredCallbacks.size() == pending.size());
+            for (const ScheduledCallback &callback : restoredCallbacks) {
+                auto it = pending.find(restored.accountIndexer.getAccountId(callback.id));
+                assert(it != pending.end() && it->second == make_pair(callback.version, callback.deadline));
+            }
+        };
+
+        SchedulerType schedulers[] = {SchedulerType::BinaryHeap, SchedulerType::TimingWheel};
+        for (SchedulerType scheduler : schedulers) {
+            AccountManager accountManager(3, scheduler);
+            accountManager.processAccountUpdates("multi_account_multi_version_indexing.json");
+            accountManager.processAccountUpdates("account_superseded_outside_top_k.json");
+            AccountData data;
+            data.set("checkpointed", 1);
+            for (int i = 0; i < 20; ++i) {
+                accountManager.ingestAccount(Account("pending" + to_string(i), "escrow", 100 * i, 60000, data, 1));
+            }
+            assert(accountManager.callbackManager.size() >= 20);
+            assert(accountManager.checkpoint("/tmp/account_manager.ckpt"));
+
+            AccountManager restored(3, scheduler);
+            assert(restored.restoreCheckpoint("/tmp/account_manager.ckpt"));
+            sameState(accountManager, restored);
+            // A restored manager only accepts newer versions, and cannot be restored into again
+            restored.ingestAccount(Account("pending0", "escrow", 5, 60000, data, 1));
+            assert(restored.accountIndexer.findLatestAccount(restored.accountIndexer.findAccountId("pending0"))->tokens == 0);
+            assert(!restored.restoreCheckpoint("/tmp/account_manager.ckpt"));
+
+            // Restoring with another K ranks the accounts afresh
+            AccountManager reranked(1, scheduler);
+            assert(reranked.restoreCheckpoint("/tmp/account_manager.ckpt"));
+            assert(reranked.accountIndexer.findHighestTokenAccounts("escrow")->size() == 1);
+            assert(reranked.accountIndexer.findHighestTokenAccounts("escrow")->sortedEntries()[0].tokens == 1900);
         }
 
-        /**
-         * Insert the account into the priority queue while maintaining the descending order of tokens.
-         * @param pq The priority queue.
-         * @param account The account to be inserted.
-         * @return The updated priority queue.
-         */
-        priority_queue<Account, vector<Account>, AccountTokenComparator> insertAccountIntoPriorityQueue(priority_queue<Account, vector<Account>, AccountTokenComparator> pq, const Account &account) {
-            priority_queue<Account, vector<Account>, AccountTokenComparator> temp;
-            while (!pq.empty() && pq.top().tokens > account.tokens) {
-                temp.push(pq.top());
-                pq.pop();
+        // The background checkpoint holds the state as of startCheckpoint, whatever is ingested meanwhile
+        {
+            AccountManager accountManager(3);
+            accountManager.processAccountUpdates("account_updates.json");
+            AccountManager expected(3);
+            expected.processAccountUpdates("account_updates.json");
+            accountManager.startCheckpoint("/tmp/account_manager_background.ckpt");
+            AccountData data;
+            for (int i = 0; i < 50; ++i) {
+                accountManager.ingestAccount(Account("later" + to_string(i), "escrow", i, 60000, data, 1));
             }
-            temp.push(account);
-            while (!pq.empty()) {
-                temp.push(pq.top());
-                pq.pop();
+            assert(accountManager.waitForCheckpoint());
+            AccountManager restored(3);
+            assert(restored.restoreCheckpoint("/tmp/account_manager_background.ckpt"));
+            assert(restored.accountIndexer.size() == expected.accountIndexer.size());
+            assert(restored.accountIndexer.findAccountId("later0") == kInvalidHandle);
+        }
+
+        ifstream input("/tmp/account_manager.ckpt", ios::binary);
+        string contents((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+        string truncated = contents.substr(0, contents.size() / 2);
+        string badVersion = contents;
+        badVersion[12] = 9;
+        const string *corrupt[] = {&truncated, &badVersion};
+        for (const string *bytes : corrupt) {
+            ofstream output("/tmp/corrupt.ckpt", ios::binary | ios::trunc);
+            output.write(bytes->data(), bytes->size());
+            output.close();
+            AccountManager accountManager(3);
+            assert(!accountManager.restoreCheckpoint("/tmp/corrupt.ckpt"));
+            assert(accountManager.accountIndexer.size() == 0);
+        }
+    }
+    // Test Case 25: Updates are logged to the write-ahead log in group-committed batches, and recovery
+    // replays the log on top of the latest checkpoint, discarding a torn tail
+    {
+        auto sameAccounts = [](AccountManager &expected, AccountManager &recovered) {
+            vector<Account> a = expected.searchAndFilterAccounts();
+            vector<Account> b = recovered.searchAndFilterAccounts();
+            assert(a.size() == b.size() && !a.empty());
+            for (size_t i = 0; i < a.size(); ++i) {
+                assert(a[i].id == b[i].id && a[i].accountType == b[i].accountType && a[i].tokens == b[i].tokens);
+                assert(a[i].version == b[i].version && a[i].callbackTimeMs == b[i].callbackTimeMs && a[i].data == b[i].data);
             }
-            return temp;
+            assert(expected.callbackManager.size() == recovered.callbackManager.size());
+        };
+        const char *logFile = "/tmp/account_manager.wal";
+        const char *checkpointFile = "/tmp/account_manager_wal.ckpt";
+        remove(logFile);
+        remove(checkpointFile);
+
+        AccountManager accountManager(3);
+        // A long delay and large batches, so that only the size of the pending batch or a sync flushes it
+        assert(accountManager.enableWriteAheadLog(logFile, GroupCommitPolicy(1 << 12, chrono::microseconds(1000000))));
+        accountManager.processAccountUpdates("multi_account_multi_version_indexing.json");
+        AccountData data;
+        data.set("logged", 1);
+        for (int i = 0; i < 300; ++i) {
+            accountManager.ingestAccount(Account("wal" + to_string(i % 100), i % 2 ? "escrow" : "vault", i, 60000, data, i / 100 + 1));
+        }
+        assert(accountManager.checkpoint(checkpointFile));
+        for (int i = 0; i < 50; ++i) {
+            accountManager.ingestAccount(Account("wal" + to_string(i), "stake", 1000 + i, 60000, data, 10));
+        }
+        assert(accountManager.syncWriteAheadLog());
+        WriteAheadLogStats stats = accountManager.getWriteAheadLogStats();
+        assert(stats.records >= 350 && stats.batches >= 2 && stats.batches < stats.records);
+        assert(stats.maxBatchRecords > 1 && stats.averageBatchRecords() > 1.0);
+        assert(stats.fsyncLatencyPercentile(99) >= stats.fsyncLatencyPercentile(50));
+        assert(stats.fsyncLatencyPercentile(50).count() > 0);
+        accountManager.disableWriteAheadLog();
+
+        // The checkpoint plus the 50 updates logged after it
+        AccountManager recovered(3);
+        assert(recovered.recover(checkpointFile, logFile));
+        sameAccounts(accountManager, recovered);
+        assert(!recovered.recover(checkpointFile, logFile));
+
+        // The recovered manager goes on logging where the log left off, so the log alone replays to its state
+        recovered.ingestAccount(Account("wal0", "stake", 5000, 60000, data, 11));
+        assert(recovered.syncWriteAheadLog());
+        recovered.disableWriteAheadLog();
+        AccountManager replayed(3);
+        assert(replayed.recover("no_such_checkpoint.ckpt", logFile));
+        sameAccounts(recovered, replayed);
+        replayed.disableWriteAheadLog();
+
+        // A record torn by a crash ends the log, and is cut off when the log is reopened
+        ifstream input(logFile, ios::binary);
+        string contents((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+        input.close();
+        {
+            ofstream output(logFile, ios::binary | ios::app);
+            output.write(contents.data(), 20);
         }
+        AccountManager afterCrash(3);
+        assert(afterCrash.recover(checkpointFile, logFile));
+        sameAccounts(recovered, afterCrash);
+        afterCrash.disableWriteAheadLog();
+        ifstream repaired(logFile, ios::binary | ios::ate);
+        assert(static_cast<size_t>(repaired.tellg()) == contents.size());
 
-        /**
-         * Remove the account from the priority queue.
-         * @param pq The priority queue.
-         * @param account The account to be removed.
-         * @return The updated priority queue.
-         */
-        priority_queue<Account, vector<Account>, AccountTokenComparator> removeAccountFromPriorityQueue(priority_queue<Account, vector<Account>, AccountTokenComparator> pq, const Account &account) {
-            priority_queue<Account, vector<Account>, AccountTokenComparator> temp;
-            while (!pq.empty() && pq.top().id != account.id) {
-                temp.push(pq.top());
-                pq.pop();
+        // Once the log fails to write, updates it cannot take are rejected rather than applied unlogged
+        AccountManager unlogged(3);
+        unlogged.callbackManager.setSink(nullptr);
+        assert(unlogged.enableWriteAheadLog("/dev/full"));
+        assert(unlogged.ingestAccount(Account("full0", "vault", 1, 60000, data, 1)));
+        assert(!unlogged.syncWriteAheadLog());
+        assert(!unlogged.ingestAccount(Account("full1", "vault", 2, 60000, data, 1)));
+        vector<Account> rejected;
+        rejected.push_back(Account("full2", "vault", 3, 60000, data, 1));
+        rejected.push_back(Account("full3", "vault", 4, 60000, data, 1));
+        assert(!unlogged.ingestAccountUpdates(std::move(rejected)));
+        assert(!unlogged.replayColumnarFile("/tmp/account_updates.json.acol"));
+        assert(unlogged.accountIndexer.size() == 1 && unlogged.accountIndexer.findLatestAccount("full0"));
+        unlogged.disableWriteAheadLog();
+    }
+    // Test Case 26: The index nodes come from the indexer's node arena, and superseding versions reuses
+    // freed slots instead of taking more memory
+    {
+        AccountManager accountManager(3);
+        AccountData data;
+        data.set("pooled", 1);
+        for (int version = 1; version <= 2; ++version) {
+            for (int i = 0; i < 200; ++i) {
+                accountManager.ingestAccount(Account("pool" + to_string(i), i % 2 ? "escrow" : "vault", i * version, 60000, data, version));
             }
-            pq.pop(); // Remove the account
-            while (!pq.empty()) {
-                temp.push(pq.top());
-                pq.pop();
+        }
+        NodeArenaStats warm = accountManager.accountIndexer.getNodeArenaStats();
+        // One node in indexedAccounts and one in each of the two token indexes per account
+        assert(warm.liveSlots == 3 * accountManager.accountIndexer.size());
+        assert(warm.reuses > 0 && warm.slabs > 0);
+
+        for (int version = 3; version <= 20; ++version) {
+            for (int i = 0; i < 200; ++i) {
+                accountManager.ingestAccount(Account("pool" + to_string(i), i % 2 ? "escrow" : "vault", (i * version) % 97, 60000, data, version));
             }
-            return temp;
         }
-};
+        NodeArenaStats churned = accountManager.accountIndexer.getNodeArenaStats();
+        assert(accountManager.accountIndexer.size() == 200 && churned.liveSlots == warm.liveSlots);
+        assert(churned.slabs == warm.slabs && churned.reservedBytes == warm.reservedBytes);
+        assert(churned.reuses >= warm.reuses + 18 * 200 * 3);
+        assert(accountManager.searchAndFilterAccounts("vault").size() == 100);
 
-int main() {
-    // Test Case 1: Single Account Update
+        {
+            NodeArena arena;
+            PoolAllocator<int> allocator(arena);
+            vector<int, PoolAllocator<int>> large(1000, 7, allocator);
+            less<int> order;
+            set<int, less<int>, PoolAllocator<int>> small(order, allocator);
+            for (int i = 0; i < 100; ++i) small.insert(i);
+            // The vector's array is not a single object, so only the set's nodes are pooled
+            assert(arena.getStats().liveSlots == 100 && large.size() == 1000);
+            small.clear();
+            assert(arena.getStats().liveSlots == 0 && arena.getStats().allocations == 100);
+        }
+    }
+    // Test Case 27: Moved-in updates are indexed like copied ones, and a stale moved-in update leaves
+    // the indexed version untouched
     {
-        AccountManager accountManager("single_account_update.json");
-        assert(accountManager.accountIndexer.indexedAccounts.size() == 1);
-        assert(accountManager.accountIndexer.indexedAccounts.count({"GzbXUY1JQwRVUf3j3myg2NbDRwD5i4jD4HJpYhVNfiDm", 123}) == 1);
+        AccountManager accountManager(3);
+        AccountData data;
+        data.set("moved", 5);
+        string longId(48, 'm');
+        Account copied(longId, "escrow", 40, 60000, data, 1);
+        accountManager.ingestAccount(copied);
+        assert(copied.id == longId && copied.data.size() == 1);
+
+        accountManager.ingestAccount(Account(longId, "escrow", 70, 60000, data, 2));
+        Account stale(longId, "escrow", 10, 60000, data, 1);
+        accountManager.ingestAccount(std::move(stale));
+        const IndexedAccount *indexed = accountManager.accountIndexer.findAccount(longId, 2);
+        assert(indexed != nullptr && indexed->tokens == 70 && indexed->data.size() == 1);
+        assert(accountManager.accountIndexer.findAccount(longId, 1) == nullptr);
+        assert(accountManager.accountIndexer.getSymbols().ids.size() == 1);
+
+        json update = {{"id", "parsed"}, {"accountType", "vault"}, {"tokens", 3}, {"callbackTimeMs", 60000},
+                       {"data", {{"moved", 6}}}, {"version", 1}};
+        accountManager.ingestAccount(AccountUpdateReader::parseAccountUpdate(update));
+        indexed = accountManager.accountIndexer.findAccount("parsed", 1);
+        assert(indexed != nullptr && indexed->data.at("moved") == 6);
+        assert(accountManager.accountIndexer.size() == 2);
     }
-    // Test Case 2: Multiple Account Updates with Callbacks
+    // Test Case 28: A batch is collapsed to the latest version of every id, and ends up indexed and
+    // ranked as if its updates had been ingested one by one
     {
-        AccountManager accountManager("multi_account_updates_with_callback.json");
-        assert(accountManager.accountIndexer.indexedAccounts.size() == 3);
-        assert(accountManager.accountIndexer.indexedAccounts.count({"account1", 2}) == 1);
-        assert(accountManager.accountIndexer.indexedAccounts.count({"account2", 1}) == 1);
-        assert(accountManager.accountIndexer.indexedAccounts.count({"account3", 1}) == 1);
+        AccountData data;
+        data.set("batched", 1);
+        vector<Account> updates;
+        updates.push_back(Account("batchA", "escrow", 10, 60000, data, 1));
+        updates.push_back(Account("batchB", "escrow", 20, 60000, data, 1));
+        updates.push_back(Account("batchA", "escrow", 30, 60000, data, 3));
+        updates.push_back(Account("batchA", "escrow", 99, 60000, data, 2));
+        updates.push_back(Account("batchC", "vault", 5, 60000, data, 1));
+        updates.push_back(Account("batchB", "escrow", 77, 60000, data, 1));
+        updates.push_back(Account("batchD", "escrow", 25, 60000, data, 1));
+
+        AccountManager oneByOne(2);
+        for (const Account &update : updates) oneByOne.ingestAccount(update);
+        AccountManager batched(2);
+        batched.ingestAccountUpdates(updates);
+        assert(updates[0].id == "batchA");
+
+        for (AccountManager *manager : {&oneByOne, &batched}) {
+            assert(manager->accountIndexer.size() == 4 && manager->callbackManager.size() == 4);
+            assert(manager->accountIndexer.findAccount("batchA", 3)->tokens == 30);
+            assert(manager->accountIndexer.findAccount("batchB", 1)->tokens == 20);
+            vector<TopKEntry> escrow = manager->accountIndexer.findHighestTokenAccounts("escrow")->sortedEntries();
+            assert(escrow.size() == 2 && escrow[0].tokens == 30 && escrow[1].tokens == 25);
+        }
+
+        // The next batch demotes the top account, which the ranking after the batch picks up
+        vector<Account> next;
+        next.push_back(Account("batchA", "escrow", 1, 60000, data, 4));
+        next.push_back(Account("batchD", "escrow", 2, 60000, data, 1));
+        next.push_back(Account("batchE", "escrow", 40, 60000, data, 1));
+        batched.ingestAccountUpdates(std::move(next));
+        vector<TopKEntry> escrow = batched.accountIndexer.findHighestTokenAccounts("escrow")->sortedEntries();
+        assert(escrow.size() == 2 && escrow[0].tokens == 40 && escrow[1].tokens == 25);
+        assert(batched.accountIndexer.findAccount("batchA", 3) == nullptr && batched.accountIndexer.size() == 5);
+        assert(batched.callbackManager.size() == 5);
+
+        // Only the surviving versions are logged, and recovery replays them to the same state
+        const char *logFile = "/tmp/account_manager_batch.wal";
+        remove(logFile);
+        {
+            AccountManager logged(2);
+            assert(logged.enableWriteAheadLog(logFile));
+            logged.ingestAccountUpdates(updates);
+            assert(logged.syncWriteAheadLog());
+            assert(logged.getWriteAheadLogStats().records == 4);
+        }
+        AccountManager recovered(2);
+        assert(recovered.recover("/tmp/no_such_checkpoint.ckpt", logFile));
+        assert(recovered.accountIndexer.size() == 4 && recovered.accountIndexer.findAccount("batchA", 3)->tokens == 30);
+        assert(recovered.accountIndexer.findAccount("batchB", 1)->tokens == 20);
+        remove(logFile);
     }
-    // Test Case 3: Account Update with Higher Tokens Replacing Existing Account (Callback cancellation)
+    // Test Case 29: The hot paths are counted and timed, and the metrics export as Prometheus text and JSON
+#if ACCOUNT_INDEXING_METRICS
     {
-        AccountManager accountManager("account_replaced_by_higher_token.json");
-        assert(accountManager.accountIndexer.indexedAccounts.size() == 1);
-        assert(accountManager.accountIndexer.indexedAccounts.count({"account1", 2}) == 1);
+        for (uint64_t value : {0ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull, 1ull << 40}) {
+            size_t bucket = Metrics::bucketOf(value);
+            assert(Metrics::bucketLowerBound(bucket) <= value && value < Metrics::bucketUpperBound(bucket));
+        }
+        assert(Metrics::bucketOf(15) == 15 && Metrics::bucketOf(16) == 16 && Metrics::bucketOf(32) == 32);
+
+        MetricsSnapshot before = MetricsSnapshot::take();
+        AccountManager accountManager(3);
+        accountManager.callbackManager.setSink(make_shared<FunctionCallbackSink>([](const vector<FiredCallback> &) {}));
+        AccountData data;
+        data.set("metered", 1);
+        accountManager.ingestAccount(Account("meteredA", "escrow", 10, 60000, data, 1));
+        accountManager.ingestAccount(Account("meteredA", "escrow", 20, 60000, data, 2));
+        accountManager.ingestAccount(Account("meteredA", "escrow", 30, 60000, data, 1));
+        vector<Account> batch;
+        batch.push_back(Account("meteredB", "vault", 5, 60000, data, 1));
+        batch.push_back(Account("meteredB", "vault", 6, 60000, data, 2));
+        accountManager.ingestAccountUpdates(std::move(batch));
+        AccountUpdateReader::parseAccountUpdate(json{{"id", "meteredC"}, {"accountType", "vault"}, {"tokens", 1},
+                                                     {"callbackTimeMs", 0}, {"data", json::object()}, {"version", 1}});
+        assert(accountManager.searchAndFilterAccounts("escrow").size() == 1);
+        accountManager.callbackManager.fireCallbacks(chrono::system_clock::now() + chrono::hours(1));
+
+        MetricsSnapshot metrics = accountManager.getMetrics();
+        auto delta = [&before, &metrics](Counter counter) { return metrics.get(counter) - before.get(counter); };
+        assert(delta(Counter::UpdatesIngested) == 5 && delta(Counter::UpdatesCollapsed) == 1);
+        assert(delta(Counter::UpdatesNew) == 2 && delta(Counter::UpdatesSuperseding) == 1 && delta(Counter::UpdatesRejected) == 1);
+        assert(delta(Counter::UpdatesParsed) == 1 && delta(Counter::Queries) == 1);
+        assert(delta(Counter::CallbacksScheduled) == 3 && delta(Counter::CallbacksFired) == 2);
+        assert(metrics.get(Histogram::IngestLatency).count - before.get(Histogram::IngestLatency).count == 3);
+        assert(metrics.get(Histogram::IngestBatchLatency).count > before.get(Histogram::IngestBatchLatency).count);
+        assert(metrics.get(Histogram::FireLag).count - before.get(Histogram::FireLag).count == 2);
+        assert(metrics.get(Histogram::QueryLatency).percentile(0.99) > 0);
+
+        // A batch file the fast path gives up on partway is parsed again by nlohmann, and its updates
+        // are counted once
+        const char *fallbackFile = "/tmp/account_manager_fallback.json";
+        {
+            ofstream out(fallbackFile);
+            out << "[{\"id\": \"fallbackA\", \"accountType\": \"vault\", \"tokens\": 1, \"callbackTimeMs\": 0, "
+                   "\"data\": {}, \"version\": 1},\n"
+                   " {\"id\": \"fallbackB\", \"accountType\": \"vault\", \"tokens\": 2, \"callbackTimeMs\": 0, "
+                   "\"data\": {}, \"version\": 1, \"memo\": 7}]";
+        }
+        MetricsSnapshot beforeFallback = MetricsSnapshot::take();
+        size_t fallbackUpdates = 0;
+        assert(AccountUpdateReader::readFile(fallbackFile, IngestMode::Batch, [&fallbackUpdates](Account &&) { ++fallbackUpdates; }));
+        MetricsSnapshot afterFallback = MetricsSnapshot::take();
+        assert(fallbackUpdates == 2 && afterFallback.get(Counter::ParserFallbacks) - beforeFallback.get(Counter::ParserFallbacks) == 1);
+        assert(afterFallback.get(Counter::UpdatesParsed) - beforeFallback.get(Counter::UpdatesParsed) == 2);
+        assert(afterFallback.get(Histogram::ParseLatency).count - beforeFallback.get(Histogram::ParseLatency).count == 2);
+        remove(fallbackFile);
+
+        string text = metrics.toPrometheus();
+        assert(text.find("account_indexing_updates_ingested_total " + to_string(metrics.get(Counter::UpdatesIngested))) != string::npos);
+        assert(text.find("account_indexing_pending_callbacks 0") != string::npos);
+        assert(text.find("account_indexing_ingest_latency_seconds_bucket{le=\"+Inf\"}") != string::npos);
+        json document = json::parse(metrics.toJson().dump());
+        assert(document["counters"]["queries"] == metrics.get(Counter::Queries));
+        assert(document["gauges"]["indexed_accounts"] == 2);
+        assert(document["histograms"]["ingest_latency"]["count"] == metrics.get(Histogram::IngestLatency).count);
     }
-    // Test Case 4: Three account updates with different IDs and account types. All three updates have different versions. The assertions check that all three accounts are indexed correctly.
+#endif
+    // Test Case 30: A manager on the public key policy, with fixed-width ids, a timing wheel and a
+    // compile-time K, indexes, ranks, fires and checkpoints like the default instantiation
     {
-        AccountManager accountManager("multi_account_multi_version_indexing.json");
-        assert(accountManager.accountIndexer.indexedAccounts.size() == 2);
-        assert(accountManager.accountIndexer.indexedAccounts.count({"account1", 3}) == 1);
-        assert(accountManager.accountIndexer.indexedAccounts.count({"account2", 1}) == 1);
+        static_assert(is_same<CallbackManager, BasicCallbackManager<DefaultAccountPolicy>>::value,
+                      "CallbackManager is the default instantiation");
+        vector<Account> updates;
+        AccountData data;
+        data.set("pubkey", 1);
+        for (int i = 0; i < 200; ++i) {
+            unsigned char key[32];
+            for (int b = 0; b < 32; ++b) key[b] = static_cast<unsigned char>(i * 7 + b * 13 + (b == 0 ? 1 : 0));
+            string id = Base58PubkeyKey::toString(key);
+            updates.push_back(Account(id, i % 3 == 0 ? "vault" : "stake", (i * 37) % 101, 0, data, 1 + i % 2));
+        }
+        updates.push_back(Account(updates[5].id, "stake", 500, 0, data, 9));
+        updates.push_back(Account(updates[6].id, "vault", -1, 0, data, 1));
+
+        BasicAccountManager<PubkeyAccountPolicy> pubkeys(8, SchedulerType::BinaryHeap);
+        AccountManager defaults(3);
+        assert(pubkeys.accountIndexer.getTopK() == 3);
+        vector<FiredCallback> fired;
+        pubkeys.callbackManager.setSink(make_shared<FunctionCallbackSink>(
+            [&fired](const vector<FiredCallback> &batch) { fired.insert(fired.end(), batch.begin(), batch.end()); }));
+        defaults.callbackManager.setSink(nullptr);
+        for (const Account &update : updates) {
+            pubkeys.ingestAccount(update);
+            defaults.ingestAccount(update);
+        }
+        assert(pubkeys.accountIndexer.size() == defaults.accountIndexer.size());
+        assert(pubkeys.accountIndexer.getSymbols().ids.size() == 200);
+        assert(pubkeys.accountIndexer.findAccountId(updates[7].id) == defaults.accountIndexer.findAccountId(updates[7].id));
+        unsigned char unseen[32];
+        memset(unseen, 0xFF, sizeof(unseen));
+        assert(pubkeys.accountIndexer.findAccountId(Base58PubkeyKey::toString(unseen)) == kInvalidHandle);
+        assert(pubkeys.accountIndexer.findAccountId(string(45, 'z')) == kInvalidHandle);
+
+        for (const string &accountType : {string(""), string("vault"), string("stake")}) {
+            vector<Account> expected = defaults.searchAndFilterAccounts(accountType, 10, 90);
+            vector<Account> actual = pubkeys.searchAndFilterAccounts(accountType, 10, 90);
+            assert(!expected.empty() && actual.size() == expected.size());
+            for (size_t i = 0; i < expected.size(); ++i) {
+                assert(actual[i].id == expected[i].id && actual[i].version == expected[i].version);
+            }
+            if (accountType.empty()) continue;
+            vector<TopKEntry> expectedTop = defaults.accountIndexer.findHighestTokenAccounts(accountType)->sortedEntries();
+            vector<TopKEntry> actualTop = pubkeys.accountIndexer.findHighestTokenAccounts(accountType)->sortedEntries();
+            assert(actualTop.size() == 3 && actualTop.size() == expectedTop.size());
+            for (size_t i = 0; i < 3; ++i) assert(actualTop[i].tokens == expectedTop[i].tokens);
+        }
+        assert(pubkeys.accountIndexer.findHighestTokenAccounts("stake")->sortedEntries()[0].tokens == 500);
+
+        // Ids that are not base58 public keys are refused
+        bool refused = false;
+        try {
+            pubkeys.accountIndexer.internAccountId("not-a-pubkey");
+        }
+        catch (const invalid_argument &) {
+            refused = true;
+        }
+        assert(refused && pubkeys.accountIndexer.getSymbols().ids.size() == 200);
+
+        // The checkpoint restores into a manager of the same policy
+        const char *checkpointFile = "/tmp/account_manager_pubkey.ckpt";
+        assert(pubkeys.checkpoint(checkpointFile));
+        BasicAccountManager<PubkeyAccountPolicy> restored(3);
+        assert(restored.restoreCheckpoint(checkpointFile));
+        assert(restored.accountIndexer.size() == pubkeys.accountIndexer.size());
+        assert(restored.accountIndexer.findLatestAccount(updates[5].id)->tokens == 500);
+        remove(checkpointFile);
+
+        // Every latest version's callback fires from the timing wheel, once; on a slow run some fired
+        // while their accounts were still being ingested, a few of them for versions superseded since
+        pubkeys.callbackManager.fireCallbacks(chrono::system_clock::now() + chrono::hours(1));
+        assert(pubkeys.callbackManager.size() == 0);
+        size_t firedLatest = 0;
+        for (const FiredCallback &callback : fired) {
+            firedLatest += pubkeys.accountIndexer.findLatestAccount(callback.id)->version == callback.version;
+        }
+        assert(firedLatest == 200 && fired.size() <= 201);
     }
-    // Test Case 5: Accounts should get filtered based on the criteria
+    // Test Case 31: The flat account map keeps its values in place through inserts, erases and rehashes,
+    // and agrees with unordered_map; public keys round trip through base58 and only canonical text decodes
     {
-        AccountManager accountManager("multi_accounts_to_be_filtered.json");
-        vector<Account> filteredAccounts = accountManager.searchAndFilterAccounts("user", 200, 400);
-        // Validate the filtered accounts
-        assert(filteredAccounts.size() == 2);
-        assert(filteredAccounts[0].id == "id4");
-        assert(filteredAccounts[0].accountType == "user");
-        assert(filteredAccounts[0].tokens == 400);
-        assert(filteredAccounts[1].id == "id3");
-        assert(filteredAccounts[1].accountType == "user");
-        assert(filteredAccounts[1].tokens == 300);
+        FlatHashMap<AccountKey, int, AccountKeyHash> flat;
+        unordered_map<AccountKey, int, AccountKeyHash> reference;
+        map<pair<IdHandle, int>, const int *> addresses;
+        mt19937 engine(7);
+        for (int round = 0; round < 20000; ++round) {
+            AccountKey key{static_cast<IdHandle>(engine() % 3000), static_cast<int>(engine() % 4)};
+            if (engine() % 3 == 0) {
+                auto it = flat.find(key);
+                assert((it != flat.end()) == (reference.count(key) == 1));
+                if (it != flat.end()) {
+                    flat.erase(it);
+                    reference.erase(key);
+                    addresses.erase(make_pair(key.id, key.version));
+                }
+            }
+            else {
+                auto inserted = flat.emplace(key, round);
+                assert(inserted.second == reference.emplace(key, round).second);
+                if (inserted.second) addresses[make_pair(key.id, key.version)] = &inserted.first->second;
+            }
+        }
+        assert(flat.size() == reference.size() && flat.bucket_count() * 7 >= flat.size() * 8);
+        size_t visited = 0;
+        for (const pair<const AccountKey, int> &entry : flat) {
+            assert(reference.at(entry.first) == entry.second);
+            assert(addresses.at(make_pair(entry.first.id, entry.first.version)) == &entry.second);
+            ++visited;
+        }
+        assert(visited == flat.size());
+        assert(flat.erase(AccountKey{5000, 0}) == 0);
+
+        unsigned char key[32], decoded[32];
+        for (int i = 0; i < 32; ++i) key[i] = static_cast<unsigned char>(i < 2 ? 0 : 255 - i);
+        string text = Base58PubkeyKey::toString(key);
+        assert(text.compare(0, 2, "11") == 0 && text[2] != '1');
+        assert(Base58PubkeyKey::encode(text, decoded) && memcmp(key, decoded, 32) == 0);
+        // A dropped leading '1' decodes to the same number, and is refused rather than aliased
+        assert(!Base58PubkeyKey::encode(text.substr(1), decoded));
+        assert(!Base58PubkeyKey::encode(string(45, '2'), decoded) && !Base58PubkeyKey::encode("0OIl", decoded));
+        assert(Base58PubkeyKey::toString(vector<unsigned char>(32, 0).data()) == string(32, '1'));
     }
+    // Test Case 32: Scans of the column store match the token index, through churn, for any type and
+    // range, and filter on data fields
+    {
+        AccountIndexer indexer(3);
+        mt19937 engine(11);
+        AccountData data;
+        for (int round = 0; round < 5000; ++round) {
+            string id = "col" + to_string(engine() % 700);
+            int version = static_cast<int>(engine() % 5);
+            if (engine() % 4 == 0) {
+                indexer.removeAccount(id, version);
+                continue;
+            }
+            data.set("parity", static_cast<int>(engine() % 2));
+            // Few distinct token values, so that versions of an id often tie on tokens
+            indexer.indexAccount(Account(id, engine() % 3 == 0 ? "vault" : "stake", static_cast<int>(engine() % 40) - 20,
+                                         0, data, version));
+        }
+        assert(indexer.getColumnRows() >= indexer.size());
+        for (const string &accountType : {string(""), string("vault"), string("stake"), string("missing")}) {
+            for (int low : {numeric_limits<int>::min(), -20, -3, 7, 19}) {
+                for (int high : {-21, -3, 0, 19, numeric_limits<int>::max()}) {
+                    vector<const IndexedAccount *> walked, scanned, unordered;
+                    for (const TokenIndexEntry &entry : indexer.findAccountsByTokens(accountType, low, high)) {
+                        walked.push_back(entry.account);
+                    }
+                    indexer.scanAccountsByTokens(accountType, low, high, scanned, true);
+                    indexer.scanAccountsByTokens(accountType, low, high, unordered);
+                    assert(scanned == walked && unordered.size() == walked.size());
+                    sort(unordered.begin(), unordered.end());
+                    sort(walked.begin(), walked.end());
+                    assert(unordered == walked);
+                }
+            }
+        }
+
+        // The manager picks the scan for wide queries and the index for narrow ones, with the same results
+        AccountManager accountManager(3);
+        accountManager.callbackManager.setSink(nullptr);
+        for (int i = 0; i < 2000; ++i) {
+            data.set("parity", i % 2);
+            accountManager.ingestAccount(Account("scan" + to_string(i), i % 4 == 0 ? "vault" : "stake", i, 0, data, 1));
+        }
+        for (const pair<int, int> &range : {make_pair(0, 10), make_pair(100, 1900), make_pair(-5, 5000)}) {
+            vector<Account> found = accountManager.searchAndFilterAccounts("stake", range.first, range.second);
+            AccountView view = accountManager.queryAccounts("stake", range.first, range.second);
+            vector<AccountRef> expected(view.begin(), view.end());
+            assert(found.size() == expected.size());
+            for (size_t i = 0; i < found.size(); ++i) assert(found[i].id == expected[i].id());
+        }
+        vector<Account> odd = accountManager.searchAndFilterAccounts("vault", 0, 999, [](const AccountData &fields) {
+            const int *parity = fields.find("parity");
+            return parity && *parity == 1;
+        });
+        assert(odd.empty());
+        vector<Account> even = accountManager.searchAndFilterAccounts("", 1000, 1100, [](const AccountData &fields) {
+            const int *parity = fields.find("parity");
+            return parity && *parity == 0;
+        });
+        assert(even.size() == 51 && even.front().tokens == 1100 && even.back().tokens == 1000);
+    }
+    // Test Case 33: Subscribers that apply the reported changes to their copy of a result keep it equal
+    // to the query, through single updates and batches that move accounts across types and ranges
+    {
+        AccountManager accountManager(3);
+        accountManager.callbackManager.setSink(nullptr);
+        for (int i = 0; i < 50; ++i) accountManager.ingestAccount(Account("sub" + to_string(i), "stake", i * 4, 0, AccountData(), 1));
+
+        typedef map<string, Account> Result;
+        auto apply = [](Result &result, const vector<AccountChange> &changes) {
+            for (const AccountChange &change : changes) {
+                auto held = result.find(change.account.id);
+                assert((change.kind == AccountChangeKind::Enter) == (held == result.end()));
+                // A leaving account is reported as it was last reported, an update is newer than that
+                assert(change.kind != AccountChangeKind::Leave || held->second.version == change.account.version);
+                assert(change.kind != AccountChangeKind::Update || held->second.version < change.account.version);
+                if (change.kind == AccountChangeKind::Leave) result.erase(change.account.id);
+                else result[change.account.id] = change.account;
+            }
+        };
+        auto matches = [](const Result &result, const vector<Account> &expected) {
+            if (result.size() != expected.size()) return false;
+            for (const Account &account : expected) {
+                auto it = result.find(account.id);
+                if (it == result.end() || it->second.version != account.version || it->second.tokens != account.tokens ||
+                    it->second.accountType != account.accountType) return false;
+            }
+            return true;
+        };
+
+        Result stakeRange, anyRange, vaultTop, laterTop;
+        size_t deliveries = 0;
+        accountManager.subscribe("stake", 40, 120, [&](const vector<AccountChange> &changes) {
+            assert(!changes.empty());
+            ++deliveries;
+            apply(stakeRange, changes);
+        });
+        assert(deliveries == 1 && stakeRange.size() == 21);
+        accountManager.subscribe("", 100, 150, [&](const vector<AccountChange> &changes) { apply(anyRange, changes); });
+        accountManager.subscribeHighestTokenAccounts("vault", [&](const vector<AccountChange> &changes) { apply(vaultTop, changes); });
+        // A type not seen yet is picked up when its first account is indexed
+        accountManager.subscribeHighestTokenAccounts("later", [&](const vector<AccountChange> &changes) { apply(laterTop, changes); });
+        size_t quietDeliveries = 0;
+        SubscriptionId quiet = accountManager.subscribe("stake", 10000, 20000, [&](const vector<AccountChange> &) { ++quietDeliveries; });
+        // A subscription that cancels itself from its handler, on the first change after the initial result
+        size_t onceDeliveries = 0;
+        SubscriptionId once = accountManager.subscribe("stake", 0, 8, [&](const vector<AccountChange> &) {
+            if (++onceDeliveries == 2) assert(accountManager.unsubscribe(once));
+        });
+        assert(onceDeliveries == 1);
+
+        auto topK = [&accountManager](const string &accountType) {
+            vector<Account> expected;
+            const TopKAccounts *top = accountManager.accountIndexer.findHighestTokenAccounts(accountType);
+            if (!top) return expected;
+            for (const TopKEntry &entry : top->sortedEntries()) {
+                expected.push_back(AccountRef(accountManager.accountIndexer.findLatestAccount(entry.id),
+                                              &accountManager.accountIndexer.getSymbols().ids,
+                                              &accountManager.accountIndexer.getSymbols().types).toAccount());
+            }
+            return expected;
+        };
+
+        mt19937 engine(5);
+        vector<int> versions(60, 1);
+        const char *types[] = {"stake", "vault", "later"};
+        for (int round = 0; round < 400; ++round) {
+            vector<Account> batch;
+            size_t updates = round % 2 == 0 ? 1 : 1 + engine() % 20;
+            for (size_t u = 0; u < updates; ++u) {
+                int i = static_cast<int>(engine() % 60);
+                // Every so often a stale version, which changes nothing
+                int version = engine() % 8 == 0 ? versions[i] - 1 : ++versions[i];
+                batch.push_back(Account("sub" + to_string(i), types[round < 200 ? engine() % 2 : engine() % 3],
+                                        static_cast<int>(engine() % 200), 0, AccountData(), version));
+            }
+            if (batch.size() == 1) accountManager.ingestAccount(batch.front());
+            else accountManager.ingestAccountUpdates(batch);
+
+            assert(matches(stakeRange, accountManager.searchAndFilterAccounts("stake", 40, 120)));
+            assert(matches(anyRange, accountManager.searchAndFilterAccounts("", 100, 150)));
+            assert(matches(vaultTop, topK("vault")));
+            assert(matches(laterTop, topK("later")));
+        }
+        assert(!laterTop.empty() && quietDeliveries == 0 && onceDeliveries == 2 && !accountManager.unsubscribe(once));
+        assert(accountManager.unsubscribe(quiet) && !accountManager.unsubscribe(quiet));
+    }
+    // Test Case 34: Updates routed across nodes by consistent hashing, and queries gathered from them,
+    // give the results of a single manager, with bounded merges
+    {
+        ConsistentHashRing three, four;
+        for (const string &name : {string("a:1"), string("b:2"), string("c:3")}) three.addNode(name);
+        // The same names in another order make the same ring
+        for (const string &name : {string("c:3"), string("a:1"), string("b:2"), string("d:4")}) four.addNode(name);
+        size_t moved = 0;
+        for (int i = 0; i < 10000; ++i) {
+            string id = "ring" + to_string(i);
+            const string &before = three.getName(three.nodeOf(id));
+            const string &after = four.getName(four.nodeOf(id));
+            // Only ids of the new node move
+            assert(before == after || after == "d:4");
+            moved += before != after;
+        }
+        assert(moved > 1500 && moved < 3500);
+
+        vector<unique_ptr<AccountManager>> managers;
+        vector<unique_ptr<AccountNodeServer>> servers;
+        PartitionRouter router(64);
+        QueryCoordinator coordinator(3);
+        for (int i = 0; i < 3; ++i) {
+            managers.emplace_back(new AccountManager(3));
+            managers.back()->callbackManager.setSink(nullptr);
+            servers.emplace_back(new AccountNodeServer(*managers.back()));
+            assert(servers.back()->start());
+            assert(router.addNode("127.0.0.1", servers.back()->getPort()));
+            assert(coordinator.addNode("localhost", servers.back()->getPort()));
+        }
+        AccountManager reference(3);
+        reference.callbackManager.setSink(nullptr);
+        mt19937 engine(17);
+        AccountData data;
+        for (int round = 0; round < 3000; ++round) {
+            data.set("round", round);
+            Account update("node" + to_string(engine() % 500), engine() % 3 == 0 ? "vault" : "stake",
+                           static_cast<int>(engine() % 2000), 0, data, static_cast<int>(engine() % 10));
+            reference.ingestAccount(update);
+            assert(router.route(update));
+        }
+        assert(router.flush());
+        size_t routed = router.getRoutedCount(0) + router.getRoutedCount(1) + router.getRoutedCount(2);
+        assert(routed == 3000 && router.getRoutedCount(0) > 500 && router.getRoutedCount(0) < 1500);
+        size_t indexed = 0;
+        for (int i = 0; i < 3; ++i) {
+            indexed += managers[i]->accountIndexer.size();
+            for (TypeHandle type = 0; type < managers[i]->accountIndexer.getAccountTypeCount(); ++type) {
+                for (const TokenIndexEntry &entry : managers[i]->accountIndexer.getTokenIndex(type)) {
+                    assert(router.nodeOf(managers[i]->accountIndexer.getAccountId(entry.account->id)) == static_cast<size_t>(i));
+                }
+            }
+        }
+        assert(indexed == reference.accountIndexer.size());
+
+        for (const string &accountType : {string(""), string("stake"), string("missing")}) {
+            vector<Account> expected = reference.searchAndFilterAccounts(accountType, 100, 1500);
+            sort(expected.begin(), expected.end(), [](const Account &a, const Account &b) { return node::precedes(a, b); });
+            for (size_t limit : {size_t(0), size_t(1), size_t(25), numeric_limits<size_t>::max()}) {
+                vector<Account> found;
+                assert(coordinator.searchAndFilterAccounts(found, accountType, 100, 1500, limit));
+                assert(found.size() == min(limit, expected.size()));
+                for (size_t i = 0; i < found.size(); ++i) {
+                    assert(found[i].id == expected[i].id && found[i].version == expected[i].version &&
+                           found[i].tokens == expected[i].tokens && found[i].data == expected[i].data);
+                }
+            }
+        }
+        vector<string> accountTypes;
+        assert(coordinator.getAccountTypes(accountTypes) && accountTypes.size() == 2);
+        for (const string &accountType : accountTypes) {
+            vector<ShardedTopKEntry> merged;
+            assert(coordinator.getHighestTokenAccounts(merged, accountType));
+            vector<TopKEntry> expected = reference.accountIndexer.findHighestTokenAccounts(accountType)->sortedEntries();
+            assert(merged.size() == expected.size());
+            for (size_t i = 0; i < merged.size(); ++i) {
+                const IndexedAccount *latest = reference.accountIndexer.findLatestAccount(merged[i].id);
+                assert(merged[i].tokens == expected[i].tokens && latest->version == merged[i].version &&
+                       latest->tokens == merged[i].tokens);
+            }
+        }
+
+        // A stopped node refuses connections, and fails the queries of the coordinator connected to it
+        AccountNodeClient unreachable;
+        servers[2]->stop();
+        assert(!unreachable.connect("127.0.0.1", servers[2]->getPort()));
+        vector<Account> partial;
+        assert(!coordinator.searchAndFilterAccounts(partial, "", 0, 10));
+
+        // A node whose answers claim more items than they hold, or end partway through an item, fails the
+        // query without allocating for the claimed count, and none of its answer is merged
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addressLength = sizeof(address);
+        assert(listener >= 0 && ::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0);
+        assert(listen(listener, 4) == 0 && getsockname(listener, reinterpret_cast<sockaddr *>(&address), &addressLength) == 0);
+        vector<string> replies;
+        for (node::MessageType type : {node::kAccounts, node::kAccounts, node::kTopKEntries}) {
+            string reply;
+            size_t start = node::beginFrame(reply, type);
+            bool truncated = replies.size() == 1;
+            wire::put<uint32_t>(reply, truncated ? 2 : numeric_limits<uint32_t>::max());
+            if (truncated) {
+                wire::putAccount(reply, Account("hostile", "stake", 1999, 0, AccountData(), 1));
+                reply += "trunc";
+            }
+            node::finishFrame(reply, start);
+            replies.push_back(reply);
+        }
+        thread hostile([listener, &replies]() {
+            for (const string &reply : replies) {
+                int connection = accept(listener, nullptr, nullptr);
+                node::MessageType type;
+                string request;
+                if (connection >= 0 && node::exchangeHandshake(connection) && node::readFrame(connection, type, request)) {
+                    node::writeAll(connection, reply.data(), reply.size());
+                }
+                close(connection);
+            }
+        });
+        for (size_t i = 0; i < replies.size(); ++i) {
+            QueryCoordinator mixed(3);
+            assert(mixed.addNode("127.0.0.1", servers[0]->getPort()));
+            assert(mixed.addNode("127.0.0.1", ntohs(address.sin_port)));
+            if (i < 2) {
+                vector<Account> found;
+                assert(!mixed.searchAndFilterAccounts(found, "", 0, 2000));
+                assert(found.size() == managers[0]->searchAndFilterAccounts("", 0, 2000).size());
+                for (const Account &account : found) assert(account.id != "hostile" && !account.id.empty());
+            }
+            else {
+                vector<ShardedTopKEntry> merged;
+                assert(!mixed.getHighestTokenAccounts(merged, "stake"));
+                assert(merged.size() == managers[0]->accountIndexer.findHighestTokenAccounts("stake")->sortedEntries().size());
+            }
+        }
+        hostile.join();
+        close(listener);
+    }
+    // Test Case 35: Under a memory budget, cold accounts are evicted to the disk-backed tier and faulted
+    // back in, with the same queries, top K and checkpoints as an unbounded manager, while the top K and
+    // the accounts with a pending callback stay in memory
+    {
+        const char *coldFile = "/tmp/account_manager.cold";
+        const char *checkpointFile = "/tmp/account_manager_cold.ckpt";
+        AccountManager reference(3), bounded(3);
+        reference.callbackManager.setSink(nullptr);
+        bounded.callbackManager.setSink(nullptr);
+        const string types[] = {"stake", "vault", "mint"};
+        mt19937 engine(35);
+        auto update = [&engine, &types](int i, int version) {
+            AccountData data;
+            data.set("parity", i % 2);
+            if (i % 5 == 0) for (int f = 0; f < 6; ++f) data.set("field" + to_string(f), f);
+            return Account("cold" + to_string(i), types[engine() % 3], static_cast<int>(engine() % 500), 0, data, version);
+        };
+        vector<int> versions(1500, 1);
+        vector<Account> initial;
+        for (int i = 0; i < 1500; ++i) initial.push_back(update(i, 1));
+        reference.ingestAccountUpdates(initial);
+        bounded.ingestAccountUpdates(initial);
+        // Accounts with a pending callback are pinned, so let them all fire first
+        chrono::system_clock::time_point later = chrono::system_clock::now() + chrono::hours(1);
+        bounded.callbackManager.fireCallbacks(later);
+        // Each cold account keeps an index entry, about half what an account in memory takes
+        size_t budget = bounded.accountIndexer.getMemoryUsage() * 2 / 3;
+        assert(bounded.enableMemoryBudget(budget, coldFile));
+        assert(bounded.accountIndexer.getColdAccountCount() > 0 && bounded.accountIndexer.getMemoryUsage() <= budget);
+        assert(bounded.accountIndexer.size() == 1500);
+
+        auto same = [](const vector<Account> &a, const vector<Account> &b) {
+            if (a.size() != b.size()) return false;
+            for (size_t i = 0; i < a.size(); ++i) {
+                if (a[i].id != b[i].id || a[i].version != b[i].version || a[i].tokens != b[i].tokens ||
+                    a[i].accountType != b[i].accountType || a[i].data != b[i].data) return false;
+            }
+            return true;
+        };
+        auto highest = [](AccountManager &manager, const string &accountType) {
+            vector<pair<string, int>> entries;
+            for (const TopKEntry &entry : manager.accountIndexer.findHighestTokenAccounts(accountType)->sortedEntries()) {
+                entries.push_back(make_pair(manager.accountIndexer.getAccountId(entry.id), entry.version));
+                // The top K is never evicted
+                assert(manager.accountIndexer.findLatestAccount(entry.id)->version == entry.version);
+            }
+            return entries;
+        };
+        auto check = [&]() {
+            // Snapshots hold the cold accounts too, and read them from the tier without faulting them in
+            bounded.publishSnapshot();
+            shared_ptr<const AccountSnapshot> coldSnapshot = bounded.getSnapshot();
+            size_t coldCount = bounded.accountIndexer.getColdAccountCount();
+            assert(coldCount > 0 && coldSnapshot->size() == reference.searchAndFilterAccounts().size());
+            for (const string &accountType : {string(""), string("vault")}) {
+                assert(same(reference.searchAndFilterAccounts(accountType, 100, 120),
+                            coldSnapshot->searchAndFilterAccounts(accountType, 100, 120)));
+                assert(same(reference.searchAndFilterAccounts(accountType), coldSnapshot->searchAndFilterAccounts(accountType)));
+            }
+            assert(bounded.accountIndexer.getColdAccountCount() == coldCount);
+            for (const string &accountType : {string(""), string("stake"), string("vault"), string("mint")}) {
+                for (pair<int, int> range : {make_pair(numeric_limits<int>::min(), numeric_limits<int>::max()), make_pair(480, 499),
+                                             make_pair(100, 120), make_pair(250, 250)}) {
+                    assert(same(reference.searchAndFilterAccounts(accountType, range.first, range.second),
+                                bounded.searchAndFilterAccounts(accountType, range.first, range.second)));
+                }
+                auto odd = [](const AccountData &data) { return data.at("parity") == 1; };
+                assert(same(reference.searchAndFilterAccounts(accountType, 0, 300, odd),
+                            bounded.searchAndFilterAccounts(accountType, 0, 300, odd)));
+                if (!accountType.empty()) assert(highest(reference, accountType) == highest(bounded, accountType));
+            }
+            // Views fault in the accounts they reach, page by page
+            vector<Account> expected = reference.searchAndFilterAccounts("vault", 0, 499), paged;
+            AccountView page = bounded.queryAccounts("vault", 0, 499, 5, 20);
+            for (const AccountRef &account : page) paged.push_back(account.toAccount());
+            assert(same(vector<Account>(expected.begin() + 5, expected.begin() + 25), paged));
+            paged.clear();
+            AccountCursor cursor;
+            for (AccountView next = bounded.queryAccounts("vault", 0, 499, 0, 64); !next.empty();
+                 next = bounded.queryAccountsAfter(cursor, "vault", 0, 499, 64)) {
+                for (const AccountRef &account : next) {
+                    paged.push_back(account.toAccount());
+                    cursor = AccountCursor(account);
+                }
+            }
+            assert(same(expected, paged));
+        };
+        check();
+
+        for (int round = 0; round < 6; ++round) {
+            vector<Account> batch;
+            for (int n = 0; n < 400; ++n) {
+                int i = static_cast<int>(engine() % 1500);
+                // Some updates are stale, still others are new ids
+                int version = engine() % 8 == 0 ? versions[i] : ++versions[i];
+                batch.push_back(update(i, version));
+            }
+            if (round % 2 == 0) {
+                reference.ingestAccountUpdates(batch);
+                bounded.ingestAccountUpdates(batch);
+            }
+            else {
+                for (const Account &account : batch) {
+                    reference.ingestAccount(account);
+                    bounded.ingestAccount(account);
+                }
+            }
+            bounded.callbackManager.fireCallbacks(later);
+            Account added = update(1500 + round, 1);
+            bounded.ingestAccount(added);
+            reference.ingestAccount(added);
+            // Accounts faulted in by the queries are evicted again by the next update
+            assert(bounded.accountIndexer.getMemoryUsage() <= budget);
+            assert(bounded.accountIndexer.size() == reference.accountIndexer.size());
+            check();
+        }
+
+        // A checkpoint holds the cold accounts too
+        assert(bounded.checkpoint(checkpointFile));
+        {
+            AccountManager restored(3);
+            restored.callbackManager.setSink(nullptr);
+            assert(restored.restoreCheckpoint(checkpointFile));
+            assert(restored.accountIndexer.size() == reference.accountIndexer.size());
+            // Ids are interned in checkpoint order, so accounts with equal tokens may come back in another order
+            vector<Account> expected = reference.searchAndFilterAccounts(), actual = restored.searchAndFilterAccounts();
+            auto byId = [](const Account &a, const Account &b) { return a.id < b.id; };
+            sort(expected.begin(), expected.end(), byId);
+            sort(actual.begin(), actual.end(), byId);
+            assert(same(expected, actual));
+        }
+
+        // With the lowest budget, everything is evicted but the top K and the account with a pending callback
+        bounded.callbackManager.fireCallbacks(later);
+        Account pinned("pinned", "stake", 1, 60000, AccountData(), 1);
+        pinned.data.set("parity", 0);
+        bounded.ingestAccount(pinned);
+        assert(bounded.enableMemoryBudget(1, coldFile));
+        assert(bounded.accountIndexer.findLatestAccount("pinned") != nullptr);
+        assert(bounded.accountIndexer.size() - bounded.accountIndexer.getColdAccountCount() <= 3 * 3 + 1);
+        size_t fired = 0;
+        bounded.callbackManager.setSink(make_shared<FunctionCallbackSink>([&fired](const vector<FiredCallback> &callbacks) {
+            fired += callbacks.size();
+        }));
+        bounded.callbackManager.fireCallbacks(later);
+        assert(fired == 1);
+        reference.ingestAccount(pinned);
+        check();
+
+        // An update of a cold account is checked against the cold index entry and supersedes it in the
+        // tier, without faulting the cold version in; it is only read when a subscription holds it
+        vector<AccountChange> changes;
+        SubscriptionId subscription = bounded.subscribe("vault", 0, 499, [&changes](const vector<AccountChange> &batch) {
+            changes.insert(changes.end(), batch.begin(), batch.end());
+        });
+        // The subscription faulted its range in; the next update evicts it again
+        bounded.ingestAccount(pinned);
+        string coldName;
+        for (const Account &account : reference.searchAndFilterAccounts("vault", 0, 499)) {
+            // Of the ids whose versions are tracked, not those added a round at a time
+            if (account.id.compare(0, 4, "cold") == 0 && stoi(account.id.substr(4)) < 1500 &&
+                !bounded.accountIndexer.findLatestAccount(account.id)) coldName = account.id;
+        }
+        assert(!coldName.empty());
+        int coldId = stoi(coldName.substr(4));
+        size_t coldCount = bounded.accountIndexer.getColdAccountCount();
+#if ACCOUNT_INDEXING_METRICS
+        uint64_t faultedIn = bounded.getMetrics().get(Counter::AccountsFaultedIn);
+#endif
+        Account stale(coldName, "vault", 7, 0, AccountData(), versions[coldId]);
+        stale.data.set("parity", 1);
+        changes.clear();
+        bounded.ingestAccount(stale);
+        reference.ingestAccount(stale);
+        assert(bounded.accountIndexer.findLatestAccount(coldName) == nullptr && changes.empty());
+        assert(bounded.accountIndexer.getColdAccountCount() == coldCount);
+        Account newer(coldName, "vault", 7, 60000, AccountData(), ++versions[coldId]);
+        newer.data.set("parity", 1);
+        bounded.ingestAccount(newer);
+        reference.ingestAccount(newer);
+        assert(bounded.accountIndexer.findLatestAccount(coldName)->version == versions[coldId]);
+        assert(bounded.accountIndexer.getColdAccountCount() == coldCount - 1);
+        assert(changes.size() == 1 && changes[0].kind == AccountChangeKind::Update && changes[0].account.version == versions[coldId]);
+#if ACCOUNT_INDEXING_METRICS
+        assert(bounded.getMetrics().get(Counter::AccountsFaultedIn) == faultedIn);
+#endif
+        assert(bounded.unsubscribe(subscription));
+        check();
+
+        // A node's limited search reads the cold accounts that make its cut from the tier, and faults none in
+        {
+            AccountNodeServer server(bounded);
+            assert(server.start());
+            QueryCoordinator coordinator(3);
+            assert(coordinator.addNode("localhost", server.getPort()));
+            size_t coldCount = bounded.accountIndexer.getColdAccountCount();
+            for (const string &accountType : {string(""), string("vault")}) {
+                for (size_t limit : {size_t(1), size_t(10), size_t(200)}) {
+                    vector<Account> expected = reference.searchAndFilterAccounts(accountType, 0, 499), found;
+                    sort(expected.begin(), expected.end(), [](const Account &a, const Account &b) { return node::precedes(a, b); });
+                    expected.resize(limit);
+                    assert(coordinator.searchAndFilterAccounts(found, accountType, 0, 499, limit));
+                    assert(same(expected, found));
+                }
+            }
+            assert(bounded.accountIndexer.getColdAccountCount() == coldCount);
+        }
+        remove(checkpointFile);
+    }
+    // Test Case 36: Accounts with equal tokens rank by id, so the highest token value accounts and their
+    // order do not depend on the order the accounts arrived in, or on whether they came in a batch
+    {
+        vector<Account> updates;
+        for (const char *id : {"tieD", "tieB", "tieE", "tieC", "tieA"}) {
+            updates.push_back(Account(id, "escrow", string(id) == "tieE" ? 60 : 50, 60000, AccountData(), 1));
+        }
+        vector<Account> reversed(updates.rbegin(), updates.rend());
+
+        AccountManager forward(3), backward(3), batched(3);
+        for (const Account &update : updates) forward.ingestAccount(update);
+        for (const Account &update : reversed) backward.ingestAccount(update);
+        batched.ingestAccountUpdates(updates);
+
+        auto topIds = [](AccountManager &manager) {
+            vector<string> ids;
+            for (const TopKEntry &entry : manager.accountIndexer.findHighestTokenAccounts("escrow")->sortedEntries()) {
+                ids.push_back(manager.accountIndexer.getAccountId(entry.id));
+            }
+            return ids;
+        };
+        for (AccountManager *manager : {&forward, &backward, &batched}) {
+            assert((topIds(*manager) == vector<string>{"tieE", "tieA", "tieB"}));
+        }
+
+        // Demoting a held account backfills with the lowest id of those tied at the K-th place
+        for (AccountManager *manager : {&forward, &backward, &batched}) {
+            manager->ingestAccount(Account("tieA", "escrow", 10, 60000, AccountData(), 2));
+            assert((topIds(*manager) == vector<string>{"tieE", "tieB", "tieC"}));
+        }
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,115 @@
+/**
+ * @file BoundedQueue.h
+ * @brief Bounded blocking queue shared between threads
+ *
+ * A fixed capacity FIFO queue guarded by a mutex, for handing work from any number of producer
+ * threads to any number of consumer threads. Producers choose between failing and waiting when the
+ * queue is full; consumers take items in batches to keep the lock traffic per item low.
+ */
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+
+using namespace std;
+
+template <typename T>
+class BoundedQueue {
+    private:
+        mutable mutex queueMutex;
+        condition_variable notEmpty;
+        condition_variable notFull;
+        deque<T> items;
+        size_t capacity;
+        bool closed;
+
+    public:
+        /**
+         * Construct a queue.
+         * @param capacity The maximum number of items the queue holds.
+         */
+        explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), closed(false) {}
+
+        BoundedQueue(const BoundedQueue &) = delete;
+        BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+        /**
+         * Append an item if there is room for it.
+         * @param item The item to append.
+         * @return False if the queue is full or closed.
+         */
+        bool tryPush(T item) {
+            {
+                lock_guard<mutex> guard(queueMutex);
+                if (closed || items.size() >= capacity) return false;
+                items.push_back(std::move(item));
+            }
+            notEmpty.notify_one();
+            return true;
+        }
+
+        /**
+         * Append an item, waiting for room if the queue is full.
+         * @param item The item to append.
+         * @return False if the queue is closed.
+         */
+        bool push(T item) {
+            {
+                unique_lock<mutex> guard(queueMutex);
+                notFull.wait(guard, [this] { return closed || items.size() < capacity; });
+                if (closed) return false;
+                items.push_back(std::move(item));
+            }
+            notEmpty.notify_one();
+            return true;
+        }
+
+        /**
+         * Take up to maxItems items from the front of the queue, waiting until there is at least one.
+         * @param batch The vector to append the items to.
+         * @param maxItems The maximum number of items to take.
+         * @return The number of items taken; 0 only once the queue is closed and empty.
+         */
+        size_t popBatch(vector<T> &batch, size_t maxItems) {
+            size_t taken = 0;
+            {
+                unique_lock<mutex> guard(queueMutex);
+                notEmpty.wait(guard, [this] { return closed || !items.empty(); });
+                while (taken < maxItems && !items.empty()) {
+                    batch.push_back(std::move(items.front()));
+                    items.pop_front();
+                    ++taken;
+                }
+            }
+            if (taken > 0) notFull.notify_all();
+            return taken;
+        }
+
+        /**
+         * Close the queue. Pushes fail from now on; the items already queued can still be taken.
+         */
+        void close() {
+            {
+                lock_guard<mutex> guard(queueMutex);
+                closed = true;
+            }
+            notEmpty.notify_all();
+            notFull.notify_all();
+        }
+
+        size_t size() const {
+            lock_guard<mutex> guard(queueMutex);
+            return items.size();
+        }
+
+        size_t getCapacity() const {
+            return capacity;
+        }
+};
+
+#endif // BOUNDED_QUEUE_H
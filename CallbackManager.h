@@ -0,0 +1,337 @@
+/**
+ * @file CallbackManager.h
+ * @brief Callback scheduling and firing for indexed accounts
+ *
+ * Schedules a callback per indexed account version and fires the due ones, resolving each account
+ * from the AccountIndexer at fire time. The pending callbacks are kept in one of the schedulers from
+ * CallbackScheduler.h, chosen at construction, or fixed by the policy the manager is instantiated on.
+ *
+ * Due callbacks are fired either by polling fireCallbacks, or by a dispatcher thread that sleeps
+ * until the next deadline and fires the callbacks due by then in one batch. Each batch of fired
+ * callbacks goes to a CallbackSink, which prints them to stdout unless another one is set.
+ */
+
+#ifndef CALLBACK_MANAGER_H
+#define CALLBACK_MANAGER_H
+
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "Account.h"
+#include "AccountIndexer.h"
+#include "CallbackScheduler.h"
+#include "CallbackSink.h"
+#include "Metrics.h"
+#include "AccountPolicies.h"
+
+/**
+ * The scheduler of a callback manager whose policy names a concrete scheduler: held by value, so the
+ * scheduler's final methods are called directly. The SchedulerType chosen at construction is ignored.
+ */
+template <typename Scheduler>
+class SchedulerStorage {
+    private:
+        Scheduler scheduler;
+
+    public:
+        explicit SchedulerStorage(SchedulerType) {}
+
+        Scheduler *operator->() { return &scheduler; }
+        const Scheduler *operator->() const { return &scheduler; }
+};
+
+// The scheduler of a callback manager whose policy leaves the choice to run time
+template <>
+class SchedulerStorage<CallbackScheduler> {
+    private:
+        unique_ptr<CallbackScheduler> scheduler;
+
+        static CallbackScheduler *makeScheduler(SchedulerType type) {
+            switch (type) {
+                case SchedulerType::TimingWheel:
+                    return new TimingWheelCallbackScheduler();
+                case SchedulerType::BinaryHeap:
+                default:
+                    return new HeapCallbackScheduler();
+            }
+        }
+
+    public:
+        explicit SchedulerStorage(SchedulerType type) : scheduler(makeScheduler(type)) {}
+
+        CallbackScheduler *operator->() { return scheduler.get(); }
+        const CallbackScheduler *operator->() const { return scheduler.get(); }
+};
+
+template <typename Policy>
+class BasicCallbackManager {
+    public:
+        typedef BasicAccountIndexer<Policy> Indexer;
+
+    private:
+        SchedulerStorage<typename Policy::Scheduler> scheduler;
+        vector<ScheduledCallback> dueCallbacks;
+        vector<FiredCallback> firedCallbacks;
+        const Indexer &indexer;
+        shared_ptr<CallbackSink> sink;
+
+        // Guards the scheduler, the sink pointer and the dispatcher state below
+        mutable mutex schedulerMutex;
+        condition_variable wakeup;
+        thread dispatcher;
+        // Held while fired callbacks are resolved against the indexer; set while the dispatcher runs
+        mutex *indexerMutex;
+        bool stopping;
+        bool draining;
+        // The time the dispatcher sleeps until; a callback due earlier has to wake it
+        chrono::system_clock::time_point wakeAt;
+
+        /**
+         * Resolve the given due callbacks against the indexer and deliver the ones whose account
+         * version is still the latest to the sink, as one batch. The index is only locked while the
+         * callbacks are resolved, so a slow sink holds up neither ingest nor the scheduler.
+         * @param due The due callbacks.
+         * @param fired The vector to collect the fired callbacks in.
+         */
+        void fire(const vector<ScheduledCallback> &due, vector<FiredCallback> &fired) {
+            if (due.empty()) return;
+            METRICS_TIME(Histogram::FireLatency);
+            shared_ptr<CallbackSink> target;
+            {
+                lock_guard<mutex> guard(schedulerMutex);
+                target = sink;
+            }
+            fired.clear();
+            {
+                unique_lock<mutex> indexerGuard;
+                if (indexerMutex) indexerGuard = unique_lock<mutex>(*indexerMutex);
+                for (const ScheduledCallback &callback : due) {
+                    const IndexedAccount *account = indexer.findLatestAccount(callback.id);
+                    if (!account || account->version != callback.version) continue;
+                    fired.push_back(FiredCallback{callback.id, &indexer.getAccountId(callback.id), callback.version, callback.deadline});
+                }
+            }
+            if (!fired.empty() && target) target->deliver(fired);
+#if ACCOUNT_INDEXING_METRICS
+            METRICS_COUNT(Counter::CallbacksFired, fired.size());
+            METRICS_COUNT(Counter::CallbacksDropped, due.size() - fired.size());
+            // Deadlines ahead of the clock, as when firing against a simulated time, count as no lag
+            chrono::system_clock::time_point firedAt = chrono::system_clock::now();
+            for (const FiredCallback &callback : fired) {
+                chrono::nanoseconds lag = firedAt - callback.deadline;
+                METRICS_RECORD(Histogram::FireLag, lag.count() > 0 ? static_cast<uint64_t>(lag.count()) : 0);
+            }
+#endif
+        }
+
+        /**
+         * Body of the dispatcher thread. Sleeps until the scheduler's next deadline or until an
+         * earlier callback is scheduled, then fires everything due by then as one batch.
+         */
+        void dispatch() {
+            vector<ScheduledCallback> due;
+            vector<FiredCallback> fired;
+            unique_lock<mutex> guard(schedulerMutex);
+            while (true) {
+                due.clear();
+                scheduler->expire(chrono::system_clock::now(), due);
+                if (!due.empty()) {
+                    guard.unlock();
+                    fire(due, fired);
+                    guard.lock();
+                    continue;
+                }
+                if (stopping && (!draining || scheduler->size() == 0)) break;
+
+                if (scheduler->nextDeadline(wakeAt)) {
+                    wakeup.wait_until(guard, wakeAt);
+                }
+                else {
+                    wakeAt = chrono::system_clock::time_point::max();
+                    wakeup.wait(guard);
+                }
+                wakeAt = chrono::system_clock::time_point::max();
+            }
+        }
+
+        // Wake the dispatcher if the given deadline is earlier than the one it sleeps until
+        void notifyDispatcher(chrono::system_clock::time_point deadline) {
+            if (dispatcher.joinable() && deadline < wakeAt) wakeup.notify_one();
+        }
+
+    public:
+        /**
+         * Construct a CallbackManager.
+         * @param indexer The indexer that accounts are resolved from when their callbacks fire.
+         * @param type The data structure to keep the pending callbacks in, unless the policy fixes it.
+         */
+        explicit BasicCallbackManager(const Indexer &indexer, SchedulerType type = SchedulerType::BinaryHeap)
+            : scheduler(type), indexer(indexer), sink(make_shared<ConsoleCallbackSink>()),
+              indexerMutex(nullptr), stopping(false),
+              draining(false), wakeAt(chrono::system_clock::time_point::max()) {}
+
+        BasicCallbackManager(const BasicCallbackManager &) = delete;
+        BasicCallbackManager &operator=(const BasicCallbackManager &) = delete;
+
+        // A running dispatcher is stopped without waiting for the pending callbacks, which may be due
+        // hours from now; stopDispatcher(true) first fires them at their deadlines
+        ~BasicCallbackManager() {
+            stopDispatcher(false);
+        }
+
+        /**
+         * Set the sink that fired callbacks are delivered to. The previous sink is released once any
+         * batch it is delivering has been delivered.
+         * @param callbackSink The new sink, or null to discard fired callbacks.
+         */
+        void setSink(shared_ptr<CallbackSink> callbackSink) {
+            lock_guard<mutex> guard(schedulerMutex);
+            sink = callbackSink;
+        }
+
+        /**
+         * Start the dispatcher thread, which fires callbacks when they are due, independently of
+         * fireCallbacks. The indexer must then only be modified while holding indexerMutex.
+         * @param indexerMutex The mutex guarding modifications of the indexer.
+         */
+        void startDispatcher(mutex &indexerMutex) {
+            if (dispatcher.joinable()) return;
+            this->indexerMutex = &indexerMutex;
+            stopping = false;
+            dispatcher = thread(&BasicCallbackManager::dispatch, this);
+        }
+
+        /**
+         * Stop the dispatcher thread, if it is running.
+         * @param drain If true, the dispatcher first fires every pending callback at its deadline,
+         * including ones scheduled while it drains. Otherwise pending callbacks are kept for polling.
+         */
+        void stopDispatcher(bool drain = true) {
+            if (!dispatcher.joinable()) return;
+            {
+                lock_guard<mutex> guard(schedulerMutex);
+                stopping = true;
+                draining = drain;
+            }
+            wakeup.notify_one();
+            dispatcher.join();
+            indexerMutex = nullptr;
+        }
+
+        /**
+         * Check whether the dispatcher thread is running.
+         * @return True if due callbacks are fired by the dispatcher.
+         */
+        bool isDispatching() const {
+            return dispatcher.joinable();
+        }
+
+        /**
+         * Schedule a callback for the given account at the specified time.
+         * @param account The account associated with the callback.
+         * @param callbackTime The time at which the callback should be triggered.
+         */
+        void scheduleCallback(const IndexedAccount &account, chrono::system_clock::time_point callbackTime) {
+            METRICS_COUNT(Counter::CallbacksScheduled, 1);
+            lock_guard<mutex> guard(schedulerMutex);
+            scheduler->schedule(ScheduledCallback{callbackTime, account.id, account.version});
+            notifyDispatcher(callbackTime);
+        }
+
+        /**
+         * Replace the pending callback of the given account's previous version with one for this
+         * version, in place, or schedule it if the account has no pending callback.
+         * @param account The new version of the account.
+         * @param callbackTime The time at which the callback should be triggered.
+         */
+        void rescheduleCallback(const IndexedAccount &account, chrono::system_clock::time_point callbackTime) {
+            METRICS_COUNT(Counter::CallbacksScheduled, 1);
+            lock_guard<mutex> guard(schedulerMutex);
+            scheduler->reschedule(ScheduledCallback{callbackTime, account.id, account.version});
+            notifyDispatcher(callbackTime);
+        }
+
+        /**
+         * Replace or schedule the pending callbacks of a batch of account versions, as rescheduleCallback
+         * does one by one, under a single lock and with at most one wakeup of the dispatcher.
+         * @param callbacks The new callbacks, at most one per account.
+         */
+        void rescheduleCallbacks(const vector<ScheduledCallback> &callbacks) {
+            if (callbacks.empty()) return;
+            METRICS_COUNT(Counter::CallbacksScheduled, callbacks.size());
+            lock_guard<mutex> guard(schedulerMutex);
+            chrono::system_clock::time_point earliest = chrono::system_clock::time_point::max();
+            for (const ScheduledCallback &callback : callbacks) {
+                scheduler->reschedule(callback);
+                earliest = min(earliest, callback.deadline);
+            }
+            notifyDispatcher(earliest);
+        }
+
+        /**
+         * Cancel the callback associated with the given account.
+         * @param id The handle of the account for which the callback should be canceled.
+         */
+        void cancelCallback(IdHandle id) {
+            lock_guard<mutex> guard(schedulerMutex);
+            if (scheduler->cancel(id)) {
+                METRICS_COUNT(Counter::CallbacksCancelled, 1);
+            }
+        }
+
+        /**
+         * Fire the callbacks that have reached or passed the current time.
+         * The account of each due callback is looked up in the indexer at this point; a callback whose
+         * account version is no longer indexed is dropped without firing.
+         * @param currentTime The current time.
+         */
+        void fireCallbacks(std::chrono::system_clock::time_point currentTime) {
+            dueCallbacks.clear();
+            {
+                lock_guard<mutex> guard(schedulerMutex);
+                scheduler->expire(currentTime, dueCallbacks);
+            }
+            fire(dueCallbacks, firedCallbacks);
+        }
+
+        /**
+         * Get a copy of the pending callbacks.
+         * @return The pending callbacks, in no particular order.
+         */
+        vector<ScheduledCallback> pendingCallbacks() const {
+            vector<ScheduledCallback> pending;
+            lock_guard<mutex> guard(schedulerMutex);
+            pending.reserve(scheduler->size());
+            scheduler->collect(pending);
+            return pending;
+        }
+
+        /**
+         * Check whether the given account version has a pending callback.
+         * @param id The handle of the account.
+         * @param version The version of the account.
+         * @return True if the account's pending callback is for that version.
+         */
+        bool hasPendingCallback(IdHandle id, int version) const {
+            lock_guard<mutex> guard(schedulerMutex);
+            return scheduler->isPending(id, version);
+        }
+
+        /**
+         * Get the number of pending callbacks.
+         * @return The number of pending callbacks.
+         */
+        size_t size() const {
+            lock_guard<mutex> guard(schedulerMutex);
+            return scheduler->size();
+        }
+};
+
+typedef BasicCallbackManager<DefaultAccountPolicy> CallbackManager;
+
+#endif // CALLBACK_MANAGER_H
@@ -0,0 +1,436 @@
+/**
+ * @file CallbackScheduler.h
+ * @brief Schedulers for pending account callbacks
+ *
+ * Defines the pending callback record and the schedulers the CallbackManager can be built on: an
+ * indexed heap in exact deadline order, and a hierarchical timing wheel for large numbers of
+ * callbacks that all fall due within a narrow window.
+ */
+
+#ifndef CALLBACK_SCHEDULER_H
+#define CALLBACK_SCHEDULER_H
+
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "Account.h"
+
+// A pending callback: when it is due and which account version it is for. The account itself is
+// resolved from the indexer only when the callback fires.
+struct ScheduledCallback {
+    chrono::system_clock::time_point deadline;
+    IdHandle id;
+    int version;
+};
+
+// Custom Comparator to heapify based on time
+struct AccountTimeComparator {
+    bool operator()(const ScheduledCallback &a, const ScheduledCallback &b) const {
+        return a.deadline > b.deadline; // Compare based on the callback time
+    }
+};
+
+// Selects the data structure a CallbackManager keeps its pending callbacks in
+enum class SchedulerType {
+    BinaryHeap,   // Indexed 4-ary heap: O(log n) schedule, cancel and reschedule, exact deadline order
+    TimingWheel   // O(1) schedule and cancel, expiry in batches of 1 ms ticks
+};
+
+/**
+ * Interface of the pending callback schedulers. An account has at most one pending callback, so
+ * callbacks are identified by their account's id handle.
+ */
+class CallbackScheduler {
+    public:
+        virtual ~CallbackScheduler() {}
+
+        /**
+         * Add a pending callback, replacing the account's pending callback if it has one.
+         * @param callback The callback to be scheduled.
+         */
+        virtual void schedule(const ScheduledCallback &callback) = 0;
+
+        /**
+         * Replace the account's pending callback in place, or schedule it if the account has none.
+         * @param callback The new callback of the account.
+         * @return True if a pending callback was replaced.
+         */
+        virtual bool reschedule(const ScheduledCallback &callback) = 0;
+
+        /**
+         * Remove the pending callback of the given account.
+         * @param id The handle of the account.
+         * @return True if a pending callback was removed.
+         */
+        virtual bool cancel(IdHandle id) = 0;
+
+        /**
+         * Remove every callback that is due at the given time and append it to due.
+         * @param currentTime The current time.
+         * @param due The vector to append the due callbacks to.
+         */
+        virtual void expire(chrono::system_clock::time_point currentTime, vector<ScheduledCallback> &due) = 0;
+
+        /**
+         * Get the earliest time at which expire may return a callback. It is never later than the
+         * earliest pending deadline, but may be earlier.
+         * @param deadline Set to that time if a callback is pending.
+         * @return False if no callback is pending.
+         */
+        virtual bool nextDeadline(chrono::system_clock::time_point &deadline) const = 0;
+
+        /**
+         * Check whether the given account version has a pending callback.
+         * @param id The handle of the account.
+         * @param version The version of the account.
+         * @return True if the account's pending callback is for that version.
+         */
+        virtual bool isPending(IdHandle id, int version) const = 0;
+
+        /**
+         * Append a copy of every pending callback, in no particular order.
+         * @param pending The vector to append the pending callbacks to.
+         */
+        virtual void collect(vector<ScheduledCallback> &pending) const = 0;
+
+        /**
+         * Get the number of pending callbacks.
+         * @return The number of pending callbacks.
+         */
+        virtual size_t size() const = 0;
+};
+
+/**
+ * Indexed 4-ary min-heap on deadline. The position of every pending callback is kept in positionOf,
+ * indexed by id handle, and updated on every move, so cancel and reschedule go straight to the entry
+ * and restore the heap with a single sift. Four children per node make the heap shallower than a
+ * binary one, and the children of a node share a cache line.
+ */
+class HeapCallbackScheduler final : public CallbackScheduler {
+    private:
+        enum : uint32_t { kNil = 0xFFFFFFFFu };
+        enum { kArity = 4 };
+
+        // Using a heap to store callbacks provides an efficient way
+        // to manage and retrieve the callbacks based on their scheduled time
+        vector<ScheduledCallback> callbacks;
+        // Heap position of every account's pending callback, indexed by id handle
+        vector<uint32_t> positionOf;
+
+        void place(size_t index, const ScheduledCallback &callback) {
+            callbacks[index] = callback;
+            positionOf[callback.id] = static_cast<uint32_t>(index);
+        }
+
+        void siftUp(size_t index) {
+            ScheduledCallback callback = callbacks[index];
+            while (index > 0) {
+                size_t parent = (index - 1) / kArity;
+                if (!(callback.deadline < callbacks[parent].deadline)) break;
+                place(index, callbacks[parent]);
+                index = parent;
+            }
+            place(index, callback);
+        }
+
+        void siftDown(size_t index) {
+            ScheduledCallback callback = callbacks[index];
+            size_t count = callbacks.size();
+            while (true) {
+                size_t first = index * kArity + 1;
+                if (first >= count) break;
+                size_t last = std::min(first + kArity, count);
+                size_t earliest = first;
+                for (size_t child = first + 1; child < last; ++child) {
+                    if (callbacks[child].deadline < callbacks[earliest].deadline) earliest = child;
+                }
+                if (!(callbacks[earliest].deadline < callback.deadline)) break;
+                place(index, callbacks[earliest]);
+                index = earliest;
+            }
+            place(index, callback);
+        }
+
+        // Sift the entry at index whichever way its deadline requires
+        void restore(size_t index) {
+            if (index > 0 && callbacks[index].deadline < callbacks[(index - 1) / kArity].deadline) siftUp(index);
+            else siftDown(index);
+        }
+
+        /**
+         * Remove the callback at the given index from the heap.
+         * @param index The index of the callback to be removed.
+         * The last callback is moved into the hole and sifted up or down from there.
+         */
+        void removeAtIndex(size_t index) {
+            positionOf[callbacks[index].id] = kNil;
+            ScheduledCallback last = callbacks.back();
+            callbacks.pop_back();
+            if (index < callbacks.size()) {
+                place(index, last);
+                restore(index);
+            }
+        }
+
+    public:
+        void schedule(const ScheduledCallback &callback) override {
+            reschedule(callback);
+        }
+
+        bool reschedule(const ScheduledCallback &callback) override {
+            if (callback.id >= positionOf.size()) {
+                positionOf.resize(callback.id + 1, kNil);
+            }
+            uint32_t position = positionOf[callback.id];
+            if (position != kNil) {
+                place(position, callback);
+                restore(position);
+                return true;
+            }
+            callbacks.push_back(callback);
+            siftUp(callbacks.size() - 1);
+            return false;
+        }
+
+        bool cancel(IdHandle id) override {
+            if (id >= positionOf.size() || positionOf[id] == kNil) return false;
+            removeAtIndex(positionOf[id]);
+            return true;
+        }
+
+        void expire(chrono::system_clock::time_point currentTime, vector<ScheduledCallback> &due) override {
+            while (!callbacks.empty() && callbacks.front().deadline <= currentTime) {
+                due.push_back(callbacks.front());
+                removeAtIndex(0);
+            }
+        }
+
+        bool nextDeadline(chrono::system_clock::time_point &deadline) const override {
+            if (callbacks.empty()) return false;
+            deadline = callbacks.front().deadline;
+            return true;
+        }
+
+        bool isPending(IdHandle id, int version) const override {
+            return id < positionOf.size() && positionOf[id] != kNil && callbacks[positionOf[id]].version == version;
+        }
+
+        void collect(vector<ScheduledCallback> &pending) const override {
+            pending.insert(pending.end(), callbacks.begin(), callbacks.end());
+        }
+
+        size_t size() const override {
+            return callbacks.size();
+        }
+};
+
+/**
+ * Hierarchical timing wheel. Time is cut into ticks (1 ms by default) and a callback is filed in a
+ * slot by its deadline tick: level 0 has one slot per tick for the next 256 ticks, and each of the
+ * three levels above has 64 slots, each covering 64 times the span of a slot of the level below (so
+ * together about 18.6 hours at 1 ms ticks; anything later waits in an overflow list). When the
+ * current tick enters a higher level slot, that slot is cascaded down, so a callback is moved at
+ * most once per level. Slots are intrusive doubly linked lists over a node pool, so schedule and
+ * cancel are O(1), and a tick expires its whole slot at once.
+ *
+ * A callback fires on the first tick at or after its deadline: never early, and at most one tick late.
+ */
+class TimingWheelCallbackScheduler final : public CallbackScheduler {
+    private:
+        // Enumerators rather than static members, so that passing them by reference needs no definition
+        enum : uint32_t { kNil = 0xFFFFFFFFu };
+        enum { kLevel0Bits = 8, kLevelBits = 6, kLevels = 4 };
+        enum : uint32_t {
+            kLevel0Slots = 1u << kLevel0Bits,
+            kLevelSlots = 1u << kLevelBits,
+            kSlotCount = kLevel0Slots + (kLevels - 1) * kLevelSlots,
+            // Two extra lists after the wheel slots: callbacks already due, and callbacks beyond the top level
+            kOverdueList = kSlotCount,
+            kOverflowList = kSlotCount + 1
+        };
+
+        struct Node {
+            ScheduledCallback callback;
+            uint64_t tick;
+            uint32_t prev;
+            uint32_t next;
+            uint32_t list;
+        };
+
+        chrono::system_clock::time_point origin;
+        chrono::system_clock::duration tickLength;
+        // The last tick that has been expired
+        uint64_t currentTick;
+        vector<Node> nodes;
+        uint32_t freeNodes;
+        vector<uint32_t> heads;
+        // Node of every account's pending callback, indexed by id handle
+        vector<uint32_t> nodeOf;
+        size_t pending;
+
+        uint64_t deadlineTick(chrono::system_clock::time_point deadline) const {
+            if (deadline <= origin) return 0;
+            // Round up, so that a callback never fires before its deadline
+            return static_cast<uint64_t>((deadline - origin + tickLength - chrono::system_clock::duration(1)) / tickLength);
+        }
+
+        uint32_t listFor(uint64_t tick) const {
+            if (tick <= currentTick) return kOverdueList;
+            uint64_t delta = tick - currentTick;
+            if (delta < kLevel0Slots) return static_cast<uint32_t>(tick & (kLevel0Slots - 1));
+            for (int level = 1; level < kLevels; ++level) {
+                int shift = kLevel0Bits + level * kLevelBits;
+                if (delta < (uint64_t(1) << shift)) {
+                    uint32_t slot = static_cast<uint32_t>((tick >> (shift - kLevelBits)) & (kLevelSlots - 1));
+                    return kLevel0Slots + (level - 1) * kLevelSlots + slot;
+                }
+            }
+            return kOverflowList;
+        }
+
+        void link(uint32_t index) {
+            Node &node = nodes[index];
+            node.list = listFor(node.tick);
+            node.prev = kNil;
+            node.next = heads[node.list];
+            if (node.next != kNil) nodes[node.next].prev = index;
+            heads[node.list] = index;
+        }
+
+        void unlink(uint32_t index) {
+            Node &node = nodes[index];
+            if (node.prev != kNil) nodes[node.prev].next = node.next;
+            else heads[node.list] = node.next;
+            if (node.next != kNil) nodes[node.next].prev = node.prev;
+        }
+
+        void release(uint32_t index, vector<ScheduledCallback> *due) {
+            Node &node = nodes[index];
+            if (due) due->push_back(node.callback);
+            nodeOf[node.callback.id] = kNil;
+            node.next = freeNodes;
+            freeNodes = index;
+            --pending;
+        }
+
+        // Detach a whole list and hand every node in it to the visitor
+        template <typename Visitor>
+        void drainList(uint32_t list, Visitor visit) {
+            uint32_t index = heads[list];
+            heads[list] = kNil;
+            while (index != kNil) {
+                uint32_t next = nodes[index].next;
+                visit(index);
+                index = next;
+            }
+        }
+
+        void cascade(uint32_t list) {
+            drainList(list, [this](uint32_t index) { link(index); });
+        }
+
+        void advanceTo(uint64_t tick, vector<ScheduledCallback> &due) {
+            while (currentTick < tick) {
+                if (pending == 0) {
+                    currentTick = tick;
+                    return;
+                }
+                ++currentTick;
+                for (int level = 1; level < kLevels; ++level) {
+                    int shift = kLevel0Bits + (level - 1) * kLevelBits;
+                    if (currentTick & ((uint64_t(1) << shift) - 1)) break;
+                    uint32_t slot = static_cast<uint32_t>((currentTick >> shift) & (kLevelSlots - 1));
+                    cascade(kLevel0Slots + (level - 1) * kLevelSlots + slot);
+                    if (level == kLevels - 1) cascade(kOverflowList);
+                }
+                // Cascading files callbacks due on this very tick in the overdue list
+                drainList(kOverdueList, [this, &due](uint32_t index) { release(index, &due); });
+                drainList(static_cast<uint32_t>(currentTick & (kLevel0Slots - 1)),
+                          [this, &due](uint32_t index) { release(index, &due); });
+            }
+        }
+
+    public:
+        /**
+         * Construct a timing wheel.
+         * @param origin The time of tick 0. Deadlines before it are due immediately.
+         * @param tickLength The granularity of the wheel.
+         */
+        explicit TimingWheelCallbackScheduler(
+            chrono::system_clock::time_point origin = chrono::system_clock::now(),
+            chrono::system_clock::duration tickLength = chrono::milliseconds(1))
+            : origin(origin), tickLength(tickLength), currentTick(0), freeNodes(kNil),
+              heads(kSlotCount + 2, kNil), pending(0) {}
+
+        void schedule(const ScheduledCallback &callback) override {
+            if (callback.id >= nodeOf.size()) {
+                nodeOf.resize(callback.id + 1, kNil);
+            }
+            cancel(callback.id);
+
+            uint32_t index = freeNodes;
+            if (index != kNil) {
+                freeNodes = nodes[index].next;
+            }
+            else {
+                index = static_cast<uint32_t>(nodes.size());
+                nodes.emplace_back();
+            }
+            nodes[index].callback = callback;
+            nodes[index].tick = deadlineTick(callback.deadline);
+            link(index);
+            nodeOf[callback.id] = index;
+            ++pending;
+        }
+
+        bool reschedule(const ScheduledCallback &callback) override {
+            bool replaced = callback.id < nodeOf.size() && nodeOf[callback.id] != kNil;
+            schedule(callback);
+            return replaced;
+        }
+
+        bool cancel(IdHandle id) override {
+            if (id >= nodeOf.size() || nodeOf[id] == kNil) return false;
+            uint32_t index = nodeOf[id];
+            unlink(index);
+            release(index, nullptr);
+            return true;
+        }
+
+        void expire(chrono::system_clock::time_point currentTime, vector<ScheduledCallback> &due) override {
+            drainList(kOverdueList, [this, &due](uint32_t index) { release(index, &due); });
+            if (currentTime < origin) return;
+            advanceTo(static_cast<uint64_t>((currentTime - origin) / tickLength), due);
+        }
+
+        // The next tick whose level 0 slot is occupied, or the next level 1 cascade if that comes first
+        bool nextDeadline(chrono::system_clock::time_point &deadline) const override {
+            if (pending == 0) return false;
+            uint64_t tick = currentTick;
+            if (heads[kOverdueList] == kNil) {
+                uint64_t cascadeTick = (currentTick | (kLevel0Slots - 1)) + 1;
+                for (tick = currentTick + 1; tick < cascadeTick; ++tick) {
+                    if (heads[tick & (kLevel0Slots - 1)] != kNil) break;
+                }
+            }
+            deadline = origin + tickLength * static_cast<chrono::system_clock::rep>(tick);
+            return true;
+        }
+
+        bool isPending(IdHandle id, int version) const override {
+            return id < nodeOf.size() && nodeOf[id] != kNil && nodes[nodeOf[id]].callback.version == version;
+        }
+
+        void collect(vector<ScheduledCallback> &pendingCallbacks) const override {
+            for (uint32_t index : nodeOf) {
+                if (index != kNil) pendingCallbacks.push_back(nodes[index].callback);
+            }
+        }
+
+        size_t size() const override {
+            return pending;
+        }
+};
+
+#endif // CALLBACK_SCHEDULER_H
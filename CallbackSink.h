@@ -0,0 +1,255 @@
+/**
+ * @file CallbackSink.h
+ * @brief Destinations for fired account callbacks
+ *
+ * The CallbackManager hands every batch of fired callbacks to a CallbackSink. Sinks are called on
+ * the thread that fires the callbacks, after the index has been unlocked, so they run concurrently
+ * with ingest and must not touch the index; each record carries its account id, resolved while the
+ * index was locked. A sink that may be slow still holds up the firing thread, so it should hand the
+ * batch on rather than process it in place: the QueuedCallbackSink copies the records into a bounded
+ * queue that a pool of worker threads drains.
+ */
+
+#ifndef CALLBACK_SINK_H
+#define CALLBACK_SINK_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "Account.h"
+#include "AccountIndexer.h"
+#include "BoundedQueue.h"
+
+// A fired callback: the account version it was scheduled for, and when it was due. The account id
+// points into the indexer's interning table, whose strings never move or change once interned.
+struct FiredCallback {
+    IdHandle id;
+    const string *accountId;
+    int version;
+    chrono::system_clock::time_point deadline;
+};
+
+class CallbackSink {
+    public:
+        virtual ~CallbackSink() {}
+
+        /**
+         * Receive a batch of fired callbacks. Must not keep a reference to the batch.
+         * @param batch The fired callbacks, in the order they fell due.
+         */
+        virtual void deliver(const vector<FiredCallback> &batch) = 0;
+};
+
+/**
+ * Prints "Callback fired for Account <id> v<version>" for every fired callback, writing each batch to
+ * stdout in one go with a single flush.
+ */
+class ConsoleCallbackSink : public CallbackSink {
+    private:
+        ostringstream buffer;
+
+    public:
+        void deliver(const vector<FiredCallback> &batch) override {
+            buffer.str(string());
+            for (const FiredCallback &callback : batch) {
+                buffer << "Callback fired for Account " << *callback.accountId << " v" << callback.version << '\n';
+            }
+            cout << buffer.str() << flush;
+        }
+};
+
+/**
+ * Appends a "<id>,<version>,<deadline in ms since the epoch>" line per fired callback to a file. Lines
+ * are collected in memory and written out once the buffer reaches its limit, and on destruction.
+ */
+class BufferedFileCallbackSink : public CallbackSink {
+    private:
+        ofstream file;
+        string buffer;
+        size_t bufferLimit;
+
+    public:
+        /**
+         * Construct a file sink.
+         * @param filename The file to append to.
+         * @param bufferLimit The number of buffered bytes that triggers a write.
+         */
+        explicit BufferedFileCallbackSink(const string &filename, size_t bufferLimit = 64 * 1024)
+            : file(filename, ios::app), bufferLimit(bufferLimit) {
+            if (!file.is_open()) {
+                cerr << "Failed to open the file: " << filename << endl;
+            }
+            buffer.reserve(bufferLimit);
+        }
+
+        ~BufferedFileCallbackSink() {
+            flush();
+        }
+
+        void deliver(const vector<FiredCallback> &batch) override {
+            for (const FiredCallback &callback : batch) {
+                long long deadlineMs = chrono::duration_cast<chrono::milliseconds>(callback.deadline.time_since_epoch()).count();
+                buffer += *callback.accountId;
+                buffer += ',';
+                buffer += to_string(callback.version);
+                buffer += ',';
+                buffer += to_string(deadlineMs);
+                buffer += '\n';
+            }
+            if (buffer.size() >= bufferLimit) flush();
+        }
+
+        /**
+         * Write the buffered lines to the file.
+         */
+        void flush() {
+            if (buffer.empty()) return;
+            file.write(buffer.data(), buffer.size());
+            file.flush();
+            buffer.clear();
+        }
+};
+
+/**
+ * Passes every batch to a user supplied function, on the firing thread.
+ */
+class FunctionCallbackSink : public CallbackSink {
+    private:
+        function<void(const vector<FiredCallback> &)> handler;
+
+    public:
+        explicit FunctionCallbackSink(function<void(const vector<FiredCallback> &)> handler) : handler(handler) {}
+
+        void deliver(const vector<FiredCallback> &batch) override {
+            handler(batch);
+        }
+};
+
+// What a QueuedCallbackSink does with fired callbacks while its queue is full
+enum class BackpressurePolicy {
+    Drop,   // Discard them, and count them as dropped
+    Block,  // Wait for room in the queue, stalling the firing thread
+    Spill   // Keep them in an unbounded overflow list that the workers drain after the queue
+};
+
+/**
+ * Copies fired callbacks into a bounded queue that a pool of worker threads drains, calling the
+ * handler for every record. The handler runs concurrently with ingest and must not touch the index;
+ * the record's accountId is safe to read. Destroying the sink lets the workers finish every queued and spilled record.
+ */
+class QueuedCallbackSink : public CallbackSink {
+    private:
+        enum { kWorkerBatch = 64 };
+
+        function<void(const FiredCallback &)> handler;
+        BackpressurePolicy policy;
+        BoundedQueue<FiredCallback> queue;
+        // Records that did not fit in the queue under the Spill policy, oldest first
+        mutex spillMutex;
+        deque<FiredCallback> spill;
+        vector<thread> workers;
+        atomic<uint64_t> handled;
+        atomic<uint64_t> dropped;
+        atomic<uint64_t> spilled;
+
+        // Move spilled records into the queue while there is room, so they go ahead of newer ones
+        void refill() {
+            lock_guard<mutex> guard(spillMutex);
+            while (!spill.empty() && queue.tryPush(spill.front())) {
+                spill.pop_front();
+            }
+        }
+
+        // Take spilled records once the queue is closed and empty
+        size_t takeSpilled(vector<FiredCallback> &batch) {
+            lock_guard<mutex> guard(spillMutex);
+            size_t taken = 0;
+            while (taken < kWorkerBatch && !spill.empty()) {
+                batch.push_back(spill.front());
+                spill.pop_front();
+                ++taken;
+            }
+            return taken;
+        }
+
+        void work() {
+            vector<FiredCallback> batch;
+            batch.reserve(kWorkerBatch);
+            while (true) {
+                batch.clear();
+                if (queue.popBatch(batch, kWorkerBatch) > 0) {
+                    if (policy == BackpressurePolicy::Spill) refill();
+                }
+                else if (takeSpilled(batch) == 0) {
+                    return;
+                }
+                for (const FiredCallback &callback : batch) {
+                    handler(callback);
+                }
+                handled += batch.size();
+            }
+        }
+
+    public:
+        /**
+         * Construct a queued sink and start its workers.
+         * @param handler The function called for every fired callback, on a worker thread.
+         * @param capacity The capacity of the queue.
+         * @param workerCount The number of worker threads.
+         * @param policy What to do with fired callbacks while the queue is full.
+         */
+        QueuedCallbackSink(function<void(const FiredCallback &)> handler, size_t capacity = 4096,
+                           size_t workerCount = 1, BackpressurePolicy policy = BackpressurePolicy::Drop)
+            : handler(handler), policy(policy), queue(capacity), handled(0), dropped(0), spilled(0) {
+            if (workerCount == 0) workerCount = 1;
+            for (size_t i = 0; i < workerCount; ++i) {
+                workers.push_back(thread(&QueuedCallbackSink::work, this));
+            }
+        }
+
+        ~QueuedCallbackSink() {
+            queue.close();
+            for (thread &worker : workers) {
+                worker.join();
+            }
+        }
+
+        void deliver(const vector<FiredCallback> &batch) override {
+            for (const FiredCallback &callback : batch) {
+                switch (policy) {
+                    case BackpressurePolicy::Block:
+                        queue.push(callback);
+                        break;
+                    case BackpressurePolicy::Spill: {
+                        lock_guard<mutex> guard(spillMutex);
+                        if (spill.empty() && queue.tryPush(callback)) break;
+                        spill.push_back(callback);
+                        ++spilled;
+                        break;
+                    }
+                    case BackpressurePolicy::Drop:
+                    default:
+                        if (!queue.tryPush(callback)) ++dropped;
+                        break;
+                }
+            }
+        }
+
+        // The number of records the handler has been called for
+        uint64_t getHandledCount() const { return handled; }
+        // The number of records discarded under the Drop policy
+        uint64_t getDroppedCount() const { return dropped; }
+        // The number of records that went to the overflow list under the Spill policy
+        uint64_t getSpilledCount() const { return spilled; }
+};
+
+#endif // CALLBACK_SINK_H
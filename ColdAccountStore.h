@@ -0,0 +1,309 @@
+/**
+ * @file ColdAccountStore.h
+ * @brief Disk-backed tier the indexer evicts cold account versions to
+ *
+ * An append-only scratch file of account records in the encoding of AccountWire.h, read back through
+ * a shared memory mapping of the file. Appends are buffered and written in blocks; a record still in
+ * the buffer is read from it. Evicting a record back out of the tier only marks its bytes as garbage,
+ * and once the garbage outweighs the live records the live ones are copied to a fresh file.
+ *
+ * The file is a cache of this process, created empty and removed on close: the durable copies of the
+ * accounts are the checkpoint and the write-ahead log. The pages read from it are file-backed, so the
+ * kernel can reclaim them under memory pressure, unlike the indexer's own memory.
+ */
+
+#ifndef COLD_ACCOUNT_STORE_H
+#define COLD_ACCOUNT_STORE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "Account.h"
+#include "AccountWire.h"
+
+// Location of an account record in the cold tier's file
+struct ColdRecord {
+    uint64_t offset;
+    uint32_t length;
+};
+
+/**
+ * An open cold tier file. Its records never change once written, so it can be shared with snapshot
+ * readers and a checkpoint being written on other threads, which read them with pread while the tier
+ * appends to the file or replaces it with a compacted one.
+ */
+class ColdAccountFile {
+    private:
+        int fd;
+
+    public:
+        explicit ColdAccountFile(int fd) : fd(fd) {}
+
+        ColdAccountFile(const ColdAccountFile &) = delete;
+        ColdAccountFile &operator=(const ColdAccountFile &) = delete;
+
+        ~ColdAccountFile() {
+            ::close(fd);
+        }
+
+        int descriptor() const { return fd; }
+
+        /**
+         * Read the encoded bytes of a record.
+         * @param record The location of the record.
+         * @param out The string to read the bytes into.
+         * @return False if the file could not be read.
+         */
+        bool read(const ColdRecord &record, string &out) const {
+            out.resize(record.length);
+            size_t done = 0;
+            while (done < record.length) {
+                ssize_t got = pread(fd, &out[done], record.length - done, static_cast<off_t>(record.offset + done));
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) return false;
+                done += static_cast<size_t>(got);
+            }
+            return true;
+        }
+};
+
+class ColdAccountStore {
+    private:
+        enum : size_t { kWriteBufferBytes = 64 * 1024, kMinMappingBytes = 1 << 20, kMinCompactionBytes = 16 << 20 };
+
+        string path;
+        shared_ptr<ColdAccountFile> file;
+        const char *mapping;
+        size_t mappedLength;
+        // The bytes written to the file, and the records appended after them, not written yet
+        uint64_t flushedBytes;
+        string writeBuffer;
+        // The bytes of the records still in the tier
+        uint64_t liveBytes;
+
+        static bool writeAll(int fd, const char *data, size_t length, uint64_t offset) {
+            while (length > 0) {
+                ssize_t written = pwrite(fd, data, length, static_cast<off_t>(offset));
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                data += written;
+                length -= static_cast<size_t>(written);
+                offset += static_cast<uint64_t>(written);
+            }
+            return true;
+        }
+
+        void unmap() {
+            if (mapping) munmap(const_cast<char *>(mapping), mappedLength);
+            mapping = nullptr;
+            mappedLength = 0;
+        }
+
+        // Map at least the given length of the file, doubling the mapping so that it is remapped rarely.
+        // Mapping past the end of the file is allowed as long as those pages are never touched.
+        bool mapAtLeast(uint64_t length) {
+            size_t grown = max<size_t>(mappedLength, kMinMappingBytes);
+            while (grown < length) grown *= 2;
+            void *mapped = mmap(nullptr, grown, PROT_READ, MAP_SHARED, file->descriptor(), 0);
+            if (mapped == MAP_FAILED) {
+                cerr << "Failed to map the cold account file: " << path << endl;
+                return false;
+            }
+            unmap();
+            mapping = static_cast<const char *>(mapped);
+            mappedLength = grown;
+            madvise(mapped, grown, MADV_RANDOM);
+            return true;
+        }
+
+        // The encoded bytes of a record, from the write buffer or the mapping
+        const char *locate(const ColdRecord &record) {
+            if (record.offset >= flushedBytes) return writeBuffer.data() + (record.offset - flushedBytes);
+            if (record.offset + record.length > mappedLength && !mapAtLeast(flushedBytes)) return nullptr;
+            return mapping + record.offset;
+        }
+
+    public:
+        ColdAccountStore() : mapping(nullptr), mappedLength(0), flushedBytes(0), liveBytes(0) {}
+
+        ColdAccountStore(const ColdAccountStore &) = delete;
+        ColdAccountStore &operator=(const ColdAccountStore &) = delete;
+
+        ~ColdAccountStore() {
+            close();
+        }
+
+        /**
+         * Create the tier's file, replacing any file of that name.
+         * @param filename The scratch file, removed again on close.
+         * @return False if the file could not be created.
+         */
+        bool open(const string &filename) {
+            close();
+            int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0) {
+                cerr << "Failed to open the file: " << filename << endl;
+                return false;
+            }
+            path = filename;
+            file = make_shared<ColdAccountFile>(fd);
+            writeBuffer.reserve(kWriteBufferBytes);
+            return true;
+        }
+
+        // Forget every record and remove the file; a checkpoint still reading it keeps it open
+        void close() {
+            if (!file) return;
+            unmap();
+            file.reset();
+            unlink(path.c_str());
+            path.clear();
+            flushedBytes = 0;
+            writeBuffer.clear();
+            liveBytes = 0;
+        }
+
+        bool isOpen() const { return file != nullptr; }
+
+        /**
+         * Write the buffered records to the file.
+         * @return False if they could not be written.
+         */
+        bool flush() {
+            if (writeBuffer.empty()) return true;
+            if (!writeAll(file->descriptor(), writeBuffer.data(), writeBuffer.size(), flushedBytes)) {
+                cerr << "Failed to write the cold account file: " << path << endl;
+                return false;
+            }
+            flushedBytes += writeBuffer.size();
+            writeBuffer.clear();
+            return true;
+        }
+
+        /**
+         * Append the record of an account.
+         * @param id The account's id.
+         * @param accountType The account's type.
+         * @param account The account.
+         * @param record Set to the location of the record.
+         * @return False if the buffered records could not be written to make room for it.
+         */
+        bool append(const string &id, const string &accountType, const IndexedAccount &account, ColdRecord &record) {
+            if (writeBuffer.size() >= kWriteBufferBytes && !flush()) return false;
+            size_t start = writeBuffer.size();
+            wire::putAccount(writeBuffer, id, accountType, account.tokens, account.callbackTimeMs, account.data, account.version);
+            record = ColdRecord{flushedBytes + start, static_cast<uint32_t>(writeBuffer.size() - start)};
+            liveBytes += record.length;
+            return true;
+        }
+
+        /**
+         * Decode the record of an account.
+         * @param record The location of the record.
+         * @param account The account to decode into.
+         * @return False if the record could not be mapped or is not a valid record.
+         */
+        bool read(const ColdRecord &record, Account &account) {
+            const char *p = locate(record);
+            if (!p || !wire::getAccount(p, p + record.length, account)) {
+                cerr << "Failed to read the cold account file: " << path << endl;
+                return false;
+            }
+            return true;
+        }
+
+        // Mark a record as garbage, for compaction to drop
+        void release(const ColdRecord &record) {
+            liveBytes -= record.length;
+        }
+
+        /**
+         * Check whether the garbage has grown past the live records, so that compact would at least
+         * halve the file.
+         * @return True if compaction is due.
+         */
+        bool needsCompaction() const {
+            uint64_t total = flushedBytes + writeBuffer.size();
+            return total >= kMinCompactionBytes && total - liveBytes > liveBytes;
+        }
+
+        /**
+         * Copy the given records, which must be every live record, to a fresh file that then replaces
+         * the tier's file, and update their locations.
+         * @param records The locations of the live records.
+         * @return False if the fresh file could not be written; the tier is left as it was.
+         */
+        bool compact(const vector<ColdRecord *> &records) {
+            if (!flush()) return false;
+            // Copied in file order, so the old file is read front to back
+            vector<ColdRecord *> ordered(records);
+            sort(ordered.begin(), ordered.end(), [](const ColdRecord *a, const ColdRecord *b) { return a->offset < b->offset; });
+            string compacted = path + ".compact";
+            int fd = ::open(compacted.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0) {
+                cerr << "Failed to open the file: " << compacted << endl;
+                return false;
+            }
+            shared_ptr<ColdAccountFile> fresh = make_shared<ColdAccountFile>(fd);
+            vector<uint64_t> offsets;
+            offsets.reserve(ordered.size());
+            uint64_t written = 0;
+            string block;
+            bool copied = true;
+            for (const ColdRecord *record : ordered) {
+                const char *p = locate(*record);
+                if (!p) {
+                    copied = false;
+                    break;
+                }
+                offsets.push_back(written + block.size());
+                block.append(p, record->length);
+                if (block.size() >= kWriteBufferBytes) {
+                    copied = writeAll(fd, block.data(), block.size(), written);
+                    if (!copied) break;
+                    written += block.size();
+                    block.clear();
+                }
+            }
+            copied = copied && writeAll(fd, block.data(), block.size(), written);
+            written += block.size();
+            if (!copied || rename(compacted.c_str(), path.c_str()) != 0) {
+                cerr << "Failed to compact the cold account file: " << path << endl;
+                unlink(compacted.c_str());
+                return false;
+            }
+            for (size_t i = 0; i < ordered.size(); ++i) {
+                ordered[i]->offset = offsets[i];
+            }
+            unmap();
+            file = fresh;
+            flushedBytes = written;
+            liveBytes = written;
+            return true;
+        }
+
+        /**
+         * Get the tier's file for a checkpoint to read records from, with the buffered records written.
+         * @return The file, which stays open for as long as it is held, or null if the buffered records
+         * could not be written.
+         */
+        shared_ptr<const ColdAccountFile> shareFile() {
+            return flush() ? file : nullptr;
+        }
+
+        // The bytes of the file including the buffered records, and of the live records among them
+        uint64_t getFileBytes() const { return flushedBytes + writeBuffer.size(); }
+        uint64_t getLiveBytes() const { return liveBytes; }
+};
+
+#endif // COLD_ACCOUNT_STORE_H
@@ -0,0 +1,309 @@
+/**
+ * @file ColumnarAccountFormat.h
+ * @brief Binary columnar file format for account updates, and its writer and memory-mapped reader
+ *
+ * A columnar file holds a sequence of account updates in the order they are to be ingested:
+ *
+ * - a header with a magic, an endianness mark, the format version, the row count, and a schema table
+ *   giving the name, element size, offset and length of every section;
+ * - the distinct ids, account types and data field names as dictionaries (uint32 end offsets followed
+ *   by the concatenated bytes);
+ * - the id and type of every row as uint32 dictionary indexes, and its tokens, version and
+ *   callbackTimeMs as int32 columns;
+ * - the data of every row as a uint64 offset column into a payload of (field name index, value) pairs.
+ *
+ * Sections are laid out as in SectionedFile.h, 8 byte aligned and in host byte order; a reader on a
+ * machine of the other byte order rejects the file. The reader maps the file and validates it once,
+ * after which every column is read in place: a replay interns each dictionary entry once and then
+ * ingests rows of integers.
+ */
+
+#ifndef COLUMNAR_ACCOUNT_FORMAT_H
+#define COLUMNAR_ACCOUNT_FORMAT_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include "Account.h"
+#include "AccountUpdateReader.h"
+#include "MappedFile.h"
+#include "SectionedFile.h"
+
+namespace columnar {
+
+const char kMagic[8] = {'A', 'C', 'C', 'T', 'C', 'O', 'L', '1'};
+const uint32_t kFormatVersion = 1;
+
+// The sections of a file, in the order they are written
+enum Section : uint32_t {
+    kIdOffsets, kIdBytes,
+    kTypeOffsets, kTypeBytes,
+    kFieldNameOffsets, kFieldNameBytes,
+    kIdColumn, kTypeColumn, kTokensColumn, kVersionColumn, kCallbackTimeMsColumn,
+    kDataOffsets, kDataFields,
+    kSectionCount
+};
+
+struct Header {
+    char magic[8];
+    uint32_t endianMark;
+    uint32_t formatVersion;
+    uint64_t rowCount;
+    uint32_t idCount;
+    uint32_t typeCount;
+    uint32_t fieldNameCount;
+    uint32_t sectionCount;
+    sectioned::SectionInfo sections[kSectionCount];
+};
+
+// One field of a row's data
+struct DataField {
+    uint32_t name;
+    int32_t value;
+};
+
+inline const char *sectionName(uint32_t section) {
+    static const char *names[kSectionCount] = {
+        "id.offsets", "id.bytes", "accountType.offsets", "accountType.bytes",
+        "dataField.offsets", "dataField.bytes", "id", "accountType", "tokens", "version",
+        "callbackTimeMs", "data.offsets", "data.fields"
+    };
+    return names[section];
+}
+
+inline uint32_t elementSize(uint32_t section) {
+    static const uint32_t sizes[kSectionCount] = {4, 1, 4, 1, 4, 1, 4, 4, 4, 4, 4, 8, sizeof(DataField)};
+    return sizes[section];
+}
+
+} // namespace columnar
+
+/**
+ * Collects account updates and writes them as a columnar file.
+ */
+class ColumnarAccountWriter {
+    private:
+        // The distinct strings, in order of first appearance
+        sectioned::Dictionary<string> ids;
+        sectioned::Dictionary<string> types;
+        sectioned::Dictionary<string> fieldNames;
+        vector<uint32_t> idColumn;
+        vector<uint32_t> typeColumn;
+        vector<int32_t> tokensColumn;
+        vector<int32_t> versionColumn;
+        vector<int32_t> callbackTimeMsColumn;
+        vector<uint64_t> dataOffsets;
+        vector<columnar::DataField> dataFields;
+
+    public:
+        ColumnarAccountWriter() : dataOffsets(1, 0) {}
+
+        /**
+         * Append an update as the next row.
+         * @param account The account update.
+         */
+        void append(const Account &account) {
+            idColumn.push_back(ids.add(account.id));
+            typeColumn.push_back(types.add(account.accountType));
+            tokensColumn.push_back(account.tokens);
+            versionColumn.push_back(account.version);
+            callbackTimeMsColumn.push_back(account.callbackTimeMs);
+            for (const AccountData::Field &field : account.data) {
+                dataFields.push_back(columnar::DataField{fieldNames.add(FieldNames::name(field.key)), field.value});
+            }
+            dataOffsets.push_back(dataFields.size());
+        }
+
+        size_t size() const {
+            return idColumn.size();
+        }
+
+        /**
+         * Write the rows appended so far to a file.
+         * @param filename The file to create or overwrite.
+         * @return False if the file could not be written.
+         */
+        bool write(const string &filename) const {
+            using namespace columnar;
+            const void *data[kSectionCount] = {
+                ids.endOffsets.data(), ids.bytes.data(), types.endOffsets.data(), types.bytes.data(),
+                fieldNames.endOffsets.data(), fieldNames.bytes.data(), idColumn.data(), typeColumn.data(),
+                tokensColumn.data(), versionColumn.data(), callbackTimeMsColumn.data(), dataOffsets.data(), dataFields.data()
+            };
+            const uint64_t counts[kSectionCount] = {
+                ids.endOffsets.size(), ids.bytes.size(), types.endOffsets.size(), types.bytes.size(),
+                fieldNames.endOffsets.size(), fieldNames.bytes.size(), idColumn.size(), typeColumn.size(),
+                tokensColumn.size(), versionColumn.size(), callbackTimeMsColumn.size(), dataOffsets.size(), dataFields.size()
+            };
+
+            Header header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, kMagic, sizeof(kMagic));
+            header.endianMark = sectioned::kEndianMark;
+            header.formatVersion = kFormatVersion;
+            header.rowCount = idColumn.size();
+            header.idCount = ids.size();
+            header.typeCount = types.size();
+            header.fieldNameCount = fieldNames.size();
+            header.sectionCount = kSectionCount;
+            sectioned::layOut(header.sections, kSectionCount, sizeof(header), sectionName, elementSize, counts);
+
+            ofstream file(filename, ios::binary | ios::trunc);
+            if (!file.is_open()) {
+                cerr << "Failed to open the file: " << filename << endl;
+                return false;
+            }
+            return sectioned::writeSections([&file](const void *bytes, size_t length) {
+                file.write(static_cast<const char *>(bytes), static_cast<streamsize>(length));
+                return static_cast<bool>(file);
+            }, &header, sizeof(header), header.sections, kSectionCount, data);
+        }
+
+        /**
+         * Convert an account update JSON file into a columnar file.
+         * @param jsonFilename The JSON array or NDJSON file to read.
+         * @param columnarFilename The columnar file to write.
+         * @param mode How to read the JSON file.
+         * @return The number of rows written, or -1 if either file could not be processed.
+         */
+        static long long convert(const string &jsonFilename, const string &columnarFilename, IngestMode mode = IngestMode::Batch) {
+            ColumnarAccountWriter writer;
+            bool read = AccountUpdateReader::readFile(jsonFilename, mode, [&writer](Account &&account) {
+                writer.append(account);
+            });
+            if (!read || !writer.write(columnarFilename)) return -1;
+            return static_cast<long long>(writer.size());
+        }
+};
+
+/**
+ * Read-only memory mapping of a columnar file. Opening validates the header and every section, so the
+ * accessors can be used without further checks.
+ */
+class ColumnarAccountFile {
+    private:
+        MappedFile mapping;
+        const columnar::Header *header;
+        sectioned::Sections sections;
+
+        bool fail(const string &filename, const string &reason) {
+            cerr << "Invalid columnar account file " << filename << ": " << reason << endl;
+            close();
+            return false;
+        }
+
+        template <typename T>
+        const T *section(uint32_t section) const {
+            return sections.section<T>(section);
+        }
+
+        uint64_t elements(uint32_t section) const {
+            return sections.elements(section);
+        }
+
+        static bool indexesBelow(const uint32_t *values, uint64_t count, uint32_t limit) {
+            for (uint64_t i = 0; i < count; ++i) {
+                if (values[i] >= limit) return false;
+            }
+            return true;
+        }
+
+        bool validate(const string &filename) {
+            using namespace columnar;
+            size_t mappedLength = mapping.size();
+            if (mappedLength < sizeof(Header)) return fail(filename, "too short");
+            header = reinterpret_cast<const Header *>(mapping.data());
+            if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) return fail(filename, "bad magic");
+            if (header->endianMark != sectioned::kEndianMark) return fail(filename, "written with the other byte order");
+            if (header->formatVersion != kFormatVersion) return fail(filename, "unsupported format version");
+            if (header->sectionCount != kSectionCount) return fail(filename, "unexpected schema");
+
+            sections = sectioned::Sections(mapping.data(), header->sections);
+            uint32_t badSection;
+            if (!sections.tableValid(kSectionCount, mappedLength, sectionName, elementSize, badSection)) {
+                return fail(filename, string("bad section ") + sectionName(badSection));
+            }
+
+            uint64_t rows = header->rowCount;
+            if (!sections.dictionaryValid(kIdOffsets, kIdBytes, header->idCount) ||
+                !sections.dictionaryValid(kTypeOffsets, kTypeBytes, header->typeCount) ||
+                !sections.dictionaryValid(kFieldNameOffsets, kFieldNameBytes, header->fieldNameCount)) {
+                return fail(filename, "bad dictionary");
+            }
+            if (elements(kIdColumn) != rows || elements(kTypeColumn) != rows || elements(kTokensColumn) != rows ||
+                elements(kVersionColumn) != rows || elements(kCallbackTimeMsColumn) != rows ||
+                elements(kDataOffsets) != rows + 1) {
+                return fail(filename, "column lengths differ from the row count");
+            }
+            if (!indexesBelow(section<uint32_t>(kIdColumn), rows, header->idCount) ||
+                !indexesBelow(section<uint32_t>(kTypeColumn), rows, header->typeCount)) {
+                return fail(filename, "dictionary index out of range");
+            }
+            const uint64_t *offsets = section<uint64_t>(kDataOffsets);
+            if (offsets[0] != 0 || offsets[rows] != elements(kDataFields)) return fail(filename, "bad data offsets");
+            for (uint64_t row = 0; row < rows; ++row) {
+                if (offsets[row + 1] < offsets[row]) return fail(filename, "bad data offsets");
+            }
+            const DataField *fields = section<DataField>(kDataFields);
+            for (uint64_t i = 0; i < elements(kDataFields); ++i) {
+                if (fields[i].name >= header->fieldNameCount) return fail(filename, "data field name out of range");
+            }
+            return true;
+        }
+
+    public:
+        ColumnarAccountFile() : header(nullptr) {}
+
+        ColumnarAccountFile(const ColumnarAccountFile &) = delete;
+        ColumnarAccountFile &operator=(const ColumnarAccountFile &) = delete;
+
+        /**
+         * Map and validate a columnar file.
+         * @param filename The file to open.
+         * @return False if the file could not be mapped or is not a valid columnar file.
+         */
+        bool open(const string &filename) {
+            close();
+            return mapping.open(filename) && validate(filename);
+        }
+
+        void close() {
+            mapping.close();
+            header = nullptr;
+        }
+
+        bool isOpen() const { return header != nullptr; }
+        size_t rowCount() const { return static_cast<size_t>(header->rowCount); }
+        uint32_t idCount() const { return header->idCount; }
+        uint32_t typeCount() const { return header->typeCount; }
+        uint32_t fieldNameCount() const { return header->fieldNameCount; }
+
+        string id(uint32_t index) const {
+            size_t length;
+            const char *bytes = sections.dictionaryEntry(columnar::kIdOffsets, columnar::kIdBytes, index, length);
+            return string(bytes, length);
+        }
+        string accountType(uint32_t index) const {
+            size_t length;
+            const char *bytes = sections.dictionaryEntry(columnar::kTypeOffsets, columnar::kTypeBytes, index, length);
+            return string(bytes, length);
+        }
+        string fieldName(uint32_t index) const {
+            size_t length;
+            const char *bytes = sections.dictionaryEntry(columnar::kFieldNameOffsets, columnar::kFieldNameBytes, index, length);
+            return string(bytes, length);
+        }
+
+        const uint32_t *idColumn() const { return section<uint32_t>(columnar::kIdColumn); }
+        const uint32_t *typeColumn() const { return section<uint32_t>(columnar::kTypeColumn); }
+        const int32_t *tokensColumn() const { return section<int32_t>(columnar::kTokensColumn); }
+        const int32_t *versionColumn() const { return section<int32_t>(columnar::kVersionColumn); }
+        const int32_t *callbackTimeMsColumn() const { return section<int32_t>(columnar::kCallbackTimeMsColumn); }
+        const uint64_t *dataOffsets() const { return section<uint64_t>(columnar::kDataOffsets); }
+        const columnar::DataField *dataFields() const { return section<columnar::DataField>(columnar::kDataFields); }
+};
+
+#endif // COLUMNAR_ACCOUNT_FORMAT_H
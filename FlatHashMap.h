@@ -0,0 +1,334 @@
+/**
+ * @file FlatHashMap.h
+ * @brief Open-addressing hash map with SIMD group probing and stable values
+ *
+ * A Swiss-table style map: a control byte per slot holds 7 bits of the key's hash, or marks the slot
+ * empty or erased, and control bytes are probed 16 at a time, with one SSE2 compare where available.
+ * The slots are a flat array of pointers to the entries, so a lookup reads a group of control bytes,
+ * and only follows the slots whose 7 hash bits match, which for a missing key is one slot in 128 on
+ * average: a hit touches the control bytes, the slot and the entry it returns, and a miss usually only
+ * the control bytes, instead of walking a bucket's chain of nodes. At 9 bytes per slot, the table
+ * costs 10 to 21 bytes per entry on top of the entries themselves.
+ *
+ * The values live in nodes of their own, taken from the map's allocator, and never move: rehashing
+ * moves slots, not values, so pointers and references to values stay valid until they are erased, as
+ * with unordered_map. The map implements the part of unordered_map's interface the indexer uses.
+ */
+
+#ifndef FLAT_HASH_MAP_H
+#define FLAT_HASH_MAP_H
+
+#include <vector>
+#include <memory>
+#include <utility>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+template <typename Key, typename Value, typename Hash = hash<Key>, typename Equal = equal_to<Key>,
+          typename Allocator = allocator<pair<const Key, Value>>>
+class FlatHashMap {
+    public:
+        typedef Key key_type;
+        typedef Value mapped_type;
+        typedef pair<const Key, Value> value_type;
+
+    private:
+        enum { kGroupSize = 16 };
+        // Control bytes of free slots; full slots hold the low 7 bits of their key's hash
+        enum : int8_t { kEmpty = -128, kDeleted = -2 };
+        enum : size_t { kNoSlot = ~static_cast<size_t>(0) };
+
+        typedef typename allocator_traits<Allocator>::template rebind_alloc<value_type> NodeAllocator;
+
+        vector<int8_t> control;
+        vector<value_type *> slots;
+        size_t entries;
+        // Erased slots still marked kDeleted, which count against the load factor until a rehash
+        size_t tombstones;
+        Hash hasher;
+        Equal equal;
+        NodeAllocator nodeAllocator;
+
+        // Bit i of the result is set if control byte i of the group equals value
+        static uint32_t match(const int8_t *group, int8_t value) {
+#if defined(__SSE2__)
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value))));
+#else
+            uint32_t mask = 0;
+            for (int i = 0; i < kGroupSize; ++i) mask |= static_cast<uint32_t>(group[i] == value) << i;
+            return mask;
+#endif
+        }
+
+        // Bit i of the result is set if slot i of the group is empty or erased
+        static uint32_t matchFree(const int8_t *group) {
+#if defined(__SSE2__)
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group))));
+#else
+            uint32_t mask = 0;
+            for (int i = 0; i < kGroupSize; ++i) mask |= static_cast<uint32_t>(group[i] < 0) << i;
+            return mask;
+#endif
+        }
+
+        static int lowestBit(uint32_t mask) {
+            return __builtin_ctz(mask);
+        }
+
+        static int8_t controlOf(size_t h) {
+            return static_cast<int8_t>(h & 0x7F);
+        }
+
+        // Groups are visited in triangular steps, which reach every group of a power-of-two table
+        size_t groupMask() const {
+            return slots.size() / kGroupSize - 1;
+        }
+
+        size_t findSlot(const Key &key) const {
+            if (slots.empty()) return kNoSlot;
+            size_t h = hasher(key);
+            int8_t tag = controlOf(h);
+            size_t mask = groupMask();
+            for (size_t group = (h >> 7) & mask, step = 1;; group = (group + step++) & mask) {
+                const int8_t *bytes = &control[group * kGroupSize];
+                for (uint32_t candidates = match(bytes, tag); candidates; candidates &= candidates - 1) {
+                    size_t slot = group * kGroupSize + lowestBit(candidates);
+                    if (equal(slots[slot]->first, key)) return slot;
+                }
+                // A probe only moves past groups that were full, so an empty slot ends it
+                if (match(bytes, kEmpty)) return kNoSlot;
+            }
+        }
+
+        // The first free slot on the key's probe sequence; the table must have one
+        size_t findFreeSlot(size_t h) const {
+            size_t mask = groupMask();
+            for (size_t group = (h >> 7) & mask, step = 1;; group = (group + step++) & mask) {
+                uint32_t free = matchFree(&control[group * kGroupSize]);
+                if (free) return group * kGroupSize + lowestBit(free);
+            }
+        }
+
+        void rehash(size_t capacity) {
+            vector<int8_t> previousControl(capacity, kEmpty);
+            vector<value_type *> previousSlots(capacity, nullptr);
+            previousControl.swap(control);
+            previousSlots.swap(slots);
+            tombstones = 0;
+            for (size_t i = 0; i < previousSlots.size(); ++i) {
+                if (previousControl[i] < 0) continue;
+                size_t h = hasher(previousSlots[i]->first);
+                size_t slot = findFreeSlot(h);
+                control[slot] = controlOf(h);
+                slots[slot] = previousSlots[i];
+            }
+        }
+
+        // Make room for one more key, keeping full and erased slots at no more than 7/8 of the table. When
+        // erased slots are what fills it, as under churn, the table is rebuilt at the same size.
+        void reserveOne() {
+            if ((entries + tombstones + 1) * 8 <= slots.size() * 7) return;
+            if ((entries + 1) * 32 <= slots.size() * 25) rehash(slots.size());
+            else rehash(max<size_t>(kGroupSize, slots.size() * 2));
+        }
+
+        void destroyNode(value_type *node) {
+            node->~value_type();
+            nodeAllocator.deallocate(node, 1);
+        }
+
+        template <typename Map, typename Reference>
+        class Iterator {
+            private:
+                friend class FlatHashMap;
+                Map *map;
+                size_t slot;
+
+                void skipFree() {
+                    while (slot < map->slots.size() && map->control[slot] < 0) ++slot;
+                }
+
+            public:
+                typedef forward_iterator_tag iterator_category;
+                typedef typename FlatHashMap::value_type value_type;
+                typedef ptrdiff_t difference_type;
+                typedef Reference &reference;
+                typedef Reference *pointer;
+
+                Iterator(Map *map, size_t slot) : map(map), slot(slot) {}
+                // An iterator converts to a const_iterator
+                template <typename OtherMap, typename OtherReference>
+                Iterator(const Iterator<OtherMap, OtherReference> &other) : map(other.map), slot(other.slot) {}
+
+                reference operator*() const { return *map->slots[slot]; }
+                pointer operator->() const { return map->slots[slot]; }
+                Iterator &operator++() {
+                    ++slot;
+                    skipFree();
+                    return *this;
+                }
+                Iterator operator++(int) {
+                    Iterator previous = *this;
+                    ++*this;
+                    return previous;
+                }
+                bool operator==(const Iterator &other) const { return slot == other.slot; }
+                bool operator!=(const Iterator &other) const { return slot != other.slot; }
+
+                template <typename OtherMap, typename OtherReference> friend class Iterator;
+        };
+
+    public:
+        typedef Iterator<FlatHashMap, value_type> iterator;
+        typedef Iterator<const FlatHashMap, const value_type> const_iterator;
+
+        /**
+         * Construct an empty map, with the arguments of the matching unordered_map constructor.
+         * @param capacity The number of keys to make room for up front.
+         * @param hash The hash function; its low 7 bits and the bits above them are used separately, so
+         * it must mix its input into all of its bits.
+         * @param equal The key equality.
+         * @param allocator The allocator of the value nodes. The slot arrays come from operator new.
+         */
+        explicit FlatHashMap(size_t capacity = 0, const Hash &hash = Hash(), const Equal &equal = Equal(),
+                             const Allocator &allocator = Allocator())
+            : entries(0), tombstones(0), hasher(hash), equal(equal), nodeAllocator(allocator) {
+            reserve(capacity);
+        }
+
+        // The slots own their nodes
+        FlatHashMap(const FlatHashMap &) = delete;
+        FlatHashMap &operator=(const FlatHashMap &) = delete;
+
+        ~FlatHashMap() {
+            clear();
+        }
+
+        /**
+         * Find the value of the given key.
+         * @param key The key.
+         * @return An iterator to the key's entry, or end() if the key is not in the map.
+         */
+        iterator find(const Key &key) {
+            size_t slot = findSlot(key);
+            return slot != kNoSlot ? iterator(this, slot) : end();
+        }
+
+        const_iterator find(const Key &key) const {
+            size_t slot = findSlot(key);
+            return slot != kNoSlot ? const_iterator(this, slot) : end();
+        }
+
+        size_t count(const Key &key) const {
+            return findSlot(key) != kNoSlot ? 1 : 0;
+        }
+
+        /**
+         * Insert the value under the given key, unless the key is in the map already.
+         * @param key The key.
+         * @param value The value, constructed in a node of its own that never moves.
+         * @return An iterator to the key's entry, and whether the value was inserted.
+         */
+        template <typename V>
+        pair<iterator, bool> emplace(const Key &key, V &&value) {
+            size_t slot = findSlot(key);
+            if (slot != kNoSlot) return make_pair(iterator(this, slot), false);
+
+            value_type *node = nodeAllocator.allocate(1);
+            try {
+                ::new (static_cast<void *>(node)) value_type(key, std::forward<V>(value));
+            }
+            catch (...) {
+                nodeAllocator.deallocate(node, 1);
+                throw;
+            }
+            reserveOne();
+            size_t h = hasher(key);
+            slot = findFreeSlot(h);
+            if (control[slot] == kDeleted) --tombstones;
+            control[slot] = controlOf(h);
+            slots[slot] = node;
+            ++entries;
+            return make_pair(iterator(this, slot), true);
+        }
+
+        /**
+         * Erase the entry at the given position, destroying its value.
+         * @param position A valid, dereferenceable iterator.
+         */
+        void erase(const_iterator position) {
+            size_t slot = position.slot;
+            destroyNode(slots[slot]);
+            // A slot may only go back to empty if no probe has moved past its group, i.e. the group
+            // still has an empty slot; otherwise it stays on the probe sequences as erased
+            if (match(&control[slot / kGroupSize * kGroupSize], kEmpty)) {
+                control[slot] = kEmpty;
+            }
+            else {
+                control[slot] = kDeleted;
+                ++tombstones;
+            }
+            --entries;
+        }
+
+        /**
+         * Erase the entry of the given key, if there is one.
+         * @param key The key.
+         * @return The number of entries erased.
+         */
+        size_t erase(const Key &key) {
+            size_t slot = findSlot(key);
+            if (slot == kNoSlot) return 0;
+            erase(const_iterator(this, slot));
+            return 1;
+        }
+
+        /**
+         * Make room for the given number of keys, so that inserting them does not rehash.
+         * @param capacity The number of keys.
+         */
+        void reserve(size_t capacity) {
+            if (capacity * 8 <= slots.size() * 7) return;
+            size_t slotCount = kGroupSize;
+            while (capacity * 8 > slotCount * 7) slotCount *= 2;
+            rehash(slotCount);
+        }
+
+        void clear() {
+            for (size_t i = 0; i < slots.size(); ++i) {
+                if (control[i] >= 0) destroyNode(slots[i]);
+                control[i] = kEmpty;
+            }
+            entries = 0;
+            tombstones = 0;
+        }
+
+        iterator begin() {
+            iterator it(this, 0);
+            it.skipFree();
+            return it;
+        }
+        const_iterator begin() const {
+            const_iterator it(this, 0);
+            it.skipFree();
+            return it;
+        }
+        iterator end() { return iterator(this, slots.size()); }
+        const_iterator end() const { return const_iterator(this, slots.size()); }
+
+        size_t size() const { return entries; }
+        bool empty() const { return entries == 0; }
+        // The number of slots, full or not
+        size_t bucket_count() const { return slots.size(); }
+};
+
+#endif // FLAT_HASH_MAP_H
@@ -0,0 +1,78 @@
+/**
+ * @file MappedFile.h
+ * @brief Read-only memory mapping of a whole file
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <iostream>
+#include <string>
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * Owns a private, read-only mapping of a file, unmapped on close or destruction.
+ */
+class MappedFile {
+    private:
+        const unsigned char *base;
+        size_t length;
+
+    public:
+        MappedFile() : base(nullptr), length(0) {}
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        ~MappedFile() {
+            close();
+        }
+
+        /**
+         * Map the given file.
+         * @param filename The file to map.
+         * @param sequential If true, tell the kernel the file will be read front to back.
+         * @return False if the file could not be opened, is empty, or could not be mapped.
+         */
+        bool open(const string &filename, bool sequential = true) {
+            close();
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) {
+                cerr << "Failed to open the file: " << filename << endl;
+                return false;
+            }
+            struct stat status;
+            if (fstat(fd, &status) != 0 || status.st_size == 0) {
+                ::close(fd);
+                cerr << "Failed to map the file: " << filename << " is empty or unreadable" << endl;
+                return false;
+            }
+            void *mapped = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (mapped == MAP_FAILED) {
+                cerr << "Failed to map the file: " << filename << endl;
+                return false;
+            }
+            base = static_cast<const unsigned char *>(mapped);
+            length = static_cast<size_t>(status.st_size);
+            if (sequential) madvise(mapped, length, MADV_SEQUENTIAL);
+            return true;
+        }
+
+        void close() {
+            if (base) munmap(const_cast<unsigned char *>(base), length);
+            base = nullptr;
+            length = 0;
+        }
+
+        const unsigned char *data() const { return base; }
+        size_t size() const { return length; }
+};
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,352 @@
+/**
+ * @file Metrics.h
+ * @brief Process-wide counters and latency histograms of the hot paths
+ *
+ * Every thread that records a metric gets a shard of its own, with one slot per counter and one
+ * log-linear histogram per latency, which only that thread writes. Recording is therefore a relaxed
+ * load and store on memory no other thread writes: no locks, no read-modify-write instructions and
+ * no shared cache lines. Shards are linked into a lock-free list on first use and live as long as the
+ * process, so a snapshot sums them while the threads keep recording, and counts from threads that
+ * have exited are kept.
+ *
+ * Histograms keep 16 buckets per power of two, like an HDR histogram with a precision of one
+ * significant hexadecimal digit: values are exact below 16 and within 6.25% above, up to 2^48 ns.
+ *
+ * Building with -DACCOUNT_INDEXING_METRICS=0 compiles every recording macro to nothing; snapshots
+ * are then empty.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdint>
+#include "nlohmann/json.hpp"
+
+#ifndef ACCOUNT_INDEXING_METRICS
+#define ACCOUNT_INDEXING_METRICS 1
+#endif
+
+using namespace std;
+using json = nlohmann::json;
+
+// The counters, each a monotonic count of events
+enum class Counter {
+    UpdatesIngested,     // Updates handed to the index, including stale ones
+    UpdatesNew,          // Updates for an id with no indexed version
+    UpdatesSuperseding,  // Updates that replaced an older indexed version
+    UpdatesRejected,     // Updates no newer than the indexed version, ignored
+    UpdatesCollapsed,    // Updates superseded within their batch by ingestAccountUpdates, never indexed
+    UpdatesParsed,       // Updates decoded from JSON
+    ParserFallbacks,     // Inputs the schema-aware parser gave up on, decoded by nlohmann instead
+    ParseErrors,         // Inputs that could not be decoded at all
+    CallbacksScheduled,  // Callbacks scheduled or rescheduled
+    CallbacksCancelled,  // Pending callbacks cancelled
+    CallbacksFired,      // Callbacks delivered to the sink
+    CallbacksDropped,    // Due callbacks whose account version had been superseded
+    Queries,             // Calls to searchAndFilterAccounts
+    QueryScans,          // Queries answered by scanning the column store rather than walking an index
+    SubscriptionChanges, // Changes reported to subscriptions
+    AccountsEvicted,     // Account versions evicted to the cold tier
+    AccountsFaultedIn,   // Account versions faulted back in from the cold tier
+    Count
+};
+
+// The latency histograms, in nanoseconds
+enum class Histogram {
+    IngestLatency,       // ingestAccount, per update
+    IngestBatchLatency,  // ingestAccountUpdates, per batch
+    ParseLatency,        // Decoding one update, by either parser
+    FireLatency,         // fireCallbacks and dispatcher rounds, per call that found due callbacks
+    FireLag,             // Time a callback was fired at, minus its deadline
+    QueryLatency,        // searchAndFilterAccounts
+    Count
+};
+
+class Metrics {
+    public:
+        enum {
+            kCounters = static_cast<int>(Counter::Count),
+            kHistograms = static_cast<int>(Histogram::Count),
+            kSubBucketBits = 4,
+            kSubBuckets = 1 << kSubBucketBits,
+            kMaxExponent = 47,
+            kBuckets = (kMaxExponent - kSubBucketBits + 2) * kSubBuckets
+        };
+
+        /**
+         * Get the bucket a value falls in: values below kSubBuckets have a bucket each, and every
+         * power of two above is split into kSubBuckets equal buckets.
+         */
+        static size_t bucketOf(uint64_t value) {
+            if (value < kSubBuckets) return static_cast<size_t>(value);
+            int exponent = 63 - __builtin_clzll(value);
+            if (exponent > kMaxExponent) return kBuckets - 1;
+            return static_cast<size_t>((exponent - kSubBucketBits + 1) * kSubBuckets +
+                                       ((value >> (exponent - kSubBucketBits)) - kSubBuckets));
+        }
+
+        // The smallest value that falls in the given bucket
+        static uint64_t bucketLowerBound(size_t bucket) {
+            if (bucket < kSubBuckets) return bucket;
+            size_t octave = bucket / kSubBuckets;
+            return static_cast<uint64_t>(kSubBuckets + bucket % kSubBuckets) << (octave - 1);
+        }
+
+        // The smallest value above the given bucket
+        static uint64_t bucketUpperBound(size_t bucket) {
+            return bucket + 1 < kBuckets ? bucketLowerBound(bucket + 1) : UINT64_MAX;
+        }
+
+        // The slots of one thread. Only the owning thread writes them.
+        struct Shard {
+            atomic<uint64_t> counters[kCounters];
+            atomic<uint64_t> counts[kHistograms];
+            atomic<uint64_t> sums[kHistograms];
+            atomic<uint64_t> buckets[kHistograms][kBuckets];
+            Shard *next;
+
+            Shard() : next(nullptr) {
+                for (atomic<uint64_t> &counter : counters) counter.store(0, memory_order_relaxed);
+                for (int h = 0; h < kHistograms; ++h) {
+                    counts[h].store(0, memory_order_relaxed);
+                    sums[h].store(0, memory_order_relaxed);
+                    for (atomic<uint64_t> &bucket : buckets[h]) bucket.store(0, memory_order_relaxed);
+                }
+            }
+
+            static void bump(atomic<uint64_t> &slot, uint64_t amount) {
+                slot.store(slot.load(memory_order_relaxed) + amount, memory_order_relaxed);
+            }
+
+            void count(Counter counter, uint64_t amount) {
+                bump(counters[static_cast<int>(counter)], amount);
+            }
+
+            void record(Histogram histogram, uint64_t value) {
+                int h = static_cast<int>(histogram);
+                bump(counts[h], 1);
+                bump(sums[h], value);
+                bump(buckets[h][bucketOf(value)], 1);
+            }
+        };
+
+        /**
+         * Get the shard of the calling thread, linking a new one into the list on first use.
+         * @return The calling thread's shard, valid for the lifetime of the process.
+         */
+        static Shard &local() {
+            static thread_local Shard *shard = nullptr;
+            if (!shard) {
+                shard = new Shard();
+                atomic<Shard *> &head = shards();
+                Shard *first = head.load(memory_order_relaxed);
+                do {
+                    shard->next = first;
+                } while (!head.compare_exchange_weak(first, shard, memory_order_release, memory_order_relaxed));
+            }
+            return *shard;
+        }
+
+        static atomic<Shard *> &shards() {
+            // Never destroyed, so that threads still recording during static destruction are safe
+            static atomic<Shard *> *head = new atomic<Shard *>(nullptr);
+            return *head;
+        }
+
+        static const char *name(Counter counter) {
+            static const char *names[] = {
+                "updates_ingested", "updates_new", "updates_superseding", "updates_rejected", "updates_collapsed",
+                "updates_parsed", "parser_fallbacks", "parse_errors", "callbacks_scheduled", "callbacks_cancelled",
+                "callbacks_fired", "callbacks_dropped", "queries",
+                "query_scans", "subscription_changes", "accounts_evicted", "accounts_faulted_in"
+            };
+            return names[static_cast<int>(counter)];
+        }
+
+        static const char *name(Histogram histogram) {
+            static const char *names[] = {
+                "ingest_latency", "ingest_batch_latency", "parse_latency", "fire_latency", "fire_lag", "query_latency"
+            };
+            return names[static_cast<int>(histogram)];
+        }
+};
+
+// The merged buckets of one histogram
+struct HistogramSnapshot {
+    uint64_t count;
+    uint64_t sum;
+    vector<uint64_t> buckets;
+
+    HistogramSnapshot() : count(0), sum(0), buckets(Metrics::kBuckets, 0) {}
+
+    /**
+     * Estimate the value at the given quantile, as the midpoint of the bucket it falls in.
+     * @param quantile The quantile, between 0 and 1.
+     * @return The estimated value, or 0 if nothing was recorded.
+     */
+    uint64_t percentile(double quantile) const {
+        if (count == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(quantile * (count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+            seen += buckets[bucket];
+            if (seen >= rank) {
+                uint64_t low = Metrics::bucketLowerBound(bucket);
+                return bucket < Metrics::kSubBuckets ? low : low + (Metrics::bucketUpperBound(bucket) - low) / 2;
+            }
+        }
+        return Metrics::bucketLowerBound(buckets.size() - 1);
+    }
+
+    double mean() const {
+        return count ? static_cast<double>(sum) / count : 0;
+    }
+};
+
+// A gauge sampled when the snapshot is exported, such as the number of pending callbacks
+struct MetricsGauge {
+    string name;
+    double value;
+};
+
+/**
+ * The metrics of all threads, summed at one point in time. The sum is not atomic across shards:
+ * events recorded while it is taken may or may not be in it, but it never goes backwards.
+ */
+class MetricsSnapshot {
+    public:
+        uint64_t counters[Metrics::kCounters];
+        HistogramSnapshot histograms[Metrics::kHistograms];
+        vector<MetricsGauge> gauges;
+
+        MetricsSnapshot() {
+            for (uint64_t &counter : counters) counter = 0;
+        }
+
+        /**
+         * Sum the shards of every thread that has recorded a metric, without stopping them.
+         * @return The snapshot.
+         */
+        static MetricsSnapshot take() {
+            MetricsSnapshot snapshot;
+            for (Metrics::Shard *shard = Metrics::shards().load(memory_order_acquire); shard; shard = shard->next) {
+                for (int c = 0; c < Metrics::kCounters; ++c) {
+                    snapshot.counters[c] += shard->counters[c].load(memory_order_relaxed);
+                }
+                for (int h = 0; h < Metrics::kHistograms; ++h) {
+                    HistogramSnapshot &histogram = snapshot.histograms[h];
+                    histogram.count += shard->counts[h].load(memory_order_relaxed);
+                    histogram.sum += shard->sums[h].load(memory_order_relaxed);
+                    for (size_t b = 0; b < Metrics::kBuckets; ++b) {
+                        histogram.buckets[b] += shard->buckets[h][b].load(memory_order_relaxed);
+                    }
+                }
+            }
+            return snapshot;
+        }
+
+        uint64_t get(Counter counter) const { return counters[static_cast<int>(counter)]; }
+        const HistogramSnapshot &get(Histogram histogram) const { return histograms[static_cast<int>(histogram)]; }
+
+        /**
+         * Format the snapshot in the Prometheus text exposition format. Counters become
+         * account_indexing_<name>_total, and histograms account_indexing_<name>_seconds with a bucket per
+         * power of two nanoseconds that anything was recorded up to.
+         * @return The exposition text.
+         */
+        string toPrometheus() const {
+            ostringstream out;
+            for (int c = 0; c < Metrics::kCounters; ++c) {
+                string metric = string("account_indexing_") + Metrics::name(static_cast<Counter>(c)) + "_total";
+                out << "# TYPE " << metric << " counter\n" << metric << " " << counters[c] << "\n";
+            }
+            for (const MetricsGauge &gauge : gauges) {
+                string metric = "account_indexing_" + gauge.name;
+                out << "# TYPE " << metric << " gauge\n" << metric << " " << gauge.value << "\n";
+            }
+            for (int h = 0; h < Metrics::kHistograms; ++h) {
+                const HistogramSnapshot &histogram = histograms[h];
+                string metric = string("account_indexing_") + Metrics::name(static_cast<Histogram>(h)) + "_seconds";
+                out << "# TYPE " << metric << " histogram\n";
+                // The powers of two fall on bucket boundaries, so each cumulative count is exact, if
+                // exclusive of the bound itself
+                uint64_t cumulative = 0;
+                size_t bucket = 0;
+                for (int exponent = 0; exponent <= Metrics::kMaxExponent && cumulative < histogram.count; ++exponent) {
+                    uint64_t bound = uint64_t(1) << exponent;
+                    while (bucket < Metrics::kBuckets && Metrics::bucketUpperBound(bucket) <= bound) {
+                        cumulative += histogram.buckets[bucket++];
+                    }
+                    out << metric << "_bucket{le=\"" << bound * 1e-9 << "\"} " << cumulative << "\n";
+                }
+                out << metric << "_bucket{le=\"+Inf\"} " << histogram.count << "\n"
+                    << metric << "_sum " << histogram.sum * 1e-9 << "\n"
+                    << metric << "_count " << histogram.count << "\n";
+            }
+            return out.str();
+        }
+
+        /**
+         * Format the snapshot as JSON: the counters and gauges by name, and for every histogram its
+         * count, mean and p50/p99/p999 in nanoseconds.
+         * @return The JSON document.
+         */
+        json toJson() const {
+            json document;
+            json &counterValues = document["counters"] = json::object();
+            for (int c = 0; c < Metrics::kCounters; ++c) {
+                counterValues[Metrics::name(static_cast<Counter>(c))] = counters[c];
+            }
+            json &gaugeValues = document["gauges"] = json::object();
+            for (const MetricsGauge &gauge : gauges) {
+                gaugeValues[gauge.name] = gauge.value;
+            }
+            json &histogramValues = document["histograms"] = json::object();
+            for (int h = 0; h < Metrics::kHistograms; ++h) {
+                const HistogramSnapshot &histogram = histograms[h];
+                histogramValues[Metrics::name(static_cast<Histogram>(h))] = {
+                    {"count", histogram.count}, {"mean_ns", histogram.mean()}, {"p50_ns", histogram.percentile(0.5)},
+                    {"p99_ns", histogram.percentile(0.99)}, {"p999_ns", histogram.percentile(0.999)}
+                };
+            }
+            return document;
+        }
+};
+
+#if ACCOUNT_INDEXING_METRICS
+
+// Records the time from its construction to its destruction in a histogram
+class MetricsTimer {
+    private:
+        Histogram histogram;
+        chrono::steady_clock::time_point start;
+
+    public:
+        explicit MetricsTimer(Histogram histogram) : histogram(histogram), start(chrono::steady_clock::now()) {}
+
+        ~MetricsTimer() {
+            chrono::nanoseconds elapsed = chrono::steady_clock::now() - start;
+            Metrics::local().record(histogram, static_cast<uint64_t>(elapsed.count()));
+        }
+};
+
+#define METRICS_CONCAT_(a, b) a##b
+#define METRICS_CONCAT(a, b) METRICS_CONCAT_(a, b)
+#define METRICS_COUNT(counter, amount) Metrics::local().count(counter, amount)
+#define METRICS_RECORD(histogram, value) Metrics::local().record(histogram, value)
+#define METRICS_TIME(histogram) MetricsTimer METRICS_CONCAT(metricsTimer, __LINE__)(histogram)
+
+#else
+
+#define METRICS_COUNT(counter, amount) ((void)0)
+#define METRICS_RECORD(histogram, value) ((void)0)
+#define METRICS_TIME(histogram) ((void)0)
+
+#endif // ACCOUNT_INDEXING_METRICS
+
+#endif // METRICS_H
@@ -0,0 +1,193 @@
+/**
+ * @file NodePool.h
+ * @brief Slab allocation of container nodes, with free-list reuse
+ *
+ * A NodeArena hands out fixed-size slots from slabs, one pool per slot size, and keeps freed slots on
+ * an intrusive free list for the next allocation of that size. Slabs are only returned when the arena
+ * is destroyed, so a container whose size holds steady, such as an index whose accounts are replaced
+ * version by version, stops calling the system allocator once its slabs are warm and never fragments
+ * the heap. PoolAllocator plugs an arena into the standard node-based containers, which allocate one
+ * node at a time; anything larger, like a hash table's bucket array, goes to operator new as usual.
+ *
+ * An arena is not thread-safe: it must only be used by the containers of one owner, on one thread at
+ * a time.
+ */
+
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+// Counters of a NodeArena, summed over its pools
+struct NodeArenaStats {
+    // Slots in use, and slots carved out of slabs so far
+    size_t liveSlots;
+    size_t reservedSlots;
+    // Slabs taken from the system allocator, and their total size
+    size_t slabs;
+    size_t reservedBytes;
+    // Slot allocations served, and how many of them reused a freed slot
+    uint64_t allocations;
+    uint64_t reuses;
+
+    NodeArenaStats() : liveSlots(0), reservedSlots(0), slabs(0), reservedBytes(0), allocations(0), reuses(0) {}
+};
+
+/**
+ * Pool of equally sized slots. Slabs are carved front to back; freed slots are pushed on a free list
+ * threaded through the slots themselves, and popped before any new slot is carved.
+ */
+class FixedSizePool {
+    private:
+        enum { kSlabBytes = 64 * 1024, kMinSlotsPerSlab = 16 };
+
+        struct FreeSlot {
+            FreeSlot *next;
+        };
+
+        size_t slotSize;
+        size_t slotsPerSlab;
+        vector<void *> slabs;
+        FreeSlot *freeSlots;
+        // The uncarved rest of the latest slab
+        unsigned char *next;
+        unsigned char *end;
+        size_t liveSlots;
+        uint64_t allocations;
+        uint64_t reuses;
+
+    public:
+        explicit FixedSizePool(size_t slotSize)
+            : slotSize(slotSize), slotsPerSlab(max<size_t>(kMinSlotsPerSlab, kSlabBytes / slotSize)), freeSlots(nullptr),
+              next(nullptr), end(nullptr), liveSlots(0), allocations(0), reuses(0) {}
+
+        FixedSizePool(const FixedSizePool &) = delete;
+        FixedSizePool &operator=(const FixedSizePool &) = delete;
+
+        ~FixedSizePool() {
+            for (void *slab : slabs) ::operator delete(slab);
+        }
+
+        void *allocate() {
+            ++allocations;
+            ++liveSlots;
+            if (freeSlots) {
+                ++reuses;
+                FreeSlot *slot = freeSlots;
+                freeSlots = slot->next;
+                return slot;
+            }
+            if (next == end) {
+                // operator new aligns for any fundamental type, and slot sizes are multiples of that alignment
+                next = static_cast<unsigned char *>(::operator new(slotSize * slotsPerSlab));
+                end = next + slotSize * slotsPerSlab;
+                slabs.push_back(next);
+            }
+            void *slot = next;
+            next += slotSize;
+            return slot;
+        }
+
+        void deallocate(void *pointer) {
+            FreeSlot *slot = static_cast<FreeSlot *>(pointer);
+            slot->next = freeSlots;
+            freeSlots = slot;
+            --liveSlots;
+        }
+
+        size_t getSlotSize() const { return slotSize; }
+
+        void addStats(NodeArenaStats &stats) const {
+            stats.liveSlots += liveSlots;
+            stats.reservedSlots += slabs.size() * slotsPerSlab - static_cast<size_t>(end - next) / slotSize;
+            stats.slabs += slabs.size();
+            stats.reservedBytes += slabs.size() * slotsPerSlab * slotSize;
+            stats.allocations += allocations;
+            stats.reuses += reuses;
+        }
+};
+
+/**
+ * Set of FixedSizePools, one per slot size. Sizes are rounded up to the fundamental alignment, so
+ * node types of similar size share a pool.
+ */
+class NodeArena {
+    private:
+        // A deque, so that the pools the allocators point at never move
+        deque<FixedSizePool> pools;
+
+    public:
+        enum { kSlotAlignment = alignof(max_align_t) };
+
+        NodeArena() {}
+
+        NodeArena(const NodeArena &) = delete;
+        NodeArena &operator=(const NodeArena &) = delete;
+
+        /**
+         * Get the pool for slots of the given size, creating it on first use.
+         * @param size The size of the objects to be allocated.
+         * @return The pool, valid for the lifetime of the arena.
+         */
+        FixedSizePool &poolFor(size_t size) {
+            size_t slotSize = (max(size, sizeof(void *)) + kSlotAlignment - 1) / kSlotAlignment * kSlotAlignment;
+            for (FixedSizePool &pool : pools) {
+                if (pool.getSlotSize() == slotSize) return pool;
+            }
+            pools.emplace_back(slotSize);
+            return pools.back();
+        }
+
+        NodeArenaStats getStats() const {
+            NodeArenaStats stats;
+            for (const FixedSizePool &pool : pools) pool.addStats(stats);
+            return stats;
+        }
+};
+
+/**
+ * Standard allocator that takes single objects from a NodeArena. Containers rebind it to their node
+ * type, so every rebound copy resolves its own pool once, at construction.
+ */
+template <typename T>
+class PoolAllocator {
+    private:
+        template <typename U> friend class PoolAllocator;
+
+        NodeArena *arena;
+        FixedSizePool *pool;
+
+    public:
+        typedef T value_type;
+
+        static_assert(alignof(T) <= NodeArena::kSlotAlignment, "PoolAllocator slots are not aligned enough for this type");
+
+        explicit PoolAllocator(NodeArena &nodeArena) : arena(&nodeArena), pool(&nodeArena.poolFor(sizeof(T))) {}
+
+        template <typename U>
+        PoolAllocator(const PoolAllocator<U> &other) : arena(other.arena), pool(&other.arena->poolFor(sizeof(T))) {}
+
+        T *allocate(size_t n) {
+            if (n == 1) return static_cast<T *>(pool->allocate());
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T *pointer, size_t n) {
+            if (n == 1) pool->deallocate(pointer);
+            else ::operator delete(pointer);
+        }
+
+        template <typename U>
+        bool operator==(const PoolAllocator<U> &other) const { return arena == other.arena; }
+        template <typename U>
+        bool operator!=(const PoolAllocator<U> &other) const { return arena != other.arena; }
+};
+
+#endif // NODE_POOL_H
@@ -0,0 +1,201 @@
+/**
+ * @file SectionedFile.h
+ * @brief The layout shared by the columnar update files and the checkpoints
+ *
+ * Both formats are a fixed header, holding a schema table that gives the name, element size, offset
+ * and length of every section, followed by the sections, each 8 byte aligned and stored in host byte
+ * order. Strings are stored once each, as dictionaries: a section of uint32 end offsets followed by a
+ * section of the concatenated bytes, which rows refer to by index. This header has the schema table,
+ * the dictionary builder, the writer of the sections and the checks a reader makes of a mapped file;
+ * the formats only define their headers, sections and rows.
+ */
+
+#ifndef SECTIONED_FILE_H
+#define SECTIONED_FILE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstring>
+#include <cstdint>
+
+using namespace std;
+
+namespace sectioned {
+
+// Written in host byte order, so a reader on a machine of the other byte order sees it reversed
+const uint32_t kEndianMark = 0x01020304u;
+
+// Entry of the schema table
+struct SectionInfo {
+    char name[24];
+    uint32_t elementSize;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t length;
+};
+
+inline uint64_t aligned(uint64_t offset) {
+    return (offset + 7) & ~uint64_t(7);
+}
+
+/**
+ * Strings stored once each, indexed in order of first appearance.
+ * @tparam Key What identifies a string, such as the string itself or the address of an interned one.
+ */
+template <typename Key>
+struct Dictionary {
+    unordered_map<Key, uint32_t> indexes;
+    vector<uint32_t> endOffsets;
+    string bytes;
+
+    /**
+     * Add a string, unless it is in the dictionary already.
+     * @param key What identifies the string.
+     * @param value The string.
+     * @return The index of the string.
+     */
+    uint32_t add(const Key &key, const string &value) {
+        auto it = indexes.find(key);
+        if (it != indexes.end()) return it->second;
+        uint32_t index = static_cast<uint32_t>(endOffsets.size());
+        indexes.emplace(key, index);
+        bytes += value;
+        endOffsets.push_back(static_cast<uint32_t>(bytes.size()));
+        return index;
+    }
+
+    // Add a string identified by itself
+    uint32_t add(const string &value) {
+        return add(value, value);
+    }
+
+    uint32_t size() const { return static_cast<uint32_t>(endOffsets.size()); }
+};
+
+/**
+ * Fill in the schema table, laying the sections out one after the other after the header.
+ * @param sections The schema table, of count entries.
+ * @param headerSize The size of the header holding the table.
+ * @param name The name of a section.
+ * @param elementSize The element size of a section.
+ * @param counts The number of elements of every section.
+ */
+inline void layOut(SectionInfo *sections, uint32_t count, size_t headerSize, const char *(*name)(uint32_t),
+                   uint32_t (*elementSize)(uint32_t), const uint64_t *counts) {
+    uint64_t offset = aligned(headerSize);
+    for (uint32_t section = 0; section < count; ++section) {
+        SectionInfo &info = sections[section];
+        memset(info.name, 0, sizeof(info.name));
+        strncpy(info.name, name(section), sizeof(info.name) - 1);
+        info.elementSize = elementSize(section);
+        info.offset = offset;
+        info.length = counts[section] * info.elementSize;
+        offset = aligned(offset + info.length);
+    }
+}
+
+/**
+ * Write a header and the sections its schema table lays out, padded to their offsets.
+ * @param write Writes the given bytes, and returns false if it could not.
+ * @param header The header, laid out by layOut.
+ * @param headerSize The size of the header.
+ * @param sections The header's schema table.
+ * @param data The bytes of every section.
+ * @return False if a write failed.
+ */
+template <typename Write>
+bool writeSections(Write write, const void *header, size_t headerSize, const SectionInfo *sections, uint32_t count,
+                   const void *const *data) {
+    static const char padding[8] = {0};
+    bool written = write(header, headerSize);
+    uint64_t position = headerSize;
+    for (uint32_t section = 0; written && section < count; ++section) {
+        const SectionInfo &info = sections[section];
+        written = write(padding, info.offset - position) && write(data[section], info.length);
+        position = info.offset + info.length;
+    }
+    return written && write(padding, aligned(position) - position);
+}
+
+/**
+ * The sections of a mapped file, as its schema table lays them out. The table has to be checked with
+ * tableValid before any section is read.
+ */
+class Sections {
+    private:
+        const unsigned char *base;
+        const SectionInfo *table;
+
+    public:
+        Sections() : base(nullptr), table(nullptr) {}
+        Sections(const unsigned char *base, const SectionInfo *table) : base(base), table(table) {}
+
+        /**
+         * Check every entry of the schema table: the name and element size the format expects, and an
+         * aligned offset and whole elements within the file.
+         * @param badSection Set to the first section that is not valid.
+         * @return False if a section is not valid.
+         */
+        bool tableValid(uint32_t count, size_t fileLength, const char *(*name)(uint32_t),
+                        uint32_t (*elementSize)(uint32_t), uint32_t &badSection) const {
+            for (uint32_t s = 0; s < count; ++s) {
+                const SectionInfo &info = table[s];
+                if (strncmp(info.name, name(s), sizeof(info.name)) != 0 || info.elementSize != elementSize(s) ||
+                    info.offset % 8 != 0 || info.length % info.elementSize != 0 ||
+                    info.offset > fileLength || info.length > fileLength - info.offset) {
+                    badSection = s;
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        template <typename T>
+        const T *section(uint32_t section) const {
+            return reinterpret_cast<const T *>(base + table[section].offset);
+        }
+
+        uint64_t elements(uint32_t section) const {
+            const SectionInfo &info = table[section];
+            return info.length / info.elementSize;
+        }
+
+        /**
+         * Check a section of uint32 offsets into another: it has count entries, which never decrease
+         * and end at the limit.
+         * @param startsAtZero Whether the first offset must be 0, as for start offsets.
+         * @return False if the offsets are not valid.
+         */
+        bool offsetsValid(uint32_t offsets, uint64_t count, uint64_t limit, bool startsAtZero) const {
+            if (elements(offsets) != count) return false;
+            const uint32_t *ends = section<uint32_t>(offsets);
+            uint64_t previous = 0;
+            for (uint64_t i = 0; i < count; ++i) {
+                if (ends[i] < previous) return false;
+                previous = ends[i];
+            }
+            return (!startsAtZero || count == 0 || ends[0] == 0) && previous == limit;
+        }
+
+        // Check a dictionary of count strings, its end offsets in one section and its bytes in another
+        bool dictionaryValid(uint32_t offsets, uint32_t bytes, uint32_t count) const {
+            return offsetsValid(offsets, count, elements(bytes), false);
+        }
+
+        /**
+         * Get a string of a valid dictionary, in place.
+         * @param length Set to the length of the string.
+         * @return The first byte of the string.
+         */
+        const char *dictionaryEntry(uint32_t offsets, uint32_t bytes, uint32_t index, size_t &length) const {
+            const uint32_t *ends = section<uint32_t>(offsets);
+            uint32_t begin = index == 0 ? 0 : ends[index - 1];
+            length = ends[index] - begin;
+            return section<char>(bytes) + begin;
+        }
+};
+
+} // namespace sectioned
+
+#endif // SECTIONED_FILE_H
@@ -0,0 +1,268 @@
+/**
+ * @file ShardedAccountManager.h
+ * @brief Parallel ingestion across account id shards
+ *
+ * Hash-partitions account updates by id across a number of shards, each an AccountManager with its
+ * own indexer and callback manager, fed through a bounded queue by a worker thread of its own. All
+ * versions of an account go to the same shard and are ingested in order, so no lock is shared
+ * between shards. Queries and the highest token value accounts are merged across the shards.
+ */
+
+#ifndef SHARDED_ACCOUNT_MANAGER_H
+#define SHARDED_ACCOUNT_MANAGER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <utility>
+#include "Account.h"
+#include "AccountManager.h"
+#include "AccountUpdateReader.h"
+#include "BoundedQueue.h"
+
+// One of the highest token value accounts of a type, merged across shards
+struct ShardedTopKEntry {
+    string id;
+    int version;
+    int tokens;
+};
+
+/**
+ * The updates are submitted from a single thread, which is also the one that waits for them to be
+ * ingested and then queries the shards: a shard's index must not be queried while its worker may
+ * still be ingesting.
+ */
+class ShardedAccountManager {
+    private:
+        enum { kIngestBatch = 64 };
+
+        struct Shard {
+            AccountManager manager;
+            BoundedQueue<Account> queue;
+            thread worker;
+            // Updates handed to the queue, counted by the submitting thread
+            size_t submitted;
+            // Updates ingested by the worker, guarded by progressMutex
+            size_t ingested;
+            mutex progressMutex;
+            condition_variable progress;
+
+            Shard(size_t topK, SchedulerType schedulerType, size_t queueCapacity)
+                : manager(topK, schedulerType), queue(queueCapacity), submitted(0), ingested(0) {}
+        };
+
+        vector<unique_ptr<Shard>> shards;
+        size_t topK;
+
+        static void work(Shard &shard) {
+            vector<Account> batch;
+            batch.reserve(kIngestBatch);
+            while (true) {
+                batch.clear();
+                size_t taken = shard.queue.popBatch(batch, kIngestBatch);
+                if (taken == 0) return;
+                for (Account &account : batch) {
+                    shard.manager.ingestAccount(std::move(account));
+                }
+                {
+                    lock_guard<mutex> guard(shard.progressMutex);
+                    shard.ingested += taken;
+                }
+                shard.progress.notify_all();
+            }
+        }
+
+        // Highest tokens first, then by id, so that merged results do not depend on the shard count
+        static bool precedes(int tokensA, const string &idA, int tokensB, const string &idB) {
+            if (tokensA != tokensB) return tokensA > tokensB;
+            return idA < idB;
+        }
+
+    public:
+        /**
+         * Construct a sharded manager and start a worker thread per shard.
+         * @param shardCount The number of shards.
+         * @param topK The number of highest token value accounts to keep per account type.
+         * @param schedulerType The data structure each shard keeps its pending callbacks in.
+         * @param queueCapacity The number of updates each shard's queue holds before submitting blocks.
+         */
+        explicit ShardedAccountManager(size_t shardCount, size_t topK = 3,
+                                       SchedulerType schedulerType = SchedulerType::BinaryHeap,
+                                       size_t queueCapacity = 1024)
+            : topK(topK) {
+            if (shardCount == 0) shardCount = 1;
+            for (size_t i = 0; i < shardCount; ++i) {
+                shards.emplace_back(new Shard(topK, schedulerType, queueCapacity));
+            }
+            for (unique_ptr<Shard> &shard : shards) {
+                shard->worker = thread(&ShardedAccountManager::work, std::ref(*shard));
+            }
+        }
+
+        ShardedAccountManager(const ShardedAccountManager &) = delete;
+        ShardedAccountManager &operator=(const ShardedAccountManager &) = delete;
+
+        // Lets every shard ingest what has been submitted to it before stopping its worker
+        ~ShardedAccountManager() {
+            for (unique_ptr<Shard> &shard : shards) {
+                shard->queue.close();
+            }
+            for (unique_ptr<Shard> &shard : shards) {
+                shard->worker.join();
+            }
+        }
+
+        /**
+         * Process the account updates from the given file across the shards, and wait until every
+         * shard has ingested them.
+         * @param filename The name of the file containing the account updates.
+         * @param mode Whether to parse the file up front or stream it update by update.
+         */
+        void processAccountUpdates(const string &filename, IngestMode mode = IngestMode::Batch) {
+            bool read = AccountUpdateReader::readFile(filename, mode, [this](Account &&account) {
+                submit(std::move(account));
+            });
+            waitUntilIngested();
+            if (read) {
+                printHighestTokenValueAccounts();
+            }
+        }
+
+        /**
+         * Hand an account update to the shard of its id. Blocks while that shard's queue is full.
+         * @param account The account update.
+         */
+        void submit(Account &&account) {
+            Shard &shard = *shards[shardOf(account.id)];
+            ++shard.submitted;
+            shard.queue.push(std::move(account));
+        }
+
+        /**
+         * Wait until every shard has ingested every update submitted to it.
+         */
+        void waitUntilIngested() {
+            for (unique_ptr<Shard> &shard : shards) {
+                unique_lock<mutex> guard(shard->progressMutex);
+                shard->progress.wait(guard, [&shard] { return shard->ingested == shard->submitted; });
+            }
+        }
+
+        /**
+         * Get the shard that the given account id is ingested by.
+         * @param id The account id.
+         * @return The index of the shard.
+         */
+        size_t shardOf(const string &id) const {
+            return hash<string>()(id) % shards.size();
+        }
+
+        size_t getShardCount() const { return shards.size(); }
+        AccountManager &getShard(size_t shard) { return shards[shard]->manager; }
+        const AccountManager &getShard(size_t shard) const { return shards[shard]->manager; }
+
+        /**
+         * Get the number of indexed account versions across all shards.
+         * @return The number of indexed account versions.
+         */
+        size_t size() const {
+            size_t total = 0;
+            for (const unique_ptr<Shard> &shard : shards) {
+                total += shard->manager.accountIndexer.size();
+            }
+            return total;
+        }
+
+        /**
+         * Search and filter accounts across all shards.
+         * @param accountType The account type to filter by (optional).
+         * @param minTokens The minimum token value to filter by (optional).
+         * @param maxTokens The maximum token value to filter by (optional).
+         * @return A vector of filtered accounts, ordered by tokens in descending order, then by id.
+         */
+        vector<Account> searchAndFilterAccounts(
+            const string &accountType = "",
+            int minTokens = numeric_limits<int>::min(),
+            int maxTokens = numeric_limits<int>::max()
+        ) const {
+            vector<Account> filteredAccounts;
+            // A shard's search reads its cold accounts from the tier rather than faulting them in, so the
+            // shards' indexes are left as they were
+            for (const unique_ptr<Shard> &shard : shards) {
+                vector<Account> shardAccounts = shard->manager.searchAndFilterAccounts(accountType, minTokens, maxTokens);
+                filteredAccounts.insert(filteredAccounts.end(), make_move_iterator(shardAccounts.begin()),
+                                        make_move_iterator(shardAccounts.end()));
+            }
+            sort(filteredAccounts.begin(), filteredAccounts.end(), [](const Account &a, const Account &b) {
+                return precedes(a.tokens, a.id, b.tokens, b.id);
+            });
+            return filteredAccounts;
+        }
+
+        /**
+         * Get the highest token value accounts of the given type, merged from the top K of every shard.
+         * @param accountType The account type.
+         * @return Up to K accounts, highest tokens first.
+         */
+        vector<ShardedTopKEntry> getHighestTokenAccounts(const string &accountType) const {
+            vector<ShardedTopKEntry> merged;
+            for (const unique_ptr<Shard> &shard : shards) {
+                const AccountIndexer &indexer = shard->manager.accountIndexer;
+                TypeHandle type = indexer.getSymbols().types.find(accountType);
+                if (type == kInvalidHandle) continue;
+                for (const TopKEntry &entry : indexer.getHighestTokenAccounts(type).sortedEntries()) {
+                    merged.push_back(ShardedTopKEntry{indexer.getAccountId(entry.id), entry.version, entry.tokens});
+                }
+            }
+            sort(merged.begin(), merged.end(), [](const ShardedTopKEntry &a, const ShardedTopKEntry &b) {
+                return precedes(a.tokens, a.id, b.tokens, b.id);
+            });
+            if (merged.size() > topK) merged.resize(topK);
+            return merged;
+        }
+
+        /**
+         * Get the account types seen by any shard, in shard order and then in order of first appearance.
+         * @return The account types.
+         */
+        vector<string> getAccountTypes() const {
+            vector<string> accountTypes;
+            for (const unique_ptr<Shard> &shard : shards) {
+                const AccountIndexer &indexer = shard->manager.accountIndexer;
+                for (TypeHandle type = 0; type < indexer.getAccountTypeCount(); ++type) {
+                    const string &accountType = indexer.getAccountType(type);
+                    if (find(accountTypes.begin(), accountTypes.end(), accountType) == accountTypes.end()) {
+                        accountTypes.push_back(accountType);
+                    }
+                }
+            }
+            return accountTypes;
+        }
+
+        /**
+         * Print the highest token value accounts for each account type, merged across shards.
+         */
+        void printHighestTokenValueAccounts() const {
+            for (const string &accountType : getAccountTypes()) {
+                vector<ShardedTopKEntry> tokenAccounts = getHighestTokenAccounts(accountType);
+
+                cout << "Highest token value accounts for account type " << accountType << ":" << endl;
+
+                // Lowest first, as in AccountManager
+                for (auto entry = tokenAccounts.rbegin(); entry != tokenAccounts.rend(); ++entry) {
+                    cout << "Account " << entry->id << " v" << entry->version << ": Tokens - " << entry->tokens << endl;
+                }
+                cout << endl;
+            }
+        }
+};
+
+#endif // SHARDED_ACCOUNT_MANAGER_H
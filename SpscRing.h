@@ -0,0 +1,108 @@
+/**
+ * @file SpscRing.h
+ * @brief Lock-free single producer, single consumer ring buffer
+ *
+ * A bounded ring of preallocated slots between exactly one producer thread and one consumer thread.
+ * Each side owns one index and only reads the other's, with acquire/release ordering, so neither
+ * push nor pop takes a lock or does a read-modify-write. Each side also keeps a cached copy of the
+ * other's index and only reloads it when the ring looks full (or empty), which keeps the two cache
+ * lines from bouncing between the cores on every item.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <cstddef>
+
+using namespace std;
+
+template <typename T>
+class SpscRing {
+    private:
+        enum { kCacheLine = 64 };
+
+        vector<T> slots;
+        size_t mask;
+
+        // Next slot to be read: written by the consumer, read by the producer
+        alignas(kCacheLine) atomic<size_t> head;
+        size_t cachedTail;
+        // Next slot to be written: written by the producer, read by the consumer
+        alignas(kCacheLine) atomic<size_t> tail;
+        size_t cachedHead;
+        alignas(kCacheLine) atomic<bool> closed;
+
+        static size_t roundUpToPowerOfTwo(size_t value) {
+            size_t power = 1;
+            while (power < value) power <<= 1;
+            return power;
+        }
+
+    public:
+        /**
+         * Construct a ring.
+         * @param capacity The minimum number of items the ring holds; rounded up to a power of two.
+         */
+        explicit SpscRing(size_t capacity)
+            : slots(roundUpToPowerOfTwo(capacity > 0 ? capacity : 1)), mask(slots.size() - 1),
+              head(0), cachedTail(0), tail(0), cachedHead(0), closed(false) {}
+
+        SpscRing(const SpscRing &) = delete;
+        SpscRing &operator=(const SpscRing &) = delete;
+
+        /**
+         * Move an item into the ring if there is room for it. Producer only.
+         * @param item The item; left moved-from only if it was pushed.
+         * @return False if the ring is full.
+         */
+        bool tryPush(T &item) {
+            size_t position = tail.load(memory_order_relaxed);
+            if (position - cachedHead == slots.size()) {
+                cachedHead = head.load(memory_order_acquire);
+                if (position - cachedHead == slots.size()) return false;
+            }
+            slots[position & mask] = std::move(item);
+            tail.store(position + 1, memory_order_release);
+            return true;
+        }
+
+        /**
+         * Move the oldest item out of the ring. Consumer only.
+         * @param item Receives the item.
+         * @return False if the ring is empty.
+         */
+        bool tryPop(T &item) {
+            size_t position = head.load(memory_order_relaxed);
+            if (position == cachedTail) {
+                cachedTail = tail.load(memory_order_acquire);
+                if (position == cachedTail) return false;
+            }
+            item = std::move(slots[position & mask]);
+            head.store(position + 1, memory_order_release);
+            return true;
+        }
+
+        /**
+         * Mark the end of the input. Producer only, after its last push.
+         */
+        void close() {
+            closed.store(true, memory_order_release);
+        }
+
+        /**
+         * Check whether the producer has closed the ring. Once this is true, a failing tryPop means
+         * the ring is drained for good.
+         */
+        bool isClosed() const {
+            return closed.load(memory_order_acquire);
+        }
+
+        size_t getCapacity() const {
+            return slots.size();
+        }
+};
+
+#endif // SPSC_RING_H
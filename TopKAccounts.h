@@ -0,0 +1,192 @@
+/**
+ * @file TopKAccounts.h
+ * @brief Bounded top-K container for the highest token value accounts
+ *
+ * Keeps the K accounts with the highest token values of one account type, with O(log K) insert,
+ * removal by id and in-place update.
+ */
+
+#ifndef TOP_K_ACCOUNTS_H
+#define TOP_K_ACCOUNTS_H
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include "Account.h"
+
+// The part of an account that the top-K container needs in order to rank and report it
+struct TopKEntry {
+    IdHandle id;
+    int version;
+    int tokens;
+};
+
+/**
+ * Bounded container holding the K accounts with the highest token values.
+ * It is a binary min-heap on tokens, so the weakest of the current top K sits at the root and
+ * can be evicted in O(log K). Accounts with equal tokens rank by id, the lower id first, so the
+ * top K and its order do not depend on the order the accounts arrived in. The position of every
+ * entry in the heap is tracked by id, which makes lookup by id O(1) and removal or in-place
+ * update O(log K).
+ */
+class TopKAccounts {
+    private:
+        size_t capacity;
+        // The ids' strings, which ties are broken on; without them, on the id handles
+        const InternedStrings *ids;
+        vector<TopKEntry> heap;
+        unordered_map<IdHandle, size_t> positions;
+
+        // Whether a ranks below b: fewer tokens, or as many and a higher id
+        bool ranksBelow(const TopKEntry &a, const TopKEntry &b) const {
+            if (a.tokens != b.tokens) return a.tokens < b.tokens;
+            if (a.id == b.id) return false;
+            return ids ? ids->str(a.id) > ids->str(b.id) : a.id > b.id;
+        }
+
+        void place(size_t index, TopKEntry &&entry) {
+            positions[entry.id] = index;
+            heap[index] = std::move(entry);
+        }
+
+        void siftUp(size_t index) {
+            TopKEntry entry = std::move(heap[index]);
+            while (index > 0) {
+                size_t parent = (index - 1) / 2;
+                if (!ranksBelow(entry, heap[parent])) break;
+                place(index, std::move(heap[parent]));
+                index = parent;
+            }
+            place(index, std::move(entry));
+        }
+
+        void siftDown(size_t index) {
+            TopKEntry entry = std::move(heap[index]);
+            size_t size = heap.size();
+            while (true) {
+                size_t child = 2 * index + 1;
+                if (child >= size) break;
+                if (child + 1 < size && ranksBelow(heap[child + 1], heap[child])) ++child;
+                if (!ranksBelow(heap[child], entry)) break;
+                place(index, std::move(heap[child]));
+                index = child;
+            }
+            place(index, std::move(entry));
+        }
+
+        // Restore the heap property after the entry at index changed its tokens
+        void restore(size_t index) {
+            if (index > 0 && ranksBelow(heap[index], heap[(index - 1) / 2])) {
+                siftUp(index);
+            }
+            else {
+                siftDown(index);
+            }
+        }
+
+    public:
+        /**
+         * @param capacity The number of accounts to hold, K.
+         * @param ids The strings of the id handles, to break ties on, or nullptr to break them on the handles.
+         */
+        explicit TopKAccounts(size_t capacity = 3, const InternedStrings *ids = nullptr) : capacity(capacity), ids(ids) {
+            heap.reserve(capacity);
+        }
+
+        /**
+         * Insert the account, or update it in place if an entry with the same id is already held.
+         * When the container is full, the account only gets in if it ranks above the weakest entry,
+         * which is then evicted.
+         * @param account The account to be inserted or updated.
+         * @return True if the account is among the top K afterwards.
+         */
+        bool insert(const IndexedAccount &account) {
+            auto it = positions.find(account.id);
+            if (it != positions.end()) {
+                TopKEntry &entry = heap[it->second];
+                entry.version = account.version;
+                entry.tokens = account.tokens;
+                restore(it->second);
+                return true;
+            }
+
+            if (capacity == 0) return false;
+            if (heap.size() < capacity) {
+                heap.push_back(TopKEntry{account.id, account.version, account.tokens});
+                siftUp(heap.size() - 1);
+                return true;
+            }
+            TopKEntry candidate{account.id, account.version, account.tokens};
+            if (!ranksBelow(heap.front(), candidate)) return false;
+
+            positions.erase(heap.front().id);
+            place(0, std::move(candidate));
+            siftDown(0);
+            return true;
+        }
+
+        /**
+         * Remove the entry with the given id.
+         * @param id The id of the account to be removed.
+         * @return True if an entry was removed.
+         */
+        bool remove(IdHandle id) {
+            auto it = positions.find(id);
+            if (it == positions.end()) return false;
+
+            size_t index = it->second;
+            positions.erase(it);
+            if (index != heap.size() - 1) {
+                place(index, std::move(heap.back()));
+                heap.pop_back();
+                restore(index);
+            }
+            else {
+                heap.pop_back();
+            }
+            return true;
+        }
+
+        /**
+         * Find the entry with the given id.
+         * @param id The id of the account to look up.
+         * @return A pointer to the entry, or nullptr if the account is not among the top K.
+         */
+        const TopKEntry *find(IdHandle id) const {
+            auto it = positions.find(id);
+            return it != positions.end() ? &heap[it->second] : nullptr;
+        }
+
+        /**
+         * Get the weakest entry, which a new account has to rank above to get in. The container must
+         * not be empty.
+         * @return The weakest entry.
+         */
+        const TopKEntry &weakest() const {
+            return heap.front();
+        }
+
+        /**
+         * Get the entries ordered by tokens in descending order, then by id.
+         * @return A sorted copy of the entries.
+         */
+        vector<TopKEntry> sortedEntries() const {
+            vector<TopKEntry> entries = heap;
+            std::sort(entries.begin(), entries.end(), [this](const TopKEntry &a, const TopKEntry &b) {
+                return ranksBelow(b, a);
+            });
+            return entries;
+        }
+
+        // Remove every entry, keeping the capacity
+        void clear() {
+            heap.clear();
+            positions.clear();
+        }
+
+        size_t size() const { return heap.size(); }
+        bool empty() const { return heap.empty(); }
+        size_t getCapacity() const { return capacity; }
+};
+
+#endif // TOP_K_ACCOUNTS_H
@@ -0,0 +1,414 @@
+/**
+ * @file WriteAheadLog.h
+ * @brief Append-only write-ahead log of account updates, with group commit
+ *
+ * Every ingested update is appended to the log as a record (length, CRC32, log sequence number, then
+ * the update as AccountWire.h encodes it) before it is indexed. Appends only copy the record into an in-memory batch.
+ * A flusher thread writes the batch and fdatasyncs it once it holds maxBatchBytes, once its oldest
+ * record has waited maxDelay, or when sync is called, so the log costs one fsync per batch rather than
+ * one per update, and at most maxDelay of acknowledged updates can be lost in a crash. Appends block
+ * while maxPendingBytes are waiting for the disk.
+ *
+ * Recovery replays the records after a checkpoint's sequence number. A torn or corrupt record ends the
+ * log: everything before it is replayed, and reopening the log for appending cuts it off.
+ */
+
+#ifndef WRITE_AHEAD_LOG_H
+#define WRITE_AHEAD_LOG_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Account.h"
+#include "MappedFile.h"
+#include "AccountWire.h"
+
+// When the flusher thread writes and syncs the pending batch
+struct GroupCommitPolicy {
+    // Flush as soon as the pending records reach this size
+    size_t maxBatchBytes;
+    // Flush once the oldest pending record has waited this long
+    chrono::microseconds maxDelay;
+    // Block appends while this much is waiting to be flushed
+    size_t maxPendingBytes;
+
+    GroupCommitPolicy(size_t maxBatchBytes = 1 << 20, chrono::microseconds maxDelay = chrono::microseconds(2000),
+                      size_t maxPendingBytes = 16 << 20)
+        : maxBatchBytes(maxBatchBytes), maxDelay(maxDelay),
+          maxPendingBytes(maxPendingBytes > maxBatchBytes ? maxPendingBytes : maxBatchBytes) {}
+};
+
+// Counters of the batches the flusher thread has written
+struct WriteAheadLogStats {
+    enum { kLatencyBuckets = 32 };
+
+    uint64_t batches;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t maxBatchRecords;
+    chrono::nanoseconds fsyncTime;
+    chrono::nanoseconds maxFsyncTime;
+    // Batches whose fsync took less than 2^(i + 1) microseconds, and at least 2^i for i > 0
+    uint64_t fsyncLatencyBuckets[kLatencyBuckets];
+
+    WriteAheadLogStats()
+        : batches(0), records(0), bytes(0), maxBatchRecords(0), fsyncTime(0), maxFsyncTime(0), fsyncLatencyBuckets() {}
+
+    double averageBatchRecords() const {
+        return batches > 0 ? static_cast<double>(records) / batches : 0.0;
+    }
+
+    chrono::nanoseconds averageFsyncTime() const {
+        return batches > 0 ? fsyncTime / static_cast<chrono::nanoseconds::rep>(batches) : chrono::nanoseconds(0);
+    }
+
+    /**
+     * Get an upper bound of the given percentile of fsync latency, to within a factor of two.
+     * @param percentile The percentile, from 0 to 100.
+     * @return The upper edge of the latency bucket holding the percentile, or 0 if nothing was synced.
+     */
+    chrono::microseconds fsyncLatencyPercentile(double percentile) const {
+        if (batches == 0) return chrono::microseconds(0);
+        uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * (batches - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < kLatencyBuckets; ++i) {
+            seen += fsyncLatencyBuckets[i];
+            if (seen >= rank) return chrono::microseconds(uint64_t(1) << (i + 1));
+        }
+        return chrono::microseconds(uint64_t(1) << kLatencyBuckets);
+    }
+
+    void recordBatch(uint64_t batchRecords, uint64_t batchBytes, chrono::nanoseconds latency) {
+        ++batches;
+        records += batchRecords;
+        bytes += batchBytes;
+        if (batchRecords > maxBatchRecords) maxBatchRecords = batchRecords;
+        fsyncTime += latency;
+        if (latency > maxFsyncTime) maxFsyncTime = latency;
+        uint64_t micros = static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(latency).count());
+        int bucket = 0;
+        while (micros > 1 && bucket < kLatencyBuckets - 1) {
+            micros >>= 1;
+            ++bucket;
+        }
+        ++fsyncLatencyBuckets[bucket];
+    }
+};
+
+// What a replay found in a log
+struct WriteAheadLogReplay {
+    // Records handed to the handler, i.e. those after the requested sequence number
+    uint64_t replayed;
+    // The sequence number of the last valid record, or 0 if there is none
+    uint64_t lastLsn;
+    // The length of the valid prefix of the log
+    uint64_t validLength;
+    // Whether the log ends in a torn or corrupt record
+    bool tornTail;
+
+    WriteAheadLogReplay() : replayed(0), lastLsn(0), validLength(0), tornTail(false) {}
+};
+
+class WriteAheadLog {
+    private:
+        enum { kRecordHeaderSize = 16, kMaxRecordSize = 64 << 20 };
+
+        GroupCommitPolicy policy;
+        string filename;
+        int fd;
+
+        // Guards everything below
+        mutable mutex logMutex;
+        condition_variable flushNeeded;
+        condition_variable flushed;
+        thread flusher;
+        string pending;
+        uint64_t pendingRecords;
+        chrono::steady_clock::time_point oldestPending;
+        uint64_t appendedLsn;
+        uint64_t durableLsn;
+        bool syncRequested;
+        bool closing;
+        bool failed;
+        WriteAheadLogStats stats;
+
+        static uint32_t crc32(const char *data, size_t length, uint32_t crc = 0) {
+            static const vector<uint32_t> table = [] {
+                vector<uint32_t> entries(256);
+                for (uint32_t i = 0; i < 256; ++i) {
+                    uint32_t c = i;
+                    for (int bit = 0; bit < 8; ++bit) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                    entries[i] = c;
+                }
+                return entries;
+            }();
+            crc = ~crc;
+            for (size_t i = 0; i < length; ++i) {
+                crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+            }
+            return ~crc;
+        }
+
+        static void encode(string &out, uint64_t lsn, const string &id, const string &accountType, int tokens,
+                           int callbackTimeMs, const AccountData &data, int version) {
+            size_t start = out.size();
+            out.append(kRecordHeaderSize, '\0');
+            wire::putAccount(out, id, accountType, tokens, callbackTimeMs, data, version);
+            uint32_t length = static_cast<uint32_t>(out.size() - start - kRecordHeaderSize);
+            memcpy(&out[start + 8], &lsn, sizeof(lsn));
+            uint32_t crc = crc32(&out[start + 8], length + 8);
+            memcpy(&out[start], &length, sizeof(length));
+            memcpy(&out[start + 4], &crc, sizeof(crc));
+        }
+
+        static bool decode(const char *p, const char *end, Account &account) {
+            return wire::getAccount(p, end, account) && p == end;
+        }
+
+        static bool writeAll(int fd, const char *data, size_t length) {
+            while (length > 0) {
+                ssize_t written = ::write(fd, data, length);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                data += written;
+                length -= static_cast<size_t>(written);
+            }
+            return true;
+        }
+
+        bool flushDue() const {
+            return closing || syncRequested || pending.size() >= policy.maxBatchBytes ||
+                   chrono::steady_clock::now() >= oldestPending + policy.maxDelay;
+        }
+
+        /**
+         * Body of the flusher thread. Waits for a batch to become due, then writes and syncs it outside
+         * the lock while appends fill the next batch.
+         */
+        void flushLoop() {
+            string batch;
+            unique_lock<mutex> guard(logMutex);
+            while (true) {
+                while (pending.empty() && !closing && !syncRequested) flushNeeded.wait(guard);
+                while (!pending.empty() && !flushDue()) flushNeeded.wait_until(guard, oldestPending + policy.maxDelay);
+                if (pending.empty()) {
+                    syncRequested = false;
+                    flushed.notify_all();
+                    if (closing) return;
+                    continue;
+                }
+
+                batch.swap(pending);
+                pending.clear();
+                uint64_t batchRecords = pendingRecords;
+                uint64_t batchLsn = appendedLsn;
+                pendingRecords = 0;
+                syncRequested = false;
+                guard.unlock();
+
+                bool written = !failed && writeAll(fd, batch.data(), batch.size());
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                written = written && fdatasync(fd) == 0;
+                chrono::nanoseconds latency = chrono::steady_clock::now() - start;
+
+                guard.lock();
+                if (written) {
+                    durableLsn = batchLsn;
+                    stats.recordBatch(batchRecords, batch.size(), latency);
+                }
+                else if (!failed) {
+                    failed = true;
+                    cerr << "Failed to write the write-ahead log: " << filename << endl;
+                }
+                flushed.notify_all();
+            }
+        }
+
+    public:
+        explicit WriteAheadLog(GroupCommitPolicy policy = GroupCommitPolicy())
+            : policy(policy), fd(-1), pendingRecords(0), appendedLsn(0), durableLsn(0), syncRequested(false),
+              closing(false), failed(false) {}
+
+        WriteAheadLog(const WriteAheadLog &) = delete;
+        WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+        // Pending records are flushed before the log is closed
+        ~WriteAheadLog() {
+            close();
+        }
+
+        /**
+         * Read the records of a log in order and hand the ones after the given sequence number to the
+         * handler. The log is memory-mapped, and read up to its end or its first torn or corrupt record.
+         * @param filename The log file. A missing or empty file is an empty log.
+         * @param afterLsn Records with this sequence number or lower are skipped.
+         * @param onRecord Called with the sequence number and the update of every replayed record.
+         * @param result Receives what the replay found.
+         * @return False if the file exists but could not be read.
+         */
+        template <typename Handler>
+        static bool replay(const string &filename, uint64_t afterLsn, Handler onRecord, WriteAheadLogReplay &result) {
+            result = WriteAheadLogReplay();
+            struct stat status;
+            if (stat(filename.c_str(), &status) != 0 || status.st_size == 0) return true;
+            MappedFile mapping;
+            if (!mapping.open(filename)) return false;
+
+            const char *begin = reinterpret_cast<const char *>(mapping.data());
+            const char *p = begin;
+            const char *end = begin + mapping.size();
+            Account account;
+            while (p != end) {
+                uint32_t length, crc;
+                uint64_t lsn;
+                const char *record = p;
+                if (!wire::get(record, end, length) || !wire::get(record, end, crc) || !wire::get(record, end, lsn) ||
+                    length > kMaxRecordSize || static_cast<size_t>(end - record) < length ||
+                    crc32(p + 8, length + 8) != crc || lsn <= result.lastLsn) {
+                    result.tornTail = true;
+                    break;
+                }
+                if (lsn > afterLsn) {
+                    if (!decode(record, record + length, account)) {
+                        result.tornTail = true;
+                        break;
+                    }
+                    onRecord(lsn, std::move(account));
+                    ++result.replayed;
+                }
+                result.lastLsn = lsn;
+                p = record + length;
+                result.validLength = static_cast<uint64_t>(p - begin);
+            }
+            return true;
+        }
+
+        /**
+         * Open the log for appending, creating it if need be, and start the flusher thread. A torn or
+         * corrupt tail left by a crash is cut off first.
+         * @param logFilename The log file.
+         * @return False if the log could not be opened or repaired.
+         */
+        bool open(const string &logFilename) {
+            close();
+            WriteAheadLogReplay existing;
+            if (!replay(logFilename, numeric_limits<uint64_t>::max(), [](uint64_t, Account &&) {}, existing)) return false;
+            fd = ::open(logFilename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (fd < 0) {
+                cerr << "Failed to open the file: " << logFilename << endl;
+                return false;
+            }
+            if (existing.tornTail && (ftruncate(fd, static_cast<off_t>(existing.validLength)) != 0 || fsync(fd) != 0)) {
+                cerr << "Failed to cut the torn tail off the write-ahead log: " << logFilename << endl;
+                ::close(fd);
+                fd = -1;
+                return false;
+            }
+            filename = logFilename;
+            appendedLsn = durableLsn = existing.lastLsn;
+            pendingRecords = 0;
+            syncRequested = closing = failed = false;
+            stats = WriteAheadLogStats();
+            flusher = thread(&WriteAheadLog::flushLoop, this);
+            return true;
+        }
+
+        /**
+         * Flush the pending records, stop the flusher thread and close the file.
+         */
+        void close() {
+            if (!flusher.joinable()) return;
+            {
+                lock_guard<mutex> guard(logMutex);
+                closing = true;
+            }
+            flushNeeded.notify_one();
+            flusher.join();
+            ::close(fd);
+            fd = -1;
+        }
+
+        bool isOpen() const {
+            return flusher.joinable();
+        }
+
+        /**
+         * Append an update to the pending batch. It is durable once a later sync returns, or within
+         * the policy's maxDelay.
+         * @param lsn The sequence number of the update; must be higher than that of the previous record.
+         * @return False if the log has failed to write, in which case nothing more is made durable.
+         */
+        bool append(uint64_t lsn, const string &id, const string &accountType, int tokens, int callbackTimeMs,
+                    const AccountData &data, int version) {
+            unique_lock<mutex> guard(logMutex);
+            while (pending.size() >= policy.maxPendingBytes && !failed) {
+                flushNeeded.notify_one();
+                flushed.wait(guard);
+            }
+            if (failed) return false;
+            bool wasEmpty = pending.empty();
+            if (wasEmpty) oldestPending = chrono::steady_clock::now();
+            encode(pending, lsn, id, accountType, tokens, callbackTimeMs, data, version);
+            ++pendingRecords;
+            appendedLsn = lsn;
+            if (wasEmpty || pending.size() >= policy.maxBatchBytes) flushNeeded.notify_one();
+            return true;
+        }
+
+        bool append(uint64_t lsn, const Account &account) {
+            return append(lsn, account.id, account.accountType, account.tokens, account.callbackTimeMs, account.data,
+                          account.version);
+        }
+
+        /**
+         * Flush the pending records now and wait until they are on disk.
+         * @return False if the log has failed to write.
+         */
+        bool sync() {
+            unique_lock<mutex> guard(logMutex);
+            uint64_t target = appendedLsn;
+            if (!flusher.joinable()) return false;
+            syncRequested = true;
+            flushNeeded.notify_one();
+            while (durableLsn < target && !failed) flushed.wait(guard);
+            return !failed;
+        }
+
+        /**
+         * Get the sequence number of the last record appended, or found in the log when it was opened.
+         * @return The sequence number, 0 for an empty log.
+         */
+        uint64_t getLastLsn() const {
+            lock_guard<mutex> guard(logMutex);
+            return appendedLsn;
+        }
+
+        /**
+         * Get the sequence number up to which records are known to be on disk.
+         * @return The sequence number of the last synced record.
+         */
+        uint64_t getDurableLsn() const {
+            lock_guard<mutex> guard(logMutex);
+            return durableLsn;
+        }
+
+        WriteAheadLogStats getStats() const {
+            lock_guard<mutex> guard(logMutex);
+            return stats;
+        }
+};
+
+#endif // WRITE_AHEAD_LOG_H
@@ -0,0 +1,159 @@
+/**
+ * @file WorkloadGenerator.h
+ * @brief Synthetic account update streams for the benchmarks
+ *
+ * Generates streams of account updates shaped like our feeds, with the knobs that move the indexer's
+ * costs: how many accounts there are, how many updates they get and how skewed those are towards
+ * hot accounts, how many account types they spread over, how many updates arrive out of order, and
+ * how long their callbacks are delayed. Streams are deterministic for a given seed.
+ */
+
+#ifndef WORKLOAD_GENERATOR_H
+#define WORKLOAD_GENERATOR_H
+
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include "Account.h"
+#include "AccountPolicies.h"
+
+// The distribution of the callbackTimeMs of generated updates
+enum class DelayDistribution {
+    Constant,     // Always the mean
+    Uniform,      // Uniform between 0 and twice the mean
+    Exponential   // Exponential with the given mean, as for a Poisson arrival of deadlines
+};
+
+struct WorkloadConfig {
+    // Distinct account ids, and the updates spread over them
+    size_t accounts;
+    size_t updates;
+    size_t accountTypes;
+    // Zipf exponent of the choice of account per update: 0 is uniform, around 1 is the skew of a
+    // live feed, where a few hot accounts get most of the versions
+    double zipfSkew;
+    // Share of updates that re-deliver a version no newer than the latest, which the indexer ignores
+    double staleFraction;
+    DelayDistribution delayDistribution;
+    int meanDelayMs;
+    uint32_t seed;
+
+    WorkloadConfig()
+        : accounts(100000), updates(1000000), accountTypes(8), zipfSkew(0.99), staleFraction(0.05),
+          delayDistribution(DelayDistribution::Uniform), meanDelayMs(500), seed(42) {}
+};
+
+/**
+ * Draws ranks in [0, n) with probability proportional to 1 / (rank + 1)^s. The cumulative
+ * distribution is tabulated once, so a draw is a binary search, for any exponent s >= 0.
+ */
+class ZipfianGenerator {
+    private:
+        vector<double> cumulative;
+
+    public:
+        ZipfianGenerator(size_t n, double s) : cumulative(n) {
+            double sum = 0;
+            for (size_t rank = 0; rank < n; ++rank) {
+                sum += s == 0 ? 1.0 : 1.0 / pow(static_cast<double>(rank + 1), s);
+                cumulative[rank] = sum;
+            }
+            for (double &value : cumulative) value /= sum;
+        }
+
+        template <typename Engine>
+        size_t operator()(Engine &engine) {
+            double u = uniform_real_distribution<double>(0.0, 1.0)(engine);
+            size_t rank = static_cast<size_t>(lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin());
+            return min(rank, cumulative.size() - 1);
+        }
+};
+
+/**
+ * Generator of synthetic account update streams. Every account has a fixed type and the base58 text
+ * of a random 32-byte public key as its id, like our feeds' keys; its first update is version 1 and each later one is either
+ * the next version or, with the configured probability, a stale re-delivery of an earlier one.
+ * Hot accounts are scattered over the id space rather than being its first ids.
+ */
+class WorkloadGenerator {
+    private:
+        WorkloadConfig config;
+        mt19937 engine;
+        ZipfianGenerator zipfian;
+        vector<string> ids;
+        vector<string> typeNames;
+        vector<uint32_t> typeOf;
+        // The account of every Zipf rank
+        vector<uint32_t> accountOfRank;
+        vector<int> latestVersion;
+
+        int drawDelay() {
+            switch (config.delayDistribution) {
+                case DelayDistribution::Constant:
+                    return config.meanDelayMs;
+                case DelayDistribution::Exponential:
+                    return static_cast<int>(exponential_distribution<double>(1.0 / max(1, config.meanDelayMs))(engine));
+                case DelayDistribution::Uniform:
+                default:
+                    return uniform_int_distribution<int>(0, 2 * config.meanDelayMs)(engine);
+            }
+        }
+
+    public:
+        explicit WorkloadGenerator(const WorkloadConfig &config)
+            : config(config), engine(config.seed), zipfian(config.accounts, config.zipfSkew), ids(config.accounts),
+              typeOf(config.accounts), accountOfRank(config.accounts), latestVersion(config.accounts, 0) {
+            uniform_int_distribution<size_t> type(0, max<size_t>(1, config.accountTypes) - 1);
+            for (size_t i = 0; i < max<size_t>(1, config.accountTypes); ++i) {
+                typeNames.push_back("type" + to_string(i));
+            }
+            for (size_t i = 0; i < config.accounts; ++i) {
+                unsigned char key[Base58PubkeyKey::kKeyBytes];
+                for (unsigned char &byte : key) byte = static_cast<unsigned char>(engine());
+                ids[i] = Base58PubkeyKey::toString(key);
+                typeOf[i] = static_cast<uint32_t>(type(engine));
+                accountOfRank[i] = static_cast<uint32_t>(i);
+            }
+            shuffle(accountOfRank.begin(), accountOfRank.end(), engine);
+        }
+
+        /**
+         * Generate the next update of the stream.
+         * @return The account update.
+         */
+        Account next() {
+            uint32_t account = accountOfRank[zipfian(engine)];
+            int &latest = latestVersion[account];
+            int version;
+            if (latest > 0 && uniform_real_distribution<double>(0.0, 1.0)(engine) < config.staleFraction) {
+                version = uniform_int_distribution<int>(1, latest)(engine);
+            }
+            else {
+                version = ++latest;
+            }
+            AccountData data;
+            data.set("balance", static_cast<int>(engine() % 100000));
+            data.set("slot", version);
+            return Account(ids[account], typeNames[typeOf[account]], static_cast<int>(engine() % 1000000), drawDelay(),
+                           std::move(data), version);
+        }
+
+        /**
+         * Generate the configured number of updates.
+         * @return The updates, in stream order.
+         */
+        vector<Account> generate() {
+            vector<Account> updates;
+            updates.reserve(config.updates);
+            for (size_t i = 0; i < config.updates; ++i) updates.push_back(next());
+            return updates;
+        }
+
+        const vector<string> &getAccountTypes() const { return typeNames; }
+        const WorkloadConfig &getConfig() const { return config; }
+};
+
+#endif // WORKLOAD_GENERATOR_H
@@ -0,0 +1,80 @@
+/**
+ * @file account_map_bench.cpp
+ * @brief Benchmark of the indexed account maps: FlatHashMap against unordered_map
+ *
+ * Fills each map with N account versions keyed by {id handle, version}, with their values from a
+ * NodeArena as in the indexer, then times lookups of present keys in random order, lookups of absent
+ * keys, and churn in which every account's version is erased and its successor inserted. Also reports
+ * the bytes per entry outside the value nodes, i.e. the bucket array or the control bytes and slots,
+ * plus any per-node overhead of the map itself.
+ *
+ * Usage: bench/account_map_bench [accounts, default 1000000]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdlib>
+#include "Account.h"
+#include "NodePool.h"
+#include "FlatHashMap.h"
+
+typedef chrono::steady_clock BenchClock;
+
+static double nsPer(BenchClock::time_point start, size_t operations) {
+    return chrono::duration<double, nano>(BenchClock::now() - start).count() / operations;
+}
+
+template <typename Map>
+static void run(const string &name, const vector<AccountKey> &keys, size_t nodeOverhead) {
+    NodeArena arena;
+    Map map(0, AccountKeyHash(), equal_to<AccountKey>(), PoolAllocator<pair<const AccountKey, IndexedAccount>>(arena));
+    for (const AccountKey &key : keys) {
+        map.emplace(key, IndexedAccount{key.id, 0, static_cast<int>(key.id % 1000), key.version, 0, AccountData()});
+    }
+
+    vector<AccountKey> probes(keys);
+    shuffle(probes.begin(), probes.end(), mt19937(1));
+    size_t checksum = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for (const AccountKey &key : probes) checksum += map.find(key)->second.tokens;
+    double hit = nsPer(start, probes.size());
+
+    start = BenchClock::now();
+    for (const AccountKey &key : probes) checksum += map.find(AccountKey{key.id, key.version + 1}) != map.end();
+    double miss = nsPer(start, probes.size());
+
+    start = BenchClock::now();
+    for (const AccountKey &key : probes) {
+        map.erase(map.find(key));
+        map.emplace(AccountKey{key.id, key.version + 1},
+                    IndexedAccount{key.id, 0, static_cast<int>(key.id % 1000), key.version + 1, 0, AccountData()});
+    }
+    double churn = nsPer(start, probes.size());
+
+    size_t tableBytes = map.bucket_count() * (name == "FlatHashMap" ? sizeof(int8_t) + sizeof(void *) : sizeof(void *));
+    cout << left << setw(16) << name << right << fixed << setprecision(1)
+         << setw(8) << hit << " ns hit" << setw(8) << miss << " ns miss" << setw(8) << churn << " ns erase+insert"
+         << setw(8) << static_cast<double>(tableBytes) / keys.size() + nodeOverhead << " B/entry overhead"
+         << (checksum == 0 ? " !" : "") << endl;
+}
+
+int main(int argc, char **argv) {
+    size_t accounts = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    vector<AccountKey> keys;
+    keys.reserve(accounts);
+    for (size_t i = 0; i < accounts; ++i) keys.push_back(AccountKey{static_cast<IdHandle>(i), 1 + static_cast<int>(i % 7)});
+
+    cout << accounts << " accounts, " << sizeof(IndexedAccount) << " byte values" << endl;
+    // libstdc++'s nodes carry a next pointer and, for a hash that may throw, the cached hash code
+    run<unordered_map<AccountKey, IndexedAccount, AccountKeyHash, equal_to<AccountKey>,
+                      PoolAllocator<pair<const AccountKey, IndexedAccount>>>>("unordered_map", keys, 2 * sizeof(void *));
+    run<FlatHashMap<AccountKey, IndexedAccount, AccountKeyHash, equal_to<AccountKey>,
+                    PoolAllocator<pair<const AccountKey, IndexedAccount>>>>("FlatHashMap", keys, 0);
+    return 0;
+}
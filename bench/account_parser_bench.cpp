@@ -0,0 +1,93 @@
+/**
+ * @file account_parser_bench.cpp
+ * @brief Benchmark of the schema-aware account update parser against the nlohmann DOM path
+ *
+ * Generates N account update lines shaped like our feeds (44 character base58-like ids, a handful of
+ * account types, two to six data fields) and decodes each line into an Account, once through
+ * json::parse plus AccountUpdateReader::parseAccountUpdate and once through AccountUpdateParser.
+ *
+ * Usage: bench/account_parser_bench [updates, default 200000]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include "AccountUpdateReader.h"
+#include "AccountUpdateParser.h"
+
+typedef chrono::steady_clock BenchClock;
+
+static double elapsedNs(BenchClock::time_point start) {
+    return chrono::duration<double, nano>(BenchClock::now() - start).count();
+}
+
+static void report(const string &parser, size_t updates, size_t bytes, double ns) {
+    cout << left << setw(16) << parser << right
+         << setw(10) << updates << " updates"
+         << setw(10) << fixed << setprecision(1) << ns / updates << " ns/update"
+         << setw(10) << setprecision(1) << bytes / ns * 1e3 << " MB/s" << endl;
+}
+
+static vector<string> generateLines(size_t count) {
+    static const char alphabet[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+    static const char *types[] = {"escrow", "regular", "vault", "stake", "user"};
+    mt19937 gen(7);
+    uniform_int_distribution<int> letter(0, sizeof(alphabet) - 2);
+    uniform_int_distribution<int> type(0, 4);
+    uniform_int_distribution<int> tokens(0, 1000000);
+    uniform_int_distribution<int> fields(2, 6);
+
+    vector<string> lines;
+    lines.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        string id;
+        for (int c = 0; c < 44; ++c) id += alphabet[letter(gen)];
+        string line = "{\"id\": \"" + id + "\", \"accountType\": \"" + types[type(gen)] + "\", \"tokens\": " +
+                      to_string(tokens(gen)) + ", \"callbackTimeMs\": " + to_string(tokens(gen) % 1000) + ", \"data\": {";
+        int fieldCount = fields(gen);
+        for (int f = 0; f < fieldCount; ++f) {
+            if (f > 0) line += ", ";
+            line += "\"subtype_field" + to_string(f + 1) + "\": " + (f % 2 ? string("true") : to_string(tokens(gen)));
+        }
+        line += "}, \"version\": " + to_string(i % 100 + 1) + "}";
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+    vector<string> lines = generateLines(count);
+    size_t bytes = 0;
+    for (const string &line : lines) bytes += line.size();
+
+    long long checksum = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for (const string &line : lines) {
+        Account account = AccountUpdateReader::parseAccountUpdate(json::parse(line));
+        checksum += account.tokens + account.data.size();
+    }
+    report("nlohmann", count, bytes, elapsedNs(start));
+
+    long long fastChecksum = 0;
+    Account account;
+    start = BenchClock::now();
+    for (const string &line : lines) {
+        if (!AccountUpdateParser::parse(line, account)) {
+            cerr << "Schema-aware parser rejected: " << line << endl;
+            return 1;
+        }
+        fastChecksum += account.tokens + account.data.size();
+    }
+    report("schema-aware", count, bytes, elapsedNs(start));
+
+    if (checksum != fastChecksum) {
+        cerr << "Checksums differ: " << checksum << " vs " << fastChecksum << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+/**
+ * @file callback_scheduler_bench.cpp
+ * @brief Benchmark of the binary heap and timing wheel callback schedulers
+ *
+ * Fills each scheduler with N pending callbacks whose deadlines fall in the window our feeds produce
+ * (callbackTimeMs of a few hundred ms plus up to 1000 ms of random delay), supersedes a tenth of them
+ * twice, first with a cancel and schedule and then with an in-place reschedule, then expires
+ * everything by advancing a simulated clock in 1 ms steps.
+ *
+ * Usage: bench/callback_scheduler_bench [pending callbacks, default 1000000]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
+#include "CallbackScheduler.h"
+
+typedef chrono::steady_clock BenchClock;
+
+static double elapsedNs(BenchClock::time_point start) {
+    return chrono::duration<double, nano>(BenchClock::now() - start).count();
+}
+
+static void report(const string &scheduler, const string &operation, size_t operations, double ns) {
+    cout << left << setw(14) << scheduler << setw(12) << operation << right
+         << setw(12) << operations << " ops"
+         << setw(10) << fixed << setprecision(1) << ns / operations << " ns/op"
+         << setw(10) << setprecision(2) << operations / ns * 1e3 << " Mops/s" << endl;
+}
+
+static void run(const string &name, CallbackScheduler &scheduler, size_t pending,
+                chrono::system_clock::time_point base) {
+    mt19937 gen(42);
+    uniform_int_distribution<int> delayMs(300, 1300);
+
+    BenchClock::time_point start = BenchClock::now();
+    for (size_t i = 0; i < pending; ++i) {
+        chrono::system_clock::time_point deadline = base + chrono::milliseconds(delayMs(gen));
+        scheduler.schedule(ScheduledCallback{deadline, static_cast<IdHandle>(i), 1});
+    }
+    report(name, "schedule", pending, elapsedNs(start));
+
+    // A tenth of the accounts, each picked once, get a newer version
+    vector<IdHandle> ids(pending);
+    for (size_t i = 0; i < pending; ++i) ids[i] = static_cast<IdHandle>(i);
+    shuffle(ids.begin(), ids.end(), gen);
+    size_t superseded = pending / 10;
+    ids.resize(superseded);
+
+    start = BenchClock::now();
+    for (IdHandle id : ids) scheduler.cancel(id);
+    report(name, "cancel", superseded, elapsedNs(start));
+
+    start = BenchClock::now();
+    for (IdHandle id : ids) {
+        scheduler.schedule(ScheduledCallback{base + chrono::milliseconds(delayMs(gen)), id, 2});
+    }
+    report(name, "schedule", superseded, elapsedNs(start));
+
+    // and then another one, replacing the pending callback in place
+    start = BenchClock::now();
+    for (IdHandle id : ids) {
+        scheduler.reschedule(ScheduledCallback{base + chrono::milliseconds(delayMs(gen)), id, 3});
+    }
+    report(name, "reschedule", superseded, elapsedNs(start));
+
+    size_t expected = scheduler.size();
+    vector<ScheduledCallback> due;
+    due.reserve(pending);
+    start = BenchClock::now();
+    for (int ms = 0; ms <= 1400; ++ms) {
+        scheduler.expire(base + chrono::milliseconds(ms), due);
+    }
+    report(name, "expire", due.size(), elapsedNs(start));
+
+    if (due.size() != expected || scheduler.size() != 0) {
+        cerr << name << ": expired " << due.size() << " of " << expected << " callbacks" << endl;
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t pending = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    chrono::system_clock::time_point base = chrono::system_clock::now();
+
+    cout << "Pending callbacks: " << pending << endl;
+    {
+        HeapCallbackScheduler heap;
+        run("BinaryHeap", heap, pending, base);
+    }
+    {
+        TimingWheelCallbackScheduler wheel(base);
+        run("TimingWheel", wheel, pending, base);
+    }
+    return 0;
+}
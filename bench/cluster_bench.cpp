@@ -0,0 +1,97 @@
+/**
+ * @file cluster_bench.cpp
+ * @brief Benchmark of a partitioned deployment over loopback: routing, scatter/gather and top-K merges
+ *
+ * Starts N AccountNodeServers in process, each serving its own AccountManager on a loopback port,
+ * routes a synthetic update stream from WorkloadGenerator across them with a PartitionRouter, then
+ * times QueryCoordinator searches of all types over a tenth of the token space, with a limit of 100
+ * and without one, and merged top-K queries per type. Reports the routed updates per second, and the
+ * p50/p99 latency and results per query.
+ *
+ * Usage: bench/cluster_bench [nodes, default 4] [updates, default 500000]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdlib>
+#include "AccountCluster.h"
+#include "WorkloadGenerator.h"
+
+typedef chrono::steady_clock BenchClock;
+
+static void report(const string &name, vector<double> &latenciesNs, size_t items) {
+    sort(latenciesNs.begin(), latenciesNs.end());
+    cout << left << setw(26) << name << right << fixed << setprecision(1)
+         << "p50 " << setw(9) << latenciesNs[latenciesNs.size() / 2] / 1000 << " us   p99 " << setw(9)
+         << latenciesNs[latenciesNs.size() * 99 / 100] / 1000 << " us   " << items / latenciesNs.size() << " results/query" << endl;
+}
+
+int main(int argc, char **argv) {
+    size_t nodeCount = argc > 1 ? strtoul(argv[1], nullptr, 10) : 4;
+    WorkloadConfig config;
+    config.updates = argc > 2 ? strtoul(argv[2], nullptr, 10) : 500000;
+    WorkloadGenerator generator(config);
+    vector<Account> updates = generator.generate();
+    const vector<string> &types = generator.getAccountTypes();
+
+    // The nodes' indexers report every update on stdout
+    ofstream devNull("/dev/null");
+    streambuf *stdoutBuffer = cout.rdbuf(devNull.rdbuf());
+    vector<unique_ptr<AccountManager>> managers;
+    vector<unique_ptr<AccountNodeServer>> servers;
+    PartitionRouter router;
+    QueryCoordinator coordinator;
+    for (size_t i = 0; i < nodeCount; ++i) {
+        managers.emplace_back(new AccountManager(3));
+        managers.back()->callbackManager.setSink(nullptr);
+        servers.emplace_back(new AccountNodeServer(*managers.back()));
+        if (!servers.back()->start() || !router.addNode("127.0.0.1", servers.back()->getPort()) ||
+            !coordinator.addNode("127.0.0.1", servers.back()->getPort())) {
+            return 1;
+        }
+    }
+
+    BenchClock::time_point start = BenchClock::now();
+    for (const Account &update : updates) router.route(update);
+    router.flush();
+    double routeSeconds = chrono::duration<double>(BenchClock::now() - start).count();
+
+    mt19937 engine(config.seed);
+    uniform_int_distribution<int> low(0, 900000);
+    vector<double> bounded, unbounded, topK;
+    size_t boundedItems = 0, unboundedItems = 0, topKItems = 0;
+    vector<Account> found;
+    vector<ShardedTopKEntry> entries;
+    for (int i = 0; i < 200; ++i) {
+        int minTokens = low(engine);
+        start = BenchClock::now();
+        coordinator.searchAndFilterAccounts(found, "", minTokens, minTokens + 100000, 100);
+        bounded.push_back(chrono::duration<double, nano>(BenchClock::now() - start).count());
+        boundedItems += found.size();
+
+        start = BenchClock::now();
+        coordinator.searchAndFilterAccounts(found, "", minTokens, minTokens + 100000);
+        unbounded.push_back(chrono::duration<double, nano>(BenchClock::now() - start).count());
+        unboundedItems += found.size();
+
+        start = BenchClock::now();
+        coordinator.getHighestTokenAccounts(entries, types[i % types.size()]);
+        topK.push_back(chrono::duration<double, nano>(BenchClock::now() - start).count());
+        topKItems += entries.size();
+    }
+    cout.rdbuf(stdoutBuffer);
+
+    cout << nodeCount << " nodes, " << updates.size() << " updates routed at " << fixed << setprecision(0)
+         << updates.size() / routeSeconds << " updates/s" << endl;
+    report("search limit 100", bounded, boundedItems);
+    report("search unbounded", unbounded, unboundedItems);
+    report("top-K per type", topK, topKItems);
+    return 0;
+}
@@ -0,0 +1,324 @@
+/**
+ * @file indexer_bench.cpp
+ * @brief Microbenchmarks of ingest, search, callbacks and top-K maintenance on synthetic workloads
+ *
+ * Generates an update stream with WorkloadGenerator and times, operation by operation:
+ * ingestAccount and batched ingestAccountUpdates on an AccountManager, and ingestAccount on a manager
+ * instantiated on PubkeyAccountPolicy (fixed-width ids, timing wheel, K of 3), on a manager with a range
+ * and a top-K subscription per type, and on a manager with a memory budget of half the index, which is
+ * then searched over narrow ranges; searchAndFilterAccounts over
+ * random narrow token ranges of a type, which walk the token index, over wide ranges of all types, which
+ * scan the column store, and with a predicate on a data field; scheduleCallback, cancelCallback and fireCallbacks on a
+ * CallbackManager over the ingested accounts; and TopKAccounts insert and remove as versions are
+ * superseded. Reports throughput and p50/p99/p999 latency per operation. Every operation is timed
+ * on its own, so latencies include roughly 20 ns of clock overhead.
+ *
+ * Usage: bench/indexer_bench [--accounts=N] [--updates=N] [--types=N] [--zipf=S] [--stale=F]
+ *                            [--delay=constant|uniform|exponential] [--delay-ms=N] [--topk=N]
+ *                            [--searches=N] [--scheduler=heap|wheel] [--seed=N]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <random>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+#include "AccountManager.h"
+#include "WorkloadGenerator.h"
+
+typedef chrono::steady_clock BenchClock;
+
+static double elapsedNs(BenchClock::time_point start) {
+    return chrono::duration<double, nano>(BenchClock::now() - start).count();
+}
+
+// Latencies of one kind of operation, each sample covering `weight` operations
+class LatencyRecorder {
+    private:
+        vector<double> samples;
+        double totalNs;
+        size_t operations;
+
+        double percentile(vector<double> &sorted, double p) const {
+            size_t rank = static_cast<size_t>(p * (sorted.size() - 1));
+            return sorted[rank];
+        }
+
+    public:
+        LatencyRecorder() : totalNs(0), operations(0) {}
+
+        void add(double ns, size_t weight = 1) {
+            samples.push_back(ns);
+            totalNs += ns;
+            operations += weight;
+        }
+
+        void report(const string &name) {
+            if (samples.empty()) return;
+            vector<double> sorted(samples);
+            sort(sorted.begin(), sorted.end());
+            cout << left << setw(26) << name << right
+                 << setw(10) << operations << " ops"
+                 << setw(9) << fixed << setprecision(2) << operations / totalNs * 1e3 << " Mops/s"
+                 << "   p50" << setw(9) << setprecision(0) << percentile(sorted, 0.5)
+                 << "   p99" << setw(9) << percentile(sorted, 0.99)
+                 << "   p999" << setw(9) << percentile(sorted, 0.999) << " ns" << endl;
+        }
+};
+
+static bool option(const string &argument, const string &name, string &value) {
+    string prefix = "--" + name + "=";
+    if (argument.compare(0, prefix.size(), prefix) != 0) return false;
+    value = argument.substr(prefix.size());
+    return true;
+}
+
+int main(int argc, char **argv) {
+    WorkloadConfig config;
+    size_t topK = 3;
+    size_t searches = 100000;
+    SchedulerType schedulerType = SchedulerType::BinaryHeap;
+    for (int i = 1; i < argc; ++i) {
+        string argument = argv[i], value;
+        if (option(argument, "accounts", value)) config.accounts = strtoul(value.c_str(), nullptr, 10);
+        else if (option(argument, "updates", value)) config.updates = strtoul(value.c_str(), nullptr, 10);
+        else if (option(argument, "types", value)) config.accountTypes = strtoul(value.c_str(), nullptr, 10);
+        else if (option(argument, "zipf", value)) config.zipfSkew = atof(value.c_str());
+        else if (option(argument, "stale", value)) config.staleFraction = atof(value.c_str());
+        else if (option(argument, "delay-ms", value)) config.meanDelayMs = atoi(value.c_str());
+        else if (option(argument, "topk", value)) topK = strtoul(value.c_str(), nullptr, 10);
+        else if (option(argument, "searches", value)) searches = strtoul(value.c_str(), nullptr, 10);
+        else if (option(argument, "seed", value)) config.seed = static_cast<uint32_t>(strtoul(value.c_str(), nullptr, 10));
+        else if (option(argument, "delay", value)) {
+            config.delayDistribution = value == "constant" ? DelayDistribution::Constant
+                                     : value == "exponential" ? DelayDistribution::Exponential
+                                     : DelayDistribution::Uniform;
+        }
+        else if (option(argument, "scheduler", value)) {
+            schedulerType = value == "wheel" ? SchedulerType::TimingWheel : SchedulerType::BinaryHeap;
+        }
+        else {
+            cerr << "Unknown option " << argument << endl;
+            return 1;
+        }
+    }
+    if (config.accounts == 0 || config.updates == 0) {
+        cerr << "The workload needs at least one account and one update" << endl;
+        return 1;
+    }
+
+    WorkloadGenerator generator(config);
+    vector<Account> updates = generator.generate();
+    const vector<string> &types = generator.getAccountTypes();
+    cout << "Workload: " << config.accounts << " accounts, " << config.updates << " updates, " << types.size()
+         << " types, zipf " << config.zipfSkew << ", " << config.staleFraction * 100 << "% stale, " << config.meanDelayMs
+         << " ms mean callback delay" << endl;
+
+    // The indexer reports every update on stdout
+    ofstream devNull("/dev/null");
+    streambuf *stdoutBuffer = cout.rdbuf(devNull.rdbuf());
+    shared_ptr<CallbackSink> discard = make_shared<FunctionCallbackSink>([](const vector<FiredCallback> &) {});
+    vector<pair<string, LatencyRecorder>> results;
+
+    // Ingest, update by update
+    AccountManager accountManager(topK, schedulerType);
+    accountManager.callbackManager.setSink(discard);
+    {
+        LatencyRecorder latencies;
+        for (const Account &update : updates) {
+            BenchClock::time_point start = BenchClock::now();
+            accountManager.ingestAccount(update);
+            latencies.add(elapsedNs(start));
+        }
+        results.push_back(make_pair(string("ingestAccount"), latencies));
+    }
+
+    // The same on the public key policy, whose ids and callbacks take the devirtualized paths
+    {
+        BasicAccountManager<PubkeyAccountPolicy> pubkeys;
+        pubkeys.callbackManager.setSink(discard);
+        LatencyRecorder latencies;
+        for (const Account &update : updates) {
+            BenchClock::time_point start = BenchClock::now();
+            pubkeys.ingestAccount(update);
+            latencies.add(elapsedNs(start));
+        }
+        results.push_back(make_pair(string("ingestAccount (pubkey)"), latencies));
+    }
+
+    // Ingest again with a subscription per type to a thousandth of the token space and to its top K,
+    // which is what a client polling searchAndFilter after every update would otherwise recompute
+    {
+        AccountManager subscribed(topK, schedulerType);
+        subscribed.callbackManager.setSink(discard);
+        size_t changes = 0;
+        AccountChangeHandler count = [&changes](const vector<AccountChange> &delivered) { changes += delivered.size(); };
+        for (const string &accountType : types) {
+            subscribed.subscribe(accountType, 500000, 501000, count);
+            subscribed.subscribeHighestTokenAccounts(accountType, count);
+        }
+        LatencyRecorder latencies;
+        for (const Account &update : updates) {
+            BenchClock::time_point start = BenchClock::now();
+            subscribed.ingestAccount(update);
+            latencies.add(elapsedNs(start));
+        }
+        results.push_back(make_pair(string("ingestAccount (subscribed)"), latencies));
+        results.back().first += " (" + to_string(changes) + " changes)";
+    }
+
+    // Ingest again within a memory budget of half what the unbounded index took, so that cold accounts
+    // are evicted to the disk-backed tier and faulted back in when updated, then search it as below
+    {
+        AccountManager bounded(topK, schedulerType);
+        bounded.callbackManager.setSink(discard);
+        if (!bounded.enableMemoryBudget(accountManager.accountIndexer.getMemoryUsage() / 2, "/tmp/indexer_bench.cold")) return 1;
+        LatencyRecorder latencies;
+        for (const Account &update : updates) {
+            BenchClock::time_point start = BenchClock::now();
+            bounded.ingestAccount(update);
+            latencies.add(elapsedNs(start));
+        }
+        results.push_back(make_pair(string("ingestAccount (memory budget)"), latencies));
+        results.back().first += " (" + to_string(bounded.accountIndexer.getColdAccountCount()) + " cold)";
+
+        mt19937 engine(config.seed);
+        uniform_int_distribution<size_t> type(0, types.size() - 1);
+        uniform_int_distribution<int> low(0, 999000);
+        LatencyRecorder searchLatencies;
+        for (size_t i = 0; i < searches; ++i) {
+            const string &accountType = types[type(engine)];
+            int minTokens = low(engine);
+            BenchClock::time_point start = BenchClock::now();
+            bounded.searchAndFilterAccounts(accountType, minTokens, minTokens + 1000);
+            searchLatencies.add(elapsedNs(start));
+        }
+        results.push_back(make_pair(string("searchAndFilter narrow (memory budget)"), searchLatencies));
+    }
+
+    // Ingest in batches, each sample covering a batch
+    {
+        AccountManager batched(topK, schedulerType);
+        batched.callbackManager.setSink(discard);
+        LatencyRecorder latencies;
+        vector<Account> batch;
+        for (size_t first = 0; first < updates.size(); first += 512) {
+            batch.assign(updates.begin() + first, updates.begin() + min(updates.size(), first + 512));
+            BenchClock::time_point start = BenchClock::now();
+            batched.ingestAccountUpdates(std::move(batch));
+            latencies.add(elapsedNs(start), min<size_t>(512, updates.size() - first));
+        }
+        results.push_back(make_pair(string("ingestUpdates/512"), latencies));
+    }
+
+    // Searches of a type over token ranges a thousandth of the token space wide
+    {
+        mt19937 engine(config.seed);
+        uniform_int_distribution<size_t> type(0, types.size() - 1);
+        uniform_int_distribution<int> low(0, 999000);
+        LatencyRecorder latencies;
+        size_t found = 0;
+        for (size_t i = 0; i < searches; ++i) {
+            const string &accountType = types[type(engine)];
+            int minTokens = low(engine);
+            BenchClock::time_point start = BenchClock::now();
+            found += accountManager.searchAndFilterAccounts(accountType, minTokens, minTokens + 1000).size();
+            latencies.add(elapsedNs(start));
+        }
+        results.push_back(make_pair(string("searchAndFilter"), latencies));
+        results.back().first += " (" + to_string(searches ? found / searches : 0) + " hits)";
+    }
+
+    // Searches of all types over a tenth of the token space, first as is, then for accounts with an odd
+    // balance field; each sample covers one search
+    for (int withPredicate = 0; withPredicate < 2; ++withPredicate) {
+        mt19937 engine(config.seed);
+        uniform_int_distribution<int> low(0, 900000);
+        LatencyRecorder latencies;
+        size_t found = 0;
+        size_t wideSearches = max<size_t>(1, searches / 1000);
+        for (size_t i = 0; i < wideSearches; ++i) {
+            int minTokens = low(engine);
+            BenchClock::time_point start = BenchClock::now();
+            if (withPredicate) {
+                found += accountManager.searchAndFilterAccounts("", minTokens, minTokens + 100000, [](const AccountData &data) {
+                    const int *balance = data.find("balance");
+                    return balance && *balance % 2 == 1;
+                }).size();
+            }
+            else {
+                found += accountManager.searchAndFilterAccounts("", minTokens, minTokens + 100000).size();
+            }
+            latencies.add(elapsedNs(start));
+        }
+        results.push_back(make_pair(string(withPredicate ? "searchWide+predicate" : "searchWide"), latencies));
+        results.back().first += " (" + to_string(found / wideSearches) + " hits)";
+    }
+
+    // Callbacks for every indexed account on a separate manager, then a tenth cancelled, then all
+    // fired by advancing a simulated clock in 1 ms steps
+    {
+        const AccountIndexer &indexer = accountManager.accountIndexer;
+        CallbackManager callbacks(indexer, schedulerType);
+        callbacks.setSink(discard);
+        vector<const IndexedAccount *> accounts;
+        for (IdHandle id = 0; id < indexer.getSymbols().ids.size(); ++id) {
+            const IndexedAccount *account = indexer.findLatestAccount(id);
+            if (account) accounts.push_back(account);
+        }
+        chrono::system_clock::time_point base = chrono::system_clock::now();
+        int latestDeadlineMs = 0;
+        LatencyRecorder scheduled, cancelled, fired;
+        for (const IndexedAccount *account : accounts) {
+            chrono::system_clock::time_point deadline = base + chrono::milliseconds(account->callbackTimeMs);
+            latestDeadlineMs = max(latestDeadlineMs, account->callbackTimeMs);
+            BenchClock::time_point start = BenchClock::now();
+            callbacks.scheduleCallback(*account, deadline);
+            scheduled.add(elapsedNs(start));
+        }
+        for (size_t i = 0; i < accounts.size(); i += 10) {
+            BenchClock::time_point start = BenchClock::now();
+            callbacks.cancelCallback(accounts[i]->id);
+            cancelled.add(elapsedNs(start));
+        }
+        for (int ms = 0; ms <= latestDeadlineMs + 1; ++ms) {
+            BenchClock::time_point start = BenchClock::now();
+            callbacks.fireCallbacks(base + chrono::milliseconds(ms));
+            fired.add(elapsedNs(start));
+        }
+        results.push_back(make_pair(string("scheduleCallback"), scheduled));
+        results.push_back(make_pair(string("cancelCallback"), cancelled));
+        results.push_back(make_pair(string("fireCallbacks/1ms"), fired));
+    }
+
+    // Top-K maintenance of one type as the stream supersedes versions: the previous version is
+    // removed if held, and the new one offered
+    {
+        TopKAccounts tokenAccounts(topK);
+        vector<int> latestVersion(config.accounts, 0);
+        vector<IndexedAccount> offers;
+        for (const Account &update : updates) {
+            if (update.accountType != types[0]) continue;
+            IdHandle id = accountManager.accountIndexer.findAccountId(update.id);
+            if (update.version <= latestVersion[id]) continue;
+            latestVersion[id] = update.version;
+            offers.push_back(IndexedAccount{id, 0, update.tokens, update.version, update.callbackTimeMs, AccountData()});
+        }
+        LatencyRecorder latencies;
+        for (const IndexedAccount &offer : offers) {
+            BenchClock::time_point start = BenchClock::now();
+            tokenAccounts.remove(offer.id);
+            tokenAccounts.insert(offer);
+            latencies.add(elapsedNs(start));
+        }
+        results.push_back(make_pair(string("topK remove+insert"), latencies));
+    }
+
+    cout.rdbuf(stdoutBuffer);
+    for (pair<string, LatencyRecorder> &result : results) result.second.report(result.first);
+    return 0;
+}
@@ -0,0 +1,175 @@
+/**
+ * @file ingest_allocation_bench.cpp
+ * @brief Benchmark of heap allocator calls and memory footprint of ingest under steady churn
+ *
+ * Counts the calls to operator new per update, by replacing the global allocation functions, for:
+ * decoding pre-parsed JSON objects with AccountUpdateReader::parseAccountUpdate; ingesting a JSON
+ * array file of N new accounts with processAccountUpdates; and R rounds in which every account is
+ * superseded by a newer version, as a live feed does, the last one in batches through
+ * ingestAccountUpdates. Also samples the resident set size after each phase, which stays flat under
+ * churn once the index's node slabs are warm.
+ *
+ * Usage: bench/ingest_allocation_bench [accounts, default 100000] [rounds, default 5]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include "AccountManager.h"
+
+static atomic<uint64_t> allocationCalls(0);
+
+// Every form is replaced, so that no allocation bypasses the count, and none is inlined: once an
+// inlined operator new shows its malloc to the compiler, it warns of every delete of that pointer
+static void *countedAllocation(size_t size) noexcept {
+    allocationCalls.fetch_add(1, memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    void *pointer = countedAllocation(size);
+    if (!pointer) throw bad_alloc();
+    return pointer;
+}
+
+__attribute__((noinline)) void *operator new[](size_t size) {
+    void *pointer = countedAllocation(size);
+    if (!pointer) throw bad_alloc();
+    return pointer;
+}
+
+__attribute__((noinline)) void *operator new(size_t size, const nothrow_t &) noexcept {
+    return countedAllocation(size);
+}
+
+__attribute__((noinline)) void *operator new[](size_t size, const nothrow_t &) noexcept {
+    return countedAllocation(size);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete[](void *pointer) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer, const nothrow_t &) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete[](void *pointer, const nothrow_t &) noexcept {
+    free(pointer);
+}
+
+typedef chrono::steady_clock BenchClock;
+
+static size_t residentKilobytes() {
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(int argc, char **argv) {
+    size_t accounts = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+    vector<Account> updates(accounts);
+    AccountData data;
+    data.set("subtype_field1", 1);
+    data.set("subtype_field2", 2);
+    static const char *types[] = {"escrow", "regular", "vault", "stake", "user"};
+    for (size_t i = 0; i < accounts; ++i) {
+        // Callbacks far in the future, so that none fire during the run
+        updates[i] = Account("account" + to_string(i), types[i % 5], static_cast<int>(i % 10007), 3600000, data, 0);
+    }
+
+    // The indexer reports every update on stdout
+    ofstream devNull("/dev/null");
+    streambuf *stdoutBuffer = cout.rdbuf(devNull.rdbuf());
+    AccountManager accountManager(3);
+    accountManager.callbackManager.setSink(make_shared<FunctionCallbackSink>([](const vector<FiredCallback> &) {}));
+
+    vector<string> report;
+    auto record = [&report, accounts](const string &phase, uint64_t calls, double ns) {
+        ostringstream line;
+        line << left << setw(12) << phase << right
+             << setw(10) << fixed << setprecision(2) << static_cast<double>(calls) / accounts << " allocs/update"
+             << setw(10) << setprecision(1) << ns / accounts << " ns/update"
+             << setw(10) << residentKilobytes() / 1024 << " MB resident";
+        report.push_back(line.str());
+    };
+
+    // Ids as long as our feeds' base58 keys, so that they do not fit in a string's inline buffer
+    auto longId = [](size_t i) {
+        string id = "file" + to_string(i);
+        return id + string(44 - id.size(), 'x');
+    };
+    vector<json> objects;
+    objects.reserve(accounts);
+    for (size_t i = 0; i < accounts; ++i) {
+        objects.push_back(json{{"id", longId(i)}, {"accountType", types[i % 5]}, {"tokens", static_cast<int>(i % 10007)},
+                               {"callbackTimeMs", 3600000}, {"data", {{"subtype_field1", 1}, {"subtype_field2", 2}}},
+                               {"version", 1}});
+    }
+    uint64_t callsBefore = allocationCalls.load();
+    BenchClock::time_point start = BenchClock::now();
+    size_t checksum = 0;
+    for (const json &object : objects) {
+        Account account = AccountUpdateReader::parseAccountUpdate(object);
+        checksum += account.id.size();
+    }
+    record("decode", allocationCalls.load() - callsBefore, chrono::duration<double, nano>(BenchClock::now() - start).count());
+
+    string filename = "/tmp/ingest_allocation_bench.json";
+    {
+        ofstream file(filename);
+        file << json(objects).dump();
+    }
+    objects.clear();
+    callsBefore = allocationCalls.load();
+    start = BenchClock::now();
+    accountManager.processAccountUpdates(filename);
+    record("json file", allocationCalls.load() - callsBefore, chrono::duration<double, nano>(BenchClock::now() - start).count());
+    remove(filename.c_str());
+
+    for (int round = 0; round <= rounds; ++round) {
+        for (Account &update : updates) {
+            ++update.version;
+            update.tokens = (update.tokens * 31 + 7) % 10007;
+        }
+        callsBefore = allocationCalls.load();
+        start = BenchClock::now();
+        for (const Account &update : updates) {
+            accountManager.ingestAccount(update);
+        }
+        record(round == 0 ? "initial" : "churn " + to_string(round), allocationCalls.load() - callsBefore,
+               chrono::duration<double, nano>(BenchClock::now() - start).count());
+    }
+    // Once more, through the batch entry point, which ranks and schedules once per batch
+    for (Account &update : updates) {
+        ++update.version;
+        update.tokens = (update.tokens * 31 + 7) % 10007;
+    }
+    vector<Account> batch;
+    callsBefore = allocationCalls.load();
+    start = BenchClock::now();
+    for (size_t first = 0; first < accounts; first += 512) {
+        batch.assign(updates.begin() + first, updates.begin() + min(accounts, first + 512));
+        accountManager.ingestAccountUpdates(std::move(batch));
+    }
+    record("batched", allocationCalls.load() - callsBefore, chrono::duration<double, nano>(BenchClock::now() - start).count());
+    cout.rdbuf(stdoutBuffer);
+    for (const string &line : report) cout << line << endl;
+    return checksum > 0 ? 0 : 1;
+}
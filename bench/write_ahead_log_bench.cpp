@@ -0,0 +1,62 @@
+/**
+ * @file write_ahead_log_bench.cpp
+ * @brief Benchmark of write-ahead log group commit
+ *
+ * Appends N account updates to a write-ahead log under a range of group commit delays, syncing after
+ * every update for the baseline, and reports the append throughput, the batch sizes and the fsync
+ * latency of each.
+ *
+ * Usage: bench/write_ahead_log_bench [updates, default 20000] [log file, default /tmp/write_ahead_log_bench.wal]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include "WriteAheadLog.h"
+
+typedef chrono::steady_clock BenchClock;
+
+static void run(const string &label, const string &filename, size_t count, GroupCommitPolicy policy, bool syncEach) {
+    remove(filename.c_str());
+    WriteAheadLog log(policy);
+    if (!log.open(filename)) exit(1);
+    AccountData data;
+    data.set("subtype_field1", 1);
+    data.set("subtype_field2", 2);
+    string id = "6BhkGCMVMyrjEEkrASJcLxfAvoW43g6BubxjpeUyZFoz";
+
+    BenchClock::time_point start = BenchClock::now();
+    for (size_t i = 0; i < count; ++i) {
+        log.append(i + 1, id, "escrow", static_cast<int>(i), 100, data, static_cast<int>(i + 1));
+        if (syncEach) log.sync();
+    }
+    log.sync();
+    double seconds = chrono::duration<double>(BenchClock::now() - start).count();
+    WriteAheadLogStats stats = log.getStats();
+    log.close();
+    remove(filename.c_str());
+
+    cout << left << setw(18) << label << right
+         << setw(12) << fixed << setprecision(0) << count / seconds << " updates/s"
+         << setw(8) << stats.batches << " batches"
+         << setw(10) << setprecision(1) << stats.averageBatchRecords() << " avg batch"
+         << setw(8) << stats.maxBatchRecords << " max batch"
+         << setw(8) << chrono::duration_cast<chrono::microseconds>(stats.averageFsyncTime()).count() << " us avg fsync"
+         << setw(8) << stats.fsyncLatencyPercentile(50).count() << " us p50"
+         << setw(8) << stats.fsyncLatencyPercentile(99).count() << " us p99" << endl;
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000;
+    string filename = argc > 2 ? argv[2] : "/tmp/write_ahead_log_bench.wal";
+
+    run("sync per update", filename, count, GroupCommitPolicy(1 << 20, chrono::microseconds(0)), true);
+    const int delays[] = {100, 1000, 10000};
+    for (int delay : delays) {
+        run("group " + to_string(delay) + " us", filename, count, GroupCommitPolicy(1 << 20, chrono::microseconds(delay)), false);
+    }
+    return 0;
+}
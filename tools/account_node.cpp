@@ -0,0 +1,63 @@
+/**
+ * @file account_node.cpp
+ * @brief Runs an AccountManager as a node of a partitioned deployment
+ *
+ * Serves an AccountManager over TCP with AccountNodeServer, for a PartitionRouter to feed and a
+ * QueryCoordinator to query (see AccountCluster.h). Callbacks are fired by the dispatcher thread at
+ * their deadlines. With --memory-budget, accounts beyond the budget are evicted to the cold file (see
+ * AccountIndexer.h). Runs until interrupted, then drains the pending callbacks.
+ *
+ * Usage: tools/account_node [--port=N] [--address=A] [--topk=N] [--scheduler=heap|wheel]
+ *                           [--memory-budget=BYTES] [--cold-file=P]
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <csignal>
+#include <pthread.h>
+#include "AccountManager.h"
+#include "AccountNode.h"
+
+int main(int argc, char **argv) {
+    uint16_t port = 7400;
+    string address = "127.0.0.1";
+    size_t topK = 3;
+    SchedulerType schedulerType = SchedulerType::BinaryHeap;
+    size_t memoryBudget = 0;
+    string coldFile = "account_node.cold";
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.compare(0, 7, "--port=") == 0) port = static_cast<uint16_t>(strtoul(arg.c_str() + 7, nullptr, 10));
+        else if (arg.compare(0, 10, "--address=") == 0) address = arg.substr(10);
+        else if (arg.compare(0, 7, "--topk=") == 0) topK = strtoul(arg.c_str() + 7, nullptr, 10);
+        else if (arg.compare(0, 16, "--memory-budget=") == 0) memoryBudget = strtoull(arg.c_str() + 16, nullptr, 10);
+        else if (arg.compare(0, 12, "--cold-file=") == 0) coldFile = arg.substr(12);
+        else if (arg == "--scheduler=wheel") schedulerType = SchedulerType::TimingWheel;
+        else if (arg != "--scheduler=heap") {
+            cerr << "Usage: " << argv[0] << " [--port=N] [--address=A] [--topk=N] [--scheduler=heap|wheel]"
+                 << " [--memory-budget=BYTES] [--cold-file=P]" << endl;
+            return 2;
+        }
+    }
+
+    // Blocked before any thread starts, so that only sigwait below receives them
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+
+    AccountManager accountManager(topK, schedulerType);
+    if (memoryBudget > 0 && !accountManager.enableMemoryBudget(memoryBudget, coldFile)) return 1;
+    accountManager.startCallbackDispatcher();
+    AccountNodeServer server(accountManager);
+    if (!server.start(port, address)) return 1;
+    cerr << "Serving accounts on " << address << ":" << server.getPort() << endl;
+
+    int received;
+    sigwait(&stopSignals, &received);
+    server.stop();
+    accountManager.stopCallbackDispatcher();
+    return 0;
+}